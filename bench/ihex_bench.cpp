@@ -0,0 +1,120 @@
+// Measures Intel HEX loader throughput on a generated image.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "ram.h"
+#include "trace.h"
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-s megabytes] [-r runs] [-o file]\n", program);
+    fprintf(stderr, "  -s  Size of the generated image data (default 16)\n");
+    fprintf(stderr, "  -r  Number of loads, the fastest is reported (default 5)\n");
+    fprintf(stderr, "  -o  File to generate the image in (default ihex_bench.hex)\n");
+}
+
+// Write an image of 32 byte data records with extended linear address
+// records, like objcopy produces. Returns the file size (0 on failure).
+static long generate_image(const char *filename, uint32_t size)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    uint32_t seed = 0x12345678;
+    for (uint32_t address = 0; address < size; address += 32)
+    {
+        if ((address & 0xFFFF) == 0)
+        {
+            uint8_t checksum = (uint8_t)(2 + 4 + (address >> 24) + ((address >> 16) & 0xFF));
+            fprintf(file, ":02000004%04X%02X\n", address >> 16, (uint8_t)(~checksum + 1));
+        }
+
+        uint8_t checksum = (uint8_t)(32 + ((address >> 8) & 0xFF) + (address & 0xFF));
+        fprintf(file, ":20%04X00", address & 0xFFFF);
+        for (int i = 0; i < 32; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            uint8_t value = (uint8_t)(seed >> 16);
+            checksum += value;
+            fprintf(file, "%02X", value);
+        }
+        fprintf(file, "%02X\n", (uint8_t)(~checksum + 1));
+    }
+    fprintf(file, ":00000001FF\n");
+
+    long length = ftell(file);
+    fclose(file);
+    return length;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t megabytes = 16;
+    int runs = 5;
+    const char *filename = "ihex_bench.hex";
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            megabytes = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            filename = argv[++i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (megabytes == 0 || megabytes > 2048 || runs <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    long file_size = generate_image(filename, megabytes << 20);
+    if (file_size == 0)
+    {
+        fprintf(stderr, "Unable to write %s\n", filename);
+        return 1;
+    }
+
+    double best = 0;
+    for (int run = 0; run < runs; run++)
+    {
+        RAM *ram = new RAM;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int result = ram->load_memory_ihex(filename);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        delete ram;
+        if (result != 0)
+        {
+            fprintf(stderr, "Load failed\n");
+            remove(filename);
+            return 1;
+        }
+        if (run == 0 || elapsed.count() < best)
+        {
+            best = elapsed.count();
+        }
+    }
+
+    remove(filename);
+
+    printf("%u MiB of data, %.1f MiB of HEX: %.2f ms, %.1f MiB/s of HEX\n", megabytes, file_size / 1048576.0, best * 1000, file_size / 1048576.0 / best);
+    return 0;
+}
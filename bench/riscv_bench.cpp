@@ -0,0 +1,374 @@
+// Runs the guest workloads in bench/workloads through each execution engine
+// and reports throughput.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "ram.h"
+#include "processor.h"
+#include "jit_engine.h"
+#include "trace.h"
+
+#ifndef RISCV_BENCH_WORKLOADS
+#define RISCV_BENCH_WORKLOADS "bench/workloads"
+#endif
+
+// A guest program and the result it must leave in a0
+typedef struct
+{
+    const char *name;
+    const char *description;
+    uint32_t result;
+    uint64_t instructions;
+} workload_t;
+
+static const workload_t workloads[] = {
+    {"intloop", "Integer ALU loop", 0x007C7653, 48000008},
+    {"memcpy", "Word and byte copies", 0x849AA4D2, 22366869},
+    {"branchy", "Data dependent branches", 0x0FD5AA6F, 56219609},
+    {"mul", "Matrix multiply", 0x64BB5DF2, 23352593},
+    {"kernel", "List walk, CRC-16 and state machine", 0x2661AF94, 27135502},
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+static const char *engine_names[] = {"reference", "threaded", "jit"};
+
+typedef enum
+{
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_CSV,
+} format_t;
+
+// Timings of the measured runs of one workload on one engine
+typedef struct
+{
+    const workload_t *workload;
+    engine_t engine;
+    double median;  // Run time in seconds
+    double minimum;
+    double maximum;
+    double mean;
+    double stddev;
+    double load;    // Median load time in seconds
+    bool valid;     // Every run produced the expected result
+} measurement_t;
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-e engine,...] [-r runs] [-w warmup] [-d directory] [-f text|json|csv] [-o file] [workload...]\n", program);
+    fprintf(stderr, "  -e  Engines to measure (default reference,threaded,jit)\n");
+    fprintf(stderr, "  -r  Measured runs per workload (default 5)\n");
+    fprintf(stderr, "  -w  Warmup runs per workload, not measured (default 1)\n");
+    fprintf(stderr, "  -d  Directory holding the workload HEX files\n");
+    fprintf(stderr, "      (default %s)\n", RISCV_BENCH_WORKLOADS);
+    fprintf(stderr, "  -f  Output format (default text)\n");
+    fprintf(stderr, "  -o  File to write the results to (default stdout)\n");
+    fprintf(stderr, "Workloads (default all):\n");
+    for (size_t i = 0; i < WORKLOAD_COUNT; i++)
+    {
+        fprintf(stderr, "  %-8s %s\n", workloads[i].name, workloads[i].description);
+    }
+}
+
+// Load and run a workload once, returning false if it went wrong
+static bool run_once(const std::string &path, const workload_t *workload, engine_t engine, double *load_time, double *run_time)
+{
+    RAM ram;
+    uint32_t entry = 0;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (ram.load_memory_ihex(path.c_str(), &entry) != 0)
+    {
+        fprintf(stderr, "Unable to load %s\n", path.c_str());
+        return false;
+    }
+    std::chrono::steady_clock::time_point loaded = std::chrono::steady_clock::now();
+
+    Processor processor(&ram, entry, engine);
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    run_result_t result = processor.run();
+    std::chrono::steady_clock::time_point finished = std::chrono::steady_clock::now();
+
+    *load_time = std::chrono::duration<double>(loaded - start).count();
+    *run_time = std::chrono::duration<double>(finished - started).count();
+
+    uint32_t a0 = processor.get_register(10);
+    if (result.reason != STOP_HALTED || result.instructions != workload->instructions || a0 != workload->result)
+    {
+        fprintf(stderr, "%s on %s: %s after %llu instructions with a0 0x%08X, expected %llu instructions and 0x%08X\n",
+                workload->name, engine_names[engine], STOP_REASON_STR[result.reason], (unsigned long long)result.instructions, a0,
+                (unsigned long long)workload->instructions, workload->result);
+        return false;
+    }
+    return true;
+}
+
+static double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+static measurement_t measure(const std::string &directory, const workload_t *workload, engine_t engine, int warmup, int runs)
+{
+    measurement_t measurement;
+    memset(&measurement, 0, sizeof(measurement));
+    measurement.workload = workload;
+    measurement.engine = engine;
+    measurement.valid = true;
+
+    std::string path = directory + "/" + workload->name + ".hex";
+    std::vector<double> run_times;
+    std::vector<double> load_times;
+    for (int i = 0; i < warmup + runs; i++)
+    {
+        double load_time;
+        double run_time;
+        if (!run_once(path, workload, engine, &load_time, &run_time))
+        {
+            measurement.valid = false;
+            return measurement;
+        }
+        if (i >= warmup)
+        {
+            run_times.push_back(run_time);
+            load_times.push_back(load_time);
+        }
+    }
+
+    measurement.median = median(run_times);
+    measurement.load = median(load_times);
+    measurement.minimum = *std::min_element(run_times.begin(), run_times.end());
+    measurement.maximum = *std::max_element(run_times.begin(), run_times.end());
+    double sum = 0;
+    for (size_t i = 0; i < run_times.size(); i++)
+    {
+        sum += run_times[i];
+    }
+    measurement.mean = sum / run_times.size();
+    double squares = 0;
+    for (size_t i = 0; i < run_times.size(); i++)
+    {
+        squares += (run_times[i] - measurement.mean) * (run_times[i] - measurement.mean);
+    }
+    measurement.stddev = run_times.size() > 1 ? sqrt(squares / (run_times.size() - 1)) : 0;
+    return measurement;
+}
+
+static double mips(const measurement_t &measurement)
+{
+    return measurement.workload->instructions / measurement.median / 1e6;
+}
+
+static double ns_per_instruction(const measurement_t &measurement)
+{
+    return measurement.median * 1e9 / measurement.workload->instructions;
+}
+
+static void print_results(FILE *file, format_t format, const std::vector<measurement_t> &measurements, int warmup, int runs)
+{
+    if (format == FORMAT_TEXT)
+    {
+        fprintf(file, "%-10s %-10s %12s %10s %8s %10s %10s %9s\n", "workload", "engine", "instructions", "MIPS", "ns/inst", "median ms", "stddev ms", "load ms");
+        for (size_t i = 0; i < measurements.size(); i++)
+        {
+            const measurement_t &m = measurements[i];
+            if (!m.valid)
+            {
+                fprintf(file, "%-10s %-10s %12s\n", m.workload->name, engine_names[m.engine], "FAILED");
+                continue;
+            }
+            fprintf(file, "%-10s %-10s %12llu %10.1f %8.3f %10.2f %10.2f %9.3f\n", m.workload->name, engine_names[m.engine],
+                    (unsigned long long)m.workload->instructions, mips(m), ns_per_instruction(m), m.median * 1e3, m.stddev * 1e3, m.load * 1e3);
+        }
+    }
+    else if (format == FORMAT_CSV)
+    {
+        fprintf(file, "workload,engine,valid,instructions,mips,ns_per_instruction,median_s,min_s,max_s,mean_s,stddev_s,load_s\n");
+        for (size_t i = 0; i < measurements.size(); i++)
+        {
+            const measurement_t &m = measurements[i];
+            fprintf(file, "%s,%s,%d,%llu,%.3f,%.4f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n", m.workload->name, engine_names[m.engine], m.valid ? 1 : 0,
+                    (unsigned long long)m.workload->instructions, m.valid ? mips(m) : 0, m.valid ? ns_per_instruction(m) : 0,
+                    m.median, m.minimum, m.maximum, m.mean, m.stddev, m.load);
+        }
+    }
+    else
+    {
+        fprintf(file, "{\n  \"warmup\": %d,\n  \"runs\": %d,\n  \"results\": [\n", warmup, runs);
+        for (size_t i = 0; i < measurements.size(); i++)
+        {
+            const measurement_t &m = measurements[i];
+            fprintf(file, "    {\"workload\": \"%s\", \"engine\": \"%s\", \"valid\": %s, \"instructions\": %llu, \"mips\": %.3f, \"ns_per_instruction\": %.4f, "
+                          "\"median_s\": %.6f, \"min_s\": %.6f, \"max_s\": %.6f, \"mean_s\": %.6f, \"stddev_s\": %.6f, \"load_s\": %.6f}%s\n",
+                    m.workload->name, engine_names[m.engine], m.valid ? "true" : "false", (unsigned long long)m.workload->instructions,
+                    m.valid ? mips(m) : 0, m.valid ? ns_per_instruction(m) : 0, m.median, m.minimum, m.maximum, m.mean, m.stddev, m.load,
+                    i + 1 < measurements.size() ? "," : "");
+        }
+        fprintf(file, "  ]\n}\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<engine_t> engines;
+    std::vector<const workload_t *> selected;
+    int runs = 5;
+    int warmup = 1;
+    std::string directory = RISCV_BENCH_WORKLOADS;
+    format_t format = FORMAT_TEXT;
+    const char *output = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+        {
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start <= list.size())
+            {
+                size_t end = list.find(',', start);
+                std::string name = list.substr(start, end == std::string::npos ? std::string::npos : end - start);
+                size_t engine;
+                for (engine = 0; engine < 3; engine++)
+                {
+                    if (name == engine_names[engine])
+                    {
+                        break;
+                    }
+                }
+                if (engine == 3)
+                {
+                    fprintf(stderr, "Unknown engine %s\n", name.c_str());
+                    return 1;
+                }
+                engines.push_back((engine_t)engine);
+                if (end == std::string::npos)
+                {
+                    break;
+                }
+                start = end + 1;
+            }
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+        {
+            warmup = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            directory = argv[++i];
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "text") == 0)
+            {
+                format = FORMAT_TEXT;
+            }
+            else if (strcmp(argv[i], "json") == 0)
+            {
+                format = FORMAT_JSON;
+            }
+            else if (strcmp(argv[i], "csv") == 0)
+            {
+                format = FORMAT_CSV;
+            }
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            output = argv[++i];
+        }
+        else if (argv[i][0] != '-')
+        {
+            size_t w;
+            for (w = 0; w < WORKLOAD_COUNT; w++)
+            {
+                if (strcmp(argv[i], workloads[w].name) == 0)
+                {
+                    selected.push_back(&workloads[w]);
+                    break;
+                }
+            }
+            if (w == WORKLOAD_COUNT)
+            {
+                fprintf(stderr, "Unknown workload %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (runs <= 0 || warmup < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (engines.empty())
+    {
+        engines.push_back(ENGINE_REFERENCE);
+        engines.push_back(ENGINE_THREADED);
+#ifdef JIT_SUPPORTED
+        engines.push_back(ENGINE_JIT);
+#endif
+    }
+    if (selected.empty())
+    {
+        for (size_t w = 0; w < WORKLOAD_COUNT; w++)
+        {
+            selected.push_back(&workloads[w]);
+        }
+    }
+
+    // Tracing would be measured too
+    TRACE_SET(TRACE_LEVEL_NONE);
+
+    std::vector<measurement_t> measurements;
+    bool valid = true;
+    for (size_t w = 0; w < selected.size(); w++)
+    {
+        for (size_t e = 0; e < engines.size(); e++)
+        {
+            measurements.push_back(measure(directory, selected[w], engines[e], warmup, runs));
+            valid = valid && measurements.back().valid;
+        }
+    }
+
+    FILE *file = stdout;
+    if (output != NULL)
+    {
+        file = fopen(output, "w");
+        if (file == NULL)
+        {
+            fprintf(stderr, "Unable to write %s\n", output);
+            return 1;
+        }
+    }
+    print_results(file, format, measurements, warmup, runs);
+    if (file != stdout)
+    {
+        fclose(file);
+    }
+
+    return valid ? 0 : 1;
+}
@@ -4,7 +4,98 @@
 #include <stdint.h>
 #include "control.h"
 
-// Execute an ALU operation
-uint32_t alu_execute(uint32_t a, uint32_t b, aluop_t aluop, bool mul_signed_a, bool mul_signed_b, bool mul_half);
+// Execute an ALU operation (inline, the datapath runs it every instruction)
+static inline uint32_t alu_execute(uint32_t a, uint32_t b, aluop_t aluop, bool mul_signed_a, bool mul_signed_b, bool mul_half)
+{
+    switch (aluop)
+    {
+    case ALUOP_ADD:
+        return (uint32_t)((int32_t)a + (int32_t)b);
+    case ALUOP_SUB:
+        return (uint32_t)((int32_t)a - (int32_t)b);
+    case ALUOP_AND:
+        return a & b;
+    case ALUOP_OR:
+        return a | b;
+    case ALUOP_XOR:
+        return a ^ b;
+    case ALUOP_SLT:
+        return (int32_t)a < (int32_t)b;
+    case ALUOP_SLTU:
+        return a < b;
+    case ALUOP_SLL:
+        return a << (b & 0x1F);
+    case ALUOP_SRL:
+        return a >> (b & 0x1F);
+    case ALUOP_SRA:
+        return (int32_t)a >> (b & 0x1F);
+    case ALUOP_MUL:
+    {
+        int64_t a_ext = 0;
+        int64_t b_ext = 0;
+        if (mul_signed_a)
+        {
+            a_ext = (int32_t)a;
+        }
+        else
+        {
+            a_ext = (uint32_t)a;
+        }
+        if (mul_signed_b)
+        {
+            b_ext = (int32_t)b;
+        }
+        else
+        {
+            b_ext = (uint32_t)b;
+        }
+        int64_t result = a_ext * b_ext;
+        if (mul_half)
+        {
+            return (uint32_t)(result >> 32);
+        }
+        else
+        {
+            return (uint32_t)result;
+        }
+    }
+    // Division by zero and signed overflow do not trap, RISC-V defines
+    // their results
+    case ALUOP_DIV:
+        if (b == 0)
+        {
+            return 0xFFFFFFFF;
+        }
+        if (a == 0x80000000 && b == 0xFFFFFFFF)
+        {
+            return a;
+        }
+        return (uint32_t)((int32_t)a / (int32_t)b);
+    case ALUOP_DIVU:
+        if (b == 0)
+        {
+            return 0xFFFFFFFF;
+        }
+        return a / b;
+    case ALUOP_REM:
+        if (b == 0)
+        {
+            return a;
+        }
+        if (a == 0x80000000 && b == 0xFFFFFFFF)
+        {
+            return 0;
+        }
+        return (uint32_t)((int32_t)a % (int32_t)b);
+    case ALUOP_REMU:
+        if (b == 0)
+        {
+            return a;
+        }
+        return a % b;
+    default:
+        return 0;
+    }
+}
 
 #endif // ALU_H
@@ -0,0 +1,261 @@
+#ifndef CACHE_SIMULATOR_H
+#define CACHE_SIMULATOR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <map>
+#include <vector>
+#include "elf_loader.h"
+
+// Default L1 caches, 16 KiB each with 64 byte lines and 4 ways
+#define CACHE_DEFAULT_SIZE (16 * 1024)
+#define CACHE_DEFAULT_LINE_SIZE 64
+#define CACHE_DEFAULT_WAYS 4
+
+// Most ways in a set, so a set's tags fit in one host cache line
+#define CACHE_MAX_WAYS 16
+
+// Code regions listed in a report, those with the most misses first
+#define CACHE_REPORT_REGIONS 20
+
+// Tag of an empty line
+#define CACHE_TAG_INVALID 0xFFFFFFFF
+
+// Which line of a set makes room for a new one
+typedef enum
+{
+    CACHE_LRU,    // Least recently used
+    CACHE_FIFO,   // Filled longest ago
+    CACHE_RANDOM, // Any
+} cache_replacement_t;
+
+// What stores do
+typedef enum
+{
+    CACHE_WRITE_BACK,    // Allocate on a miss, write dirty lines back when evicted
+    CACHE_WRITE_THROUGH, // Pass every store on, a miss doesn't allocate
+} cache_write_policy_t;
+
+// Geometry and policies of one cache
+typedef struct
+{
+    uint32_t size;      // Bytes, a power of two
+    uint32_t line_size; // Bytes, a power of two from 4
+    uint32_t ways;      // Lines per set
+    cache_replacement_t replacement;
+    cache_write_policy_t write_policy;
+} cache_config_t;
+
+// The caches of one hart
+typedef struct
+{
+    cache_config_t l1i;
+    cache_config_t l1d;
+    bool use_l2;
+    cache_config_t l2; // Shared by instructions and data, behind both L1s
+} cache_hierarchy_config_t;
+
+// Fill in the defaults, L1 caches without an L2
+void cache_default_config(cache_hierarchy_config_t *config);
+
+// Parse a comma separated list of caches (l1i, l1d, l2), each given as
+// name=size:line:ways followed by any of lru, fifo, random, wb and wt.
+// Sizes may end in k or m, and the L2 lines can't be smaller than the L1
+// ones. A bare "default" keeps the defaults. 0 on success.
+int cache_parse_spec(const char *spec, cache_hierarchy_config_t *config);
+
+// Counts of one cache
+typedef struct
+{
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_misses;
+    uint64_t write_misses;
+    uint64_t evictions;  // Valid lines replaced
+    uint64_t writebacks; // Dirty lines written to the next level
+} cache_stats_t;
+
+// Accesses and misses of the L1 caches by the code that made them
+typedef struct
+{
+    uint64_t fetches;
+    uint64_t fetch_misses;
+    uint64_t data;
+    uint64_t data_misses;
+} cache_region_stats_t;
+
+// One set associative cache. The tags of a set are next to each other, so
+// looking a line up touches one host cache line, and the replacement state
+// and dirty bits are kept apart from them. Only tags are kept, data stays
+// in RAM.
+class Cache
+{
+public:
+    // Misses and write backs go to next (NULL for memory)
+    Cache(const cache_config_t &config, Cache *next);
+
+    // Empty every line and clear the counts
+    void reset();
+
+    // Access size bytes at an address, true if every line touched hits
+    bool access(uint32_t address, uint32_t size, bool write)
+    {
+        uint32_t line = address >> line_shift;
+        uint32_t last = (address + size - 1) >> line_shift;
+        bool hit = access_line(line, write);
+        if (last != line && !access_line(last, write))
+        {
+            hit = false;
+        }
+        return hit;
+    }
+
+    const cache_stats_t &get_stats()
+    {
+        return stats;
+    }
+
+    const cache_config_t &get_config()
+    {
+        return config;
+    }
+
+private:
+    cache_config_t config;
+    Cache *next;
+
+    uint32_t line_shift;
+    uint32_t set_mask;
+
+    // Line numbers (address >> line_shift) by set and way
+    std::vector<uint32_t> tags;
+
+    // Last use (LRU) or fill (FIFO) of each line, by set and way
+    std::vector<uint64_t> stamps;
+    uint64_t clock;
+
+    // Dirty lines (write back only), by set and way
+    std::vector<uint8_t> dirty;
+
+    // Line hit last and where it is in the arrays
+    uint32_t last_line;
+    uint32_t last_index;
+
+    // Random replacement state
+    uint32_t random_state;
+
+    cache_stats_t stats;
+
+    // Access a line, true on a hit
+    bool access_line(uint32_t line, bool write)
+    {
+        if (write)
+        {
+            stats.writes++;
+        }
+        else
+        {
+            stats.reads++;
+        }
+
+        // Consecutive accesses mostly stay on the line used last, which is
+        // already the most recently used of its set
+        if (line == last_line)
+        {
+            if (write)
+            {
+                store_hit(last_index);
+            }
+            return true;
+        }
+        return lookup(line, write);
+    }
+
+    // A store to a line that is present
+    void store_hit(uint32_t index)
+    {
+        if (config.write_policy == CACHE_WRITE_BACK)
+        {
+            dirty[index] = 1;
+        }
+        else
+        {
+            next_access(tags[index], true);
+        }
+    }
+
+    // Look a line up in its set, and fill it on a miss
+    bool lookup(uint32_t line, bool write);
+
+    // Pass an access to a line on to the next level
+    void next_access(uint32_t line, bool write)
+    {
+        if (next != NULL)
+        {
+            next->access_line((line << line_shift) >> next->line_shift, write);
+        }
+    }
+};
+
+// The L1 instruction and data caches of one hart and an optional L2 behind
+// them, fed with every fetch and data access by the datapath. Accesses are
+// also counted by the code region making them: the function an ELF symbol
+// covers, or the page without one.
+class CacheSimulator
+{
+public:
+    // Symbols name the code regions (NULL for pages only)
+    CacheSimulator(const cache_hierarchy_config_t &config, ElfLoader *symbols);
+    ~CacheSimulator();
+
+    // Empty the caches and clear the counts
+    void reset();
+
+    // Fetch of an instruction of length bytes at pc
+    void fetch(uint32_t pc, uint32_t length)
+    {
+        if (pc - region_start >= region_length)
+        {
+            find_region(pc);
+        }
+        region->fetches++;
+        if (!l1i->access(pc, length, false))
+        {
+            region->fetch_misses++;
+        }
+    }
+
+    // Data access of size bytes made by the instruction at the last fetch
+    void data(uint32_t address, uint32_t size, bool write)
+    {
+        region->data++;
+        if (!l1d->access(address, size, write))
+        {
+            region->data_misses++;
+        }
+    }
+
+    // Print the counts of every cache and the regions with the most misses
+    void report(FILE *output);
+
+private:
+    Cache *l1i;
+    Cache *l1d;
+    Cache *l2;
+
+    ElfLoader *symbols;
+
+    // Counts by region start, and the region of the last fetch
+    std::map<uint32_t, cache_region_stats_t> regions;
+    cache_region_stats_t *region;
+    uint32_t region_start;
+    uint32_t region_length;
+
+    // Make the region holding pc the current one
+    void find_region(uint32_t pc);
+
+    // Print the counts of one cache
+    static void report_cache(FILE *output, const char *name, Cache *cache);
+};
+
+#endif // CACHE_SIMULATOR_H
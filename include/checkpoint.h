@@ -0,0 +1,83 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "ram.h"
+#include "processor.h"
+
+// Checkpoint file layout. The header and hart records are followed by the
+// numbers of the saved pages, then the page data starting on a page
+// boundary so it can be mapped straight into RAM.
+#define CHECKPOINT_MAGIC "RVCHKPT"
+#define CHECKPOINT_VERSION 2
+
+typedef struct
+{
+    char magic[8];        // CHECKPOINT_MAGIC
+    uint32_t version;     // CHECKPOINT_VERSION
+    uint32_t hart_count;  // Hart records after the header
+    uint32_t page_count;  // Saved pages
+    uint32_t reserved;
+    uint64_t data_offset; // File offset of the first page
+    uint64_t checksum;    // Over the whole file, with this field zero
+} checkpoint_header_t;
+
+typedef struct
+{
+    uint32_t pc;
+    uint32_t hart_id;
+    uint32_t halt;
+    uint32_t reserved;
+    uint64_t instruction_count;
+    uint32_t x[32];
+
+    // Counter CSRs, see Processor
+    uint32_t counter_inhibit;
+    uint32_t hpm_events[CSR_HPM_COUNTERS];
+    uint64_t counter_offsets[32];
+    uint64_t counter_frozen[32];
+    uint64_t event_counts[HPM_EVENT_COUNT];
+} checkpoint_hart_t;
+
+// Saves and restores the state of a set of harts and their memory. Only
+// pages that hold something are saved, and a restore maps them from the
+// file as copy on write where the host allows it, so many runs can start
+// from one checkpoint without copying it.
+class Checkpoint
+{
+public:
+    Checkpoint();
+    ~Checkpoint();
+
+    // Save harts and the memory they share (0 on success)
+    static int save(const char *filename, Processor *const *processors, uint32_t count, RAM *ram);
+
+    // Open a checkpoint and check its version and checksum (0 on success)
+    int open(const char *filename);
+
+    // Harts in the opened checkpoint
+    uint32_t get_hart_count();
+
+    // Restore the opened checkpoint into as many harts as were saved and
+    // their memory, before any of them runs (0 on success)
+    int restore(Processor *const *processors, uint32_t count, RAM *ram);
+
+private:
+    // Opened file
+    int fd;
+    const uint8_t *image;
+    size_t size;
+#ifndef RAM_FILE_MAPPING
+    std::vector<uint8_t> contents;
+#endif
+
+    // Header of the opened file
+    checkpoint_header_t header;
+
+    // Release the opened file
+    void close();
+};
+
+#endif // CHECKPOINT_H
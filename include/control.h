@@ -14,16 +14,19 @@ typedef enum : unsigned int
     OP_JAL = 0b1101111,   // JAL J-type instruction
     OP_JALR = 0b1100111,  // JALR I-type instruction
     OP_LD_ITYPE = 0b0000011, // Load I-type instruction
+    OP_MISC_MEM = 0b0001111, // FENCE and FENCE.I
+    OP_AMO = 0b0101111,      // Atomic memory operation (A extension)
+    OP_SYSTEM = 0b1110011,   // ECALL, EBREAK and CSR instructions
 } opcode_t;
 
 typedef enum : unsigned int
 {
     SLL_MULH = 0x1,
-    SRL_SRA = 0x5,
+    SRL_SRA_DIVU = 0x5,
     ADD_SUB_MUL = 0x0,
-    AND = 0x7,
-    OR = 0x6,
-    XOR = 0x4,
+    AND_REMU = 0x7,
+    OR_REM = 0x6,
+    XOR_DIV = 0x4,
     SLT_MULHSU = 0x2,
     SLTU_MULHU = 0x3,
 } funct3_r_t;
@@ -63,6 +66,44 @@ typedef enum : unsigned int
     SW = 0x2,
 } funct3_s_t;
 
+typedef enum : unsigned int
+{
+    FENCE = 0x0,
+    FENCE_I = 0x1,
+} funct3_misc_mem_t;
+
+// Atomic operation (funct7 bits 6:2), only the word width exists
+typedef enum : unsigned int
+{
+    AMO_FUNCT_ADD = 0x00,
+    AMO_FUNCT_SWAP = 0x01,
+    AMO_FUNCT_LR = 0x02,
+    AMO_FUNCT_SC = 0x03,
+    AMO_FUNCT_XOR = 0x04,
+    AMO_FUNCT_OR = 0x08,
+    AMO_FUNCT_AND = 0x0C,
+    AMO_FUNCT_MIN = 0x10,
+    AMO_FUNCT_MAX = 0x14,
+    AMO_FUNCT_MINU = 0x18,
+    AMO_FUNCT_MAXU = 0x1C,
+} funct5_amo_t;
+
+#define AMO_FUNCT3_W 0x2
+
+typedef enum : unsigned int
+{
+    PRIV = 0x0,
+    CSRRW = 0x1,
+    CSRRS = 0x2,
+    CSRRC = 0x3,
+    CSRRWI = 0x5,
+    CSRRSI = 0x6,
+    CSRRCI = 0x7,
+} funct3_system_t;
+
+#define SYSTEM_ECALL 0x000
+#define SYSTEM_EBREAK 0x001
+
 typedef enum : unsigned int
 {
     BEQ = 0x0,
@@ -175,12 +216,43 @@ typedef enum
     ALUOP_SRL,  // Shift right logical
     ALUOP_SRA,  // Shift right arithmetic
     ALUOP_MUL,  // Multiply
+    ALUOP_DIV,  // Divide
+    ALUOP_DIVU, // Divide unsigned
+    ALUOP_REM,  // Remainder
+    ALUOP_REMU, // Remainder unsigned
 } aluop_t;
 
+typedef enum
+{
+    CSR_NONE,  // Not a CSR instruction
+    CSR_WRITE, // Write the source
+    CSR_SET,   // Set the bits of the source
+    CSR_CLEAR, // Clear the bits of the source
+} csr_op_t;
+
+typedef enum
+{
+    AMO_NONE, // Not an atomic instruction
+    AMO_LR,   // Load reserved
+    AMO_SC,   // Store conditional
+    AMO_SWAP, // Swap
+    AMO_ADD,  // Add
+    AMO_XOR,  // Bitwise XOR
+    AMO_AND,  // Bitwise AND
+    AMO_OR,   // Bitwise OR
+    AMO_MIN,  // Signed minimum
+    AMO_MAX,  // Signed maximum
+    AMO_MINU, // Unsigned minimum
+    AMO_MAXU, // Unsigned maximum
+} amo_op_t;
+
 // Defines what the processor should do based on the instruction
 typedef struct
 {
     bool halt;                  // Halt
+    bool breakpoint;            // Halts for a breakpoint instead of running (set by DecodeCache)
+    uint8_t length;             // Instruction size in bytes (2 if compressed)
+    bool ecall;                 // ECALL, halts unless a system call proxy takes it
     uint8_t mem_read;           // Read from memory (0 = none, 1 = byte, 2 = halfword, 3 = word)
     bool mem_read_unsigned;     // Read from memory unsigned
     uint8_t mem_write;          // Write to memory (0 = none, 1 = byte, 2 = halfword, 3 = word)
@@ -198,8 +270,19 @@ typedef struct
     uint32_t imm;               // Immediate value
     bool alu_a_src;             // ALU source A (false = register, true = pc)
     bool alu_b_src;             // ALU source B (false = register, true = immediate)
+    amo_op_t amo;               // Atomic operation on the word at rs1
+    bool fence;                 // Order memory accesses between harts
+    bool fence_i;               // Make stores visible to instruction fetch
+    csr_op_t csr_op;            // CSR operation on the register in imm
+    bool csr_imm;               // CSR source is rs1 as an immediate, not a register
 } control_t;
 
+// Decode an instruction. A compressed instruction (low bits not 11) is
+// decoded as the 32-bit instruction it expands to, with length 2.
 void control(control_t *control, uint32_t instruction);
 
+// 32-bit equivalent of a compressed instruction (0, which is illegal, if
+// it has none)
+uint32_t expand_compressed(uint32_t instruction);
+
 #endif // CONTROL_H
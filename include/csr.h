@@ -0,0 +1,54 @@
+#ifndef CSR_H
+#define CSR_H
+
+// Control and status register numbers
+#define CSR_MISA 0x301
+#define CSR_MCOUNTINHIBIT 0x320
+#define CSR_MHPMEVENT3 0x323
+#define CSR_MHPMEVENT31 0x33F
+#define CSR_MCYCLE 0xB00
+#define CSR_MINSTRET 0xB02
+#define CSR_MHPMCOUNTER3 0xB03
+#define CSR_MCYCLEH 0xB80
+#define CSR_CYCLE 0xC00
+#define CSR_TIME 0xC01
+#define CSR_INSTRET 0xC02
+#define CSR_HPMCOUNTER3 0xC03
+#define CSR_CYCLEH 0xC80
+#define CSR_MHARTID 0xF14
+
+// Counters are numbered by the low address bits: 0 cycle, 1 time,
+// 2 instret and 3-31 the programmable counters. The high halves are 0x80
+// above the low ones.
+#define CSR_COUNTER_HIGH 0x80
+#define CSR_COUNTER_MASK 0x1F
+#define CSR_COUNTER_CYCLE 0
+#define CSR_COUNTER_TIME 1
+#define CSR_COUNTER_INSTRET 2
+#define CSR_HPM_FIRST 3
+#define CSR_HPM_COUNTERS 29
+
+// Registers with both top bits of the address set are read only
+#define CSR_READ_ONLY(address) (((address) >> 10) == 3)
+
+// Frequency of the time counter
+#define CSR_TIME_HZ 1000000
+
+// misa for RV32IMAC
+#define CSR_MISA_VALUE ((1u << 30) | (1u << ('A' - 'A')) | (1u << ('C' - 'A')) | (1u << ('I' - 'A')) | (1u << ('M' - 'A')))
+
+// Events the programmable counters can be set to count (mhpmevent values)
+typedef enum
+{
+    HPM_EVENT_NONE,         // Counter holds its value
+    HPM_EVENT_LOAD,         // Loads, including LR.W
+    HPM_EVENT_STORE,        // Stores, including SC.W
+    HPM_EVENT_BRANCH,       // Conditional branches
+    HPM_EVENT_BRANCH_TAKEN, // Conditional branches taken
+    HPM_EVENT_JUMP,         // JAL and JALR
+    HPM_EVENT_MUL,          // Multiplies
+    HPM_EVENT_ATOMIC,       // AMO instructions
+    HPM_EVENT_COUNT,
+} hpm_event_t;
+
+#endif // CSR_H
@@ -0,0 +1,106 @@
+#ifndef DECODE_CACHE_H
+#define DECODE_CACHE_H
+
+#include <stdint.h>
+#include <set>
+#include <unordered_map>
+#include "control.h"
+#include "ram.h"
+
+// Instructions start on any halfword
+#define DECODE_ENTRIES_PER_PAGE (RAM_PAGE_SIZE / 2)
+#define DECODE_VALID_WORDS (DECODE_ENTRIES_PER_PAGE / 64)
+
+// Words tracked by CodeCoverage per page
+#define COVERAGE_WORDS_PER_PAGE (RAM_PAGE_SIZE / 4)
+#define COVERAGE_BITMAP_WORDS (COVERAGE_WORDS_PER_PAGE / 64)
+
+// Decoded instructions for one page of memory
+typedef struct
+{
+    uint64_t valid[DECODE_VALID_WORDS];          // One bit per entry
+    control_t entries[DECODE_ENTRIES_PER_PAGE]; // Decoded instruction per halfword
+} decode_page_t;
+
+// Tracks which instruction words have been translated by an execution
+// engine, so that stores to data sharing a page with code can be ignored
+class CodeCoverage
+{
+public:
+    CodeCoverage();
+    ~CodeCoverage();
+
+    // Mark the words in [start, end) as translated
+    void mark(uint32_t start, uint32_t end);
+
+    // Check if a store overlaps a translated word
+    bool overlaps(uint32_t address, uint32_t size);
+
+    // Forget everything
+    void clear();
+
+private:
+    // One bit per word, by page number
+    std::unordered_map<uint32_t, uint64_t *> pages;
+};
+
+// Caches the decoded control signals for each PC so that loops are only
+// decoded once. Entries are dropped when RAM reports a store over them.
+class DecodeCache : public CodeObserver
+{
+public:
+    DecodeCache(RAM *ram);
+    ~DecodeCache();
+
+    // Get the decoded instruction at an address
+    const control_t *lookup(uint32_t pc)
+    {
+        uint32_t page_number = pc >> RAM_PAGE_SHIFT;
+        decode_page_t *page = (page_number == last_page_number) ? last_page : find_page(page_number);
+
+        uint32_t index = (pc & (RAM_PAGE_SIZE - 1)) >> 1;
+        if (!((page->valid[index / 64] >> (index % 64)) & 1))
+        {
+            decode(page, index, pc);
+        }
+        return &page->entries[index];
+    }
+
+    // Drop all decoded instructions
+    void flush();
+
+    // Drop the decoded instructions overlapping a store
+    void code_written(uint32_t address, uint32_t size);
+
+    // Decode the instruction at an address as a breakpoint from now on, or
+    // as itself again. Already decoded copies must be dropped.
+    void set_breakpoint(uint32_t address, bool enabled);
+
+    // True if the instruction at an address is decoded as a breakpoint
+    bool has_breakpoint(uint32_t address)
+    {
+        return !breakpoints.empty() && breakpoints.count(address) != 0;
+    }
+
+private:
+    // Memory to fetch from
+    RAM *ram;
+
+    // Decoded pages by page number
+    std::unordered_map<uint32_t, decode_page_t *> pages;
+
+    // Most recently used page
+    uint32_t last_page_number;
+    decode_page_t *last_page;
+
+    // Addresses decoded as breakpoints
+    std::set<uint32_t> breakpoints;
+
+    // Find or allocate the page for a page number
+    decode_page_t *find_page(uint32_t page_number);
+
+    // Fetch and decode one instruction into a page
+    void decode(decode_page_t *page, uint32_t index, uint32_t pc);
+};
+
+#endif // DECODE_CACHE_H
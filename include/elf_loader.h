@@ -0,0 +1,136 @@
+#ifndef ELF_LOADER_H
+#define ELF_LOADER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "ram.h"
+
+// ELF32 file layout (only the fields the loader needs are interpreted)
+typedef struct
+{
+    uint8_t e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} elf32_ehdr_t;
+
+typedef struct
+{
+    uint32_t p_type;
+    uint32_t p_offset;
+    uint32_t p_vaddr;
+    uint32_t p_paddr;
+    uint32_t p_filesz;
+    uint32_t p_memsz;
+    uint32_t p_flags;
+    uint32_t p_align;
+} elf32_phdr_t;
+
+typedef struct
+{
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint32_t sh_flags;
+    uint32_t sh_addr;
+    uint32_t sh_offset;
+    uint32_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint32_t sh_addralign;
+    uint32_t sh_entsize;
+} elf32_shdr_t;
+
+typedef struct
+{
+    uint32_t st_name;
+    uint32_t st_value;
+    uint32_t st_size;
+    uint8_t st_info;
+    uint8_t st_other;
+    uint16_t st_shndx;
+} elf32_sym_t;
+
+#define ELF_CLASS_32 1
+#define ELF_DATA_LSB 1
+#define ELF_TYPE_EXEC 2
+#define ELF_MACHINE_RISCV 243
+#define ELF_PT_LOAD 1
+#define ELF_SHT_SYMTAB 2
+
+// Section indexes of undefined symbols, and from which on they are special
+// (absolute values, common blocks) rather than sections
+#define ELF_SHN_UNDEF 0
+#define ELF_SHN_LORESERVE 0xFF00
+
+// Symbol types (low nibble of st_info)
+#define ELF_STT_OBJECT 1
+#define ELF_STT_FUNC 2
+
+// A symbol from the symbol table
+typedef struct
+{
+    std::string name;
+    uint32_t value; // Address
+    uint32_t size;  // Size in bytes (0 if unknown)
+    uint8_t type;   // ELF_STT_*
+} elf_symbol_t;
+
+// Loads RISC-V ELF32 executables into RAM. Page aligned parts of PT_LOAD
+// segments are mapped from the file where the host allows it, the rest
+// is copied.
+class ElfLoader
+{
+public:
+    ElfLoader();
+    ~ElfLoader();
+
+    // Check if a file starts with the ELF magic
+    static bool is_elf(const char *filename);
+
+    // Load an executable into RAM (0 on success)
+    int load(const char *filename, RAM *ram);
+
+    // Entry point of the loaded executable
+    uint32_t get_entry();
+
+    // Address just past the highest loaded segment, where the heap starts
+    uint32_t get_end();
+
+    // Symbols of the loaded executable, sorted by address
+    const std::vector<elf_symbol_t> &get_symbols();
+
+    // Find a symbol by name (NULL if not found)
+    const elf_symbol_t *find_symbol(const char *name);
+
+    // Find the symbol covering an address (NULL if none)
+    const elf_symbol_t *symbol_at(uint32_t address);
+
+private:
+    // Entry point
+    uint32_t entry;
+
+    // End of the highest segment
+    uint32_t end;
+
+    // Symbols sorted by address
+    std::vector<elf_symbol_t> symbols;
+
+    // Load the PT_LOAD segments of a file held in memory
+    int load_segments(const uint8_t *image, size_t size, int fd, RAM *ram);
+
+    // Read the symbol table of a file held in memory
+    void load_symbols(const uint8_t *image, size_t size);
+};
+
+#endif // ELF_LOADER_H
@@ -0,0 +1,113 @@
+#ifndef FARM_H
+#define FARM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ram.h"
+#include "processor.h"
+
+// Raw file copied into guest memory before a job starts
+typedef struct
+{
+    std::string filename;
+    uint32_t address;
+} farm_input_t;
+
+// One line of the manifest
+typedef struct
+{
+    std::string name;                                  // Reported name (the image by default)
+    std::string image;                                 // ELF or Intel HEX program
+    uint64_t max_instructions;                         // Instruction budget
+    std::vector<std::pair<int, uint32_t> > registers;  // Registers set after reset
+    std::vector<farm_input_t> inputs;                  // Files placed in memory
+} farm_job_t;
+
+// Outcome of a job
+typedef struct
+{
+    bool loaded;            // Image and inputs were loaded
+    stop_reason_t reason;   // Why the job stopped
+    uint64_t instructions;  // Instructions executed
+    uint32_t pc;            // Address of the next instruction
+    uint64_t memory_digest; // RAM::digest() at the end
+    uint32_t x[32];         // Final registers
+} farm_result_t;
+
+// A program or input file, read once and shared by every job using it
+typedef struct
+{
+    std::mutex lock;            // Held while loading
+    bool loaded;                // Loading was attempted
+    bool valid;                 // Loading succeeded
+    RAM *memory;                // Program image (programs only)
+    uint32_t entry;             // Program entry point
+    std::vector<uint8_t> data;  // File contents (inputs only)
+} farm_file_t;
+
+// Runs many independent guest programs on a pool of host threads. Each
+// worker keeps one RAM and one Processor per lane and reuses them for every
+// job it takes, and every distinct image is parsed only once. With more than
+// one lane, consecutive jobs running the same image are run together by a
+// LockstepEngine.
+class Farm
+{
+public:
+    Farm(engine_t engine, uint32_t threads, uint32_t lanes = 1);
+    ~Farm();
+
+    // Read a manifest with one job per line (0 on success):
+    //   image [name=NAME] [n=INSTRUCTIONS] [xN=VALUE]... [FILE@ADDRESS]...
+    // Paths are relative to the manifest, # starts a comment
+    int load_manifest(const char *filename, uint64_t max_instructions);
+
+    // Run every job
+    void run();
+
+    // Write one line per job in manifest order, to stdout if filename is
+    // NULL (0 on success)
+    int write_results(const char *filename);
+
+private:
+    // Engine used by every worker
+    engine_t engine;
+
+    // Worker threads
+    uint32_t threads;
+
+    // Jobs run in lockstep by each worker
+    uint32_t lanes;
+
+    // Jobs and their results
+    std::vector<farm_job_t> jobs;
+    std::vector<farm_result_t> results;
+
+    // Runs of consecutive jobs (first, count) taken by a worker at once
+    std::vector<std::pair<size_t, size_t> > batches;
+
+    // Images and inputs by path, filled while loading the manifest and only
+    // read after that
+    std::map<std::string, farm_file_t *> files;
+
+    // Take batches until there are none left
+    void worker();
+
+    // Load a job into a worker's RAM and processor (false if it can't be)
+    bool start_job(size_t index, RAM *ram, Processor *processor);
+
+    // Record the result of a job
+    void finish_job(size_t index, RAM *ram, Processor *processor, stop_reason_t reason);
+
+    // Find a file, loading it the first time (NULL if it can't be loaded)
+    farm_file_t *get_image(const std::string &filename);
+    farm_file_t *get_input(const std::string &filename);
+
+    // Next batch to take
+    std::atomic<size_t> next_batch;
+};
+
+#endif // FARM_H
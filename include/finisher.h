@@ -0,0 +1,51 @@
+#ifndef FINISHER_H
+#define FINISHER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "ram.h"
+#include "processor.h"
+
+// Where main maps the finisher, as on common RISC-V boards
+#define FINISHER_BASE 0x00100000
+#define FINISHER_SIZE 0x1000
+
+// Low halfword of a word written to the finisher, a failure carries the
+// exit code in the high halfword
+#define FINISHER_FAIL 0x3333
+#define FINISHER_PASS 0x5555
+
+// Test finisher: the guest writes a word to end the run with an exit code.
+// Every registered processor is asked to stop, which happens within the
+// block being run.
+class Finisher : public Device
+{
+public:
+    Finisher();
+
+    // Stop a processor when the guest finishes
+    void add_processor(Processor *processor);
+
+    uint32_t read(uint32_t offset, uint32_t size);
+    void write(uint32_t offset, uint32_t value, uint32_t size);
+
+    // The guest wrote a pass or fail word
+    bool is_finished()
+    {
+        return finished.load();
+    }
+
+    // Exit code of the first pass or fail word
+    int get_exit_code()
+    {
+        return exit_code.load();
+    }
+
+private:
+    std::vector<Processor *> processors;
+    std::atomic<bool> finished;
+    std::atomic<int> exit_code;
+};
+
+#endif // FINISHER_H
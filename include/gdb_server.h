@@ -0,0 +1,145 @@
+#ifndef GDB_SERVER_H
+#define GDB_SERVER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "processor.h"
+
+// Sockets need POSIX calls
+#if defined(__unix__) || defined(__APPLE__)
+#define GDB_SERVER_SUPPORTED
+#endif
+
+// Largest packet the debugger may send
+#define GDB_PACKET_SIZE 4096
+
+// Milliseconds a continued hart runs between checks for an interrupt from
+// the debugger
+#define GDB_POLL_INTERVAL 50
+
+// Registers in a g packet: x0-x31 and pc
+#define GDB_REGISTER_COUNT 33
+#define GDB_REGISTER_PC 32
+
+// Signals in stop replies
+#define GDB_SIGINT 2
+#define GDB_SIGTRAP 5
+
+// Why serve() returned
+typedef enum
+{
+    GDB_DETACHED, // The debugger detached or went away, the run goes on
+    GDB_KILLED,   // The debugger killed the program, the run should end
+} gdb_outcome_t;
+
+// Breakpoint and watchpoint kinds, as numbered in Z packets
+typedef enum
+{
+    GDB_BREAKPOINT_SOFTWARE = 0,
+    GDB_BREAKPOINT_HARDWARE = 1,
+    GDB_WATCHPOINT_WRITE = 2,
+    GDB_WATCHPOINT_READ = 3,
+    GDB_WATCHPOINT_ACCESS = 4,
+} gdb_breakpoint_t;
+
+// GDB remote serial protocol server for one hart, listening on a TCP port
+// on localhost or on a Unix socket. A background thread accepts the
+// debugger and stops the hart's run where it is. The hart's own thread
+// then calls serve(), which answers the debugger and runs the hart as it
+// asks until it detaches. Breakpoints and watchpoints are Processor ones,
+// so a continued hart runs on its engine at full speed.
+class GdbServer
+{
+public:
+    GdbServer();
+
+    // Close the sockets
+    ~GdbServer();
+
+    // Listen on a TCP port given as a number, or a Unix socket at a path
+    // (0 on success)
+    int listen(const char *address);
+
+    // Accept debuggers for a processor in the background
+    void start(Processor *processor);
+
+    // Wait for a debugger to connect
+    void wait_for_debugger();
+
+    // True once a debugger has connected and wants the hart, which is
+    // asked to stop. The hart's thread should call serve() when its run
+    // returns.
+    bool is_pending()
+    {
+        return pending.load();
+    }
+
+    // Serve the debugger on the hart's thread until it detaches or kills
+    // the program
+    gdb_outcome_t serve();
+
+    // Stop accepting and disconnect the debugger
+    void stop();
+
+private:
+    Processor *processor;
+
+    // Listening and connected sockets (-1 if none)
+    int listen_fd;
+    std::atomic<int> client_fd;
+
+    // Unix socket path to remove when done
+    std::string socket_path;
+
+    // Accepts debuggers
+    std::thread accept_thread;
+    std::atomic<bool> stopping;
+    std::atomic<bool> pending;
+
+    // Acknowledgements are turned off by QStartNoAckMode
+    bool acknowledge;
+
+    // Bytes received and not yet used
+    std::string input;
+
+    // Breakpoints and watchpoints the debugger set
+    std::map<uint32_t, gdb_breakpoint_t> breakpoints;
+    std::vector<ram_watch_t> watchpoints;
+
+    // Reply to ? and after the hart stops
+    std::string stop_reply;
+
+    // Body of the accept thread
+    void accept_debuggers();
+
+    // Read a packet's data into packet, answering interrupts and
+    // acknowledgements on the way (false if the debugger went away)
+    bool read_packet(std::string *packet);
+
+    // Send a packet (false if the debugger went away)
+    bool send_packet(const std::string &data);
+
+    // Run the hart until it stops or the debugger interrupts, single
+    // stepping if step is set, and work out the stop reply
+    void resume(bool step);
+
+    // Answer one packet. Sets outcome and returns false when the session
+    // ends.
+    bool handle_packet(const std::string &packet, std::string *reply, gdb_outcome_t *outcome);
+
+    // Register, memory and breakpoint packets
+    std::string read_registers();
+    bool write_registers(const std::string &data);
+    std::string read_memory(uint32_t address, uint32_t length);
+    bool write_memory(uint32_t address, uint32_t length, const std::string &data);
+    std::string target_description(const std::string &annex, uint32_t offset, uint32_t length);
+
+    // Remove every breakpoint and watchpoint and close the connection
+    void disconnect();
+};
+
+#endif // GDB_SERVER_H
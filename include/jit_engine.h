@@ -0,0 +1,195 @@
+#ifndef JIT_ENGINE_H
+#define JIT_ENGINE_H
+
+#include <stdint.h>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "decode_cache.h"
+#include "ram.h"
+#include "threaded_engine.h"
+
+// The translator emits x86-64 code into mmap'd buffers
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#endif
+
+// Size of the executable code buffer
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+
+// Entries in the JALR target cache
+#define JIT_JUMP_CACHE_SIZE 1024
+
+// Why translated code returned to the dispatcher
+typedef enum
+{
+    JIT_EXIT_CHAIN,      // Static target not linked yet (patch_site says where)
+    JIT_EXIT_INDIRECT,   // JALR target not in the jump cache
+    JIT_EXIT_FALLBACK,   // Instruction left to Processor::execute_instruction()
+    JIT_EXIT_HALT,       // Halt instruction
+    JIT_EXIT_CODE_WRITE, // Store over translated code
+    JIT_EXIT_BUDGET,     // Instruction budget used up or stop requested
+    JIT_EXIT_WATCH,      // Access that hit a watchpoint (pc is the instruction's)
+} jit_exit_t;
+
+// JALR target cache entry, looked up by translated code
+typedef struct
+{
+    uint32_t pc;
+    uint32_t pad;
+    uint8_t *code;
+} jit_jump_entry_t;
+
+class RAM;
+class JitEngine;
+
+// State shared between the dispatcher and translated code. Translated code
+// keeps its address in R12, so the layout is part of the generated code.
+typedef struct
+{
+    uint32_t *x;           // Guest registers (REGISTER_SINK absorbs x0 writes)
+    ram_tlb_entry_t *read_tlb;  // RAM TLBs for the inline fast path, misses
+    ram_tlb_entry_t *write_tlb; // and code pages take the slow path
+    RAM *ram;              // RAM for the slow path helpers
+    JitEngine *engine;     // Owning engine
+    int64_t budget;        // Instructions left before returning
+    uint8_t *patch_site;   // Jump to link for JIT_EXIT_CHAIN
+    uint64_t *event_counts; // Performance counter events, added to per block
+    uint32_t pc;           // Next guest PC on exit
+    bool code_modified;    // Set when a store overlaps translated code or a device stops the run
+    bool watch_pending;    // Set when an access hits a watchpoint
+    volatile uint8_t stop; // Set by request_stop(), checked on block entry
+    jit_jump_entry_t jump_cache[JIT_JUMP_CACHE_SIZE];
+} jit_context_t;
+
+// A translated basic block
+typedef struct
+{
+    uint32_t start_pc;                                    // Address of the first instruction
+    uint32_t end_pc;                                      // Address after the last instruction
+    uint8_t *code;                                        // Entry point
+    std::vector<std::pair<uint8_t *, uint8_t *> > incoming; // Linked jumps into this block and their stubs
+} jit_block_t;
+
+class Processor;
+
+// Translates hot basic blocks to x86-64 and runs them, chaining blocks with
+// patched direct jumps. Instructions it does not translate are run through
+// Processor::execute_instruction(). Produces the same state as the reference
+// datapath.
+class JitEngine : public CodeObserver
+{
+public:
+    JitEngine(Processor *processor, RAM *ram, DecodeCache *decode_cache);
+    ~JitEngine();
+
+    // Check if the host can run translated code
+    static bool supported();
+
+    // False if the host refused memory to run translated code from
+    bool has_code_buffer();
+
+    // Run until the processor halts or a stop condition is reached at a
+    // block boundary
+    void run();
+
+    // Leave translated code at the next block boundary
+    void request_stop();
+
+    // Start a block at an address whenever execution reaches it
+    void stop_at(uint32_t address);
+
+    // Undo stop_at(), letting the translations split at the address join again
+    void clear_stop(uint32_t address);
+
+    // Drop all translations
+    void flush();
+
+    // Drop all translations before the next block runs (FENCE.I)
+    void fence_instructions();
+
+    // Queue the translations overlapping a store to be dropped
+    void code_written(uint32_t address, uint32_t size);
+
+    // Leave translated code after the access being made, which hit a
+    // watchpoint
+    void watch_hit();
+
+    // Leave translated code after a device store that asked the processor
+    // to stop
+    void device_written();
+
+private:
+    // Processor whose state is executed
+    Processor *processor;
+
+    // Memory
+    RAM *ram;
+
+    // Decoder shared with the reference datapath
+    DecodeCache *decode_cache;
+
+    // Context handed to translated code
+    jit_context_t context;
+
+    // Code buffer, writable while code is emitted or patched and executable
+    // while it runs, never both
+    uint8_t *code_buffer;
+    uint8_t *code_end;
+    bool code_writable;
+
+    // Next free byte in the buffer
+    uint8_t *code_free;
+
+    // Enter translated code: enter(context, code) returns a jit_exit_t
+    uint32_t (*enter)(jit_context_t *context, uint8_t *code);
+
+    // Common exit path (exit reason in EAX)
+    uint8_t *exit_code;
+
+    // Target of empty jump cache entries
+    uint8_t *indirect_miss_code;
+
+    // Blocks by start address
+    std::unordered_map<uint32_t, jit_block_t *> blocks;
+
+    // Words covered by translations
+    CodeCoverage coverage;
+
+    // Code stores since translations were last checked (address, size)
+    std::vector<std::pair<uint32_t, uint32_t> > pending_writes;
+
+    // Set by fence_instructions()
+    bool flush_pending;
+
+    // Translations count events for the performance counters, which they
+    // only do while a counter selects one
+    bool events_counted;
+
+    // Addresses blocks must not run through (see stop_at())
+    std::set<uint32_t> stop_points;
+
+    // Emit the entry and exit trampolines at the start of the buffer
+    void emit_trampolines();
+
+    // Translate the block starting at an address (NULL if the first
+    // instruction can't be translated)
+    jit_block_t *translate_block(uint32_t pc);
+
+    // Drop translations that have been written over (returns true if any were dropped)
+    bool process_invalidations();
+
+    // Reset the jump cache to all misses
+    void clear_jump_cache();
+
+    // Switch the code buffer between writable and executable. On failure
+    // the buffer is released and the reference datapath runs everything.
+    bool make_code_writable();
+    bool make_code_executable();
+    bool protect_code(int protection);
+
+    // Drop every translation and unmap the code buffer
+    void release_code_buffer();
+};
+
+#endif // JIT_ENGINE_H
@@ -0,0 +1,114 @@
+#ifndef LOCKSTEP_ENGINE_H
+#define LOCKSTEP_ENGINE_H
+
+#include <stdint.h>
+#include "register_file.h"
+#include "threaded_engine.h"
+
+// Instances run together
+#define LOCKSTEP_LANES 8
+
+// Translated blocks kept, by halfword address of their first instruction
+#define LOCKSTEP_BLOCK_CACHE_ENTRIES 512
+
+// Instructions in a block at most
+#define LOCKSTEP_MAX_BLOCK_LENGTH 32
+
+// Use vector types where the compiler supports them, otherwise arrays that
+// the handlers loop over one lane at a time
+#if defined(__GNUC__)
+#define LOCKSTEP_VECTORS
+#endif
+
+#ifdef LOCKSTEP_VECTORS
+// One register of every lane. The compiler turns arithmetic on these into
+// vector instructions, two SSE2 operations per register on plain x86-64 and
+// one with AVX2. The alignment is kept at 16 bytes so the engine can be
+// allocated with new.
+typedef uint32_t lockstep_vector_t __attribute__((vector_size(4 * LOCKSTEP_LANES), aligned(16)));
+typedef int32_t lockstep_signed_vector_t __attribute__((vector_size(4 * LOCKSTEP_LANES), aligned(16)));
+#else
+// One register of every lane
+typedef uint32_t lockstep_vector_t[LOCKSTEP_LANES];
+#endif
+
+// A straight line run of translated instructions ending in a branch, a
+// jump or an instruction the lanes can't run
+typedef struct
+{
+    uint32_t start_pc;  // Address of the first instruction
+    uint32_t end_pc;    // Address after the last instruction
+    uint32_t length;    // Instructions in the block, 0 if the entry is empty
+    threaded_op_t ops[LOCKSTEP_MAX_BLOCK_LENGTH];
+} lockstep_block_t;
+
+class Processor;
+
+// Runs up to LOCKSTEP_LANES processors executing the same program on
+// different data, each with its own RAM. Every block is decoded once for all
+// lanes and each instruction executes as one vector operation across them
+// (a loop over the lanes without vector types), with results masked to the
+// lanes at that PC. Lanes whose branches go another way wait while the lanes
+// at the lowest PC run, which brings them back together where the paths
+// meet. Loads and stores go to each lane's RAM in turn, and instructions
+// without a lane handler (atomics, CSRs, fences) run on each lane's
+// Processor. Lanes must run the same code, a lane writing code drops the
+// blocks holding it for every lane.
+class LockstepEngine : public CodeObserver
+{
+public:
+    LockstepEngine();
+    ~LockstepEngine();
+
+    // Run the processors until each has halted or executed its budget
+    void run(Processor *const *processors, const uint64_t *max_instructions, uint32_t count);
+
+    // Drop the blocks holding written code
+    void code_written(uint32_t address, uint32_t size);
+
+private:
+    // Registers by number (REGISTER_SINK absorbs x0 writes)
+    lockstep_vector_t x[REGISTER_FILE_SLOTS];
+
+    // Next instruction of each lane
+    lockstep_vector_t pc;
+
+    // Lanes running the current group, as all ones or zero
+    lockstep_vector_t active;
+    uint32_t active_lanes;  // The same lanes as a bit mask
+
+    // Per lane state
+    uint64_t instruction_count[LOCKSTEP_LANES];
+    uint64_t stop_count[LOCKSTEP_LANES];
+    bool runnable[LOCKSTEP_LANES];
+
+    // Processors being run and their memories
+    Processor *lanes[LOCKSTEP_LANES];
+    RAM *rams[LOCKSTEP_LANES];
+    uint32_t lane_count;
+
+    // Some lane counts events for the performance counters, so every
+    // instruction goes through the processors
+    bool scalar_only;
+
+    // Translations by start PC
+    lockstep_block_t blocks[LOCKSTEP_BLOCK_CACHE_ENTRIES];
+
+    // A lane wrote code held by a block, so the running block must stop
+    bool code_modified;
+
+    // Find or translate the block at a PC
+    const lockstep_block_t *get_block(uint32_t start_pc, uint32_t first);
+
+    // Run the lanes at a PC together for as long as they stay together
+    void run_group(uint32_t group_pc);
+
+    // Run the instruction at a PC through the datapath of each active lane
+    void step_scalar();
+
+    // Copy a lane's state to its processor and back
+    void store_lane(uint32_t lane);
+    void load_lane(uint32_t lane);
+};
+
+#endif // LOCKSTEP_ENGINE_H
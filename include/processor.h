@@ -4,26 +4,193 @@
 #include "ram.h"
 #include "stdint.h"
 #include "register_file.h"
+#include "decode_cache.h"
+#include "csr.h"
+#include <atomic>
+#include <chrono>
 
-class Processor
+class ThreadedEngine;
+class JitEngine;
+class Checkpoint;
+class Profiler;
+class LockstepEngine;
+class SyscallProxy;
+class TimingModel;
+class CacheSimulator;
+class TraceRecorder;
+class GdbServer;
+
+// How run() executes instructions
+typedef enum
+{
+    ENGINE_REFERENCE, // Decode and execute each instruction through the datapath
+    ENGINE_THREADED,  // Predecoded basic blocks with a handler per instruction
+    ENGINE_JIT,       // Basic blocks translated to host code (threaded elsewhere)
+} engine_t;
+
+// Why run() returned
+typedef enum
+{
+    STOP_HALTED,     // Halt instruction (or an illegal one)
+    STOP_BUDGET,     // Instruction budget used up
+    STOP_BREAKPOINT, // Reached the run_until() address or a breakpoint
+    STOP_TIMEOUT,    // Wall clock deadline passed
+    STOP_REQUESTED,  // request_stop() was called
+    STOP_WATCHPOINT, // An instruction accessed a watched range
+    STOP_REASON_COUNT,
+} stop_reason_t;
+
+extern const char *STOP_REASON_STR[];
+
+// Outcome of a call to run()
+typedef struct
 {
+    stop_reason_t reason;  // Why execution stopped
+    uint64_t instructions; // Instructions executed by this call
+    uint32_t pc;           // Address of the next instruction
+} run_result_t;
+
+// No instruction budget
+#define RUN_UNLIMITED UINT64_MAX
+
+// Instructions run between deadline checks in run_for()
+#define RUN_DEADLINE_SLICE (1 << 20)
+
+// Optional datapath features. The datapath is compiled once for every
+// combination and each run uses the one with just the features in use, so
+// the usual case checks for none of them.
+#define DATAPATH_TRACE 0x1    // Register, memory and branch debug traces
+#define DATAPATH_EVENTS 0x2   // Events for the performance counters
+#define DATAPATH_PROFILE 0x4  // Calls and returns for the profiler
+#define DATAPATH_TIMING 0x8   // Retired instructions for the timing model
+#define DATAPATH_CACHES 0x10  // Fetches and data accesses for the cache simulator
+#define DATAPATH_RECORD 0x20  // Executed instructions for the trace recorder
+#define DATAPATH_HISTORY 0x40 // PCs of the last instructions, for watchpoint reports
+#define DATAPATH_ALL 0x7F
+#define DATAPATH_VARIANTS 128
+
+// The access that stopped a run with STOP_WATCHPOINT
+typedef struct
+{
+    uint32_t pc;          // Instruction that made the access
+    uint32_t address;     // Address accessed
+    uint32_t size;        // Bytes accessed
+    uint32_t kind;        // RAM_WATCH_READ, RAM_WATCH_WRITE or both (atomics)
+    uint32_t old_value;   // Bytes accessed before the access
+    uint32_t new_value;   // and after it (equal for loads)
+    ram_watch_t watch;    // Watched range that was hit
+} watch_hit_t;
+
+class Processor : public WatchObserver
+{
+    friend class ThreadedEngine;
+    friend class JitEngine;
+    friend class Checkpoint;
+    friend class LockstepEngine;
+    friend class GdbServer;
 
 public:
-    Processor(RAM *ram, uint32_t start_address);
+    // Harts sharing memory each get their own RAM view (see RAM(RAM *))
+    // and a distinct hart_id
+    Processor(RAM *ram, uint32_t start_address, engine_t engine = ENGINE_REFERENCE, uint32_t hart_id = 0);
     ~Processor();
 
-    // Reset the processor
+    // Reset the processor, a0 holds the hart ID
     void reset(uint32_t start_address);
 
+    // ID of this hart
+    uint32_t get_hart_id();
+
     // Execute a single instruction
     void execute_instruction();
 
+    // Execute up to max_instructions with the selected engine
+    run_result_t run(uint64_t max_instructions = RUN_UNLIMITED);
+
+    // Execute until the next instruction is at an address. An instruction at
+    // the current PC is always executed first.
+    run_result_t run_until(uint32_t address, uint64_t max_instructions = RUN_UNLIMITED);
+
+    // Execute until a wall clock time has passed
+    run_result_t run_for(uint32_t milliseconds, uint64_t max_instructions = RUN_UNLIMITED);
+
+    // Make the current or next run return STOP_REQUESTED. Safe to call from
+    // another thread or a signal handler.
+    void request_stop();
+
+    // Stop runs before the instruction at an address executes, with
+    // STOP_BREAKPOINT. The instruction is decoded as a breakpoint, so no
+    // engine looks for breakpoints until it reaches one.
+    void add_breakpoint(uint32_t address);
+    void remove_breakpoint(uint32_t address);
+
+    // True if a breakpoint is set at an address
+    bool has_breakpoint(uint32_t address);
+
+    // Execute the instruction at the PC, even if a breakpoint is set on it
+    run_result_t step_over();
+
+    // Stop runs with STOP_WATCHPOINT after an instruction accesses a range
+    // of memory in one of the RAM_WATCH_* kinds. Only the pages holding the
+    // range leave this hart's TLBs, so every other access and every engine
+    // runs as fast as ever.
+    void add_watchpoint(uint32_t address, uint32_t length, uint32_t kinds);
+    void remove_watchpoint(uint32_t address, uint32_t length, uint32_t kinds);
+
+    // The access that stopped the last run with STOP_WATCHPOINT
+    const watch_hit_t &get_watch_hit();
+
+    // Keep the PCs of the last count instructions from now on (0 to stop),
+    // everything runs on the datapath meanwhile
+    void set_pc_history(uint32_t count);
+
+    // PCs of the last instructions executed, oldest first
+    std::vector<uint32_t> get_pc_history();
+
+    // Called by the RAM on an access to a watched range
+    void watch_hit(const ram_watch_t &watch, uint32_t address, uint32_t size, uint32_t kind, uint32_t old_value,
+                   uint32_t new_value);
+
     // Dump the state of the processor
     void dump_state();
 
+    // Read a general purpose register
+    uint32_t get_register(int reg);
+
+    // Address of the next instruction
+    uint32_t get_pc();
+
+    // Instructions executed since reset
+    uint64_t get_instruction_count();
+
+    // Write a general purpose register (writes to x0 are ignored)
+    void set_register(int reg, uint32_t value);
+
+    // Drop everything decoded or translated from memory (FENCE.I), for
+    // when memory is replaced underneath the processor
+    void fence_instructions();
+
     // Check if the processor is halted
     bool is_halted();
 
+    // Sample this hart with a profiler from now on (NULL to stop)
+    void set_profiler(Profiler *profiler);
+
+    // Handle ECALL with a system call proxy (NULL halts on ECALL)
+    void set_syscalls(SyscallProxy *syscalls);
+
+    // Estimate cycles with a timing model from now on (NULL to stop). The
+    // cycle counters count its cycles, and everything runs on the datapath.
+    void set_timing(TimingModel *timing);
+
+    // Simulate caches from now on (NULL to stop), everything runs on the
+    // datapath meanwhile
+    void set_caches(CacheSimulator *caches);
+
+    // Record every instruction executed from now on into a trace (NULL to
+    // stop), everything runs on the datapath meanwhile
+    void set_recorder(TraceRecorder *recorder);
+
 private:
     // General purpose registers
     RegisterFile registers;
@@ -34,11 +201,152 @@ private:
     // Memory
     RAM *ram;
 
+    // Decoded instructions by PC
+    DecodeCache decode_cache;
+
+    // Engine used by run()
+    engine_t engine;
+
+    // Block interpreter (ENGINE_THREADED only)
+    ThreadedEngine *threaded_engine;
+
+    // Block translator (ENGINE_JIT only)
+    JitEngine *jit_engine;
+
+    // Hart ID
+    uint32_t hart_id;
+
+    // Counter CSRs are derived from instruction_count and event_counts when
+    // read. The offsets hold what guest writes added, and inhibited counters
+    // hold their value in counter_frozen.
+    uint64_t counter_offsets[32];
+    uint64_t counter_frozen[32];
+    uint32_t counter_inhibit;
+    uint32_t hpm_events[CSR_HPM_COUNTERS];
+
+    // Events counted by the datapath while any counter selects one
+    uint64_t event_counts[HPM_EVENT_COUNT];
+    bool hpm_active;
+
+    // Start of the time counter
+    std::chrono::steady_clock::time_point time_base;
+
+    // LR.W reservation: address and the value loaded from it
+    bool reservation_valid;
+    uint32_t reservation_address;
+    uint32_t reservation_value;
+
     // Halt flag
     bool halt;
 
     // Instruction count
     uint64_t instruction_count;
+
+    // Instruction count the current run stops at
+    uint64_t stop_count;
+
+    // Address the current run stops at (run_until() only)
+    bool breakpoint_set;
+    uint32_t breakpoint;
+
+    // Set by request_stop()
+    std::atomic<bool> stop_requested;
+
+    // Set when an instruction of the current run hit a watchpoint, and
+    // what it did
+    bool watch_triggered;
+    watch_hit_t last_watch_hit;
+
+    // Ring of the last PCs executed (empty unless set_pc_history() was
+    // called), its size a power of two, and how many have been written
+    std::vector<uint32_t> pc_history;
+    uint32_t pc_history_count;
+    uint64_t pc_history_next;
+
+    // Sampling profiler, told about calls and returns by every engine
+    Profiler *profiler;
+
+    // Host system calls for ECALL
+    SyscallProxy *syscalls;
+
+    // Cycle estimates, fed by the datapath
+    TimingModel *timing;
+
+    // Cache simulation, fed by the datapath
+    CacheSimulator *caches;
+
+    // Execution trace, fed by the datapath
+    TraceRecorder *recorder;
+
+    // Run until a stop condition, engines return early at block boundaries
+    // and the datapath finishes the rest
+    run_result_t run_limited(uint64_t max_instructions, bool use_deadline, std::chrono::steady_clock::time_point deadline);
+
+    // Run the datapath until a stop condition
+    stop_reason_t run_reference();
+
+    // Datapath features needed by the current state
+    uint32_t datapath_features();
+
+    // Run a specialized datapath until a stop condition (true) or until the
+    // features it was built with no longer match (false)
+    template <uint32_t FEATURES>
+    bool run_datapath(stop_reason_t *reason);
+
+    // Execute a single instruction with the datapath for some features
+    template <uint32_t FEATURES>
+    void execute();
+
+    // Tell the cache simulator about an instruction's fetch and data access
+    void simulate_caches(const control_t &ctrl);
+
+    // Record an instruction that ran at instruction_pc, given the address
+    // and store value it had before running
+    void record_instruction(const control_t &ctrl, uint32_t instruction_pc, uint32_t address, uint32_t store_value);
+
+    // Drop everything decoded or translated from some bytes of memory
+    void invalidate_code(uint32_t address, uint32_t size);
+
+    // Execute a decoded instruction, the rest of execute()
+    template <uint32_t FEATURES>
+    void execute_decoded(const control_t &ctrl);
+
+    // Register access, skipping RegisterFile's checks and traces unless
+    // tracing
+    template <uint32_t FEATURES>
+    uint32_t read_register(uint32_t reg);
+    template <uint32_t FEATURES>
+    void write_register(uint32_t reg, uint32_t value);
+
+    // Execute an A extension instruction
+    void execute_atomic(const control_t &ctrl);
+
+    // Execute a Zicsr instruction
+    void execute_csr(const control_t &ctrl);
+
+    // Read a CSR (false if it doesn't exist)
+    bool read_csr(uint32_t address, uint32_t *value);
+
+    // Write a CSR (false if it doesn't exist or is read only)
+    bool write_csr(uint32_t address, uint32_t value);
+
+    // Current value of a counter, retired instructions not counting the
+    // one being executed
+    uint64_t counter_value(int index, uint64_t retired);
+
+    // What a counter counts, before its offset
+    uint64_t counter_source(int index, uint64_t retired);
+
+    // Set a counter to a value, as seen by the next instruction
+    void set_counter(int index, uint64_t value);
+
+    // Count the events of an executed instruction
+    void count_events(const control_t &ctrl, bool taken);
+
+    // The event an instruction other than an atomic counts whenever it runs
+    // (HPM_EVENT_NONE if none). Taken branches count HPM_EVENT_BRANCH_TAKEN
+    // as well. The block engines add these up per block.
+    static hpm_event_t instruction_event(const control_t &ctrl);
 };
 
 #endif // PROCESSOR_H
@@ -0,0 +1,121 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unordered_map>
+#include <vector>
+#include "elf_loader.h"
+
+// Deepest call stack kept, deeper calls are counted but not recorded
+#define PROFILER_MAX_DEPTH 256
+
+// Default instructions between samples
+#define PROFILER_DEFAULT_INTERVAL 10000
+
+// Return address register used by the calling convention
+#define PROFILER_LINK_REGISTER 1
+
+// How a jump moves the call stack
+typedef enum : uint8_t
+{
+    PROFILE_JUMP,   // Plain jump or tail call
+    PROFILE_CALL,   // Links through ra
+    PROFILE_RETURN, // jalr x0, ra
+} profile_jump_t;
+
+// Classify a JAL (indirect false) or JALR by its registers
+static inline profile_jump_t profile_classify(bool indirect, uint32_t rd, uint32_t rs1)
+{
+    if (rd == PROFILER_LINK_REGISTER)
+    {
+        return PROFILE_CALL;
+    }
+    if (indirect && rd == 0 && rs1 == PROFILER_LINK_REGISTER)
+    {
+        return PROFILE_RETURN;
+    }
+    return PROFILE_JUMP;
+}
+
+// FNV-1a over the addresses of a sampled stack
+struct ProfileStackHash
+{
+    size_t operator()(const std::vector<uint32_t> &stack) const
+    {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (size_t i = 0; i < stack.size(); i++)
+        {
+            hash = (hash ^ stack[i]) * 0x100000001B3ULL;
+        }
+        return (size_t)hash;
+    }
+};
+
+// Samples the PC of one hart every so many instructions. The call stack is
+// rebuilt from calls and returns through ra as the execution engines report
+// them, and samples are counted per distinct stack. The stacks of any number
+// of harts can be written out in folded format for flame graphs.
+class Profiler
+{
+public:
+    Profiler(uint64_t interval = PROFILER_DEFAULT_INTERVAL);
+    ~Profiler();
+
+    // Start profiling at a PC and instruction count, the PC is the root of
+    // every stack
+    void start(uint32_t pc, uint64_t instruction_count);
+
+    // Track a jump to a target
+    void jump(profile_jump_t kind, uint32_t target)
+    {
+        if (kind == PROFILE_CALL)
+        {
+            if (depth < PROFILER_MAX_DEPTH)
+            {
+                frames[depth] = target;
+            }
+            depth++;
+        }
+        else if (kind == PROFILE_RETURN && depth > 1)
+        {
+            depth--;
+        }
+    }
+
+    // Instruction count the next sample is due at
+    uint64_t next_sample()
+    {
+        return next_count;
+    }
+
+    // Record a sample of the next instruction to run, once the instruction
+    // count reaches next_sample()
+    void sample(uint32_t pc, uint64_t instruction_count);
+
+    // Samples taken
+    uint64_t get_sample_count();
+
+    // Write the stacks of several profilers in folded format, one line per
+    // stack with the functions root first and the sample count. Functions
+    // are named by symbol where one covers them (0 on success).
+    static int write_folded(const char *filename, Profiler *const *profilers, uint32_t count, ElfLoader *symbols);
+
+private:
+    // Instructions between samples
+    uint64_t interval;
+    uint64_t next_count;
+
+    // Entry points of the functions being run, root first
+    uint32_t frames[PROFILER_MAX_DEPTH];
+    uint32_t depth;
+
+    // Samples by stack, the sampled PC last
+    std::unordered_map<std::vector<uint32_t>, uint64_t, ProfileStackHash> stacks;
+    uint64_t sample_count;
+
+    // Key being built by sample()
+    std::vector<uint32_t> key;
+};
+
+#endif // PROFILER_H
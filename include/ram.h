@@ -3,48 +3,558 @@
 
 #include "stdint.h"
 #include "stdio.h"
+#include <mutex>
+#include <vector>
+#include "trace.h"
 
-#define RAM_SIZE_WORDS 16384
+// Guest memory covers the whole 32-bit address space in 4 KiB pages,
+// allocated on first write
+#define RAM_PAGE_SHIFT 12
+#define RAM_PAGE_SIZE (1 << RAM_PAGE_SHIFT)
+#define RAM_PAGE_WORDS (RAM_PAGE_SIZE / 4)
+
+// Two level page table: a directory of tables of pages
+#define RAM_TABLE_BITS 10
+#define RAM_TABLE_ENTRIES (1 << RAM_TABLE_BITS)
+#define RAM_DIRECTORY_ENTRIES (1 << (32 - RAM_PAGE_SHIFT - RAM_TABLE_BITS))
+
+// Direct mapped TLB entries in front of the page table
+#define RAM_TLB_ENTRIES 256
+
+// Dirty page bitmap: one bit per page, and one summary bit per 64 pages
+#define RAM_PAGE_COUNT (1 << (32 - RAM_PAGE_SHIFT))
+#define RAM_DIRTY_WORDS (RAM_PAGE_COUNT / 64)
+#define RAM_DIRTY_SUMMARY_WORDS (RAM_DIRTY_WORDS / 64)
+
+// Page flags
+#define RAM_PAGE_CODE 0x01   // Instructions have been decoded from the page
+#define RAM_PAGE_MAPPED 0x02 // Words live in a file mapping, not owned by the page
+#define RAM_PAGE_DEVICE 0x04 // Part of the page is a memory mapped device
+
+// Stores to pages with any of these flags bypass the write TLB
+#define RAM_PAGE_WRITE_SLOW (RAM_PAGE_CODE | RAM_PAGE_DEVICE)
+
+// Accesses a watched range stops on
+#define RAM_WATCH_READ 0x1                                   // Loads
+#define RAM_WATCH_WRITE 0x2                                  // Stores
+#define RAM_WATCH_ACCESS (RAM_WATCH_READ | RAM_WATCH_WRITE) // Either
+#define RAM_WATCH_CHANGE 0x4                                 // Stores that change the value
+
+typedef struct
+{
+    uint32_t *words; // RAM_PAGE_WORDS words of data
+    uint32_t flags;
+} ram_page_t;
+
+// Files can be mapped straight into guest memory (copy on write)
+#if defined(__unix__) || defined(__APPLE__)
+#define RAM_FILE_MAPPING
+#endif
+
+class RAM;
+class Device;
+
+// Address range of a memory mapped device
+typedef struct
+{
+    uint32_t start;  // First address
+    uint32_t last;   // Last address
+    Device *device;
+} ram_device_t;
+
+// Page number and host words of a recently used page
+typedef struct
+{
+    uint32_t tag;    // Page number (RAM_TLB_INVALID if empty)
+    uint32_t pad;
+    uint32_t *words; // Host copy of the page
+} ram_tlb_entry_t;
+
+#define RAM_TLB_INVALID 0xFFFFFFFF
+
+// Pages and file mappings, shared by every view of the same memory
+typedef struct
+{
+    // Page tables by the top address bits (NULL until a page in range is written)
+    ram_page_t **directory[RAM_DIRECTORY_ENTRIES];
+
+#ifdef RAM_FILE_MAPPING
+    // File mappings backing RAM_PAGE_MAPPED pages (address, length)
+    std::vector<std::pair<void *, size_t> > mappings;
+#endif
+
+    // Guards the page tables and page flags. Only the TLB miss paths take
+    // it, so loads and stores that hit stay lock free.
+    std::mutex lock;
+
+    // Views created over this memory besides the owner
+    int views;
+
+    // The owner and every view, so all of their write TLBs can be emptied
+    std::vector<RAM *> rams;
+
+    // Pages written since the last RAM::mark_clean(). A page only enters a
+    // write TLB once it is marked, so stores that hit don't have to.
+    uint64_t dirty[RAM_DIRTY_WORDS];
+    uint64_t dirty_summary[RAM_DIRTY_SUMMARY_WORDS];
+
+    // Memory mapped devices. Their pages never enter a TLB, so only loads
+    // and stores that miss look here.
+    std::vector<ram_device_t> devices;
+} ram_memory_t;
+
+// Intel HEX loader read buffer, and the longest record it has to hold
+#define IHEX_BUFFER_SIZE (1 << 20)
+#define IHEX_MAX_RECORD (1 + 2 * (1 + 2 + 1 + 255 + 1) + 2)
+
+// Notified when a store hits a page that has been marked as holding code
+class CodeObserver
+{
+public:
+    virtual ~CodeObserver() {}
+
+    // Drop anything derived from the bytes written at an address
+    virtual void code_written(uint32_t address, uint32_t size) = 0;
+
+    // A store of this RAM's processor went to a memory mapped device, which
+    // may have asked the processor to stop
+    virtual void device_written() {}
+};
+
+// A watched range of addresses
+typedef struct
+{
+    uint32_t start; // First address
+    uint32_t last;  // Last address
+    uint32_t kinds; // RAM_WATCH_* accesses to stop on
+} ram_watch_t;
+
+// Told when a load or store touches a watched range
+class WatchObserver
+{
+public:
+    virtual ~WatchObserver() {}
+
+    // An access of size bytes at an address matched a watch. kind is
+    // RAM_WATCH_READ, RAM_WATCH_WRITE or both (atomics), and the values
+    // are the bytes accessed before and after it (equal for loads).
+    virtual void watch_hit(const ram_watch_t &watch, uint32_t address, uint32_t size, uint32_t kind, uint32_t old_value,
+                           uint32_t new_value) = 0;
+};
+
+// Memory mapped device, given the loads and stores to its address range.
+// Harts on other threads may access it at the same time.
+class Device
+{
+public:
+    virtual ~Device() {}
+
+    // Read size bytes (1, 2 or 4) at an offset into the device
+    virtual uint32_t read(uint32_t offset, uint32_t size) = 0;
+
+    // Write the low size bytes of a value at an offset into the device
+    virtual void write(uint32_t offset, uint32_t value, uint32_t size) = 0;
+};
 
 class RAM
 {
+    // Translated code accesses memory directly on its fast path
+    friend class JitEngine;
+
+    // Checkpoints save the allocated pages
+    friend class Checkpoint;
 
 public:
     RAM();
+
+    // Create a view of another RAM's memory with its own TLBs and code
+    // observers, for a processor on another host thread. Views must be
+    // created before any of them runs, and destroyed before the owner.
+    RAM(RAM *shared);
+
     ~RAM();
 
+    // Loads and stores trace at debug level unless TRACED is false, for
+    // datapaths built without tracing
+
     // Store a word in RAM
-    void store_word(uint32_t address, uint32_t data);
+    template <bool TRACED = true>
+    void store_word(uint32_t address, uint32_t data)
+    {
+        if (TRACED)
+        {
+            TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Storing 0x%08X at 0x%08X\n", data, address);
+        }
+        uint32_t *word;
+        if (write_hit(address, &word))
+        {
+            *word = data;
+        }
+        else
+        {
+            store_miss(address, data, 4);
+        }
+    }
 
     // Store a halfword in RAM
-    void store_halfword(uint32_t address, uint16_t data);
+    template <bool TRACED = true>
+    void store_halfword(uint32_t address, uint16_t data)
+    {
+        if (TRACED)
+        {
+            TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Storing 0x%04X at 0x%08X\n", data, address);
+        }
+        uint32_t *word;
+        if (write_hit(address, &word))
+        {
+            merge_store(word, address, data, 2);
+        }
+        else
+        {
+            store_miss(address, data, 2);
+        }
+    }
 
     // Store a byte in RAM
-    void store_byte(uint32_t address, uint8_t data);
+    template <bool TRACED = true>
+    void store_byte(uint32_t address, uint8_t data)
+    {
+        if (TRACED)
+        {
+            TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Storing 0x%02X at 0x%08X\n", data, address);
+        }
+        uint32_t *word;
+        if (write_hit(address, &word))
+        {
+            merge_store(word, address, data, 1);
+        }
+        else
+        {
+            store_miss(address, data, 1);
+        }
+    }
 
     // Load a word from RAM
-    uint32_t load_word(uint32_t address);
+    template <bool TRACED = true>
+    uint32_t load_word(uint32_t address)
+    {
+        const uint32_t *word;
+        uint32_t data = read_hit(address, &word) ? *word : load_miss(address, 4);
+        if (TRACED)
+        {
+            TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Loading 0x%08X from 0x%08X\n", data, address);
+        }
+        return data;
+    }
 
     // Load a halfword from RAM
-    uint16_t load_halfword(uint32_t address);
+    template <bool TRACED = true>
+    uint16_t load_halfword(uint32_t address)
+    {
+        const uint32_t *word;
+        uint32_t data = read_hit(address, &word) ? *word : load_miss(address, 2);
+        data = address % 4 == 0 ? data & 0xFFFF : (data >> 16) & 0xFFFF;
+        if (TRACED)
+        {
+            TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Loading 0x%04X from 0x%08X\n", data, address);
+        }
+        return (uint16_t)data;
+    }
 
     // Load a byte from RAM
-    uint8_t load_byte(uint32_t address);
+    template <bool TRACED = true>
+    uint8_t load_byte(uint32_t address)
+    {
+        const uint32_t *word;
+        uint32_t data = read_hit(address, &word) ? *word : load_miss(address, 1);
+        data = (data >> ((address % 4) * 8)) & 0xFF;
+        if (TRACED)
+        {
+            TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Loading 0x%02X from 0x%08X\n", data, address);
+        }
+        return (uint8_t)data;
+    }
 
-    // Load instruction from RAM
-    uint32_t load_instruction(uint32_t address);
+    // Load an instruction from a halfword aligned address. A 32-bit
+    // instruction may straddle two words (and two pages), a compressed one
+    // comes back in the low half.
+    uint32_t load_instruction(uint32_t address)
+    {
+        uint32_t data = *read_word(address);
+        if (address & 2)
+        {
+            data >>= 16;
+            if ((data & 3) == 3)
+            {
+                data |= *read_word(address + 2) << 16;
+            }
+        }
+        TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Loading instruction 0x%08X from 0x%08X\n", data, address);
+        return data;
+    }
 
-    // Load a memory image from an Intel HEX file
-    int load_memory_ihex(char *filename);
+    // Load a memory image from an Intel HEX file. A start address record
+    // sets entry, if given.
+    int load_memory_ihex(const char *filename, uint32_t *entry = NULL);
 
-    // Dump memory to stdout in Intel HEX format
-    void dump_memory_ihex(uint32_t start_address, uint32_t end_address);
+    // Dump memory to stdout in Intel HEX format, 16 bytes per record with
+    // each word written as its value, most significant byte first. The
+    // loader stores record bytes in address order, so a dump loaded back
+    // gives every word byte swapped. Only pages written since mark_clean()
+    // are dumped if dirty_only is set, zero words included.
+    void dump_memory_ihex(uint32_t start_address, uint32_t end_address, bool dirty_only = false);
 
     // Dump memory to a file in Intel HEX format
-    void dump_memory_ihex(char *filename, uint32_t start_address, uint32_t end_address);
+    void dump_memory_ihex(const char *filename, uint32_t start_address, uint32_t end_address, bool dirty_only = false);
+
+    // Dump memory to a file as raw bytes, at the offset of their address
+    // from start_address. Pages that are skipped are left as holes, and
+    // the file ends with the last page dumped.
+    void dump_memory_bin(const char *filename, uint32_t start_address, uint32_t end_address, bool dirty_only = false);
+
+    // Forget which pages have been written, dirty only dumps cover the pages
+    // written from now on. No view of the memory may be running.
+    void mark_clean();
+
+    // Copy bytes into memory
+    void write_block(uint32_t address, const uint8_t *data, uint32_t length);
+
+    // Zero a range of memory, pages never written are left alone
+    void clear_block(uint32_t address, uint32_t length);
+
+#ifdef RAM_FILE_MAPPING
+    // Map whole pages of an open file at a page aligned address and file
+    // offset. Guest writes go to private copies. Returns 0 on success.
+    int map_file(int fd, uint64_t offset, uint32_t address, uint32_t pages);
+
+    // Map consecutive pages of an open file at a page aligned offset to
+    // the given page numbers. Returns 0 on success.
+    int map_file_pages(int fd, uint64_t offset, const uint32_t *page_numbers, uint32_t count);
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Host bytes holding guest memory from an address up to length bytes
+    // or the end of its page, for passing guest buffers straight to host
+    // calls. Pages to be written are allocated, marked written and reported
+    // to code observers up front. NULL for device pages.
+    uint8_t *host_bytes(uint32_t address, uint32_t length, bool for_write, uint32_t *chunk);
+#endif
+
+    // Zero all of memory
+    void clear();
+
+    // Replace all of memory with a copy of another RAM's, which must not
+    // be written meanwhile
+    void copy_from(RAM *source);
+
+    // FNV-1a style hash of the pages that are not all zero and their
+    // addresses, equal for equal contents however they were written
+    uint64_t digest();
+
+    // Mark the page holding an address as containing decoded code
+    void mark_code_page(uint32_t address);
+
+    // Register an observer to be told when a code page is written
+    void add_code_observer(CodeObserver *observer);
+
+    // Unregister a code observer
+    void remove_code_observer(CodeObserver *observer);
+
+    // Watch a range of addresses for the RAM_WATCH_* kinds of access, through
+    // this view only. Its pages are marked in a shadow bitmap that keeps
+    // them out of the TLBs, so only accesses to those pages reach the exact
+    // range checks and the rest stay on the fast path. Loads and stores are
+    // watched, as are atomics that report themselves with check_watches();
+    // device registers and system call buffers are not.
+    void add_watch(uint32_t address, uint32_t length, uint32_t kinds);
+
+    // Stop watching a range added with the same arguments
+    void remove_watch(uint32_t address, uint32_t length, uint32_t kinds);
+
+    // Set the observer told about watch hits (NULL for none)
+    void set_watch_observer(WatchObserver *observer);
+
+    // True if any range is watched
+    bool has_watches()
+    {
+        return !watches.empty();
+    }
+
+    // Check an access made through atomic_word() against the watches
+    void check_watches(uint32_t address, uint32_t size, uint32_t kind, uint32_t old_value, uint32_t new_value);
+
+    // Route loads and stores in a range of addresses to a device instead of
+    // memory. Devices must be added before any view of the memory runs and
+    // outlive the memory. Loads and stores elsewhere on the same pages still
+    // go to memory, but miss the TLBs. Atomics and instruction fetches see
+    // the memory under the device.
+    void add_device(uint32_t address, uint32_t size, Device *device);
+
+    // Host word holding an aligned address, for atomic operations. Stores
+    // through it are seen by code observers like any other store.
+    uint32_t *atomic_word(uint32_t address)
+    {
+        return write_word(address, 4);
+    }
+
+    // Host word holding an aligned address, for atomic loads
+    const uint32_t *atomic_read_word(uint32_t address)
+    {
+        return read_word(address);
+    }
 
 private:
-    uint32_t memory[RAM_SIZE_WORDS];
+    // Pages, possibly shared with other views
+    ram_memory_t *memory;
+
+    // Set if this RAM created the memory and frees it
+    bool owner;
+
+    // Recently read pages, unwritten pages map to a shared zero page while
+    // the memory has no other views
+    ram_tlb_entry_t read_tlb[RAM_TLB_ENTRIES];
+
+    // Recently written pages without RAM_PAGE_WRITE_SLOW flags
+    ram_tlb_entry_t write_tlb[RAM_TLB_ENTRIES];
+
+    // Observers to notify when a code page is written
+    std::vector<CodeObserver *> code_observers;
+
+    // Watched ranges and their observer
+    std::vector<ram_watch_t> watches;
+    WatchObserver *watch_observer;
+
+    // Shadow bitmap of pages holding a watched range, one bit per page
+    // (empty until something is watched). Marked pages never enter this
+    // view's TLBs.
+    std::vector<uint64_t> watched_pages;
+
+    // Host word holding an address, for reading
+    const uint32_t *read_word(uint32_t address)
+    {
+        uint32_t page = address >> RAM_PAGE_SHIFT;
+        const ram_tlb_entry_t &entry = read_tlb[page & (RAM_TLB_ENTRIES - 1)];
+        const uint32_t *words = entry.tag == page ? entry.words : read_miss(page);
+        return &words[(address & (RAM_PAGE_SIZE - 1)) >> 2];
+    }
+
+    // Host word holding an address, for writing size bytes
+    uint32_t *write_word(uint32_t address, uint32_t size)
+    {
+        uint32_t page = address >> RAM_PAGE_SHIFT;
+        const ram_tlb_entry_t &entry = write_tlb[page & (RAM_TLB_ENTRIES - 1)];
+        uint32_t *words = entry.tag == page ? entry.words : write_miss(address, size);
+        return &words[(address & (RAM_PAGE_SIZE - 1)) >> 2];
+    }
+
+    // Point word at the host word holding an address, true if its page is
+    // in the read TLB
+    bool read_hit(uint32_t address, const uint32_t **word)
+    {
+        uint32_t page = address >> RAM_PAGE_SHIFT;
+        const ram_tlb_entry_t &entry = read_tlb[page & (RAM_TLB_ENTRIES - 1)];
+        *word = &entry.words[(address & (RAM_PAGE_SIZE - 1)) >> 2];
+        return entry.tag == page;
+    }
+
+    // Point word at the host word holding an address, true if its page is
+    // in the write TLB
+    bool write_hit(uint32_t address, uint32_t **word)
+    {
+        uint32_t page = address >> RAM_PAGE_SHIFT;
+        const ram_tlb_entry_t &entry = write_tlb[page & (RAM_TLB_ENTRIES - 1)];
+        *word = &entry.words[(address & (RAM_PAGE_SIZE - 1)) >> 2];
+        return entry.tag == page;
+    }
+
+    // Store size bytes of data into the host word holding an address
+    static void merge_store(uint32_t *word, uint32_t address, uint32_t data, uint32_t size)
+    {
+        if (size == 4)
+        {
+            *word = data;
+        }
+        else if (size == 2)
+        {
+            *word = address % 4 == 0 ? (*word & 0xFFFF0000) | data : (*word & 0x0000FFFF) | (data << 16);
+        }
+        else
+        {
+            uint32_t shift = (address % 4) * 8;
+            *word = (*word & ~(0xFF << shift)) | (data << shift);
+        }
+    }
+
+    // Loads that miss the read TLB: the word holding an address as the
+    // inline loads expect it, from a device or from memory
+    uint32_t load_miss(uint32_t address, uint32_t size);
+
+    // Stores that miss the write TLB, to a device or to memory
+    void store_miss(uint32_t address, uint32_t data, uint32_t size);
+
+    // Device covering an address (NULL if none)
+    const ram_device_t *find_device(uint32_t address)
+    {
+        for (size_t i = 0; i < memory->devices.size(); i++)
+        {
+            const ram_device_t &device = memory->devices[i];
+            if (address >= device.start && address <= device.last)
+            {
+                return &device;
+            }
+        }
+        return NULL;
+    }
+
+    // Find a page and refill its read TLB entry, device pages are left out
+    const uint32_t *read_miss(uint32_t page);
+
+    // Find or allocate a page, run the slow store checks and refill its
+    // write TLB entry if the page has none
+    uint32_t *write_miss(uint32_t address, uint32_t size);
+
+    // Find a page (NULL if it has never been written). The page table
+    // functions below expect memory->lock to be held.
+    ram_page_t *find_page(uint32_t page);
+
+    // Find a page, allocating it if needed
+    ram_page_t *get_page(uint32_t page);
+
+    // Drop the TLB entries for a page
+    void invalidate_tlb(uint32_t page);
+
+    // Drop every TLB entry
+    void flush_tlb();
+
+    // Point a page at new words, dropping its old contents
+    void replace_page(uint32_t page, uint32_t *words, uint32_t flags);
+
+    // Dump memory to an open file in Intel HEX format
+    void dump_memory_ihex(FILE *file, uint32_t start_address, uint32_t end_address, bool dirty_only);
+
+    // Record that a page was written (memory->lock held)
+    void mark_dirty(uint32_t page)
+    {
+        memory->dirty[page >> 6] |= 1ULL << (page & 63);
+        memory->dirty_summary[page >> 12] |= 1ULL << ((page >> 6) & 63);
+    }
+
+    // Page numbers from first_page to last_page of the allocated pages, or
+    // of the pages written since mark_clean() (memory->lock held)
+    void find_dump_pages(uint32_t first_page, uint32_t last_page, bool dirty_only, std::vector<uint32_t> *pages);
+
+    // Notify observers that a code page was written
+    void notify_code_write(uint32_t address, uint32_t size);
+
+    // True if a page holds a watched range
+    bool is_watched(uint32_t page)
+    {
+        return !watched_pages.empty() && (watched_pages[page >> 6] >> (page & 63)) & 1;
+    }
+
+    // Rebuild the shadow bitmap from the watches, dropping the TLB entries
+    // of the pages that changed
+    void update_watched_pages();
 };
 
 #endif // RAM_H
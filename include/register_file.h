@@ -3,6 +3,10 @@
 
 #include <stdint.h>
 
+// x0-x31 plus a scratch slot that execution engines point x0 writes at
+#define REGISTER_FILE_SLOTS 33
+#define REGISTER_SINK 32
+
 class RegisterFile
 {
 public:
@@ -21,8 +25,15 @@ public:
     // Dump the state of the register file
     void dump_state();
 
+    // Raw register array indexed by register number. x0 reads as zero as long
+    // as writes to it are redirected to REGISTER_SINK.
+    uint32_t *data()
+    {
+        return registers;
+    }
+
 private:
-    uint32_t registers[31];
+    uint32_t registers[REGISTER_FILE_SLOTS];
 };
 
 #endif // REGISTER_FILE_H
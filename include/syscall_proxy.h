@@ -0,0 +1,123 @@
+#ifndef SYSCALL_PROXY_H
+#define SYSCALL_PROXY_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "ram.h"
+#include "processor.h"
+
+// Guest buffers are handed to the host in place, which needs POSIX calls
+// and guest byte order
+#if (defined(__unix__) || defined(__APPLE__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SYSCALL_PROXY_SUPPORTED
+#include <sys/uio.h>
+#endif
+
+// System call numbers of the RISC-V Linux ABI (a7)
+#define SYSCALL_OPENAT 56
+#define SYSCALL_CLOSE 57
+#define SYSCALL_LSEEK 62
+#define SYSCALL_READ 63
+#define SYSCALL_WRITE 64
+#define SYSCALL_FSTAT 80
+#define SYSCALL_EXIT 93
+#define SYSCALL_EXIT_GROUP 94
+#define SYSCALL_CLOCK_GETTIME 113
+#define SYSCALL_BRK 214
+#define SYSCALL_CLOCK_GETTIME64 403
+#define SYSCALL_OPEN 1024 // newlib's libgloss, open relative to the working directory
+
+// Guest values of the open() flags and AT_FDCWD
+#define SYSCALL_O_ACCMODE 0x3
+#define SYSCALL_O_CREAT 0x40
+#define SYSCALL_O_EXCL 0x80
+#define SYSCALL_O_TRUNC 0x200
+#define SYSCALL_O_APPEND 0x400
+#define SYSCALL_O_NONBLOCK 0x800
+#define SYSCALL_O_DIRECTORY 0x10000
+#define SYSCALL_AT_FDCWD -100
+
+// Size of the guest struct stat
+#define SYSCALL_STAT_SIZE 104
+
+// Longest path read from the guest
+#define SYSCALL_PATH_MAX 4096
+
+// Most bytes moved by one read or write, larger requests return short
+#define SYSCALL_MAX_TRANSFER (1 << 20)
+
+// Runs the system calls of newlib and Linux style programs on the host:
+// a7 selects the call, a0-a5 hold the arguments and a0 the result, with
+// errors as negated errno values. Reads and writes go straight between the
+// host and the pages of guest memory, without a copy. Guest file
+// descriptors 0-2 are the emulator's own, the rest are files the guest
+// opened. Shared by every hart.
+class SyscallProxy
+{
+public:
+    SyscallProxy();
+
+    // Close the files the guest left open
+    ~SyscallProxy();
+
+    // Set where the heap starts (0 leaves brk failing)
+    void set_break(uint32_t address);
+
+    // Stop a processor when a hart calls exit_group
+    void add_processor(Processor *processor);
+
+    // Run the call a processor's registers ask for. Returns false if the
+    // hart exited and should halt.
+    bool call(Processor *processor, RAM *ram);
+
+    // A hart exited
+    bool has_exited()
+    {
+        return exited.load();
+    }
+
+    // Status passed to the first exit
+    int get_exit_code()
+    {
+        return exit_code.load();
+    }
+
+private:
+    // Host descriptors by guest descriptor (-1 when free)
+    std::vector<int> files;
+
+    // Program break and where it started
+    uint32_t break_start;
+    uint32_t break_current;
+
+    // Guards files and the break
+    std::mutex lock;
+
+    // Processors stopped by exit_group
+    std::vector<Processor *> processors;
+
+    std::atomic<bool> exited;
+    std::atomic<int> exit_code;
+
+#ifdef SYSCALL_PROXY_SUPPORTED
+    // Host descriptor for a guest one (-1 if it isn't open)
+    int host_file(uint32_t fd);
+
+    // Host iovecs covering a guest buffer (false if part of it is a device)
+    bool map_buffer(RAM *ram, uint32_t address, uint32_t length, bool for_write, std::vector<struct iovec> *iov);
+
+    // Individual calls, returning the value for a0
+    int32_t sys_openat(RAM *ram, int32_t dirfd, uint32_t path, uint32_t flags, uint32_t mode);
+    int32_t sys_close(uint32_t fd);
+    int32_t sys_lseek(uint32_t fd, int32_t offset, uint32_t whence);
+    int32_t sys_read(RAM *ram, uint32_t fd, uint32_t buffer, uint32_t length);
+    int32_t sys_write(RAM *ram, uint32_t fd, uint32_t buffer, uint32_t length);
+    int32_t sys_fstat(RAM *ram, uint32_t fd, uint32_t buffer);
+    int32_t sys_clock_gettime(RAM *ram, uint32_t clock, uint32_t buffer, bool time64);
+    uint32_t sys_brk(RAM *ram, uint32_t address);
+#endif
+};
+
+#endif // SYSCALL_PROXY_H
@@ -0,0 +1,196 @@
+#ifndef THREADED_ENGINE_H
+#define THREADED_ENGINE_H
+
+#include <stdint.h>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include "control.h"
+#include "csr.h"
+#include "decode_cache.h"
+#include "ram.h"
+#include "profiler.h"
+
+// Longest run of instructions in one block
+#define THREADED_MAX_BLOCK_LENGTH 64
+
+// Every specialized handler. Blocks end at the last group (control flow, a
+// halt, an instruction left to the reference datapath, or a plain fallthrough).
+#define THREADED_OPS(X) \
+    X(NOP)              \
+    X(LI)               \
+    X(ADDI)             \
+    X(SLTI)             \
+    X(SLTIU)            \
+    X(XORI)             \
+    X(ORI)              \
+    X(ANDI)             \
+    X(SLLI)             \
+    X(SRLI)             \
+    X(SRAI)             \
+    X(ADD)              \
+    X(SUB)              \
+    X(AND)              \
+    X(OR)               \
+    X(XOR)              \
+    X(SLT)              \
+    X(SLTU)             \
+    X(SLL)              \
+    X(SRL)              \
+    X(SRA)              \
+    X(MUL)              \
+    X(MULH)             \
+    X(MULHSU)           \
+    X(MULHU)            \
+    X(DIV)              \
+    X(DIVU)             \
+    X(REM)              \
+    X(REMU)             \
+    X(LB)               \
+    X(LBU)              \
+    X(LH)               \
+    X(LHU)              \
+    X(LW)               \
+    X(SB)               \
+    X(SH)               \
+    X(SW)               \
+    X(BEQ)              \
+    X(BNE)              \
+    X(BLT)              \
+    X(BGE)              \
+    X(BLTU)             \
+    X(BGEU)             \
+    X(JAL)              \
+    X(JALR)             \
+    X(HALT)             \
+    X(GENERIC)          \
+    X(END)
+
+#define THREADED_OP_ENUM(name) THREADED_OP_##name,
+
+typedef enum : uint8_t
+{
+    THREADED_OPS(THREADED_OP_ENUM)
+    THREADED_OP_COUNT,
+} threaded_op_kind_t;
+
+#undef THREADED_OP_ENUM
+
+// One predecoded instruction
+typedef struct
+{
+    const void *handler;     // Handler label (computed goto builds only)
+    threaded_op_kind_t kind; // Handler to run
+    uint8_t rd;              // Destination register (REGISTER_SINK for x0)
+    uint8_t rs1;             // Source register 1
+    uint8_t rs2;             // Source register 2
+    profile_jump_t profile;  // Call or return (JAL/JALR only)
+    uint8_t length;          // Instruction size in bytes
+    uint8_t event;           // hpm_event_t counted whenever it runs
+    uint32_t imm;            // Immediate, or the value for LI
+    uint32_t link;           // Address of the next instruction, written by JAL/JALR
+} threaded_op_t;
+
+// A straight line run of instructions ending in a branch, jump or fallthrough
+typedef struct threaded_block
+{
+    uint32_t start_pc;              // Address of the first instruction
+    uint32_t end_pc;                // Address after the last decoded instruction
+    uint32_t length;                // Instructions counted on entry
+    uint32_t taken_pc;              // Branch or JAL target
+    uint32_t not_taken_pc;          // Fallthrough address
+    struct threaded_block *taken;     // Chained block at taken_pc
+    struct threaded_block *not_taken; // Chained block at not_taken_pc
+    uint32_t indirect_pc;             // Last JALR target
+    struct threaded_block *indirect;  // Chained block at indirect_pc
+    uint32_t events[HPM_EVENT_COUNT]; // Events of the instructions counted on entry
+    std::vector<threaded_op_t> ops;
+} threaded_block_t;
+
+class Processor;
+
+// Executes predecoded basic blocks with one handler per instruction and
+// direct threaded dispatch, following chained blocks without returning to
+// the lookup loop. Produces the same state as Processor::execute_instruction().
+class ThreadedEngine : public CodeObserver
+{
+public:
+    ThreadedEngine(Processor *processor, RAM *ram, DecodeCache *decode_cache);
+    ~ThreadedEngine();
+
+    // Run until the processor halts or a stop condition is reached at a
+    // block boundary
+    void run();
+
+    // Start a block at an address whenever execution reaches it
+    void stop_at(uint32_t address);
+
+    // Undo stop_at(), letting the blocks split at the address join again
+    void clear_stop(uint32_t address);
+
+    // Drop all blocks
+    void flush();
+
+    // Drop all blocks before the next block runs (FENCE.I)
+    void fence_instructions();
+
+    // Queue the blocks overlapping a store to be dropped
+    void code_written(uint32_t address, uint32_t size);
+
+    // Leave the running block after the access being made, which hit a
+    // watchpoint
+    void watch_hit();
+
+    // Leave the running block after a device store that asked the
+    // processor to stop
+    void device_written();
+
+    // Translate decoded control signals into an op
+    static void translate(threaded_op_t *op, const control_t &ctrl, uint32_t pc);
+
+private:
+    // Processor whose state is executed
+    Processor *processor;
+
+    // Memory
+    RAM *ram;
+
+    // Decoder shared with the reference datapath
+    DecodeCache *decode_cache;
+
+    // Blocks by start address
+    std::unordered_map<uint32_t, threaded_block_t *> blocks;
+
+    // Words covered by blocks
+    CodeCoverage coverage;
+
+    // Code stores since blocks were last checked (address, size)
+    std::vector<std::pair<uint32_t, uint32_t> > pending_writes;
+
+    // Set when a store hits a word covered by a block, or a device store
+    // asked the processor to stop
+    bool code_modified;
+
+    // Set by fence_instructions()
+    bool flush_pending;
+
+    // Set by watch_hit()
+    bool watch_pending;
+
+    // Addresses blocks must not run through (see stop_at())
+    std::set<uint32_t> stop_points;
+
+    // Build the block starting at an address
+    threaded_block_t *build_block(uint32_t pc);
+
+    // Drop blocks that have been written over (returns true if any were dropped)
+    bool process_invalidations();
+
+    // Delete a set of blocks and unlink every chain into them
+    void remove_blocks(std::vector<threaded_block_t *> &dead);
+
+    // Take back the events of the ops after one that left its block early
+    void uncount_events(const threaded_block_t *block, const threaded_op_t *op);
+};
+
+#endif // THREADED_ENGINE_H
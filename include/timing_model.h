@@ -0,0 +1,219 @@
+#ifndef TIMING_MODEL_H
+#define TIMING_MODEL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "control.h"
+
+// Stages of the modelled pipeline (fetch, decode, execute, memory, write
+// back). The first instruction takes all of them to retire.
+#define TIMING_PIPELINE_DEPTH 5
+
+// Default latencies, in cycles until the result can be forwarded to the
+// next instructions
+#define TIMING_DEFAULT_LOAD_LATENCY 2
+#define TIMING_DEFAULT_MUL_LATENCY 3
+
+// Default cycles lost redirecting fetch. A mispredicted branch or a JALR is
+// resolved in execute, a taken branch predicted correctly or a JAL in decode.
+#define TIMING_DEFAULT_MISPREDICT_PENALTY 2
+#define TIMING_DEFAULT_TAKEN_PENALTY 1
+
+// Default predictor table size (log2 of the two bit counters) and global
+// history length
+#define TIMING_DEFAULT_PREDICTOR_BITS 12
+#define TIMING_DEFAULT_HISTORY_BITS 10
+
+// Branch predictors
+typedef enum
+{
+    PREDICTOR_STATIC,  // Backward taken, forward not taken
+    PREDICTOR_BIMODAL, // Two bit counters indexed by PC
+    PREDICTOR_GSHARE,  // Two bit counters indexed by PC xor global history
+} predictor_t;
+
+extern const char *PREDICTOR_STR[];
+
+// Where cycles other than the one each instruction takes went
+typedef enum
+{
+    TIMING_STALL_LOAD_USE,   // Waiting for a load result
+    TIMING_STALL_MULTIPLY,   // Waiting for a multiply result
+    TIMING_STALL_MISPREDICT, // Mispredicted conditional branches
+    TIMING_STALL_TAKEN,      // Taken branches predicted correctly and JAL
+    TIMING_STALL_INDIRECT,   // JALR
+    TIMING_STALL_COUNT,
+} timing_stall_t;
+
+extern const char *TIMING_STALL_STR[];
+
+// Pipeline and predictor parameters
+typedef struct
+{
+    predictor_t predictor;
+    uint32_t predictor_bits;     // log2 of the predictor table size
+    uint32_t history_bits;       // Global history length (gshare only)
+    uint32_t load_latency;       // Load (and atomic) to use
+    uint32_t mul_latency;        // Multiply to use
+    uint32_t mispredict_penalty; // Mispredicted branch or JALR
+    uint32_t taken_penalty;      // Correctly predicted taken branch or JAL
+} timing_config_t;
+
+// Fill in the defaults, a bimodal predictor
+void timing_default_config(timing_config_t *config);
+
+// Parse a comma separated list of a predictor name (static, bimodal,
+// gshare) and key=value settings (bits, history, load, mul, mispredict,
+// taken) into a config (0 on success)
+int timing_parse_spec(const char *spec, timing_config_t *config);
+
+// Cycle estimate for an in-order pipeline with full forwarding, fed with
+// each instruction as it retires. Results are timed with a scoreboard of
+// when each register can be forwarded, and fetch redirects cost cycles
+// depending on what the branch predictor guessed. Nothing is simulated
+// beyond that, so memory always answers in time. One per hart.
+class TimingModel
+{
+public:
+    TimingModel(const timing_config_t &config);
+
+    // Start counting from an empty pipeline
+    void reset();
+
+    // Account for an instruction that ran at pc, with the next one at
+    // next_pc
+    void retire(const control_t &ctrl, uint32_t pc, uint32_t next_pc)
+    {
+        instructions++;
+
+        // Every stage takes a cycle, so an instruction retires the cycle
+        // after the one before it unless it waits for an operand
+        uint64_t cycle = cycles + 1;
+        if (ready[ctrl.rs1] > cycle || ready[ctrl.rs2] > cycle)
+        {
+            int reg = ready[ctrl.rs1] >= ready[ctrl.rs2] ? ctrl.rs1 : ctrl.rs2;
+            stalls[producer[reg]] += ready[reg] - cycle;
+            cycle = ready[reg];
+        }
+
+        // Results come back late from memory and the multiplier, x0 is
+        // always ready
+        if (ctrl.rd != 0)
+        {
+            if (ctrl.mem_read || ctrl.mem_to_reg || ctrl.amo != AMO_NONE)
+            {
+                ready[ctrl.rd] = cycle + config.load_latency;
+                producer[ctrl.rd] = TIMING_STALL_LOAD_USE;
+            }
+            else if (ctrl.alu_op == ALUOP_MUL)
+            {
+                ready[ctrl.rd] = cycle + config.mul_latency;
+                producer[ctrl.rd] = TIMING_STALL_MULTIPLY;
+            }
+            else
+            {
+                ready[ctrl.rd] = 0;
+            }
+        }
+        cycles = cycle;
+
+        if (ctrl.branch)
+        {
+            bool taken = next_pc != pc + ctrl.length;
+            if (predict(ctrl, pc, taken) != taken)
+            {
+                add_stall(TIMING_STALL_MISPREDICT, config.mispredict_penalty);
+                mispredicts++;
+            }
+            else if (taken)
+            {
+                add_stall(TIMING_STALL_TAKEN, config.taken_penalty);
+            }
+            branches++;
+        }
+        else if (ctrl.jump)
+        {
+            // JAL adds the offset to the PC, JALR to a register
+            if (ctrl.alu_a_src)
+            {
+                add_stall(TIMING_STALL_TAKEN, config.taken_penalty);
+            }
+            else
+            {
+                add_stall(TIMING_STALL_INDIRECT, config.mispredict_penalty);
+            }
+        }
+    }
+
+    // Cycles since reset, up to the last instruction retired
+    uint64_t get_cycles()
+    {
+        return cycles;
+    }
+
+    // Print cycles, CPI, stalls and predictor accuracy
+    void report(FILE *output);
+
+private:
+    timing_config_t config;
+
+    // Cycle the last instruction retired in
+    uint64_t cycles;
+    uint64_t instructions;
+
+    // First cycle an instruction reading each register can retire in, and
+    // what the register is waiting for
+    uint64_t ready[32];
+    timing_stall_t producer[32];
+
+    // Cycles lost by cause
+    uint64_t stalls[TIMING_STALL_COUNT];
+
+    // Conditional branches and how many went the other way than predicted
+    uint64_t branches;
+    uint64_t mispredicts;
+
+    // Two bit saturating counters, taken from 2 up
+    std::vector<uint8_t> counters;
+    uint32_t counter_mask;
+
+    // Outcomes of the latest conditional branches, newest in bit 0
+    uint32_t history;
+    uint32_t history_mask;
+
+    void add_stall(timing_stall_t cause, uint32_t penalty)
+    {
+        stalls[cause] += penalty;
+        cycles += penalty;
+    }
+
+    // Predict a branch and train the predictor with its outcome
+    bool predict(const control_t &ctrl, uint32_t pc, bool taken)
+    {
+        if (config.predictor == PREDICTOR_STATIC)
+        {
+            return (int32_t)ctrl.imm < 0;
+        }
+
+        uint32_t index = pc >> 1;
+        if (config.predictor == PREDICTOR_GSHARE)
+        {
+            index ^= history;
+            history = ((history << 1) | (taken ? 1 : 0)) & history_mask;
+        }
+        uint8_t &counter = counters[index & counter_mask];
+        bool prediction = counter >= 2;
+        if (taken && counter < 3)
+        {
+            counter++;
+        }
+        else if (!taken && counter > 0)
+        {
+            counter--;
+        }
+        return prediction;
+    }
+};
+
+#endif // TIMING_MODEL_H
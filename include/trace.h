@@ -9,29 +9,58 @@
 #define TRACE_LEVEL_INFO 3
 #define TRACE_LEVEL_DEBUG 4
 
-static int trace_level = TRACE_LEVEL_DEBUG;
+// Highest level compiled into the build. Traces above it compile to nothing,
+// so a build with TRACE_MAX_LEVEL=TRACE_LEVEL_NONE has no trace checks at all.
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_LEVEL_DEBUG
+#endif
 
-#define TRACE_SET(level)     \
-    do                       \
-    {                        \
-        trace_level = level; \
-    } while (0)
+// Level used by every category until changed at runtime
+#define TRACE_DEFAULT_LEVEL TRACE_LEVEL_WARNING
+
+typedef enum
+{
+    TRACE_CAT_GENERAL, // Anything without a more specific category
+    TRACE_CAT_DECODE,  // Instruction decode
+    TRACE_CAT_REGFILE, // Register file reads and writes
+    TRACE_CAT_MEMORY,  // RAM loads and stores
+    TRACE_CAT_BRANCH,  // Branch and jump outcomes
+    TRACE_CAT_LOADER,  // Memory image loading and dumping
+    TRACE_CAT_COUNT,
+} trace_cat_t;
+
+// Runtime level of each category, shared by the whole process
+extern int trace_levels[TRACE_CAT_COUNT];
+
+extern const char *TRACE_LEVEL_STR[];
+extern const char *TRACE_CAT_STR[];
+
+// Set the runtime level of every category
+void trace_set_level(int level);
+
+// Set the runtime level of one category
+void trace_set_category_level(trace_cat_t category, int level);
+
+// Get the runtime level of one category
+int trace_get_category_level(trace_cat_t category);
+
+// Apply a spec like "info" or "decode=debug,memory=none" (returns -1 on error)
+int trace_parse_spec(const char *spec);
+
+#define TRACE_SET(level) trace_set_level(level)
 
-static const char *TRACE_LEVEL_STR[] = {
-    "",
-    "ERROR",
-    "WARNING",
-    "INFO",
-    "DEBUG"};
+// True if a level is compiled in and enabled for a category
+#define TRACE_ENABLED(category, level) \
+    ((level) <= TRACE_MAX_LEVEL && (level) <= trace_levels[category])
 
-#define TRACE(level, fmt, ...)                                                 \
+#define TRACE(category, level, fmt, ...)                                       \
     do                                                                         \
     {                                                                          \
-        if (level <= trace_level)                                              \
+        if (TRACE_ENABLED(category, level))                                    \
         {                                                                      \
             printf("%s: %s:%d: ", TRACE_LEVEL_STR[level], __FILE__, __LINE__); \
             printf(fmt, ##__VA_ARGS__);                                        \
         }                                                                      \
     } while (0)
 
-#endif // TRACE_H
\ No newline at end of file
+#endif // TRACE_H
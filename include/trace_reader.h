@@ -0,0 +1,146 @@
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "ram.h"
+#include "trace_recorder.h"
+
+// Reads an execution trace written by TraceRecorder. The file is mapped
+// where the host allows it and decoded in place one record at a time,
+// keeping the registers up to date along the way.
+class TraceReader
+{
+public:
+    TraceReader();
+    ~TraceReader();
+
+    // Open a trace and check its header (0 on success)
+    int open(const char *filename);
+
+    const trace_file_header_t &get_header()
+    {
+        return header;
+    }
+
+    // Decode the next record, false at the end of the trace
+    bool next(trace_record_t *record)
+    {
+        // Records can't run past the end until the last few
+        if ((size_t)(end - cursor) >= TRACE_RECORD_MAX)
+        {
+            cursor = decode(cursor, record);
+            return true;
+        }
+        return next_near_end(record);
+    }
+
+    // Registers after the last record read
+    const uint32_t *get_registers()
+    {
+        return x;
+    }
+
+    // Records read since the start
+    uint64_t get_position()
+    {
+        return position;
+    }
+
+    // True once the end was reached partway through a record, as when the
+    // recorder didn't get to close the trace
+    bool is_truncated()
+    {
+        return truncated;
+    }
+
+    // Go back to the first record
+    void rewind();
+
+    // Bytes in the file
+    size_t get_size()
+    {
+        return size;
+    }
+
+private:
+    // Opened file
+    int fd;
+    const uint8_t *image;
+    size_t size;
+#ifndef RAM_FILE_MAPPING
+    std::vector<uint8_t> contents;
+#endif
+
+    trace_file_header_t header;
+
+    // Next record and the end of the records
+    const uint8_t *cursor;
+    const uint8_t *end;
+
+    // What the next record was encoded against
+    uint32_t next_pc;
+    uint32_t x[32];
+    uint32_t address;
+
+    uint64_t position;
+    bool truncated;
+
+    // Decode a record at in, returning the byte after it
+    const uint8_t *decode(const uint8_t *in, trace_record_t *record)
+    {
+        uint32_t flags = *in++;
+        uint32_t delta;
+
+        record->length = (flags & TRACE_RECORD_COMPRESSED) ? 2 : 4;
+        if (flags & TRACE_RECORD_JUMP)
+        {
+            in = trace_get_varint(in, &delta);
+            next_pc += trace_unzigzag(delta);
+        }
+        record->pc = next_pc;
+        next_pc += record->length;
+
+        record->rd = 0;
+        record->value = 0;
+        if (flags & TRACE_RECORD_REGISTER)
+        {
+            uint32_t rd = *in++ & 31;
+            in = trace_get_varint(in, &delta);
+            x[rd] += trace_unzigzag(delta);
+            record->rd = (uint8_t)rd;
+            record->value = x[rd];
+        }
+
+        record->size = 0;
+        record->write = false;
+        record->has_data = false;
+        record->address = 0;
+        record->data = 0;
+        if (flags & TRACE_RECORD_ACCESS)
+        {
+            record->size = (uint8_t)(1u << ((flags >> TRACE_RECORD_SIZE_SHIFT) & 3));
+            record->write = (flags & TRACE_RECORD_WRITE) != 0;
+            in = trace_get_varint(in, &delta);
+            address += trace_unzigzag(delta);
+            record->address = address;
+            if (flags & TRACE_RECORD_DATA)
+            {
+                record->has_data = true;
+                in = trace_get_varint(in, &record->data);
+            }
+        }
+
+        position++;
+        return in;
+    }
+
+    // Decode one of the last records, checking it is all there
+    bool next_near_end(trace_record_t *record);
+
+    // Release the opened file
+    void close();
+};
+
+#endif // TRACE_READER_H
@@ -0,0 +1,219 @@
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Execution trace file layout. The header is followed by one record per
+// instruction executed, each a flags byte and the fields it calls for:
+//
+//   PC delta         zigzag varint, TRACE_RECORD_JUMP only
+//   register         byte, TRACE_RECORD_REGISTER only
+//   value delta      zigzag varint from the register's previous value
+//   address delta    zigzag varint from the previous access's address,
+//                    TRACE_RECORD_ACCESS only
+//   data             varint, TRACE_RECORD_DATA only
+//
+// Varints are 7 bits a byte, low bits first, with the top bit set on every
+// byte but the last. An instruction's PC is the one after the previous
+// instruction unless the record jumps, the first one after the header's.
+#define TRACE_FILE_MAGIC "RVTRACE"
+#define TRACE_FILE_VERSION 1
+
+typedef struct
+{
+    char magic[8];              // TRACE_FILE_MAGIC
+    uint32_t version;           // TRACE_FILE_VERSION
+    uint32_t hart_id;
+    uint32_t pc;                // Of the first instruction
+    uint32_t reserved;
+    uint64_t first_instruction; // Instructions executed before the first record
+    uint64_t record_count;      // Records after the header, 0 if unfinished
+    uint32_t x[32];             // Registers before the first instruction
+} trace_file_header_t;
+
+// Record flags
+#define TRACE_RECORD_JUMP 0x01       // PC isn't the one after the previous instruction
+#define TRACE_RECORD_COMPRESSED 0x02 // 2 byte instruction
+#define TRACE_RECORD_REGISTER 0x04   // Writes a register other than x0
+#define TRACE_RECORD_ACCESS 0x08     // Accesses memory
+#define TRACE_RECORD_WRITE 0x10      // The access writes
+#define TRACE_RECORD_SIZE_SHIFT 5    // log2 of the access size, 2 bits
+#define TRACE_RECORD_DATA 0x80       // Value stored (plain stores only)
+
+// Longest encoded record: flags, register and four 5 byte varints
+#define TRACE_RECORD_MAX 22
+
+// Bytes of records handed to the writer thread at a time, and buffers
+// the recording hart can fill before it has to wait for the disk
+#define TRACE_BUFFER_SIZE (4 * 1024 * 1024)
+#define TRACE_BUFFER_COUNT 4
+
+// Buffer of encoded records
+typedef struct
+{
+    uint8_t *data;
+    size_t size; // Bytes used
+} trace_buffer_t;
+
+// One instruction of a trace
+typedef struct
+{
+    uint32_t pc;
+    uint8_t length;   // 2 or 4
+    uint8_t rd;       // Register written, 0 for none
+    uint8_t size;     // Bytes accessed, 0 for no access
+    bool write;       // The access writes
+    bool has_data;    // data holds the value stored
+    uint32_t value;   // Written to rd
+    uint32_t address; // Of the access
+    uint32_t data;    // Stored, the low size bytes
+} trace_record_t;
+
+static inline uint8_t *trace_put_varint(uint8_t *cursor, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        *cursor++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *cursor++ = (uint8_t)value;
+    return cursor;
+}
+
+// Reads at most 5 bytes, however the top bits are set
+static inline const uint8_t *trace_get_varint(const uint8_t *cursor, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (uint32_t shift = 0; shift < 35; shift += 7)
+    {
+        uint8_t byte = *cursor++;
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            break;
+        }
+    }
+    *value = result;
+    return cursor;
+}
+
+// Small differences either way encode short
+static inline uint32_t trace_zigzag(uint32_t delta)
+{
+    return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+static inline uint32_t trace_unzigzag(uint32_t value)
+{
+    return (value >> 1) ^ (0u - (value & 1));
+}
+
+// Writes the execution trace of one hart. Records are encoded into a
+// large buffer, and full buffers are written out by a background thread
+// so the hart only waits for the disk when every buffer is full.
+class TraceRecorder
+{
+public:
+    TraceRecorder();
+
+    // Finish the file if close() wasn't called
+    ~TraceRecorder();
+
+    // Create the trace file (0 on success)
+    int open(const char *filename);
+
+    // Write the header and start the writer thread. Records follow from
+    // an instruction at pc with these registers.
+    void start(uint32_t hart_id, uint32_t pc, uint64_t instruction_count, const uint32_t *x);
+
+    // Record an executed instruction
+    void record(const trace_record_t &record)
+    {
+        if (cursor > limit)
+        {
+            flush();
+        }
+
+        // Flags go in front once the fields are known
+        uint8_t *out = cursor + 1;
+        uint32_t flags = record.length == 2 ? TRACE_RECORD_COMPRESSED : 0;
+        if (record.pc != next_pc)
+        {
+            flags |= TRACE_RECORD_JUMP;
+            out = trace_put_varint(out, trace_zigzag(record.pc - next_pc));
+        }
+        next_pc = record.pc + record.length;
+
+        if (record.rd != 0)
+        {
+            flags |= TRACE_RECORD_REGISTER;
+            *out++ = record.rd;
+            out = trace_put_varint(out, trace_zigzag(record.value - x[record.rd]));
+            x[record.rd] = record.value;
+        }
+
+        if (record.size != 0)
+        {
+            flags |= TRACE_RECORD_ACCESS | (record.size == 4 ? 2 : record.size - 1) << TRACE_RECORD_SIZE_SHIFT;
+            if (record.write)
+            {
+                flags |= TRACE_RECORD_WRITE;
+            }
+            out = trace_put_varint(out, trace_zigzag(record.address - address));
+            address = record.address;
+            if (record.has_data)
+            {
+                flags |= TRACE_RECORD_DATA;
+                out = trace_put_varint(out, record.data);
+            }
+        }
+
+        *cursor = (uint8_t)flags;
+        cursor = out;
+        record_count++;
+    }
+
+    // Write out every record, fill in the header and close the file (0 if
+    // everything was written)
+    int close();
+
+private:
+    FILE *file;
+    trace_file_header_t header;
+
+    // Buffer being filled, and where the next record can't fit past
+    uint8_t *buffer;
+    uint8_t *cursor;
+    uint8_t *limit;
+
+    // What the next record is encoded against
+    uint32_t next_pc;
+    uint32_t x[32];
+    uint32_t address;
+    uint64_t record_count;
+
+    // Buffers, full ones waiting for the writer thread in order and empty
+    // ones waiting for the hart
+    std::vector<std::vector<uint8_t> > storage;
+    std::deque<trace_buffer_t> full;
+    std::vector<uint8_t *> empty;
+    std::thread writer;
+    std::mutex queue_lock;
+    std::condition_variable queue_changed;
+    bool stopping;
+    bool failed;
+
+    // Hand the current buffer to the writer thread and take an empty one
+    void flush();
+
+    // Body of the writer thread
+    void write_buffers();
+};
+
+#endif // TRACE_RECORDER_H
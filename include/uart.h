@@ -0,0 +1,84 @@
+#ifndef UART_H
+#define UART_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "ram.h"
+
+// Where main maps the UART, as on common RISC-V boards
+#define UART_BASE 0x10000000
+#define UART_SIZE 0x100
+
+// 16550 registers used, by byte offset
+#define UART_THR 0 // Transmit holding register (DLAB clear)
+#define UART_LCR 3 // Line control register
+#define UART_LSR 5 // Line status register
+
+#define UART_LCR_DLAB 0x80 // Offsets 0 and 1 hold the baud rate divisor
+#define UART_LSR_THRE 0x20 // Transmit holding register empty
+#define UART_LSR_TEMT 0x40 // Transmitter empty
+
+// Bytes the guest can get ahead of the host before it has to wait
+#define UART_RING_SIZE 65536
+
+// Bytes gathered into one host write
+#define UART_WRITE_SIZE 4096
+
+// Slot of the transmit ring. The sequence says whether the slot is free
+// for the producer at a position or holds the byte at a position.
+typedef struct
+{
+    std::atomic<uint32_t> sequence;
+    uint8_t value;
+} uart_slot_t;
+
+// Transmit side of a 16550 UART. Bytes the guest writes go into a lock free
+// ring that a background thread drains to a host file, so harts only wait
+// for the host when the ring is full. Reception is not supported, the
+// receive buffer always reads as empty.
+class Uart : public Device
+{
+public:
+    // Start the output thread writing to a file
+    Uart(FILE *output);
+
+    // Drain the ring and stop the output thread
+    ~Uart();
+
+    uint32_t read(uint32_t offset, uint32_t size);
+    void write(uint32_t offset, uint32_t value, uint32_t size);
+
+    // Write out everything the guest has sent and stop the output thread
+    void stop();
+
+private:
+    FILE *output;
+
+    // Ring of transmitted bytes, any hart may produce into it
+    uart_slot_t ring[UART_RING_SIZE];
+    std::atomic<uint32_t> head;   // Next position to produce
+    uint32_t tail;                // Next position to drain (output thread)
+
+    // Line control register, only the divisor latch bit matters
+    std::atomic<uint32_t> line_control;
+
+    // The output thread sleeps when the ring is empty until woken or a
+    // short timeout passes, producers only wake it when it is asleep
+    std::thread io_thread;
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    std::atomic<bool> sleeping;
+    std::atomic<bool> stopping;
+
+    // Add a byte to the ring, waiting while it is full
+    void put(uint8_t value);
+
+    // Body of the output thread
+    void drain();
+};
+
+#endif // UART_H
@@ -0,0 +1,447 @@
+#ifndef X86_EMITTER_H
+#define X86_EMITTER_H
+
+#include <stdint.h>
+#include <string.h>
+
+// x86-64 general purpose registers
+typedef enum
+{
+    X86_RAX = 0,
+    X86_RCX = 1,
+    X86_RDX = 2,
+    X86_RBX = 3,
+    X86_RSP = 4,
+    X86_RBP = 5,
+    X86_RSI = 6,
+    X86_RDI = 7,
+    X86_R8 = 8,
+    X86_R9 = 9,
+    X86_R10 = 10,
+    X86_R11 = 11,
+    X86_R12 = 12,
+    X86_R13 = 13,
+    X86_R14 = 14,
+    X86_R15 = 15,
+} x86_reg_t;
+
+// Group 1 ALU operations (the /digit of opcodes 0x81 and 0x83, and bits 5:3
+// of the register forms)
+typedef enum
+{
+    X86_ADD = 0,
+    X86_OR = 1,
+    X86_AND = 4,
+    X86_SUB = 5,
+    X86_XOR = 6,
+    X86_CMP = 7,
+} x86_alu_t;
+
+// Shift operations (the /digit of opcodes 0xC1 and 0xD3)
+typedef enum
+{
+    X86_SHL = 4,
+    X86_SHR = 5,
+    X86_SAR = 7,
+} x86_shift_t;
+
+// Condition codes
+typedef enum
+{
+    X86_CC_B = 0x2,  // Below (unsigned less than)
+    X86_CC_AE = 0x3, // Above or equal
+    X86_CC_E = 0x4,  // Equal
+    X86_CC_NE = 0x5, // Not equal
+    X86_CC_L = 0xC,  // Less than
+    X86_CC_GE = 0xD, // Greater or equal
+} x86_cc_t;
+
+// Writes x86-64 machine code into a buffer. Only the handful of encodings
+// the JIT needs; memory operands are always [base + disp] or [base + index].
+class X86Emitter
+{
+public:
+    X86Emitter(uint8_t *buffer, uint8_t *end)
+    {
+        this->code = buffer;
+        this->end = end;
+    }
+
+    // Current write position
+    uint8_t *position()
+    {
+        return code;
+    }
+
+    // Bytes left in the buffer
+    size_t remaining()
+    {
+        return end - code;
+    }
+
+    void byte(uint8_t value)
+    {
+        *code++ = value;
+    }
+
+    void dword(uint32_t value)
+    {
+        memcpy(code, &value, 4);
+        code += 4;
+    }
+
+    void qword(uint64_t value)
+    {
+        memcpy(code, &value, 8);
+        code += 8;
+    }
+
+    // op r32, [base + disp]   (mov = 0x8B, alu = (op << 3) | 3, ...)
+    void op_reg_mem(uint8_t opcode, x86_reg_t reg, x86_reg_t base, int32_t disp, bool wide = false)
+    {
+        rex(wide, reg, X86_RAX, base);
+        byte(opcode);
+        modrm_mem(reg, base, disp);
+    }
+
+    // op [base + disp], r32
+    void op_mem_reg(uint8_t opcode, x86_reg_t base, int32_t disp, x86_reg_t reg, bool wide = false)
+    {
+        op_reg_mem(opcode, reg, base, disp, wide);
+    }
+
+    // mov r32, [base + disp]
+    void mov_load(x86_reg_t reg, x86_reg_t base, int32_t disp)
+    {
+        op_reg_mem(0x8B, reg, base, disp);
+    }
+
+    // mov [base + disp], r32
+    void mov_store(x86_reg_t base, int32_t disp, x86_reg_t reg)
+    {
+        op_mem_reg(0x89, base, disp, reg);
+    }
+
+    // mov r64, [base + disp]
+    void mov_load64(x86_reg_t reg, x86_reg_t base, int32_t disp)
+    {
+        op_reg_mem(0x8B, reg, base, disp, true);
+    }
+
+    // mov [base + disp], r64
+    void mov_store64(x86_reg_t base, int32_t disp, x86_reg_t reg)
+    {
+        op_mem_reg(0x89, base, disp, reg, true);
+    }
+
+    // mov dword [base + disp], imm32
+    void mov_store_imm(x86_reg_t base, int32_t disp, uint32_t imm)
+    {
+        rex(false, X86_RAX, X86_RAX, base);
+        byte(0xC7);
+        modrm_mem(X86_RAX, base, disp);
+        dword(imm);
+    }
+
+    // alu r32, [base + disp]
+    void alu_load(x86_alu_t op, x86_reg_t reg, x86_reg_t base, int32_t disp)
+    {
+        op_reg_mem((uint8_t)((op << 3) | 3), reg, base, disp);
+    }
+
+    // alu r32, imm32
+    void alu_imm(x86_alu_t op, x86_reg_t reg, uint32_t imm, bool wide = false)
+    {
+        rex(wide, X86_RAX, X86_RAX, reg);
+        byte(0x81);
+        modrm_reg((x86_reg_t)op, reg);
+        dword(imm);
+    }
+
+    // alu dword/qword [base + disp], imm32
+    void alu_mem_imm(x86_alu_t op, x86_reg_t base, int32_t disp, uint32_t imm, bool wide = false)
+    {
+        rex(wide, X86_RAX, X86_RAX, base);
+        byte(0x81);
+        modrm_mem((x86_reg_t)op, base, disp);
+        dword(imm);
+    }
+
+    // alu dst, src (register to register)
+    void alu_reg(x86_alu_t op, x86_reg_t dst, x86_reg_t src, bool wide = false)
+    {
+        rex(wide, src, X86_RAX, dst);
+        byte((uint8_t)((op << 3) | 1));
+        modrm_reg(src, dst);
+    }
+
+    // mov dst, src
+    void mov_reg(x86_reg_t dst, x86_reg_t src, bool wide = false)
+    {
+        rex(wide, src, X86_RAX, dst);
+        byte(0x89);
+        modrm_reg(src, dst);
+    }
+
+    // mov r32, imm32
+    void mov_imm(x86_reg_t reg, uint32_t imm)
+    {
+        rex(false, X86_RAX, X86_RAX, reg);
+        byte(0xB8 + (reg & 7));
+        dword(imm);
+    }
+
+    // mov r64, imm64
+    void mov_imm64(x86_reg_t reg, uint64_t imm)
+    {
+        rex(true, X86_RAX, X86_RAX, reg);
+        byte(0xB8 + (reg & 7));
+        qword(imm);
+    }
+
+    // test r32, imm32
+    void test_imm(x86_reg_t reg, uint32_t imm)
+    {
+        rex(false, X86_RAX, X86_RAX, reg);
+        byte(0xF7);
+        modrm_reg(X86_RAX, reg);
+        dword(imm);
+    }
+
+    // test dst, src
+    void test_reg(x86_reg_t dst, x86_reg_t src)
+    {
+        rex(false, src, X86_RAX, dst);
+        byte(0x85);
+        modrm_reg(src, dst);
+    }
+
+    // shift r32, imm8 (wide for r64)
+    void shift_imm(x86_shift_t op, x86_reg_t reg, uint8_t amount, bool wide = false)
+    {
+        rex(wide, X86_RAX, X86_RAX, reg);
+        byte(0xC1);
+        modrm_reg((x86_reg_t)op, reg);
+        byte(amount);
+    }
+
+    // shift r32, cl
+    void shift_cl(x86_shift_t op, x86_reg_t reg)
+    {
+        rex(false, X86_RAX, X86_RAX, reg);
+        byte(0xD3);
+        modrm_reg((x86_reg_t)op, reg);
+    }
+
+    // imul r32, [base + disp]
+    void imul_load(x86_reg_t reg, x86_reg_t base, int32_t disp)
+    {
+        rex(false, reg, X86_RAX, base);
+        byte(0x0F);
+        byte(0xAF);
+        modrm_mem(reg, base, disp);
+    }
+
+    // imul r64, r64
+    void imul_reg64(x86_reg_t dst, x86_reg_t src)
+    {
+        rex(true, dst, X86_RAX, src);
+        byte(0x0F);
+        byte(0xAF);
+        modrm_reg(dst, src);
+    }
+
+    // cqo, sign extends rax into rdx
+    void cqo()
+    {
+        byte(0x48);
+        byte(0x99);
+    }
+
+    // div or idiv rdx:rax by r32 (wide for r64), quotient in rax and
+    // remainder in rdx
+    void div_reg(x86_reg_t reg, bool is_signed, bool wide = false)
+    {
+        rex(wide, X86_RAX, X86_RAX, reg);
+        byte(0xF7);
+        modrm_reg(is_signed ? (x86_reg_t)7 : (x86_reg_t)6, reg);
+    }
+
+    // movsxd r64, dword [base + disp]
+    void movsxd_load(x86_reg_t reg, x86_reg_t base, int32_t disp)
+    {
+        op_reg_mem(0x63, reg, base, disp, true);
+    }
+
+    // setcc r8 (only registers below RSP, which need no REX prefix)
+    void setcc(x86_cc_t cc, x86_reg_t reg)
+    {
+        byte(0x0F);
+        byte(0x90 | cc);
+        modrm_reg(X86_RAX, reg);
+    }
+
+    // Loads and stores at [base + index] with the access size of the opcode:
+    // mov r32 (0x8B), movzx byte/word (0x0FB6/0x0FB7), movsx (0x0FBE/0x0FBF)
+    void load_indexed(uint16_t opcode, x86_reg_t reg, x86_reg_t base, x86_reg_t index)
+    {
+        rex(false, reg, index, base);
+        if (opcode > 0xFF)
+        {
+            byte(opcode >> 8);
+        }
+        byte(opcode & 0xFF);
+        modrm_indexed(reg, base, index);
+    }
+
+    // mov [base + index], r8/r16/r32 by size in bytes
+    void store_indexed(int size, x86_reg_t base, x86_reg_t index, x86_reg_t reg)
+    {
+        if (size == 2)
+        {
+            byte(0x66);
+        }
+        rex(false, reg, index, base);
+        byte(size == 1 ? 0x88 : 0x89);
+        modrm_indexed(reg, base, index);
+    }
+
+    // cmp byte [base + disp], imm8
+    void cmp_byte_mem(x86_reg_t base, int32_t disp, uint8_t imm)
+    {
+        rex(false, X86_RAX, X86_RAX, base);
+        byte(0x80);
+        modrm_mem((x86_reg_t)X86_CMP, base, disp);
+        byte(imm);
+    }
+
+    // cmp byte [base + index], imm8
+    void cmp_byte_indexed(x86_reg_t base, x86_reg_t index, uint8_t imm)
+    {
+        rex(false, X86_RAX, index, base);
+        byte(0x80);
+        modrm_indexed((x86_reg_t)X86_CMP, base, index);
+        byte(imm);
+    }
+
+    // jmp rel32, returns the location of the displacement
+    uint8_t *jmp(uint8_t *target)
+    {
+        byte(0xE9);
+        uint8_t *site = code;
+        dword(0);
+        patch(site, target);
+        return site;
+    }
+
+    // jcc rel32, returns the location of the displacement
+    uint8_t *jcc(x86_cc_t cc, uint8_t *target)
+    {
+        byte(0x0F);
+        byte(0x80 | cc);
+        uint8_t *site = code;
+        dword(0);
+        patch(site, target);
+        return site;
+    }
+
+    // jmp qword [base + disp]
+    void jmp_mem(x86_reg_t base, int32_t disp)
+    {
+        rex(false, X86_RAX, X86_RAX, base);
+        byte(0xFF);
+        modrm_mem((x86_reg_t)4, base, disp);
+    }
+
+    // jmp r64
+    void jmp_reg(x86_reg_t reg)
+    {
+        rex(false, X86_RAX, X86_RAX, reg);
+        byte(0xFF);
+        modrm_reg((x86_reg_t)4, reg);
+    }
+
+    // call r64
+    void call_reg(x86_reg_t reg)
+    {
+        rex(false, X86_RAX, X86_RAX, reg);
+        byte(0xFF);
+        modrm_reg((x86_reg_t)2, reg);
+    }
+
+    void push(x86_reg_t reg)
+    {
+        rex(false, X86_RAX, X86_RAX, reg);
+        byte(0x50 + (reg & 7));
+    }
+
+    void pop(x86_reg_t reg)
+    {
+        rex(false, X86_RAX, X86_RAX, reg);
+        byte(0x58 + (reg & 7));
+    }
+
+    void ret()
+    {
+        byte(0xC3);
+    }
+
+    // Point a rel32 displacement at a target
+    static void patch(uint8_t *site, uint8_t *target)
+    {
+        int32_t rel = (int32_t)(target - (site + 4));
+        memcpy(site, &rel, 4);
+    }
+
+private:
+    uint8_t *code;
+    uint8_t *end;
+
+    // REX prefix, emitted only when needed
+    void rex(bool wide, x86_reg_t reg, x86_reg_t index, x86_reg_t base)
+    {
+        uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((index & 8) ? 2 : 0) | ((base & 8) ? 1 : 0);
+        if (prefix != 0x40)
+        {
+            byte(prefix);
+        }
+    }
+
+    void modrm_reg(x86_reg_t reg, x86_reg_t rm)
+    {
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void modrm_mem(x86_reg_t reg, x86_reg_t base, int32_t disp)
+    {
+        bool short_disp = disp >= -128 && disp <= 127;
+        byte((short_disp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == X86_RSP)
+        {
+            // RSP and R12 need a SIB byte with no index
+            byte(0x24);
+        }
+        if (short_disp)
+        {
+            byte((uint8_t)disp);
+        }
+        else
+        {
+            dword((uint32_t)disp);
+        }
+    }
+
+    void modrm_indexed(x86_reg_t reg, x86_reg_t base, x86_reg_t index)
+    {
+        // RBP and R13 bases have no form without a displacement
+        bool needs_disp = (base & 7) == X86_RBP;
+        byte((needs_disp ? 0x40 : 0x00) | ((reg & 7) << 3) | 0x04);
+        byte(((index & 7) << 3) | (base & 7));
+        if (needs_disp)
+        {
+            byte(0);
+        }
+    }
+};
+
+#endif // X86_EMITTER_H
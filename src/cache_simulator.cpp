@@ -0,0 +1,443 @@
+// Set associative instruction and data caches, simulated by their tags.
+
+#include "cache_simulator.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include "ram.h"
+
+static const char *replacement_str[] = {
+    "LRU",
+    "FIFO",
+    "random",
+};
+
+static const char *write_policy_str[] = {
+    "write back",
+    "write through",
+};
+
+void cache_default_config(cache_hierarchy_config_t *config)
+{
+    cache_config_t l1;
+    l1.size = CACHE_DEFAULT_SIZE;
+    l1.line_size = CACHE_DEFAULT_LINE_SIZE;
+    l1.ways = CACHE_DEFAULT_WAYS;
+    l1.replacement = CACHE_LRU;
+    l1.write_policy = CACHE_WRITE_BACK;
+
+    config->l1i = l1;
+    config->l1d = l1;
+    config->use_l2 = false;
+    config->l2 = l1;
+    config->l2.size = 16 * CACHE_DEFAULT_SIZE;
+    config->l2.ways = 2 * CACHE_DEFAULT_WAYS;
+}
+
+static bool is_power_of_two(uint32_t value)
+{
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// Parse size:line:ways[:policy...] up to end (0 on success)
+static int parse_cache(const char *spec, const char *end, cache_config_t *config)
+{
+    uint32_t numbers[3];
+    for (int i = 0; i < 3; i++)
+    {
+        char *number_end;
+        unsigned long value = strtoul(spec, &number_end, 0);
+        if (number_end == spec || number_end > end)
+        {
+            return -1;
+        }
+        if (number_end < end && (*number_end == 'k' || *number_end == 'K'))
+        {
+            value *= 1024;
+            number_end++;
+        }
+        else if (number_end < end && (*number_end == 'm' || *number_end == 'M'))
+        {
+            value *= 1024 * 1024;
+            number_end++;
+        }
+        numbers[i] = (uint32_t)value;
+
+        // Colons separate the fields, the ways may be the last one
+        if (i == 2 && number_end == end)
+        {
+            spec = end;
+            break;
+        }
+        if (number_end >= end || *number_end != ':')
+        {
+            return -1;
+        }
+        spec = number_end + 1;
+    }
+    config->size = numbers[0];
+    config->line_size = numbers[1];
+    config->ways = numbers[2];
+
+    while (spec < end)
+    {
+        const char *field_end = (const char *)memchr(spec, ':', end - spec);
+        if (field_end == NULL)
+        {
+            field_end = end;
+        }
+        size_t length = field_end - spec;
+        if (length == 3 && strncmp(spec, "lru", 3) == 0)
+        {
+            config->replacement = CACHE_LRU;
+        }
+        else if (length == 4 && strncmp(spec, "fifo", 4) == 0)
+        {
+            config->replacement = CACHE_FIFO;
+        }
+        else if (length == 6 && strncmp(spec, "random", 6) == 0)
+        {
+            config->replacement = CACHE_RANDOM;
+        }
+        else if (length == 2 && strncmp(spec, "wb", 2) == 0)
+        {
+            config->write_policy = CACHE_WRITE_BACK;
+        }
+        else if (length == 2 && strncmp(spec, "wt", 2) == 0)
+        {
+            config->write_policy = CACHE_WRITE_THROUGH;
+        }
+        else
+        {
+            return -1;
+        }
+        spec = field_end < end ? field_end + 1 : end;
+    }
+
+    // Sets must be a power of two too, as they are indexed by address bits
+    if (!is_power_of_two(config->size) || !is_power_of_two(config->line_size) || config->line_size < 4 || config->ways == 0 ||
+        config->ways > CACHE_MAX_WAYS || config->size % (config->line_size * config->ways) != 0 ||
+        !is_power_of_two(config->size / (config->line_size * config->ways)))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int cache_parse_spec(const char *spec, cache_hierarchy_config_t *config)
+{
+    while (*spec)
+    {
+        const char *end = strchr(spec, ',');
+        if (end == NULL)
+        {
+            end = spec + strlen(spec);
+        }
+
+        const char *equals = (const char *)memchr(spec, '=', end - spec);
+        size_t length = equals != NULL ? (size_t)(equals - spec) : 0;
+        if (equals == NULL)
+        {
+            if ((size_t)(end - spec) != 7 || strncmp(spec, "default", 7) != 0)
+            {
+                return -1;
+            }
+        }
+        else if (length == 3 && strncmp(spec, "l1i", 3) == 0)
+        {
+            if (parse_cache(equals + 1, end, &config->l1i) != 0)
+            {
+                return -1;
+            }
+        }
+        else if (length == 3 && strncmp(spec, "l1d", 3) == 0)
+        {
+            if (parse_cache(equals + 1, end, &config->l1d) != 0)
+            {
+                return -1;
+            }
+        }
+        else if (length == 2 && strncmp(spec, "l2", 2) == 0)
+        {
+            if (parse_cache(equals + 1, end, &config->l2) != 0)
+            {
+                return -1;
+            }
+            config->use_l2 = true;
+        }
+        else
+        {
+            return -1;
+        }
+
+        spec = *end ? end + 1 : end;
+    }
+
+    // An L1 line must fit in one L2 line
+    if (config->use_l2 && (config->l2.line_size < config->l1i.line_size || config->l2.line_size < config->l1d.line_size))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+Cache::Cache(const cache_config_t &config, Cache *next)
+{
+    this->config = config;
+    this->next = next;
+
+    uint32_t sets = config.size / (config.line_size * config.ways);
+    line_shift = 0;
+    while ((1u << line_shift) < config.line_size)
+    {
+        line_shift++;
+    }
+    set_mask = sets - 1;
+
+    tags.resize(sets * config.ways);
+    stamps.resize(sets * config.ways);
+    dirty.resize(sets * config.ways);
+    reset();
+}
+
+void Cache::reset()
+{
+    std::fill(tags.begin(), tags.end(), CACHE_TAG_INVALID);
+    std::fill(stamps.begin(), stamps.end(), 0);
+    std::fill(dirty.begin(), dirty.end(), 0);
+    clock = 0;
+    last_line = CACHE_TAG_INVALID;
+    last_index = 0;
+    random_state = 0x2545F491;
+    memset(&stats, 0, sizeof(stats));
+}
+
+bool Cache::lookup(uint32_t line, bool write)
+{
+    uint32_t base = (line & set_mask) * config.ways;
+    clock++;
+    for (uint32_t way = 0; way < config.ways; way++)
+    {
+        if (tags[base + way] == line)
+        {
+            uint32_t index = base + way;
+            if (config.replacement == CACHE_LRU)
+            {
+                stamps[index] = clock;
+            }
+            if (write)
+            {
+                store_hit(index);
+            }
+            last_line = line;
+            last_index = index;
+            return true;
+        }
+    }
+
+    if (write)
+    {
+        stats.write_misses++;
+
+        // Stores that miss a write through cache don't allocate
+        if (config.write_policy == CACHE_WRITE_THROUGH)
+        {
+            next_access(line, true);
+            return false;
+        }
+    }
+    else
+    {
+        stats.read_misses++;
+    }
+
+    // Empty lines have the oldest stamps, so they go first
+    uint32_t victim = base;
+    if (config.replacement == CACHE_RANDOM)
+    {
+        for (uint32_t way = 0; way < config.ways; way++)
+        {
+            if (tags[base + way] == CACHE_TAG_INVALID)
+            {
+                victim = base + way;
+                break;
+            }
+        }
+        if (tags[victim] != CACHE_TAG_INVALID)
+        {
+            random_state ^= random_state << 13;
+            random_state ^= random_state >> 17;
+            random_state ^= random_state << 5;
+            victim = base + random_state % config.ways;
+        }
+    }
+    else
+    {
+        for (uint32_t way = 1; way < config.ways; way++)
+        {
+            if (stamps[base + way] < stamps[victim])
+            {
+                victim = base + way;
+            }
+        }
+    }
+
+    if (tags[victim] != CACHE_TAG_INVALID)
+    {
+        stats.evictions++;
+        if (dirty[victim])
+        {
+            stats.writebacks++;
+            next_access(tags[victim], true);
+        }
+    }
+
+    // Fill the line from the next level
+    next_access(line, false);
+    tags[victim] = line;
+    stamps[victim] = clock;
+    dirty[victim] = write ? 1 : 0;
+    last_line = line;
+    last_index = victim;
+    return false;
+}
+
+CacheSimulator::CacheSimulator(const cache_hierarchy_config_t &config, ElfLoader *symbols)
+{
+    l2 = config.use_l2 ? new Cache(config.l2, NULL) : NULL;
+    l1i = new Cache(config.l1i, l2);
+    l1d = new Cache(config.l1d, l2);
+    this->symbols = symbols;
+    reset();
+}
+
+CacheSimulator::~CacheSimulator()
+{
+    delete l1i;
+    delete l1d;
+    delete l2;
+}
+
+void CacheSimulator::reset()
+{
+    l1i->reset();
+    l1d->reset();
+    if (l2 != NULL)
+    {
+        l2->reset();
+    }
+    regions.clear();
+    region = NULL;
+    region_start = 0;
+    region_length = 0;
+}
+
+// Orders an address before the symbols above it
+static bool symbol_after(uint32_t address, const elf_symbol_t &symbol)
+{
+    return address < symbol.value;
+}
+
+void CacheSimulator::find_region(uint32_t pc)
+{
+    // The part of the page up to the next symbol, unless a symbol covers pc
+    uint32_t start = pc & ~(uint32_t)(RAM_PAGE_SIZE - 1);
+    uint32_t length = RAM_PAGE_SIZE;
+    if (symbols != NULL)
+    {
+        const std::vector<elf_symbol_t> &list = symbols->get_symbols();
+        std::vector<elf_symbol_t>::const_iterator next = std::upper_bound(list.begin(), list.end(), pc, symbol_after);
+        uint32_t next_start = next != list.end() ? next->value : 0;
+
+        const elf_symbol_t *symbol = symbols->symbol_at(pc);
+        if (symbol != NULL && symbol->size != 0)
+        {
+            start = symbol->value;
+            length = symbol->size;
+        }
+        else if (symbol != NULL)
+        {
+            // A label runs up to the next symbol
+            start = symbol->value;
+            length = next_start - start;
+        }
+        else if (next_start != 0 && next_start - start < length)
+        {
+            length = next_start - start;
+        }
+    }
+
+    region = &regions[start];
+    region_start = start;
+    region_length = length;
+}
+
+void CacheSimulator::report_cache(FILE *output, const char *name, Cache *cache)
+{
+    const cache_config_t &config = cache->get_config();
+    const cache_stats_t &stats = cache->get_stats();
+    uint64_t accesses = stats.reads + stats.writes;
+    uint64_t misses = stats.read_misses + stats.write_misses;
+
+    if (config.size % 1024 == 0)
+    {
+        fprintf(output, "%s: %u KiB", name, config.size / 1024);
+    }
+    else
+    {
+        fprintf(output, "%s: %u bytes", name, config.size);
+    }
+    fprintf(output, ", %u byte lines, %u-way, %s, %s\n", config.line_size, config.ways, replacement_str[config.replacement],
+            write_policy_str[config.write_policy]);
+    fprintf(output, "  %llu reads, %llu missed; %llu writes, %llu missed; %llu evictions, %llu write backs", (unsigned long long)stats.reads,
+            (unsigned long long)stats.read_misses, (unsigned long long)stats.writes, (unsigned long long)stats.write_misses,
+            (unsigned long long)stats.evictions, (unsigned long long)stats.writebacks);
+    if (accesses > 0)
+    {
+        fprintf(output, "; miss rate %.2f%%", 100.0 * misses / accesses);
+    }
+    fprintf(output, "\n");
+}
+
+// Orders regions by their misses, most first
+static bool more_misses(const std::pair<uint32_t, cache_region_stats_t> &a, const std::pair<uint32_t, cache_region_stats_t> &b)
+{
+    uint64_t a_misses = a.second.fetch_misses + a.second.data_misses;
+    uint64_t b_misses = b.second.fetch_misses + b.second.data_misses;
+    return a_misses != b_misses ? a_misses > b_misses : a.first < b.first;
+}
+
+void CacheSimulator::report(FILE *output)
+{
+    report_cache(output, "L1I", l1i);
+    report_cache(output, "L1D", l1d);
+    if (l2 != NULL)
+    {
+        report_cache(output, "L2", l2);
+    }
+
+    std::vector<std::pair<uint32_t, cache_region_stats_t> > sorted(regions.begin(), regions.end());
+    std::sort(sorted.begin(), sorted.end(), more_misses);
+    if (sorted.size() > CACHE_REPORT_REGIONS)
+    {
+        sorted.resize(CACHE_REPORT_REGIONS);
+    }
+
+    fprintf(output, "L1 misses by code region (fetch misses/fetches, data misses/accesses):\n");
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        const cache_region_stats_t &stats = sorted[i].second;
+        const elf_symbol_t *symbol = symbols != NULL ? symbols->symbol_at(sorted[i].first) : NULL;
+        if (symbol != NULL && symbol->value == sorted[i].first)
+        {
+            fprintf(output, "  %-24s", symbol->name.c_str());
+        }
+        else
+        {
+            fprintf(output, "  0x%08X              ", sorted[i].first);
+        }
+        fprintf(output, " %llu/%llu %llu/%llu\n", (unsigned long long)stats.fetch_misses, (unsigned long long)stats.fetches,
+                (unsigned long long)stats.data_misses, (unsigned long long)stats.data);
+    }
+}
@@ -0,0 +1,354 @@
+// Saves and restores harts and their memory.
+
+#include "checkpoint.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "trace.h"
+#ifdef RAM_FILE_MAPPING
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Fletcher style checksum over 32-bit words, the sums wrap at 64 bits
+typedef struct
+{
+    uint64_t sum1;
+    uint64_t sum2;
+} checkpoint_checksum_t;
+
+static void checksum_update(checkpoint_checksum_t *checksum, const uint32_t *words, size_t count)
+{
+    uint64_t sum1 = checksum->sum1;
+    uint64_t sum2 = checksum->sum2;
+    for (size_t i = 0; i < count; i++)
+    {
+        sum1 += words[i];
+        sum2 += sum1;
+    }
+    checksum->sum1 = sum1;
+    checksum->sum2 = sum2;
+}
+
+static uint64_t checksum_value(const checkpoint_checksum_t *checksum)
+{
+    return (checksum->sum2 << 32) ^ checksum->sum1;
+}
+
+Checkpoint::Checkpoint()
+{
+    fd = -1;
+    image = NULL;
+    size = 0;
+    memset(&header, 0, sizeof(header));
+}
+
+Checkpoint::~Checkpoint()
+{
+    close();
+}
+
+int Checkpoint::save(const char *filename, Processor *const *processors, uint32_t count, RAM *ram)
+{
+    std::lock_guard<std::mutex> guard(ram->memory->lock);
+
+    // Pages holding anything, in address order
+    std::vector<uint32_t> page_numbers;
+    std::vector<const uint32_t *> pages;
+    for (uint32_t i = 0; i < RAM_DIRECTORY_ENTRIES; i++)
+    {
+        ram_page_t **table = ram->memory->directory[i];
+        if (table == NULL)
+        {
+            continue;
+        }
+        for (uint32_t j = 0; j < RAM_TABLE_ENTRIES; j++)
+        {
+            ram_page_t *page = table[j];
+            if (page == NULL)
+            {
+                continue;
+            }
+            for (uint32_t k = 0; k < RAM_PAGE_WORDS; k++)
+            {
+                if (page->words[k] != 0)
+                {
+                    page_numbers.push_back((i << RAM_TABLE_BITS) | j);
+                    pages.push_back(page->words);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Everything before the page data, padded to a page boundary
+    size_t harts_offset = sizeof(checkpoint_header_t);
+    size_t pages_offset = harts_offset + count * sizeof(checkpoint_hart_t);
+    size_t data_offset = (pages_offset + page_numbers.size() * sizeof(uint32_t) + RAM_PAGE_SIZE - 1) & ~(size_t)(RAM_PAGE_SIZE - 1);
+    std::vector<uint8_t> prefix(data_offset, 0);
+
+    checkpoint_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.hart_count = count;
+    header.page_count = (uint32_t)page_numbers.size();
+    header.data_offset = data_offset;
+    memcpy(&prefix[0], &header, sizeof(header));
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        Processor *processor = processors[i];
+        checkpoint_hart_t hart;
+        memset(&hart, 0, sizeof(hart));
+        hart.pc = processor->pc;
+        hart.hart_id = processor->hart_id;
+        hart.halt = processor->halt ? 1 : 0;
+        hart.instruction_count = processor->instruction_count;
+        for (int reg = 0; reg < 32; reg++)
+        {
+            hart.x[reg] = processor->registers.get_reg(reg);
+        }
+        hart.counter_inhibit = processor->counter_inhibit;
+        memcpy(hart.hpm_events, processor->hpm_events, sizeof(hart.hpm_events));
+        memcpy(hart.counter_offsets, processor->counter_offsets, sizeof(hart.counter_offsets));
+        memcpy(hart.counter_frozen, processor->counter_frozen, sizeof(hart.counter_frozen));
+        memcpy(hart.event_counts, processor->event_counts, sizeof(hart.event_counts));
+        memcpy(&prefix[harts_offset + i * sizeof(hart)], &hart, sizeof(hart));
+    }
+    if (!page_numbers.empty())
+    {
+        memcpy(&prefix[pages_offset], page_numbers.data(), page_numbers.size() * sizeof(uint32_t));
+    }
+
+    checkpoint_checksum_t checksum = {0, 0};
+    checksum_update(&checksum, (const uint32_t *)prefix.data(), prefix.size() / 4);
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        checksum_update(&checksum, pages[i], RAM_PAGE_WORDS);
+    }
+    header.checksum = checksum_value(&checksum);
+    memcpy(&prefix[0], &header, sizeof(header));
+
+    // Write a temporary file and rename it, so runs starting from an older
+    // checkpoint of the same name never see a partial one
+    std::string temporary = std::string(filename) + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (file == NULL)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to create checkpoint %s\n", temporary.c_str());
+        return -1;
+    }
+    bool written = fwrite(prefix.data(), 1, prefix.size(), file) == prefix.size();
+    for (size_t i = 0; written && i < pages.size(); i++)
+    {
+        written = fwrite(pages[i], 1, RAM_PAGE_SIZE, file) == RAM_PAGE_SIZE;
+    }
+    if (fclose(file) != 0 || !written)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to write checkpoint %s\n", temporary.c_str());
+        remove(temporary.c_str());
+        return -1;
+    }
+    remove(filename);
+    if (rename(temporary.c_str(), filename) != 0)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to rename checkpoint to %s\n", filename);
+        remove(temporary.c_str());
+        return -1;
+    }
+
+    TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_INFO, "Saved %u harts and %u pages to %s\n", count, header.page_count, filename);
+    return 0;
+}
+
+int Checkpoint::open(const char *filename)
+{
+    close();
+
+#ifdef RAM_FILE_MAPPING
+    // Map the whole file, pages are then mapped from it again by restore()
+    fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open checkpoint %s\n", filename);
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to read checkpoint %s\n", filename);
+        close();
+        return -1;
+    }
+    size = (size_t)info.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to map checkpoint %s\n", filename);
+        size = 0;
+        close();
+        return -1;
+    }
+    image = (const uint8_t *)mapping;
+#else
+    // Read the whole file
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open checkpoint %s\n", filename);
+        return -1;
+    }
+    uint8_t buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        contents.insert(contents.end(), buffer, buffer + count);
+    }
+    fclose(file);
+    image = contents.data();
+    size = contents.size();
+#endif
+
+    // Check the header
+    if (size < sizeof(header))
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Checkpoint %s too short\n", filename);
+        close();
+        return -1;
+    }
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "%s is not a checkpoint\n", filename);
+        close();
+        return -1;
+    }
+    if (header.version != CHECKPOINT_VERSION)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Checkpoint %s has version %u, expected %u\n", filename, header.version, CHECKPOINT_VERSION);
+        close();
+        return -1;
+    }
+    uint64_t pages_end = sizeof(header) + (uint64_t)header.hart_count * sizeof(checkpoint_hart_t) + (uint64_t)header.page_count * sizeof(uint32_t);
+    if (header.hart_count == 0 || (header.data_offset & (RAM_PAGE_SIZE - 1)) != 0 || header.data_offset < pages_end ||
+        header.data_offset + ((uint64_t)header.page_count << RAM_PAGE_SHIFT) != size)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Bad checkpoint layout in %s\n", filename);
+        close();
+        return -1;
+    }
+
+    // Check the whole file, the checksum field counts as zero
+    checkpoint_header_t zeroed = header;
+    zeroed.checksum = 0;
+    checkpoint_checksum_t checksum = {0, 0};
+    checksum_update(&checksum, (const uint32_t *)&zeroed, sizeof(zeroed) / 4);
+    checksum_update(&checksum, (const uint32_t *)(image + sizeof(header)), (size - sizeof(header)) / 4);
+    if (checksum_value(&checksum) != header.checksum)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Checksum mismatch in checkpoint %s\n", filename);
+        close();
+        return -1;
+    }
+
+    const uint32_t *page_numbers = (const uint32_t *)(image + sizeof(header) + header.hart_count * sizeof(checkpoint_hart_t));
+    for (uint32_t i = 0; i < header.page_count; i++)
+    {
+        if (page_numbers[i] >= (1u << (32 - RAM_PAGE_SHIFT)))
+        {
+            TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Bad page number in checkpoint %s\n", filename);
+            close();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+uint32_t Checkpoint::get_hart_count()
+{
+    return header.hart_count;
+}
+
+int Checkpoint::restore(Processor *const *processors, uint32_t count, RAM *ram)
+{
+    if (image == NULL)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "No checkpoint open\n");
+        return -1;
+    }
+    if (count != header.hart_count)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Checkpoint has %u harts, not %u\n", header.hart_count, count);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        checkpoint_hart_t hart;
+        memcpy(&hart, image + sizeof(header) + i * sizeof(hart), sizeof(hart));
+
+        Processor *processor = processors[i];
+        processor->hart_id = hart.hart_id;
+        processor->reset(hart.pc);
+        for (int reg = 1; reg < 32; reg++)
+        {
+            processor->registers.set_reg(reg, hart.x[reg]);
+        }
+        processor->halt = hart.halt != 0;
+        processor->instruction_count = hart.instruction_count;
+        processor->counter_inhibit = hart.counter_inhibit;
+        processor->hpm_active = false;
+        for (int event = 0; event < CSR_HPM_COUNTERS; event++)
+        {
+            processor->hpm_events[event] = hart.hpm_events[event] < HPM_EVENT_COUNT ? hart.hpm_events[event] : (uint32_t)HPM_EVENT_NONE;
+            processor->hpm_active = processor->hpm_active || processor->hpm_events[event] != HPM_EVENT_NONE;
+        }
+        memcpy(processor->counter_offsets, hart.counter_offsets, sizeof(hart.counter_offsets));
+        memcpy(processor->counter_frozen, hart.counter_frozen, sizeof(hart.counter_frozen));
+        memcpy(processor->event_counts, hart.event_counts, sizeof(hart.event_counts));
+
+        // Anything decoded before came from other memory
+        processor->fence_instructions();
+    }
+
+    ram->clear();
+    const uint32_t *page_numbers = (const uint32_t *)(image + sizeof(header) + count * sizeof(checkpoint_hart_t));
+    int result = -1;
+#ifdef RAM_FILE_MAPPING
+    result = ram->map_file_pages(fd, header.data_offset, page_numbers, header.page_count);
+#endif
+    if (result != 0)
+    {
+        for (uint32_t i = 0; i < header.page_count; i++)
+        {
+            ram->write_block(page_numbers[i] << RAM_PAGE_SHIFT, image + header.data_offset + ((size_t)i << RAM_PAGE_SHIFT), RAM_PAGE_SIZE);
+        }
+    }
+
+    TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_INFO, "Restored %u harts and %u pages (%s)\n", count, header.page_count, result == 0 ? "mapped" : "copied");
+    return 0;
+}
+
+void Checkpoint::close()
+{
+#ifdef RAM_FILE_MAPPING
+    if (image != NULL)
+    {
+        munmap((void *)image, size);
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+#else
+    contents.clear();
+#endif
+    fd = -1;
+    image = NULL;
+    size = 0;
+}
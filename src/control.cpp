@@ -3,9 +3,188 @@
 
 #include "trace.h"
 
+// Bits hi..lo of a compressed instruction, shifted down
+#define CBITS(value, hi, lo) (((value) >> (lo)) & ((1u << ((hi) - (lo) + 1)) - 1))
+
+// Registers x8-x15 of the three bit register fields
+#define CREG(value, lo) (8 + CBITS(value, (lo) + 2, lo))
+
+// Encoders for the 32-bit formats
+static uint32_t encode_r(uint32_t funct7, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+    return (funct7 << FUNCT7_SHIFT) | (rs2 << RS2_SHIFT) | (rs1 << RS1_SHIFT) | (funct3 << FUNCT3_SHIFT) | (rd << RD_SHIFT) | opcode;
+}
+
+static uint32_t encode_i(uint32_t imm, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+    return ((imm & 0xFFF) << IMM_I_SHIFT) | (rs1 << RS1_SHIFT) | (funct3 << FUNCT3_SHIFT) | (rd << RD_SHIFT) | opcode;
+}
+
+static uint32_t encode_s(uint32_t imm, uint32_t rs2, uint32_t rs1, uint32_t funct3)
+{
+    return (((imm >> 5) & 0x7F) << IMM7_S_SHIFT) | (rs2 << RS2_SHIFT) | (rs1 << RS1_SHIFT) | (funct3 << FUNCT3_SHIFT) | ((imm & 0x1F) << IMM5_S_SHIFT) | OP_STYPE;
+}
+
+static uint32_t encode_b(uint32_t imm, uint32_t rs2, uint32_t rs1, uint32_t funct3)
+{
+    return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3F) << 25) | (rs2 << RS2_SHIFT) | (rs1 << RS1_SHIFT) | (funct3 << FUNCT3_SHIFT) |
+           (((imm >> 1) & 0xF) << 8) | (((imm >> 11) & 1) << 7) | OP_BTYPE;
+}
+
+static uint32_t encode_j(uint32_t imm, uint32_t rd)
+{
+    return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3FF) << 21) | (((imm >> 11) & 1) << 20) | (((imm >> 12) & 0xFF) << 12) | (rd << RD_SHIFT) | OP_JAL;
+}
+
+// Sign extend the low bits of a value
+static uint32_t sign_extend(uint32_t value, int bits)
+{
+    return (uint32_t)((int32_t)(value << (32 - bits)) >> (32 - bits));
+}
+
+uint32_t expand_compressed(uint32_t instruction)
+{
+    uint32_t c = instruction & 0xFFFF;
+    uint32_t funct3 = CBITS(c, 15, 13);
+    uint32_t rd = CBITS(c, 11, 7);
+    uint32_t rs2 = CBITS(c, 6, 2);
+
+    // imm[5|4:0] of C.ADDI, C.LI, C.ANDI
+    uint32_t imm6 = sign_extend((CBITS(c, 12, 12) << 5) | CBITS(c, 6, 2), 6);
+
+    switch (c & 3)
+    {
+    case 0:
+        switch (funct3)
+        {
+        case 0: // C.ADDI4SPN
+        {
+            uint32_t imm = (CBITS(c, 12, 11) << 4) | (CBITS(c, 10, 7) << 6) | (CBITS(c, 6, 6) << 2) | (CBITS(c, 5, 5) << 3);
+            return imm == 0 ? 0 : encode_i(imm, 2, ADDI, CREG(c, 2), OP_ITYPE);
+        }
+        case 2: // C.LW
+        {
+            uint32_t imm = (CBITS(c, 12, 10) << 3) | (CBITS(c, 6, 6) << 2) | (CBITS(c, 5, 5) << 6);
+            return encode_i(imm, CREG(c, 7), LW, CREG(c, 2), OP_LD_ITYPE);
+        }
+        case 6: // C.SW
+        {
+            uint32_t imm = (CBITS(c, 12, 10) << 3) | (CBITS(c, 6, 6) << 2) | (CBITS(c, 5, 5) << 6);
+            return encode_s(imm, CREG(c, 2), CREG(c, 7), SW);
+        }
+        default: // Floating point or reserved
+            return 0;
+        }
+
+    case 1:
+        switch (funct3)
+        {
+        case 0: // C.ADDI, C.NOP
+            return encode_i(imm6, rd, ADDI, rd, OP_ITYPE);
+        case 1: // C.JAL
+        case 5: // C.J
+        {
+            uint32_t imm = (CBITS(c, 12, 12) << 11) | (CBITS(c, 11, 11) << 4) | (CBITS(c, 10, 9) << 8) | (CBITS(c, 8, 8) << 10) |
+                           (CBITS(c, 7, 7) << 6) | (CBITS(c, 6, 6) << 7) | (CBITS(c, 5, 3) << 1) | (CBITS(c, 2, 2) << 5);
+            return encode_j(sign_extend(imm, 12), funct3 == 1 ? 1 : 0);
+        }
+        case 2: // C.LI
+            return encode_i(imm6, 0, ADDI, rd, OP_ITYPE);
+        case 3:
+            if (rd == 2)
+            {
+                // C.ADDI16SP
+                uint32_t imm = (CBITS(c, 12, 12) << 9) | (CBITS(c, 6, 6) << 4) | (CBITS(c, 5, 5) << 6) | (CBITS(c, 4, 3) << 7) | (CBITS(c, 2, 2) << 5);
+                return imm == 0 ? 0 : encode_i(sign_extend(imm, 10), 2, ADDI, 2, OP_ITYPE);
+            }
+            // C.LUI
+            return imm6 == 0 ? 0 : (imm6 << IMM_U_SHIFT) | (rd << RD_SHIFT) | OP_LUI;
+        case 4:
+        {
+            uint32_t rd_c = CREG(c, 7);
+            uint32_t rs2_c = CREG(c, 2);
+            switch (CBITS(c, 11, 10))
+            {
+            case 0: // C.SRLI, shamt[5] must be clear on RV32
+                return CBITS(c, 12, 12) ? 0 : encode_i(rs2, rd_c, SRLI_SRAI, rd_c, OP_ITYPE);
+            case 1: // C.SRAI
+                return CBITS(c, 12, 12) ? 0 : encode_i((SUB_SRA << 5) | rs2, rd_c, SRLI_SRAI, rd_c, OP_ITYPE);
+            case 2: // C.ANDI
+                return encode_i(imm6, rd_c, ANDI, rd_c, OP_ITYPE);
+            default:
+                if (CBITS(c, 12, 12))
+                {
+                    // C.SUBW and C.ADDW are RV64 only
+                    return 0;
+                }
+                switch (CBITS(c, 6, 5))
+                {
+                case 0: // C.SUB
+                    return encode_r(SUB_SRA, rs2_c, rd_c, ADD_SUB_MUL, rd_c, OP_RTYPE);
+                case 1: // C.XOR
+                    return encode_r(ADD_SRL, rs2_c, rd_c, XOR_DIV, rd_c, OP_RTYPE);
+                case 2: // C.OR
+                    return encode_r(ADD_SRL, rs2_c, rd_c, OR_REM, rd_c, OP_RTYPE);
+                default: // C.AND
+                    return encode_r(ADD_SRL, rs2_c, rd_c, AND_REMU, rd_c, OP_RTYPE);
+                }
+            }
+        }
+        default: // C.BEQZ, C.BNEZ
+        {
+            uint32_t imm = (CBITS(c, 12, 12) << 8) | (CBITS(c, 11, 10) << 3) | (CBITS(c, 6, 5) << 6) | (CBITS(c, 4, 3) << 1) | (CBITS(c, 2, 2) << 5);
+            return encode_b(sign_extend(imm, 9), 0, CREG(c, 7), funct3 == 6 ? BEQ : BNE);
+        }
+        }
+
+    case 2:
+        switch (funct3)
+        {
+        case 0: // C.SLLI
+            return CBITS(c, 12, 12) ? 0 : encode_i(rs2, rd, SLLI, rd, OP_ITYPE);
+        case 2: // C.LWSP
+        {
+            uint32_t imm = (CBITS(c, 12, 12) << 5) | (CBITS(c, 6, 4) << 2) | (CBITS(c, 3, 2) << 6);
+            return rd == 0 ? 0 : encode_i(imm, 2, LW, rd, OP_LD_ITYPE);
+        }
+        case 4:
+            if (CBITS(c, 12, 12) == 0)
+            {
+                if (rs2 == 0)
+                {
+                    // C.JR
+                    return rd == 0 ? 0 : encode_i(0, rd, 0, 0, OP_JALR);
+                }
+                // C.MV
+                return encode_r(ADD_SRL, rs2, 0, ADD_SUB_MUL, rd, OP_RTYPE);
+            }
+            if (rs2 == 0)
+            {
+                // C.EBREAK, C.JALR
+                return rd == 0 ? encode_i(SYSTEM_EBREAK, 0, PRIV, 0, OP_SYSTEM) : encode_i(0, rd, 0, 1, OP_JALR);
+            }
+            // C.ADD
+            return encode_r(ADD_SRL, rs2, rd, ADD_SUB_MUL, rd, OP_RTYPE);
+        case 6: // C.SWSP
+        {
+            uint32_t imm = (CBITS(c, 12, 9) << 2) | (CBITS(c, 8, 7) << 6);
+            return encode_s(imm, rs2, 2, SW);
+        }
+        default: // Floating point
+            return 0;
+        }
+
+    default:
+        // Not compressed
+        return instruction;
+    }
+}
+
 void control(control_t *control, uint32_t instruction)
 {
     control->halt = false;
+    control->breakpoint = false;
+    control->ecall = false;
     control->mem_read_unsigned = false;
     control->mem_read = 0;
     control->mem_write = 0;
@@ -23,6 +202,20 @@ void control(control_t *control, uint32_t instruction)
     control->imm = 0;
     control->alu_a_src = false;
     control->alu_b_src = false;
+    control->amo = AMO_NONE;
+    control->fence = false;
+    control->fence_i = false;
+    control->csr_op = CSR_NONE;
+    control->csr_imm = false;
+    control->length = 4;
+
+    // Compressed instructions decode as their 32-bit equivalent
+    if ((instruction & 3) != 3)
+    {
+        TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "Compressed 0x%04X\n", instruction & 0xFFFF);
+        control->length = 2;
+        instruction = expand_compressed(instruction);
+    }
 
     // Decode instruction
     int opcode = instruction & 0x7F;
@@ -48,15 +241,15 @@ void control(control_t *control, uint32_t instruction)
             switch (inst.funct7)
             {
             case ADD_SRL:
-                TRACE(TRACE_LEVEL_DEBUG, "ADD x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "ADD x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_ADD;
                 break;
             case SUB_SRA:
-                TRACE(TRACE_LEVEL_DEBUG, "SUB x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SUB x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_SUB;
                 break;
             case MUL:
-                TRACE(TRACE_LEVEL_DEBUG, "MUL x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "MUL x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_MUL;
                 control->mul_signed_a = true;
                 control->mul_signed_b = true;
@@ -64,27 +257,54 @@ void control(control_t *control, uint32_t instruction)
                 break;
             }
             break;
-        case AND:
-            TRACE(TRACE_LEVEL_DEBUG, "AND x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
-            control->alu_op = ALUOP_AND;
+        case AND_REMU:
+            switch (inst.funct7)
+            {
+            case 0:
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AND x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                control->alu_op = ALUOP_AND;
+                break;
+            case MUL:
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "REMU x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                control->alu_op = ALUOP_REMU;
+                break;
+            }
             break;
-        case OR:
-            TRACE(TRACE_LEVEL_DEBUG, "OR x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
-            control->alu_op = ALUOP_OR;
+        case OR_REM:
+            switch (inst.funct7)
+            {
+            case 0:
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "OR x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                control->alu_op = ALUOP_OR;
+                break;
+            case MUL:
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "REM x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                control->alu_op = ALUOP_REM;
+                break;
+            }
             break;
-        case XOR:
-            TRACE(TRACE_LEVEL_DEBUG, "XOR x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
-            control->alu_op = ALUOP_XOR;
+        case XOR_DIV:
+            switch (inst.funct7)
+            {
+            case 0:
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "XOR x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                control->alu_op = ALUOP_XOR;
+                break;
+            case MUL:
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "DIV x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                control->alu_op = ALUOP_DIV;
+                break;
+            }
             break;
         case SLT_MULHSU:
             switch (inst.funct7)
             {
             case 0:
-                TRACE(TRACE_LEVEL_DEBUG, "SLT x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SLT x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_SLT;
                 break;
             case MUL:
-                TRACE(TRACE_LEVEL_DEBUG, "MULHSU x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "MULHSU x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_MUL;
                 control->mul_signed_a = true;
                 control->mul_signed_b = false;
@@ -96,11 +316,11 @@ void control(control_t *control, uint32_t instruction)
             switch (inst.funct7)
             {
             case 0:
-                TRACE(TRACE_LEVEL_DEBUG, "SLTU x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SLTU x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_SLTU;
                 break;
             case MUL:
-                TRACE(TRACE_LEVEL_DEBUG, "MULHU x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "MULHU x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_MUL;
                 control->mul_signed_a = false;
                 control->mul_signed_b = false;
@@ -112,11 +332,11 @@ void control(control_t *control, uint32_t instruction)
             switch (inst.funct7)
             {
             case 0:
-                TRACE(TRACE_LEVEL_DEBUG, "SLL x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SLL x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_SLL;
                 break;
             case MUL:
-                TRACE(TRACE_LEVEL_DEBUG, "MULH x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "MULH x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_MUL;
                 control->mul_signed_a = true;
                 control->mul_signed_b = true;
@@ -124,21 +344,25 @@ void control(control_t *control, uint32_t instruction)
                 break;
             }
             break;
-        case SRL_SRA:
+        case SRL_SRA_DIVU:
             switch (inst.funct7)
             {
             case ADD_SRL:
-                TRACE(TRACE_LEVEL_DEBUG, "SRL x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SRL x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_SRL;
                 break;
             case SUB_SRA:
-                TRACE(TRACE_LEVEL_DEBUG, "SRA x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SRA x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
                 control->alu_op = ALUOP_SRA;
                 break;
+            case MUL:
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "DIVU x%02d, x%02d x%02d\n", control->rd, control->rs1, control->rs2);
+                control->alu_op = ALUOP_DIVU;
+                break;
             }
             break;
         default:
-            TRACE(TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
             control->halt = true;
             break;
         }
@@ -169,47 +393,47 @@ void control(control_t *control, uint32_t instruction)
         switch (inst.funct3)
         {
         case ADDI:
-            TRACE(TRACE_LEVEL_DEBUG, "ADDI x%02d, x%02d, %d\n", control->rd, control->rs1, (int32_t)control->imm);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "ADDI x%02d, x%02d, %d\n", control->rd, control->rs1, (int32_t)control->imm);
             control->alu_op = ALUOP_ADD;
             break;
         case SLTI:
-            TRACE(TRACE_LEVEL_DEBUG, "SLTI x%02d, x%02d, %d\n", control->rd, control->rs1, (int32_t)control->imm);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SLTI x%02d, x%02d, %d\n", control->rd, control->rs1, (int32_t)control->imm);
             control->alu_op = ALUOP_SLT;
             break;
         case SLTIU:
-            TRACE(TRACE_LEVEL_DEBUG, "SLTIU x%02d, x%02d, %d\n", control->rd, control->rs1, control->imm);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SLTIU x%02d, x%02d, %d\n", control->rd, control->rs1, control->imm);
             control->alu_op = ALUOP_SLTU;
             break;
         case XORI:
-            TRACE(TRACE_LEVEL_DEBUG, "XORI x%02d, x%02d, %08X\n", control->rd, control->rs1, control->imm);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "XORI x%02d, x%02d, %08X\n", control->rd, control->rs1, control->imm);
             control->alu_op = ALUOP_XOR;
             break;
         case ORI:
-            TRACE(TRACE_LEVEL_DEBUG, "ORI x%02d, x%02d, %08X\n", control->rd, control->rs1, control->imm);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "ORI x%02d, x%02d, %08X\n", control->rd, control->rs1, control->imm);
             control->alu_op = ALUOP_OR;
             break;
         case ANDI:
-            TRACE(TRACE_LEVEL_DEBUG, "ANDI x%02d, x%02d, %08X\n", control->rd, control->rs1, control->imm);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "ANDI x%02d, x%02d, %08X\n", control->rd, control->rs1, control->imm);
             control->alu_op = ALUOP_AND;
             break;
         case SLLI:
-            TRACE(TRACE_LEVEL_DEBUG, "SLLI x%02d, x%02d, %d\n", control->rd, control->rs1, control->imm);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SLLI x%02d, x%02d, %d\n", control->rd, control->rs1, control->imm);
             control->alu_op = ALUOP_SLL;
             break;
         case SRLI_SRAI:
             if (inst.imm & 0x400)
             {
-                TRACE(TRACE_LEVEL_DEBUG, "SRAI x%02d, x%02d, %d\n", control->rd, control->rs1, control->imm & 0x1F);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SRAI x%02d, x%02d, %d\n", control->rd, control->rs1, control->imm & 0x1F);
                 control->alu_op = ALUOP_SRA;
             }
             else
             {
-                TRACE(TRACE_LEVEL_DEBUG, "SRLI x%02d, x%02d, %d\n", control->rd, control->rs1, control->imm);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SRLI x%02d, x%02d, %d\n", control->rd, control->rs1, control->imm);
                 control->alu_op = ALUOP_SRL;
             }
             break;
         default:
-            TRACE(TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
             control->halt = true;
             break;
         }
@@ -227,7 +451,7 @@ void control(control_t *control, uint32_t instruction)
         control->imm = inst.imm << 12;
         control->alu_b_src = true;
 
-        TRACE(TRACE_LEVEL_DEBUG, "LUI x%02d, 0x%08X\n", control->rd, control->imm);
+        TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "LUI x%02d, 0x%08X\n", control->rd, control->imm);
 
         break;
     }
@@ -244,7 +468,7 @@ void control(control_t *control, uint32_t instruction)
         control->alu_a_src = true;
         control->alu_b_src = true;
 
-        TRACE(TRACE_LEVEL_DEBUG, "AUIPC x%02d, 0x%08X\n", control->rd, control->imm);
+        TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AUIPC x%02d, 0x%08X\n", control->rd, control->imm);
 
         break;
     }
@@ -278,15 +502,15 @@ void control(control_t *control, uint32_t instruction)
         switch (inst.funct3)
         {
         case SB:
-            TRACE(TRACE_LEVEL_DEBUG, "SB x%02d, %d(x%02d)\n", control->rs2, (int32_t)control->imm, control->rs1);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SB x%02d, %d(x%02d)\n", control->rs2, (int32_t)control->imm, control->rs1);
             control->mem_write = 1;
             break;
         case SH:
-            TRACE(TRACE_LEVEL_DEBUG, "SH x%02d, %d(x%02d)\n", control->rs2, (int32_t)control->imm, control->rs1);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SH x%02d, %d(x%02d)\n", control->rs2, (int32_t)control->imm, control->rs1);
             control->mem_write = 2;
             break;
         case SW:
-            TRACE(TRACE_LEVEL_DEBUG, "SW x%02d, %d(x%02d)\n", control->rs2, (int32_t)control->imm, control->rs1);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SW x%02d, %d(x%02d)\n", control->rs2, (int32_t)control->imm, control->rs1);
             control->mem_write = 3;
             break;
         }
@@ -318,34 +542,34 @@ void control(control_t *control, uint32_t instruction)
         switch (inst.funct3)
         {
         case LB:
-            TRACE(TRACE_LEVEL_DEBUG, "LB x%02d, %d(x%02d)\n", control->rd, (int32_t)control->imm, control->rs1);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "LB x%02d, %d(x%02d)\n", control->rd, (int32_t)control->imm, control->rs1);
             control->mem_read = 1;
             control->mem_to_reg = true;
             break;
         case LH:
-            TRACE(TRACE_LEVEL_DEBUG, "LH x%02d, %d(x%02d)\n", control->rd, (int32_t)control->imm, control->rs1);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "LH x%02d, %d(x%02d)\n", control->rd, (int32_t)control->imm, control->rs1);
             control->mem_read = 2;
             control->mem_to_reg = true;
             break;
         case LW:
-            TRACE(TRACE_LEVEL_DEBUG, "LW x%02d, %d(x%02d)\n", control->rd, (int32_t)control->imm, control->rs1);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "LW x%02d, %d(x%02d)\n", control->rd, (int32_t)control->imm, control->rs1);
             control->mem_read = 3;
             control->mem_to_reg = true;
             break;
         case LBU:
-            TRACE(TRACE_LEVEL_DEBUG, "LBU x%02d, %d(x%02d)\n", control->rd, (int32_t)control->imm, control->rs1);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "LBU x%02d, %d(x%02d)\n", control->rd, (int32_t)control->imm, control->rs1);
             control->mem_read = 1;
             control->mem_to_reg = true;
             control->mem_read_unsigned = true;
             break;
         case LHU:
-            TRACE(TRACE_LEVEL_DEBUG, "LHU x%02d, %d(x%02d)\n", control->rd, (int32_t)control->imm, control->rs1);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "LHU x%02d, %d(x%02d)\n", control->rd, (int32_t)control->imm, control->rs1);
             control->mem_read = 2;
             control->mem_to_reg = true;
             control->mem_read_unsigned = true;
             break;
         default:
-            TRACE(TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
             control->halt = true;
             break;
         }
@@ -373,7 +597,7 @@ void control(control_t *control, uint32_t instruction)
         }
         control->imm = imm;
 
-        TRACE(TRACE_LEVEL_DEBUG, "JAL x%02d, %d\n", control->rd, (int32_t)control->imm);
+        TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "JAL x%02d, %d\n", control->rd, (int32_t)control->imm);
 
         control->alu_a_src = true;
         control->alu_b_src = true;
@@ -399,7 +623,7 @@ void control(control_t *control, uint32_t instruction)
         }
         control->imm = imm;
 
-        TRACE(TRACE_LEVEL_DEBUG, "JALR x%02d, x%02d, %d\n", control->rd, control->rs1, (int32_t)control->imm);
+        TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "JALR x%02d, x%02d, %d\n", control->rd, control->rs1, (int32_t)control->imm);
 
         control->alu_b_src = true;
         control->jump = true;
@@ -435,32 +659,32 @@ void control(control_t *control, uint32_t instruction)
 
         switch (inst.funct3) {
             case BEQ:
-                TRACE(TRACE_LEVEL_DEBUG, "BEQ x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "BEQ x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
                 control->alu_op = ALUOP_SUB;
                 control->branch_pol = 0;
                 break;
             case BNE:
-                TRACE(TRACE_LEVEL_DEBUG, "BNE x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "BNE x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
                 control->alu_op = ALUOP_SUB;
                 control->branch_pol = 1;
                 break;
             case BLT:
-                TRACE(TRACE_LEVEL_DEBUG, "BLT x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "BLT x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
                 control->alu_op = ALUOP_SLT;
                 control->branch_pol = 1;
                 break;
             case BGE:
-                TRACE(TRACE_LEVEL_DEBUG, "BGE x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "BGE x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
                 control->alu_op = ALUOP_SLT;
                 control->branch_pol = 0;
                 break;
             case BLTU:
-                TRACE(TRACE_LEVEL_DEBUG, "BLTU x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "BLTU x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
                 control->alu_op = ALUOP_SLTU;
                 control->branch_pol = 1;
                 break;
             case BGEU:
-                TRACE(TRACE_LEVEL_DEBUG, "BGEU x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "BGEU x%02d, x%02d, %d\n", control->rs1, control->rs2, (int32_t)control->imm);
                 control->alu_op = ALUOP_SLTU;
                 control->branch_pol = 0;
                 break;
@@ -468,8 +692,172 @@ void control(control_t *control, uint32_t instruction)
         break;
     }
 
+    case OP_MISC_MEM:
+    {
+        // Register fields are reserved, nothing is written
+        switch ((instruction & FUNCT3_MASK) >> FUNCT3_SHIFT)
+        {
+        case FENCE:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "FENCE\n");
+            control->fence = true;
+            break;
+        case FENCE_I:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "FENCE.I\n");
+            control->fence_i = true;
+            break;
+        default:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
+            control->halt = true;
+            break;
+        }
+        break;
+    }
+
+    case OP_AMO:
+    {
+        rtype_t inst;
+        inst.opcode = opcode;
+        inst.rd = (instruction & RD_MASK) >> RD_SHIFT;
+        inst.funct3 = (funct3_r_t)((instruction & FUNCT3_MASK) >> FUNCT3_SHIFT);
+        inst.rs1 = (instruction & RS1_MASK) >> RS1_SHIFT;
+        inst.rs2 = (instruction & RS2_MASK) >> RS2_SHIFT;
+        inst.funct7 = (funct7_r_t)((instruction & FUNCT7_MASK) >> FUNCT7_SHIFT);
+
+        control->rd = inst.rd;
+        control->rs1 = inst.rs1;
+        control->rs2 = inst.rs2;
+
+        // The aq and rl bits (funct7 bits 1:0) are ignored, every atomic
+        // operation is sequentially consistent
+        if (inst.funct3 != AMO_FUNCT3_W)
+        {
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
+            control->halt = true;
+            break;
+        }
+
+        switch (inst.funct7 >> 2)
+        {
+        case AMO_FUNCT_LR:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "LR.W x%02d, (x%02d)\n", control->rd, control->rs1);
+            control->amo = AMO_LR;
+            break;
+        case AMO_FUNCT_SC:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "SC.W x%02d, x%02d, (x%02d)\n", control->rd, control->rs2, control->rs1);
+            control->amo = AMO_SC;
+            break;
+        case AMO_FUNCT_SWAP:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AMOSWAP.W x%02d, x%02d, (x%02d)\n", control->rd, control->rs2, control->rs1);
+            control->amo = AMO_SWAP;
+            break;
+        case AMO_FUNCT_ADD:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AMOADD.W x%02d, x%02d, (x%02d)\n", control->rd, control->rs2, control->rs1);
+            control->amo = AMO_ADD;
+            break;
+        case AMO_FUNCT_XOR:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AMOXOR.W x%02d, x%02d, (x%02d)\n", control->rd, control->rs2, control->rs1);
+            control->amo = AMO_XOR;
+            break;
+        case AMO_FUNCT_AND:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AMOAND.W x%02d, x%02d, (x%02d)\n", control->rd, control->rs2, control->rs1);
+            control->amo = AMO_AND;
+            break;
+        case AMO_FUNCT_OR:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AMOOR.W x%02d, x%02d, (x%02d)\n", control->rd, control->rs2, control->rs1);
+            control->amo = AMO_OR;
+            break;
+        case AMO_FUNCT_MIN:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AMOMIN.W x%02d, x%02d, (x%02d)\n", control->rd, control->rs2, control->rs1);
+            control->amo = AMO_MIN;
+            break;
+        case AMO_FUNCT_MAX:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AMOMAX.W x%02d, x%02d, (x%02d)\n", control->rd, control->rs2, control->rs1);
+            control->amo = AMO_MAX;
+            break;
+        case AMO_FUNCT_MINU:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AMOMINU.W x%02d, x%02d, (x%02d)\n", control->rd, control->rs2, control->rs1);
+            control->amo = AMO_MINU;
+            break;
+        case AMO_FUNCT_MAXU:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "AMOMAXU.W x%02d, x%02d, (x%02d)\n", control->rd, control->rs2, control->rs1);
+            control->amo = AMO_MAXU;
+            break;
+        default:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
+            control->halt = true;
+            break;
+        }
+        break;
+    }
+
+    case OP_SYSTEM:
+    {
+        itype_t inst;
+        inst.opcode = opcode;
+        inst.rd = (instruction & RD_MASK) >> RD_SHIFT;
+        inst.rs1 = (instruction & RS1_MASK) >> RS1_SHIFT;
+        inst.imm = (instruction & IMM_I_MASK) >> IMM_I_SHIFT;
+        funct3_system_t funct3 = (funct3_system_t)((instruction & FUNCT3_MASK) >> FUNCT3_SHIFT);
+
+        control->rd = inst.rd;
+        control->rs1 = inst.rs1;
+        control->imm = inst.imm;
+
+        switch (funct3)
+        {
+        case PRIV:
+            if (inst.imm == SYSTEM_EBREAK && inst.rd == 0 && inst.rs1 == 0)
+            {
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "EBREAK\n");
+            }
+            else if (inst.imm == SYSTEM_ECALL && inst.rd == 0 && inst.rs1 == 0)
+            {
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "ECALL\n");
+                control->ecall = true;
+            }
+            else
+            {
+                TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
+            }
+            control->halt = true;
+            break;
+        case CSRRW:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "CSRRW x%02d, 0x%03X, x%02d\n", control->rd, control->imm, control->rs1);
+            control->csr_op = CSR_WRITE;
+            break;
+        case CSRRS:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "CSRRS x%02d, 0x%03X, x%02d\n", control->rd, control->imm, control->rs1);
+            control->csr_op = CSR_SET;
+            break;
+        case CSRRC:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "CSRRC x%02d, 0x%03X, x%02d\n", control->rd, control->imm, control->rs1);
+            control->csr_op = CSR_CLEAR;
+            break;
+        case CSRRWI:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "CSRRWI x%02d, 0x%03X, %d\n", control->rd, control->imm, control->rs1);
+            control->csr_op = CSR_WRITE;
+            control->csr_imm = true;
+            break;
+        case CSRRSI:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "CSRRSI x%02d, 0x%03X, %d\n", control->rd, control->imm, control->rs1);
+            control->csr_op = CSR_SET;
+            control->csr_imm = true;
+            break;
+        case CSRRCI:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "CSRRCI x%02d, 0x%03X, %d\n", control->rd, control->imm, control->rs1);
+            control->csr_op = CSR_CLEAR;
+            control->csr_imm = true;
+            break;
+        default:
+            TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
+            control->halt = true;
+            break;
+        }
+        break;
+    }
+
     default:
-        TRACE(TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
+        TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_ERROR, "Illegal Instruction 0x%08X\n", instruction);
         control->halt = true;
         break;
     }
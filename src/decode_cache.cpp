@@ -0,0 +1,177 @@
+// Caches decoded instructions per page of memory.
+
+#include "decode_cache.h"
+
+#include <string.h>
+#include "trace.h"
+
+DecodeCache::DecodeCache(RAM *ram)
+{
+    this->ram = ram;
+    last_page_number = 0xFFFFFFFF;
+    last_page = NULL;
+
+    ram->add_code_observer(this);
+}
+
+DecodeCache::~DecodeCache()
+{
+    ram->remove_code_observer(this);
+
+    for (std::unordered_map<uint32_t, decode_page_t *>::iterator it = pages.begin(); it != pages.end(); ++it)
+    {
+        delete it->second;
+    }
+}
+
+void DecodeCache::flush()
+{
+    for (std::unordered_map<uint32_t, decode_page_t *>::iterator it = pages.begin(); it != pages.end(); ++it)
+    {
+        memset(it->second->valid, 0, sizeof(it->second->valid));
+    }
+}
+
+void DecodeCache::code_written(uint32_t address, uint32_t size)
+{
+    TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "Decode cache: Invalidating 0x%08X\n", address);
+
+    // An instruction starting in the halfword before the store reaches into
+    // it, possibly from the previous page
+    uint32_t halfword = (address & ~1u) - 2;
+    uint32_t count = ((address + size - 1 - halfword) >> 1) + 1;
+    while (count > 0)
+    {
+        uint32_t first = (halfword & (RAM_PAGE_SIZE - 1)) >> 1;
+        uint32_t chunk = DECODE_ENTRIES_PER_PAGE - first < count ? DECODE_ENTRIES_PER_PAGE - first : count;
+
+        // Keep the page allocated, an instruction decoded from it may still be executing
+        std::unordered_map<uint32_t, decode_page_t *>::iterator it = pages.find(halfword >> RAM_PAGE_SHIFT);
+        if (it != pages.end())
+        {
+            for (uint32_t index = first; index < first + chunk; index++)
+            {
+                it->second->valid[index / 64] &= ~((uint64_t)1 << (index % 64));
+            }
+        }
+        halfword += chunk * 2;
+        count -= chunk;
+    }
+}
+
+void DecodeCache::set_breakpoint(uint32_t address, bool enabled)
+{
+    if (enabled)
+    {
+        breakpoints.insert(address);
+    }
+    else
+    {
+        breakpoints.erase(address);
+    }
+}
+
+decode_page_t *DecodeCache::find_page(uint32_t page_number)
+{
+    decode_page_t *page;
+
+    std::unordered_map<uint32_t, decode_page_t *>::iterator it = pages.find(page_number);
+    if (it != pages.end())
+    {
+        page = it->second;
+    }
+    else
+    {
+        page = new decode_page_t;
+        memset(page->valid, 0, sizeof(page->valid));
+        pages[page_number] = page;
+    }
+
+    last_page_number = page_number;
+    last_page = page;
+    return page;
+}
+
+void DecodeCache::decode(decode_page_t *page, uint32_t index, uint32_t pc)
+{
+    // Tell RAM to report stores to this page before caching anything from
+    // it, and to the next page too if the instruction runs into it
+    ram->mark_code_page(pc);
+    uint32_t instruction = ram->load_instruction(pc);
+    if ((instruction & 3) == 3 && (pc & (RAM_PAGE_SIZE - 1)) == RAM_PAGE_SIZE - 2)
+    {
+        ram->mark_code_page(pc + 2);
+    }
+    control(&page->entries[index], instruction);
+
+    // A breakpoint halts in place of the instruction, so nothing checks for
+    // breakpoints until one is reached
+    if (has_breakpoint(pc))
+    {
+        page->entries[index].halt = true;
+        page->entries[index].breakpoint = true;
+    }
+
+    page->valid[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+CodeCoverage::CodeCoverage()
+{
+}
+
+CodeCoverage::~CodeCoverage()
+{
+    clear();
+}
+
+void CodeCoverage::mark(uint32_t start, uint32_t end)
+{
+    for (uint32_t address = start & ~3u; address < end; address += 4)
+    {
+        uint64_t *&bits = pages[address >> RAM_PAGE_SHIFT];
+        if (bits == NULL)
+        {
+            bits = new uint64_t[COVERAGE_BITMAP_WORDS];
+            memset(bits, 0, COVERAGE_BITMAP_WORDS * sizeof(uint64_t));
+        }
+
+        uint32_t index = (address & (RAM_PAGE_SIZE - 1)) >> 2;
+        bits[index / 64] |= (uint64_t)1 << (index % 64);
+    }
+}
+
+bool CodeCoverage::overlaps(uint32_t address, uint32_t size)
+{
+    uint64_t end = (uint64_t)address + size;
+    uint64_t word = address & ~3u;
+    while (word < end)
+    {
+        // Look each page up once, stores of whole pages are common
+        uint64_t page_end = (word | (RAM_PAGE_SIZE - 1)) + 1;
+        std::unordered_map<uint32_t, uint64_t *>::iterator it = pages.find((uint32_t)(word >> RAM_PAGE_SHIFT));
+        if (it != pages.end())
+        {
+            const uint64_t *bits = it->second;
+            for (; word < end && word < page_end; word += 4)
+            {
+                uint32_t index = (word & (RAM_PAGE_SIZE - 1)) >> 2;
+                if ((bits[index / 64] >> (index % 64)) & 1)
+                {
+                    return true;
+                }
+            }
+        }
+        word = page_end;
+    }
+
+    return false;
+}
+
+void CodeCoverage::clear()
+{
+    for (std::unordered_map<uint32_t, uint64_t *>::iterator it = pages.begin(); it != pages.end(); ++it)
+    {
+        delete[] it->second;
+    }
+    pages.clear();
+}
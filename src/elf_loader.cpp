@@ -0,0 +1,308 @@
+// Loads RISC-V ELF32 executables into RAM.
+
+#include "elf_loader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "trace.h"
+#ifdef RAM_FILE_MAPPING
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const uint8_t elf_magic[4] = {0x7F, 'E', 'L', 'F'};
+
+static bool symbol_less(const elf_symbol_t &a, const elf_symbol_t &b)
+{
+    return a.value < b.value;
+}
+
+ElfLoader::ElfLoader()
+{
+    entry = 0;
+    end = 0;
+}
+
+ElfLoader::~ElfLoader()
+{
+}
+
+bool ElfLoader::is_elf(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    uint8_t magic[4];
+    bool result = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, elf_magic, sizeof(magic)) == 0;
+    fclose(file);
+    return result;
+}
+
+int ElfLoader::load(const char *filename, RAM *ram)
+{
+    const uint8_t *image;
+    size_t size;
+    int fd = -1;
+
+#ifdef RAM_FILE_MAPPING
+    // Map the whole file, segments are then mapped or copied from it
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open ELF file %s\n", filename);
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to read ELF file %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    size = (size_t)info.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to map ELF file %s\n", filename);
+        close(fd);
+        return -1;
+    }
+    image = (const uint8_t *)mapping;
+#else
+    // Read the whole file
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open ELF file %s\n", filename);
+        return -1;
+    }
+    std::vector<uint8_t> contents;
+    uint8_t buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        contents.insert(contents.end(), buffer, buffer + count);
+    }
+    fclose(file);
+    image = contents.data();
+    size = contents.size();
+#endif
+
+    int result = load_segments(image, size, fd, ram);
+    if (result == 0)
+    {
+        load_symbols(image, size);
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_INFO, "Loaded %s, entry 0x%08X, %d symbols\n", filename, entry, (int)symbols.size());
+    }
+
+#ifdef RAM_FILE_MAPPING
+    // Mapped segments keep their own references to the file
+    munmap(mapping, size);
+    close(fd);
+#endif
+
+    return result;
+}
+
+int ElfLoader::load_segments(const uint8_t *image, size_t size, int fd, RAM *ram)
+{
+    // Check the header
+    elf32_ehdr_t header;
+    if (size < sizeof(header))
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "ELF file too short\n");
+        return -1;
+    }
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.e_ident, elf_magic, sizeof(elf_magic)) != 0 || header.e_ident[4] != ELF_CLASS_32 || header.e_ident[5] != ELF_DATA_LSB)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Not a little endian ELF32 file\n");
+        return -1;
+    }
+    if (header.e_machine != ELF_MACHINE_RISCV || header.e_type != ELF_TYPE_EXEC)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Not a RISC-V executable (machine %u, type %u)\n", header.e_machine, header.e_type);
+        return -1;
+    }
+    if (header.e_phentsize < sizeof(elf32_phdr_t) || (uint64_t)header.e_phoff + (uint64_t)header.e_phnum * header.e_phentsize > size)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Bad ELF program headers\n");
+        return -1;
+    }
+
+    entry = header.e_entry;
+    end = 0;
+
+    for (int i = 0; i < header.e_phnum; i++)
+    {
+        elf32_phdr_t segment;
+        memcpy(&segment, image + header.e_phoff + i * header.e_phentsize, sizeof(segment));
+        if (segment.p_type != ELF_PT_LOAD || segment.p_memsz == 0)
+        {
+            continue;
+        }
+        if ((uint64_t)segment.p_offset + segment.p_filesz > size || segment.p_filesz > segment.p_memsz || (uint64_t)segment.p_vaddr + segment.p_memsz > 0x100000000ULL)
+        {
+            TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Bad ELF segment %d\n", i);
+            return -1;
+        }
+
+        uint32_t address = segment.p_vaddr;
+        uint64_t segment_end = (uint64_t)address + segment.p_memsz;
+        if (segment_end > end)
+        {
+            end = segment_end > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)segment_end;
+        }
+        uint64_t file_end = (uint64_t)address + segment.p_filesz;
+        const uint8_t *data = image + segment.p_offset;
+
+        // Whole pages of file data can be mapped when the file offset lines
+        // up with the address, partial pages at either end are copied
+        uint64_t map_start = ((uint64_t)address + RAM_PAGE_SIZE - 1) & ~(uint64_t)(RAM_PAGE_SIZE - 1);
+        uint64_t map_end = file_end & ~(uint64_t)(RAM_PAGE_SIZE - 1);
+        uint32_t mapped = 0;
+#ifdef RAM_FILE_MAPPING
+        if (fd >= 0 && map_end > map_start && ((segment.p_offset - address) & (RAM_PAGE_SIZE - 1)) == 0)
+        {
+            uint32_t pages = (uint32_t)((map_end - map_start) >> RAM_PAGE_SHIFT);
+            if (ram->map_file(fd, segment.p_offset + (map_start - address), (uint32_t)map_start, pages) == 0)
+            {
+                ram->write_block(address, data, (uint32_t)(map_start - address));
+                ram->write_block((uint32_t)map_end, data + (map_end - address), (uint32_t)(file_end - map_end));
+                mapped = pages << RAM_PAGE_SHIFT;
+            }
+        }
+#else
+        (void)fd;
+#endif
+        if (mapped == 0)
+        {
+            ram->write_block(address, data, segment.p_filesz);
+        }
+
+        // .bss
+        ram->clear_block((uint32_t)file_end, segment.p_memsz - segment.p_filesz);
+
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_INFO, "Segment at 0x%08X: %u bytes from file (%u mapped), %u zeroed\n", address, segment.p_filesz, mapped, segment.p_memsz - segment.p_filesz);
+    }
+
+    return 0;
+}
+
+void ElfLoader::load_symbols(const uint8_t *image, size_t size)
+{
+    symbols.clear();
+
+    elf32_ehdr_t header;
+    memcpy(&header, image, sizeof(header));
+    if (header.e_shentsize < sizeof(elf32_shdr_t) || (uint64_t)header.e_shoff + (uint64_t)header.e_shnum * header.e_shentsize > size)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_WARNING, "Bad ELF section headers, no symbols loaded\n");
+        return;
+    }
+
+    for (int i = 0; i < header.e_shnum; i++)
+    {
+        elf32_shdr_t table;
+        memcpy(&table, image + header.e_shoff + i * header.e_shentsize, sizeof(table));
+        if (table.sh_type != ELF_SHT_SYMTAB || table.sh_link >= header.e_shnum)
+        {
+            continue;
+        }
+
+        elf32_shdr_t strings;
+        memcpy(&strings, image + header.e_shoff + table.sh_link * header.e_shentsize, sizeof(strings));
+        if ((uint64_t)table.sh_offset + table.sh_size > size || (uint64_t)strings.sh_offset + strings.sh_size > size)
+        {
+            TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_WARNING, "Bad ELF symbol table\n");
+            continue;
+        }
+
+        // Entry 0 is reserved
+        for (uint32_t offset = sizeof(elf32_sym_t); offset + sizeof(elf32_sym_t) <= table.sh_size; offset += sizeof(elf32_sym_t))
+        {
+            elf32_sym_t sym;
+            memcpy(&sym, image + table.sh_offset + offset, sizeof(sym));
+
+            // Keep named symbols defined in a section, but not sections, files
+            // or absolute constants such as .equ values
+            uint8_t type = sym.st_info & 0xF;
+            if (sym.st_name == 0 || sym.st_name >= strings.sh_size || sym.st_shndx == ELF_SHN_UNDEF ||
+                sym.st_shndx >= ELF_SHN_LORESERVE || type > ELF_STT_FUNC)
+            {
+                continue;
+            }
+
+            const char *name = (const char *)image + strings.sh_offset + sym.st_name;
+            elf_symbol_t symbol;
+            symbol.name.assign(name, strnlen(name, strings.sh_size - sym.st_name));
+            symbol.value = sym.st_value;
+            symbol.size = sym.st_size;
+            symbol.type = type;
+            symbols.push_back(symbol);
+        }
+    }
+
+    std::stable_sort(symbols.begin(), symbols.end(), symbol_less);
+}
+
+uint32_t ElfLoader::get_entry()
+{
+    return entry;
+}
+
+uint32_t ElfLoader::get_end()
+{
+    return end;
+}
+
+const std::vector<elf_symbol_t> &ElfLoader::get_symbols()
+{
+    return symbols;
+}
+
+const elf_symbol_t *ElfLoader::find_symbol(const char *name)
+{
+    for (size_t i = 0; i < symbols.size(); i++)
+    {
+        if (symbols[i].name == name)
+        {
+            return &symbols[i];
+        }
+    }
+    return NULL;
+}
+
+const elf_symbol_t *ElfLoader::symbol_at(uint32_t address)
+{
+    // Last symbol at or below the address
+    elf_symbol_t key;
+    key.value = address;
+    std::vector<elf_symbol_t>::iterator it = std::upper_bound(symbols.begin(), symbols.end(), key, symbol_less);
+
+    // Prefer a sized symbol covering the address, otherwise take a label
+    const elf_symbol_t *label = NULL;
+    while (it != symbols.begin())
+    {
+        --it;
+        if (it->size != 0 && address - it->value < it->size)
+        {
+            return &*it;
+        }
+        if (it->size == 0 && label == NULL)
+        {
+            label = &*it;
+        }
+        if (label != NULL && it->value != label->value)
+        {
+            break;
+        }
+    }
+    return label;
+}
@@ -0,0 +1,395 @@
+// Runs many independent guest programs on a pool of host threads.
+
+#include "farm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include "elf_loader.h"
+#include "lockstep_engine.h"
+#include "trace.h"
+
+// Result names by stop reason, without spaces so lines split on them
+static const char *farm_result_str[] = {
+    "halted",
+    "budget",
+    "breakpoint",
+    "timeout",
+    "stopped",
+    "watchpoint",
+};
+static_assert(sizeof(farm_result_str) / sizeof(farm_result_str[0]) == STOP_REASON_COUNT, "every stop reason needs a result name");
+
+Farm::Farm(engine_t engine, uint32_t threads, uint32_t lanes)
+{
+    this->engine = engine;
+    this->lanes = lanes == 0 ? 1 : lanes > LOCKSTEP_LANES ? LOCKSTEP_LANES : lanes;
+    this->threads = threads;
+    if (this->threads == 0)
+    {
+        this->threads = std::thread::hardware_concurrency();
+    }
+    if (this->threads == 0)
+    {
+        this->threads = 1;
+    }
+    next_batch = 0;
+}
+
+Farm::~Farm()
+{
+    std::map<std::string, farm_file_t *>::iterator it;
+    for (it = files.begin(); it != files.end(); ++it)
+    {
+        delete it->second->memory;
+        delete it->second;
+    }
+}
+
+// Make a manifest path relative to the manifest's directory
+static std::string manifest_path(const std::string &directory, const char *path)
+{
+    if (path[0] == '/' || directory.empty())
+    {
+        return path;
+    }
+    return directory + path;
+}
+
+int Farm::load_manifest(const char *filename, uint64_t max_instructions)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open manifest %s\n", filename);
+        return -1;
+    }
+
+    std::string directory;
+    const char *slash = strrchr(filename, '/');
+    if (slash != NULL)
+    {
+        directory.assign(filename, slash + 1 - filename);
+    }
+
+    char line[4096];
+    int line_number = 0;
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+
+        char *save;
+        char *token = strtok_r(line, " \t\r\n", &save);
+        if (token == NULL)
+        {
+            continue;
+        }
+
+        farm_job_t job;
+        job.image = manifest_path(directory, token);
+        job.name = token;
+        job.max_instructions = max_instructions;
+        while (result == 0 && (token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+        {
+            char *end;
+            char *at = strchr(token, '@');
+            if (strncmp(token, "name=", 5) == 0)
+            {
+                job.name = token + 5;
+            }
+            else if (strncmp(token, "n=", 2) == 0)
+            {
+                job.max_instructions = strtoull(token + 2, &end, 0);
+                result = *end == '\0' ? 0 : -1;
+            }
+            else if (token[0] == 'x' && strchr(token, '=') != NULL)
+            {
+                long reg = strtol(token + 1, &end, 10);
+                uint32_t value = (uint32_t)strtoul(end + 1, &end, 0);
+                result = reg >= 1 && reg <= 31 && *end == '\0' ? 0 : -1;
+                job.registers.push_back(std::make_pair((int)reg, value));
+            }
+            else if (at != NULL)
+            {
+                *at = '\0';
+                farm_input_t input;
+                input.filename = manifest_path(directory, token);
+                input.address = (uint32_t)strtoul(at + 1, &end, 0);
+                result = *end == '\0' ? 0 : -1;
+                job.inputs.push_back(input);
+            }
+            else
+            {
+                result = -1;
+            }
+        }
+        if (result != 0)
+        {
+            TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Bad job at line %d of %s\n", line_number, filename);
+            break;
+        }
+
+        // Every file gets an entry now, so workers only ever read the map
+        std::vector<std::string> paths(1, job.image);
+        for (size_t i = 0; i < job.inputs.size(); i++)
+        {
+            paths.push_back(job.inputs[i].filename);
+        }
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            if (files.find(paths[i]) == files.end())
+            {
+                farm_file_t *entry = new farm_file_t;
+                entry->loaded = false;
+                entry->valid = false;
+                entry->memory = NULL;
+                entry->entry = 0;
+                files[paths[i]] = entry;
+            }
+        }
+        jobs.push_back(job);
+    }
+    fclose(file);
+    return result;
+}
+
+farm_file_t *Farm::get_image(const std::string &filename)
+{
+    // The map is only read once the manifest is loaded, and find() is safe
+    // to call from several threads where operator[] is not
+    farm_file_t *image = files.find(filename)->second;
+    std::lock_guard<std::mutex> guard(image->lock);
+    if (!image->loaded)
+    {
+        image->loaded = true;
+        image->memory = new RAM();
+        if (ElfLoader::is_elf(filename.c_str()))
+        {
+            ElfLoader elf;
+            image->valid = elf.load(filename.c_str(), image->memory) == 0;
+            image->entry = elf.get_entry();
+        }
+        else
+        {
+            image->valid = image->memory->load_memory_ihex(filename.c_str(), &image->entry) == 0;
+        }
+    }
+    return image->valid ? image : NULL;
+}
+
+farm_file_t *Farm::get_input(const std::string &filename)
+{
+    farm_file_t *input = files.find(filename)->second;
+    std::lock_guard<std::mutex> guard(input->lock);
+    if (!input->loaded)
+    {
+        input->loaded = true;
+        FILE *file = fopen(filename.c_str(), "rb");
+        if (file == NULL)
+        {
+            TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open input %s\n", filename.c_str());
+            return NULL;
+        }
+        uint8_t buffer[65536];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            input->data.insert(input->data.end(), buffer, buffer + count);
+        }
+        input->valid = ferror(file) == 0;
+        fclose(file);
+    }
+    return input->valid ? input : NULL;
+}
+
+void Farm::run()
+{
+    // Consecutive jobs with the same image share a batch when running in
+    // lockstep
+    batches.clear();
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        if (!batches.empty() && batches.back().second < lanes && jobs[batches.back().first].image == jobs[i].image)
+        {
+            batches.back().second++;
+        }
+        else
+        {
+            batches.push_back(std::make_pair(i, (size_t)1));
+        }
+    }
+
+    next_batch = 0;
+    results.assign(jobs.size(), farm_result_t());
+
+    // The calling thread works too
+    uint32_t count = threads < batches.size() ? threads : (uint32_t)batches.size();
+    std::vector<std::thread> pool;
+    for (uint32_t i = 1; i < count; i++)
+    {
+        pool.push_back(std::thread(&Farm::worker, this));
+    }
+    worker();
+    for (size_t i = 0; i < pool.size(); i++)
+    {
+        pool[i].join();
+    }
+}
+
+void Farm::worker()
+{
+    // Jobs alone in their batch run on the first processor, the others are
+    // only used for what the lockstep engine can't run itself
+    std::vector<RAM *> rams;
+    std::vector<Processor *> processors;
+    for (uint32_t lane = 0; lane < lanes; lane++)
+    {
+        rams.push_back(new RAM());
+        processors.push_back(new Processor(rams[lane], 0, lane == 0 ? engine : ENGINE_REFERENCE));
+    }
+    LockstepEngine *lockstep = lanes > 1 ? new LockstepEngine() : NULL;
+
+    // Batches are claimed one at a time, so long jobs don't hold up the rest
+    while (true)
+    {
+        size_t index = next_batch++;
+        if (index >= batches.size())
+        {
+            break;
+        }
+        size_t first = batches[index].first;
+        size_t count = batches[index].second;
+
+        if (count == 1)
+        {
+            if (start_job(first, rams[0], processors[0]))
+            {
+                run_result_t run = processors[0]->run(jobs[first].max_instructions);
+                finish_job(first, rams[0], processors[0], run.reason);
+            }
+            continue;
+        }
+
+        // Jobs that failed to load don't get a lane
+        std::vector<Processor *> running;
+        std::vector<uint64_t> budgets;
+        std::vector<size_t> running_jobs;
+        for (size_t job = first; job < first + count; job++)
+        {
+            uint32_t lane = (uint32_t)running.size();
+            if (start_job(job, rams[lane], processors[lane]))
+            {
+                running.push_back(processors[lane]);
+                budgets.push_back(jobs[job].max_instructions);
+                running_jobs.push_back(job);
+            }
+        }
+        lockstep->run(running.data(), budgets.data(), (uint32_t)running.size());
+        for (uint32_t lane = 0; lane < running.size(); lane++)
+        {
+            finish_job(running_jobs[lane], rams[lane], processors[lane], processors[lane]->is_halted() ? STOP_HALTED : STOP_BUDGET);
+        }
+    }
+
+    delete lockstep;
+    for (uint32_t lane = 0; lane < lanes; lane++)
+    {
+        delete processors[lane];
+        delete rams[lane];
+    }
+}
+
+bool Farm::start_job(size_t index, RAM *ram, Processor *processor)
+{
+    const farm_job_t &job = jobs[index];
+    memset(&results[index], 0, sizeof(farm_result_t));
+
+    farm_file_t *image = get_image(job.image);
+    if (image == NULL)
+    {
+        return false;
+    }
+    std::vector<farm_file_t *> inputs;
+    for (size_t i = 0; i < job.inputs.size(); i++)
+    {
+        farm_file_t *input = get_input(job.inputs[i].filename);
+        if (input == NULL)
+        {
+            return false;
+        }
+        inputs.push_back(input);
+    }
+
+    // Start from the image, with nothing left of the last job
+    ram->copy_from(image->memory);
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (!inputs[i]->data.empty())
+        {
+            ram->write_block(job.inputs[i].address, inputs[i]->data.data(), (uint32_t)inputs[i]->data.size());
+        }
+    }
+    processor->reset(image->entry);
+    processor->fence_instructions();
+    for (size_t i = 0; i < job.registers.size(); i++)
+    {
+        processor->set_register(job.registers[i].first, job.registers[i].second);
+    }
+    return true;
+}
+
+void Farm::finish_job(size_t index, RAM *ram, Processor *processor, stop_reason_t reason)
+{
+    farm_result_t &result = results[index];
+    result.loaded = true;
+    result.reason = reason;
+    result.instructions = processor->get_instruction_count();
+    result.pc = processor->get_pc();
+    result.memory_digest = ram->digest();
+    for (int reg = 0; reg < 32; reg++)
+    {
+        result.x[reg] = processor->get_register(reg);
+    }
+}
+
+int Farm::write_results(const char *filename)
+{
+    FILE *file = filename != NULL ? fopen(filename, "w") : stdout;
+    if (file == NULL)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unable to create %s\n", filename);
+        return -1;
+    }
+
+    fprintf(file, "# name result instructions pc memory x1-x31\n");
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const farm_result_t &result = results[i];
+        if (!result.loaded)
+        {
+            fprintf(file, "%s error\n", jobs[i].name.c_str());
+            continue;
+        }
+        fprintf(file, "%s %s %llu 0x%08X %016llX", jobs[i].name.c_str(), farm_result_str[result.reason],
+                (unsigned long long)result.instructions, result.pc, (unsigned long long)result.memory_digest);
+        for (int reg = 1; reg < 32; reg++)
+        {
+            fprintf(file, " %08X", result.x[reg]);
+        }
+        fprintf(file, "\n");
+    }
+
+    if (filename != NULL && fclose(file) != 0)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unable to write %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+// Test device that ends the run with an exit code.
+
+#include "finisher.h"
+
+#include "trace.h"
+
+Finisher::Finisher()
+{
+    finished = false;
+    exit_code = 0;
+}
+
+void Finisher::add_processor(Processor *processor)
+{
+    processors.push_back(processor);
+}
+
+uint32_t Finisher::read(uint32_t offset, uint32_t size)
+{
+    (void)offset;
+    (void)size;
+    return 0;
+}
+
+void Finisher::write(uint32_t offset, uint32_t value, uint32_t size)
+{
+    if (offset != 0 || size != 4)
+    {
+        return;
+    }
+    uint32_t status = value & 0xFFFF;
+    if (status != FINISHER_PASS && status != FINISHER_FAIL)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_WARNING, "Unknown finisher command 0x%08X\n", value);
+        return;
+    }
+
+    // Only the first hart to finish sets the exit code
+    bool expected = false;
+    if (!finished.compare_exchange_strong(expected, true))
+    {
+        return;
+    }
+    exit_code = status == FINISHER_PASS ? 0 : (int)(value >> 16);
+    TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_INFO, "Finished with exit code %d\n", exit_code.load());
+    for (size_t i = 0; i < processors.size(); i++)
+    {
+        processors[i]->request_stop();
+    }
+}
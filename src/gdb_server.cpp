@@ -0,0 +1,969 @@
+// GDB remote serial protocol server for one hart.
+
+#include "gdb_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "ram.h"
+#include "trace.h"
+#ifdef GDB_SERVER_SUPPORTED
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Milliseconds the accept thread waits for a connection before checking
+// whether it should stop
+#define GDB_ACCEPT_TIMEOUT 100
+
+// Register names in the order of the g packet, as GDB's RISC-V target
+// expects them
+static const char *const GDB_REGISTER_NAMES[GDB_REGISTER_COUNT] = {
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
+    "fp", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+    "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+    "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+    "pc",
+};
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+// Append a word as 8 hex digits in guest byte order
+static void append_word(std::string *output, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        uint8_t byte = (uint8_t)(value >> (8 * i));
+        *output += HEX_DIGITS[byte >> 4];
+        *output += HEX_DIGITS[byte & 0xF];
+    }
+}
+
+static int hex_value(char digit)
+{
+    if (digit >= '0' && digit <= '9')
+    {
+        return digit - '0';
+    }
+    if (digit >= 'a' && digit <= 'f')
+    {
+        return digit - 'a' + 10;
+    }
+    if (digit >= 'A' && digit <= 'F')
+    {
+        return digit - 'A' + 10;
+    }
+    return -1;
+}
+
+// Parse a byte from two hex digits at an offset (false if they aren't)
+static bool parse_byte(const std::string &text, size_t offset, uint8_t *byte)
+{
+    if (offset + 2 > text.size())
+    {
+        return false;
+    }
+    int high = hex_value(text[offset]);
+    int low = hex_value(text[offset + 1]);
+    if (high < 0 || low < 0)
+    {
+        return false;
+    }
+    *byte = (uint8_t)(high << 4 | low);
+    return true;
+}
+
+// Parse a word from 8 hex digits in guest byte order
+static bool parse_word(const std::string &text, size_t offset, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        uint8_t byte;
+        if (!parse_byte(text, offset + 2 * i, &byte))
+        {
+            return false;
+        }
+        result |= (uint32_t)byte << (8 * i);
+    }
+    *value = result;
+    return true;
+}
+
+// Parse a hex number starting at *offset, leaving *offset after it (false
+// if there are no digits)
+static bool parse_number(const std::string &text, size_t *offset, uint32_t *value)
+{
+    size_t start = *offset;
+    uint32_t result = 0;
+    while (*offset < text.size() && hex_value(text[*offset]) >= 0)
+    {
+        result = result << 4 | (uint32_t)hex_value(text[*offset]);
+        (*offset)++;
+    }
+    *value = result;
+    return *offset > start;
+}
+
+// Parse "number<separator>" (any separator if 0) and step over it
+static bool parse_field(const std::string &text, size_t *offset, uint32_t *value, char separator)
+{
+    if (!parse_number(text, offset, value))
+    {
+        return false;
+    }
+    if (separator != 0)
+    {
+        if (*offset >= text.size() || text[*offset] != separator)
+        {
+            return false;
+        }
+        (*offset)++;
+    }
+    return true;
+}
+
+static bool starts_with(const std::string &text, const char *prefix)
+{
+    return text.compare(0, strlen(prefix), prefix) == 0;
+}
+
+GdbServer::GdbServer()
+{
+    processor = NULL;
+    listen_fd = -1;
+    client_fd = -1;
+    stopping = false;
+    pending = false;
+    acknowledge = true;
+}
+
+GdbServer::~GdbServer()
+{
+    stop();
+}
+
+#ifdef GDB_SERVER_SUPPORTED
+
+int GdbServer::listen(const char *address)
+{
+    char *end;
+    unsigned long port = strtoul(address[0] == ':' ? address + 1 : address, &end, 10);
+    bool tcp = *end == '\0' && end != address;
+
+    if (tcp)
+    {
+        // Localhost only, the protocol has no authentication
+        if (port == 0 || port > 65535)
+        {
+            TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Invalid GDB port %s\n", address);
+            return -1;
+        }
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0)
+        {
+            TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unable to create a socket for GDB\n");
+            return -1;
+        }
+        int reuse = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_port = htons((uint16_t)port);
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listen_fd, (struct sockaddr *)&local, sizeof(local)) != 0 || ::listen(listen_fd, 1) != 0)
+        {
+            TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unable to listen for GDB on port %lu\n", port);
+            ::close(listen_fd);
+            listen_fd = -1;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Replace a socket left behind by an earlier run, but nothing else
+    struct sockaddr_un local;
+    memset(&local, 0, sizeof(local));
+    if (strlen(address) >= sizeof(local.sun_path))
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "GDB socket path %s too long\n", address);
+        return -1;
+    }
+    struct stat info;
+    if (lstat(address, &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        unlink(address);
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unable to create a socket for GDB\n");
+        return -1;
+    }
+    local.sun_family = AF_UNIX;
+    strcpy(local.sun_path, address);
+    if (bind(listen_fd, (struct sockaddr *)&local, sizeof(local)) != 0 || ::listen(listen_fd, 1) != 0)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unable to listen for GDB on %s\n", address);
+        ::close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    socket_path = address;
+    return 0;
+}
+
+void GdbServer::start(Processor *processor)
+{
+    this->processor = processor;
+    stopping = false;
+    accept_thread = std::thread(&GdbServer::accept_debuggers, this);
+}
+
+void GdbServer::wait_for_debugger()
+{
+    while (client_fd < 0)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unable to accept a GDB connection\n");
+            return;
+        }
+        int no_delay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        client_fd = fd;
+        pending = true;
+    }
+}
+
+void GdbServer::accept_debuggers()
+{
+    while (!stopping.load())
+    {
+        struct pollfd descriptor;
+        descriptor.fd = listen_fd;
+        descriptor.events = POLLIN;
+        descriptor.revents = 0;
+        if (poll(&descriptor, 1, GDB_ACCEPT_TIMEOUT) <= 0)
+        {
+            continue;
+        }
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        // One debugger at a time
+        if (client_fd >= 0)
+        {
+            ::close(fd);
+            continue;
+        }
+        int no_delay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        client_fd = fd;
+        pending = true;
+        processor->request_stop();
+    }
+}
+
+void GdbServer::stop()
+{
+    stopping = true;
+    if (accept_thread.joinable())
+    {
+        accept_thread.join();
+    }
+    if (client_fd >= 0)
+    {
+        ::close(client_fd);
+        client_fd = -1;
+    }
+    if (listen_fd >= 0)
+    {
+        ::close(listen_fd);
+        listen_fd = -1;
+    }
+    if (!socket_path.empty())
+    {
+        unlink(socket_path.c_str());
+        socket_path.clear();
+    }
+    pending = false;
+}
+
+gdb_outcome_t GdbServer::serve()
+{
+    pending = false;
+    acknowledge = true;
+    input.clear();
+    stop_reply = processor->is_halted() ? "W00" : "S05";
+
+    gdb_outcome_t outcome = GDB_DETACHED;
+    std::string packet;
+    std::string reply;
+    while (read_packet(&packet))
+    {
+        reply.clear();
+        bool more = handle_packet(packet, &reply, &outcome);
+
+        // A killed program doesn't answer
+        if (!(!more && outcome == GDB_KILLED) && !send_packet(reply))
+        {
+            break;
+        }
+        if (packet == "QStartNoAckMode")
+        {
+            acknowledge = false;
+        }
+        if (!more)
+        {
+            break;
+        }
+    }
+
+    disconnect();
+    TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_INFO, "GDB %s\n", outcome == GDB_KILLED ? "killed the program" : "detached");
+    return outcome;
+}
+
+bool GdbServer::read_packet(std::string *packet)
+{
+    while (true)
+    {
+        // Acknowledgements and interrupts outside packets need no answer,
+        // the hart is already stopped
+        size_t start = input.find('$');
+        if (start == std::string::npos)
+        {
+            input.clear();
+        }
+        else
+        {
+            input.erase(0, start);
+            size_t hash = input.find('#');
+            if (hash != std::string::npos && input.size() >= hash + 3)
+            {
+                uint8_t checksum = 0;
+                for (size_t i = 1; i < hash; i++)
+                {
+                    checksum += (uint8_t)input[i];
+                }
+                uint8_t expected;
+                bool valid = parse_byte(input, hash + 1, &expected) && expected == checksum;
+                *packet = input.substr(1, hash - 1);
+                input.erase(0, hash + 3);
+
+                if (acknowledge)
+                {
+                    const char *answer = valid ? "+" : "-";
+                    if (send(client_fd, answer, 1, 0) != 1)
+                    {
+                        return false;
+                    }
+                }
+                if (valid || !acknowledge)
+                {
+                    return true;
+                }
+                continue;
+            }
+        }
+
+        char buffer[GDB_PACKET_SIZE];
+        ssize_t count = recv(client_fd, buffer, sizeof(buffer), 0);
+        if (count <= 0)
+        {
+            return false;
+        }
+        input.append(buffer, (size_t)count);
+    }
+}
+
+bool GdbServer::send_packet(const std::string &data)
+{
+    uint8_t checksum = 0;
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        checksum += (uint8_t)data[i];
+    }
+    std::string frame = "$" + data + "#";
+    frame += HEX_DIGITS[checksum >> 4];
+    frame += HEX_DIGITS[checksum & 0xF];
+
+    int flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#endif
+    while (true)
+    {
+        size_t sent = 0;
+        while (sent < frame.size())
+        {
+            ssize_t count = send(client_fd, frame.data() + sent, frame.size() - sent, flags);
+            if (count <= 0)
+            {
+                return false;
+            }
+            sent += (size_t)count;
+        }
+        if (!acknowledge)
+        {
+            return true;
+        }
+
+        // Send again if the debugger asks, the next packet may already be
+        // on its way
+        while (true)
+        {
+            if (input.empty())
+            {
+                char buffer[GDB_PACKET_SIZE];
+                ssize_t count = recv(client_fd, buffer, sizeof(buffer), 0);
+                if (count <= 0)
+                {
+                    return false;
+                }
+                input.append(buffer, (size_t)count);
+            }
+            char answer = input[0];
+            if (answer == '$')
+            {
+                return true;
+            }
+            input.erase(0, 1);
+            if (answer == '+')
+            {
+                return true;
+            }
+            if (answer == '-')
+            {
+                break;
+            }
+        }
+    }
+}
+
+void GdbServer::resume(bool step)
+{
+    if (processor->is_halted())
+    {
+        stop_reply = "W00";
+        return;
+    }
+
+    // GDB resumes from a breakpoint it stopped on without removing it first
+    // when it knows the stub steps over it
+    run_result_t result;
+    result.reason = STOP_BUDGET;
+    bool stepped = false;
+    if (processor->has_breakpoint(processor->get_pc()))
+    {
+        result = processor->step_over();
+        stepped = true;
+    }
+
+    bool interrupted = false;
+    if (step)
+    {
+        if (!stepped)
+        {
+            result = processor->run(1);
+        }
+    }
+    else if (!processor->is_halted() && result.reason == STOP_BUDGET)
+    {
+        // Run in slices, looking for an interrupt from the debugger in between
+        while (true)
+        {
+            result = processor->run_for(GDB_POLL_INTERVAL);
+            if (result.reason != STOP_TIMEOUT)
+            {
+                break;
+            }
+
+            struct pollfd descriptor;
+            descriptor.fd = client_fd;
+            descriptor.events = POLLIN;
+            descriptor.revents = 0;
+            if (poll(&descriptor, 1, 0) > 0)
+            {
+                char buffer[GDB_PACKET_SIZE];
+                ssize_t count = recv(client_fd, buffer, sizeof(buffer), 0);
+                if (count <= 0)
+                {
+                    // Gone, the next read ends the session
+                    interrupted = true;
+                    break;
+                }
+                input.append(buffer, (size_t)count);
+                size_t interrupt = input.find('\x03');
+                if (interrupt != std::string::npos)
+                {
+                    input.erase(interrupt, 1);
+                    interrupted = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    char reply[32];
+    if (processor->is_halted())
+    {
+        snprintf(reply, sizeof(reply), "W00");
+    }
+    else if (result.reason == STOP_BREAKPOINT)
+    {
+        std::map<uint32_t, gdb_breakpoint_t>::iterator it = breakpoints.find(processor->get_pc());
+        bool hardware = it != breakpoints.end() && it->second == GDB_BREAKPOINT_HARDWARE;
+        snprintf(reply, sizeof(reply), "T%02x%s:;", GDB_SIGTRAP, hardware ? "hwbreak" : "swbreak");
+    }
+    else if (result.reason == STOP_WATCHPOINT)
+    {
+        // Change watchpoints from the command line look like write ones
+        const watch_hit_t &hit = processor->get_watch_hit();
+        const char *name = "watch";
+        if (hit.watch.kinds == RAM_WATCH_READ)
+        {
+            name = "rwatch";
+        }
+        else if (hit.watch.kinds == RAM_WATCH_ACCESS)
+        {
+            name = "awatch";
+        }
+        snprintf(reply, sizeof(reply), "T%02x%s:%x;", GDB_SIGTRAP, name, hit.address);
+    }
+    else if (interrupted || result.reason == STOP_REQUESTED || result.reason == STOP_TIMEOUT)
+    {
+        snprintf(reply, sizeof(reply), "S%02x", GDB_SIGINT);
+    }
+    else
+    {
+        snprintf(reply, sizeof(reply), "S%02x", GDB_SIGTRAP);
+    }
+    stop_reply = reply;
+}
+
+bool GdbServer::handle_packet(const std::string &packet, std::string *reply, gdb_outcome_t *outcome)
+{
+    char command = packet.empty() ? '\0' : packet[0];
+    size_t offset = 1;
+    uint32_t address;
+    uint32_t length;
+    uint32_t value;
+
+    switch (command)
+    {
+    case '?':
+        *reply = stop_reply;
+        break;
+
+    case 'g':
+        *reply = read_registers();
+        break;
+
+    case 'G':
+        *reply = write_registers(packet.substr(1)) ? "OK" : "E01";
+        break;
+
+    case 'p':
+        if (!parse_number(packet, &offset, &value) || value >= GDB_REGISTER_COUNT)
+        {
+            *reply = "E01";
+            break;
+        }
+        append_word(reply, value == GDB_REGISTER_PC ? processor->get_pc() : processor->get_register((int)value));
+        break;
+
+    case 'P':
+    {
+        uint32_t reg;
+        if (!parse_field(packet, &offset, &reg, '=') || reg >= GDB_REGISTER_COUNT || !parse_word(packet, offset, &value))
+        {
+            *reply = "E01";
+            break;
+        }
+        if (reg == GDB_REGISTER_PC)
+        {
+            processor->pc = value;
+        }
+        else
+        {
+            processor->set_register((int)reg, value);
+        }
+        *reply = "OK";
+        break;
+    }
+
+    case 'm':
+        if (!parse_field(packet, &offset, &address, ',') || !parse_field(packet, &offset, &length, 0))
+        {
+            *reply = "E01";
+            break;
+        }
+        *reply = read_memory(address, length);
+        break;
+
+    case 'M':
+        if (!parse_field(packet, &offset, &address, ',') || !parse_field(packet, &offset, &length, ':') ||
+            !write_memory(address, length, packet.substr(offset)))
+        {
+            *reply = "E01";
+            break;
+        }
+        *reply = "OK";
+        break;
+
+    case 'c':
+    case 's':
+        // An address says where to resume
+        if (parse_number(packet, &offset, &address))
+        {
+            processor->pc = address;
+        }
+        resume(command == 's');
+        *reply = stop_reply;
+        break;
+
+    case 'C':
+    case 'S':
+        // Signals mean nothing to the hart: sig[;addr]
+        if (parse_field(packet, &offset, &value, 0) && offset < packet.size() && packet[offset] == ';')
+        {
+            offset++;
+            if (parse_number(packet, &offset, &address))
+            {
+                processor->pc = address;
+            }
+        }
+        resume(command == 'S');
+        *reply = stop_reply;
+        break;
+
+    case 'Z':
+    case 'z':
+    {
+        // type,addr,kind where kind is a length for watchpoints
+        uint32_t type;
+        if (!parse_field(packet, &offset, &type, ',') || !parse_field(packet, &offset, &address, ',') ||
+            !parse_field(packet, &offset, &length, 0))
+        {
+            *reply = "E01";
+            break;
+        }
+        if (type >= GDB_WATCHPOINT_WRITE && type <= GDB_WATCHPOINT_ACCESS)
+        {
+            uint32_t kinds = type == GDB_WATCHPOINT_WRITE ? RAM_WATCH_WRITE : type == GDB_WATCHPOINT_READ ? RAM_WATCH_READ
+                                                                                                           : RAM_WATCH_ACCESS;
+            // A zero length still watches the byte at the address, use the
+            // same length for the RAM and the bookkeeping so z undoes Z
+            if (length == 0)
+            {
+                length = 1;
+            }
+            ram_watch_t watch;
+            watch.start = address;
+            watch.last = address + length - 1;
+            watch.kinds = kinds;
+            if (command == 'Z')
+            {
+                watchpoints.push_back(watch);
+                processor->add_watchpoint(address, length, kinds);
+            }
+            else
+            {
+                for (size_t i = 0; i < watchpoints.size(); i++)
+                {
+                    if (watchpoints[i].start == watch.start && watchpoints[i].last == watch.last && watchpoints[i].kinds == kinds)
+                    {
+                        watchpoints.erase(watchpoints.begin() + i);
+                        processor->remove_watchpoint(address, length, kinds);
+                        break;
+                    }
+                }
+            }
+            *reply = "OK";
+            break;
+        }
+        if (type != GDB_BREAKPOINT_SOFTWARE && type != GDB_BREAKPOINT_HARDWARE)
+        {
+            break;
+        }
+        if (command == 'Z')
+        {
+            breakpoints[address] = (gdb_breakpoint_t)type;
+            processor->add_breakpoint(address);
+        }
+        else if (breakpoints.erase(address) != 0)
+        {
+            processor->remove_breakpoint(address);
+        }
+        *reply = "OK";
+        break;
+    }
+
+    case 'D':
+        *reply = "OK";
+        *outcome = GDB_DETACHED;
+        return false;
+
+    case 'k':
+        *outcome = GDB_KILLED;
+        return false;
+
+    case 'H':
+    case 'T':
+        // The hart is the only thread
+        *reply = "OK";
+        break;
+
+    case 'q':
+        if (starts_with(packet, "qSupported"))
+        {
+            char features[128];
+            snprintf(features, sizeof(features), "PacketSize=%x;qXfer:features:read+;swbreak+;hwbreak+;QStartNoAckMode+", GDB_PACKET_SIZE);
+            *reply = features;
+        }
+        else if (packet == "qAttached")
+        {
+            // Detach rather than kill when GDB quits
+            *reply = "1";
+        }
+        else if (packet == "qC")
+        {
+            *reply = "QC1";
+        }
+        else if (packet == "qfThreadInfo")
+        {
+            *reply = "m1";
+        }
+        else if (packet == "qsThreadInfo")
+        {
+            *reply = "l";
+        }
+        else if (starts_with(packet, "qXfer:features:read:"))
+        {
+            // qXfer:features:read:annex:offset,length
+            size_t colon = packet.find(':', strlen("qXfer:features:read:"));
+            offset = colon + 1;
+            if (colon == std::string::npos || !parse_field(packet, &offset, &address, ',') || !parse_field(packet, &offset, &length, 0))
+            {
+                *reply = "E01";
+                break;
+            }
+            size_t annex_start = strlen("qXfer:features:read:");
+            *reply = target_description(packet.substr(annex_start, colon - annex_start), address, length);
+        }
+        break;
+
+    case 'Q':
+        if (packet == "QStartNoAckMode")
+        {
+            *reply = "OK";
+        }
+        break;
+
+    case 'v':
+        if (packet == "vCont?")
+        {
+            *reply = "vCont;c;C;s;S";
+        }
+        else if (starts_with(packet, "vCont;"))
+        {
+            // With one thread only the first action matters
+            char action = packet.size() > 6 ? packet[6] : 'c';
+            resume(action == 's' || action == 'S');
+            *reply = stop_reply;
+        }
+        else if (starts_with(packet, "vKill"))
+        {
+            *reply = "OK";
+            *outcome = GDB_KILLED;
+            return false;
+        }
+        break;
+
+    default:
+        // Anything else is unsupported, which an empty reply says
+        break;
+    }
+
+    return true;
+}
+
+std::string GdbServer::read_registers()
+{
+    std::string output;
+    for (int i = 0; i < 32; i++)
+    {
+        append_word(&output, processor->get_register(i));
+    }
+    append_word(&output, processor->get_pc());
+    return output;
+}
+
+bool GdbServer::write_registers(const std::string &data)
+{
+    uint32_t values[GDB_REGISTER_COUNT];
+    for (int i = 0; i < GDB_REGISTER_COUNT; i++)
+    {
+        if (!parse_word(data, 8 * i, &values[i]))
+        {
+            return false;
+        }
+    }
+    for (int i = 1; i < 32; i++)
+    {
+        processor->set_register(i, values[i]);
+    }
+    processor->pc = values[GDB_REGISTER_PC];
+    return true;
+}
+
+std::string GdbServer::read_memory(uint32_t address, uint32_t length)
+{
+    // Two hex digits per byte have to fit in a packet
+    if (length > GDB_PACKET_SIZE / 2)
+    {
+        length = GDB_PACKET_SIZE / 2;
+    }
+    std::string output;
+    output.reserve(2 * length);
+    for (uint32_t i = 0; i < length; i++)
+    {
+        uint8_t byte = processor->ram->load_byte<false>(address + i);
+        output += HEX_DIGITS[byte >> 4];
+        output += HEX_DIGITS[byte & 0xF];
+    }
+    return output;
+}
+
+bool GdbServer::write_memory(uint32_t address, uint32_t length, const std::string &data)
+{
+    if (data.size() != 2 * (size_t)length)
+    {
+        return false;
+    }
+
+    // Stores tell the decode cache and the engines about code they change
+    for (uint32_t i = 0; i < length; i++)
+    {
+        uint8_t byte;
+        if (!parse_byte(data, 2 * i, &byte))
+        {
+            return false;
+        }
+        processor->ram->store_byte<false>(address + i, byte);
+    }
+    return true;
+}
+
+std::string GdbServer::target_description(const std::string &annex, uint32_t offset, uint32_t length)
+{
+    if (annex != "target.xml")
+    {
+        return "E00";
+    }
+
+    std::string xml = "<?xml version=\"1.0\"?>\n"
+                      "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+                      "<target version=\"1.0\">\n"
+                      "<architecture>riscv:rv32</architecture>\n"
+                      "<feature name=\"org.gnu.gdb.riscv.cpu\">\n";
+    for (int i = 0; i < GDB_REGISTER_COUNT; i++)
+    {
+        const char *type = "int";
+        if (i == 1 || i == GDB_REGISTER_PC)
+        {
+            type = "code_ptr";
+        }
+        else if (i >= 2 && i <= 4)
+        {
+            type = "data_ptr";
+        }
+        char line[96];
+        snprintf(line, sizeof(line), "<reg name=\"%s\" bitsize=\"32\" type=\"%s\" regnum=\"%d\"/>\n", GDB_REGISTER_NAMES[i], type, i);
+        xml += line;
+    }
+    xml += "</feature>\n</target>\n";
+
+    // m says there is more, l that this is the last part
+    if (offset >= xml.size())
+    {
+        return "l";
+    }
+    if (length > GDB_PACKET_SIZE - 1)
+    {
+        length = GDB_PACKET_SIZE - 1;
+    }
+    std::string part = xml.substr(offset, length);
+    return (offset + part.size() < xml.size() ? "m" : "l") + part;
+}
+
+void GdbServer::disconnect()
+{
+    for (std::map<uint32_t, gdb_breakpoint_t>::iterator it = breakpoints.begin(); it != breakpoints.end(); ++it)
+    {
+        processor->remove_breakpoint(it->first);
+    }
+    breakpoints.clear();
+    for (size_t i = 0; i < watchpoints.size(); i++)
+    {
+        const ram_watch_t &watch = watchpoints[i];
+        processor->remove_watchpoint(watch.start, watch.last - watch.start + 1, watch.kinds);
+    }
+    watchpoints.clear();
+    input.clear();
+    int fd = client_fd.exchange(-1);
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+#else
+
+int GdbServer::listen(const char *address)
+{
+    (void)address;
+    TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "GDB server not supported on this host\n");
+    return -1;
+}
+
+void GdbServer::start(Processor *processor)
+{
+    this->processor = processor;
+}
+
+void GdbServer::wait_for_debugger()
+{
+}
+
+void GdbServer::stop()
+{
+}
+
+gdb_outcome_t GdbServer::serve()
+{
+    pending = false;
+    return GDB_DETACHED;
+}
+
+#endif // GDB_SERVER_SUPPORTED
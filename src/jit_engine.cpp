@@ -0,0 +1,1089 @@
+// Translates basic blocks to x86-64 machine code.
+
+#include "jit_engine.h"
+
+#ifdef JIT_SUPPORTED
+
+#include <stddef.h>
+#include <sys/mman.h>
+#include "processor.h"
+#include "register_file.h"
+#include "trace.h"
+#include "x86_emitter.h"
+
+// Host registers pinned by translated code
+#define JIT_REG_X X86_RBX          // Guest register file
+#define JIT_REG_CONTEXT X86_R12    // jit_context_t
+#define JIT_REG_READ_TLB X86_R13   // RAM read TLB
+#define JIT_REG_WRITE_TLB X86_R14  // RAM write TLB
+
+// Room a single block can need, translation flushes the buffer below this
+#define JIT_MAX_BLOCK_CODE (THREADED_MAX_BLOCK_LENGTH * 256 + 512)
+
+// The TLB lookup scales the index with a shift
+static_assert(sizeof(ram_tlb_entry_t) == 16, "TLB entries must be 16 bytes");
+
+// Offset of a guest register from JIT_REG_X
+#define GUEST(reg) ((int32_t)(reg) * 4)
+
+// Offset of a context field from JIT_REG_CONTEXT
+#define CONTEXT(field) ((int32_t)offsetof(jit_context_t, field))
+
+// Slow path helpers called from translated code
+
+static uint32_t jit_load_byte(jit_context_t *context, uint32_t address)
+{
+    return (uint32_t)(int32_t)(int8_t)context->ram->load_byte(address);
+}
+
+static uint32_t jit_load_byte_unsigned(jit_context_t *context, uint32_t address)
+{
+    return context->ram->load_byte(address);
+}
+
+static uint32_t jit_load_halfword(jit_context_t *context, uint32_t address)
+{
+    return (uint32_t)(int32_t)(int16_t)context->ram->load_halfword(address);
+}
+
+static uint32_t jit_load_halfword_unsigned(jit_context_t *context, uint32_t address)
+{
+    return context->ram->load_halfword(address);
+}
+
+static uint32_t jit_load_word(jit_context_t *context, uint32_t address)
+{
+    return context->ram->load_word(address);
+}
+
+// Stores return non-zero if they wrote over translated code
+
+static uint32_t jit_store_byte(jit_context_t *context, uint32_t address, uint32_t data)
+{
+    context->ram->store_byte(address, (uint8_t)data);
+    return context->code_modified;
+}
+
+static uint32_t jit_store_halfword(jit_context_t *context, uint32_t address, uint32_t data)
+{
+    context->ram->store_halfword(address, (uint16_t)data);
+    return context->code_modified;
+}
+
+static uint32_t jit_store_word(jit_context_t *context, uint32_t address, uint32_t data)
+{
+    context->ram->store_word(address, data);
+    return context->code_modified;
+}
+
+static void jit_profile_jump(Profiler *profiler, uint32_t kind, uint32_t target)
+{
+    profiler->jump((profile_jump_t)kind, target);
+}
+
+// Exit stubs a block still needs after its body has been emitted
+typedef struct
+{
+    uint8_t *site;      // rel32 to point at the stub
+    jit_exit_t reason;  // Exit reason
+    uint32_t pc;        // Guest PC to resume at
+    uint32_t refund;    // Counted instructions that did not run
+    bool chain;         // Site can later be patched to the target block
+} jit_stub_t;
+
+// Add (X86_ADD) or take back (X86_SUB) the events of some ops
+static void emit_count_events(X86Emitter &emit, const threaded_op_t *ops, uint32_t count, x86_alu_t alu)
+{
+    uint32_t events[HPM_EVENT_COUNT] = {0};
+    bool any = false;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (ops[i].kind != THREADED_OP_END && ops[i].event != HPM_EVENT_NONE)
+        {
+            events[ops[i].event]++;
+            any = true;
+        }
+    }
+    if (!any)
+    {
+        return;
+    }
+    emit.mov_load64(X86_RAX, JIT_REG_CONTEXT, CONTEXT(event_counts));
+    for (int event = HPM_EVENT_NONE + 1; event < HPM_EVENT_COUNT; event++)
+    {
+        if (events[event] != 0)
+        {
+            emit.alu_mem_imm(alu, X86_RAX, event * (int32_t)sizeof(uint64_t), events[event], true);
+        }
+    }
+}
+
+// Tell a profiler about the call or return to the target in EDX
+static void emit_profile_jump(X86Emitter &emit, Profiler *profiler, profile_jump_t kind)
+{
+    emit.mov_imm64(X86_RDI, (uint64_t)profiler);
+    emit.mov_imm(X86_RSI, kind);
+    emit.mov_imm64(X86_RAX, (uint64_t)jit_profile_jump);
+    emit.call_reg(X86_RAX);
+}
+
+// Look the address in ESI up in a RAM TLB. On a hit RAX holds the host page
+// and RCX the offset into it. Returns the jump taken on a miss.
+static uint8_t *emit_tlb_lookup(X86Emitter &emit, x86_reg_t tlb)
+{
+    emit.mov_reg(X86_RCX, X86_RSI);
+    emit.shift_imm(X86_SHR, X86_RCX, RAM_PAGE_SHIFT);
+    emit.mov_reg(X86_RAX, X86_RCX);
+    emit.alu_imm(X86_AND, X86_RAX, RAM_TLB_ENTRIES - 1);
+    emit.shift_imm(X86_SHL, X86_RAX, 4);
+    emit.alu_reg(X86_ADD, X86_RAX, tlb, true);
+    emit.op_reg_mem(0x3B, X86_RCX, X86_RAX, (int32_t)offsetof(ram_tlb_entry_t, tag));
+    uint8_t *miss = emit.jcc(X86_CC_NE, emit.position());
+    emit.mov_load64(X86_RAX, X86_RAX, (int32_t)offsetof(ram_tlb_entry_t, words));
+    emit.mov_reg(X86_RCX, X86_RSI);
+    emit.alu_imm(X86_AND, X86_RCX, RAM_PAGE_SIZE - 1);
+    return miss;
+}
+
+bool JitEngine::supported()
+{
+    return true;
+}
+
+JitEngine::JitEngine(Processor *processor, RAM *ram, DecodeCache *decode_cache)
+{
+    this->processor = processor;
+    this->ram = ram;
+    this->decode_cache = decode_cache;
+    flush_pending = false;
+    events_counted = false;
+
+    memset(&context, 0, sizeof(context));
+    context.ram = ram;
+    context.engine = this;
+    context.read_tlb = ram->read_tlb;
+    context.write_tlb = ram->write_tlb;
+    context.x = processor->registers.data();
+    context.event_counts = processor->event_counts;
+
+    // Hosts that enforce W^X refuse memory that is writable and executable
+    // at once, so the buffer starts writable and flips between the two
+    code_buffer = (uint8_t *)mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    code_writable = true;
+    if (code_buffer == MAP_FAILED)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "JIT: Unable to map code buffer\n");
+        code_buffer = NULL;
+        code_end = NULL;
+        code_free = NULL;
+    }
+    else
+    {
+        code_end = code_buffer + JIT_CODE_SIZE;
+        emit_trampolines();
+
+        // Find out now whether the host lets the buffer run at all
+        make_code_executable();
+    }
+
+    clear_jump_cache();
+    ram->add_code_observer(this);
+}
+
+JitEngine::~JitEngine()
+{
+    ram->remove_code_observer(this);
+
+    for (std::unordered_map<uint32_t, jit_block_t *>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        delete it->second;
+    }
+
+    if (code_buffer != NULL)
+    {
+        munmap(code_buffer, JIT_CODE_SIZE);
+    }
+}
+
+bool JitEngine::has_code_buffer()
+{
+    return code_buffer != NULL;
+}
+
+bool JitEngine::make_code_writable()
+{
+    return code_buffer != NULL && (code_writable || protect_code(PROT_READ | PROT_WRITE));
+}
+
+bool JitEngine::make_code_executable()
+{
+    return code_buffer != NULL && (!code_writable || protect_code(PROT_READ | PROT_EXEC));
+}
+
+bool JitEngine::protect_code(int protection)
+{
+    if (mprotect(code_buffer, JIT_CODE_SIZE, protection) != 0)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "JIT: Unable to change the code buffer protection\n");
+        release_code_buffer();
+        return false;
+    }
+    code_writable = (protection & PROT_WRITE) != 0;
+    return true;
+}
+
+void JitEngine::release_code_buffer()
+{
+    for (std::unordered_map<uint32_t, jit_block_t *>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        delete it->second;
+    }
+    blocks.clear();
+    coverage.clear();
+    pending_writes.clear();
+    context.code_modified = false;
+    flush_pending = false;
+
+    munmap(code_buffer, JIT_CODE_SIZE);
+    code_buffer = NULL;
+    code_end = NULL;
+    code_free = NULL;
+    indirect_miss_code = NULL;
+    clear_jump_cache();
+}
+
+void JitEngine::emit_trampolines()
+{
+    X86Emitter emit(code_buffer, code_end);
+
+    // uint32_t enter(jit_context_t *context, uint8_t *code)
+    enter = (uint32_t(*)(jit_context_t *, uint8_t *))emit.position();
+    emit.push(X86_RBX);
+    emit.push(X86_RBP);
+    emit.push(X86_R12);
+    emit.push(X86_R13);
+    emit.push(X86_R14);
+    emit.push(X86_R15);
+    // Keep the stack 16 byte aligned for helper calls
+    emit.alu_imm(X86_SUB, X86_RSP, 8, true);
+    emit.mov_reg(JIT_REG_CONTEXT, X86_RDI, true);
+    emit.mov_load64(JIT_REG_X, JIT_REG_CONTEXT, CONTEXT(x));
+    emit.mov_load64(JIT_REG_READ_TLB, JIT_REG_CONTEXT, CONTEXT(read_tlb));
+    emit.mov_load64(JIT_REG_WRITE_TLB, JIT_REG_CONTEXT, CONTEXT(write_tlb));
+    emit.jmp_reg(X86_RSI);
+
+    // Every exit lands here with the reason in EAX
+    exit_code = emit.position();
+    emit.alu_imm(X86_ADD, X86_RSP, 8, true);
+    emit.pop(X86_R15);
+    emit.pop(X86_R14);
+    emit.pop(X86_R13);
+    emit.pop(X86_R12);
+    emit.pop(X86_RBP);
+    emit.pop(X86_RBX);
+    emit.ret();
+
+    indirect_miss_code = emit.position();
+    emit.mov_imm(X86_RAX, JIT_EXIT_INDIRECT);
+    emit.jmp(exit_code);
+
+    code_free = emit.position();
+}
+
+void JitEngine::clear_jump_cache()
+{
+    for (int i = 0; i < JIT_JUMP_CACHE_SIZE; i++)
+    {
+        // A miss entry sends any target back to the dispatcher
+        context.jump_cache[i].pc = 0xFFFFFFFF;
+        context.jump_cache[i].code = indirect_miss_code;
+    }
+}
+
+void JitEngine::flush()
+{
+    for (std::unordered_map<uint32_t, jit_block_t *>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        delete it->second;
+    }
+    blocks.clear();
+    coverage.clear();
+    pending_writes.clear();
+    context.code_modified = false;
+    flush_pending = false;
+    clear_jump_cache();
+
+    if (code_buffer != NULL && make_code_writable())
+    {
+        emit_trampolines();
+    }
+}
+
+void JitEngine::code_written(uint32_t address, uint32_t size)
+{
+    // Data on the same page as code is not interesting
+    if (!coverage.overlaps(address, size))
+    {
+        return;
+    }
+
+    // Translations can't be dropped here, the store may come from one of them
+    pending_writes.push_back(std::make_pair(address, size));
+    context.code_modified = true;
+}
+
+void JitEngine::request_stop()
+{
+    context.stop = 1;
+}
+
+void JitEngine::watch_hit()
+{
+    context.watch_pending = true;
+}
+
+void JitEngine::device_written()
+{
+    // The store helpers already leave translated code on a code write, and
+    // the stop is seen on the way back in
+    if (processor->stop_requested.load(std::memory_order_relaxed))
+    {
+        context.code_modified = true;
+    }
+}
+
+void JitEngine::fence_instructions()
+{
+    // Stores from other harts are not tracked, so everything goes
+    flush_pending = true;
+    context.code_modified = true;
+}
+
+void JitEngine::stop_at(uint32_t address)
+{
+    // Drop the block running through the address, and the one starting there
+    // in case it was chained to since the last stop_at()
+    stop_points.insert(address);
+    code_written(address, 4);
+}
+
+void JitEngine::clear_stop(uint32_t address)
+{
+    // Drop the block ending at the address so it is translated through it
+    // again, along with the one starting there
+    if (stop_points.erase(address) != 0)
+    {
+        code_written(address - 2, 4);
+    }
+}
+
+bool JitEngine::process_invalidations()
+{
+    if (!context.code_modified)
+    {
+        return false;
+    }
+    if (flush_pending)
+    {
+        flush();
+        return true;
+    }
+    context.code_modified = false;
+
+    std::vector<jit_block_t *> dead;
+    for (std::unordered_map<uint32_t, jit_block_t *>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        jit_block_t *block = it->second;
+        for (size_t i = 0; i < pending_writes.size(); i++)
+        {
+            uint32_t address = pending_writes[i].first;
+            uint32_t size = pending_writes[i].second;
+            if (address < block->end_pc && address + size > block->start_pc)
+            {
+                dead.push_back(block);
+                break;
+            }
+        }
+    }
+    pending_writes.clear();
+
+    if (dead.empty())
+    {
+        return false;
+    }
+
+    TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "JIT: Dropping %d translations\n", (int)dead.size());
+    if (!make_code_writable())
+    {
+        return true;
+    }
+
+    for (size_t i = 0; i < dead.size(); i++)
+    {
+        // Point every linked jump back at its exit stub. The code itself stays
+        // in the buffer until the next flush.
+        for (size_t j = 0; j < dead[i]->incoming.size(); j++)
+        {
+            X86Emitter::patch(dead[i]->incoming[j].first, dead[i]->incoming[j].second);
+        }
+        blocks.erase(dead[i]->start_pc);
+        delete dead[i];
+    }
+    clear_jump_cache();
+
+    return true;
+}
+
+jit_block_t *JitEngine::translate_block(uint32_t pc)
+{
+    // Decode the block first so its length is known
+    std::vector<threaded_op_t> ops;
+    uint32_t length = 0;
+    uint32_t address = pc;
+    while (true)
+    {
+        threaded_op_t op;
+        ThreadedEngine::translate(&op, *decode_cache->lookup(address), address);
+        if (op.kind == THREADED_OP_GENERIC)
+        {
+            // Left to the reference datapath, which counts it itself
+            break;
+        }
+
+        ops.push_back(op);
+        length++;
+        address = op.link;
+
+        if ((op.kind >= THREADED_OP_BEQ && op.kind <= THREADED_OP_JALR) || op.kind == THREADED_OP_HALT)
+        {
+            break;
+        }
+
+        // Stop at page boundaries so a block only depends on one page, and
+        // before stop points so run_until() can catch them between blocks
+        if (length == THREADED_MAX_BLOCK_LENGTH || (address >> RAM_PAGE_SHIFT) != (pc >> RAM_PAGE_SHIFT) || stop_points.count(address) != 0)
+        {
+            threaded_op_t end;
+            end.kind = THREADED_OP_END;
+            end.length = 0;
+            end.link = address;
+            end.event = HPM_EVENT_NONE;
+            ops.push_back(end);
+            break;
+        }
+    }
+
+    if (length == 0)
+    {
+        return NULL;
+    }
+
+    if ((size_t)(code_end - code_free) < JIT_MAX_BLOCK_CODE)
+    {
+        TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_INFO, "JIT: Code buffer full, flushing\n");
+        flush();
+    }
+    if (!make_code_writable())
+    {
+        return NULL;
+    }
+
+    X86Emitter emit(code_free, code_end);
+    std::vector<jit_stub_t> stubs;
+
+    jit_block_t *block = new jit_block_t;
+    block->start_pc = pc;
+    block->end_pc = address;
+    block->code = emit.position();
+
+    // Leave before running anything if the budget can't cover the block or
+    // a stop was requested
+    emit.alu_mem_imm(X86_CMP, JIT_REG_CONTEXT, CONTEXT(budget), length, true);
+    jit_stub_t budget_stub = {emit.jcc(X86_CC_L, emit.position()), JIT_EXIT_BUDGET, pc, 0, false};
+    stubs.push_back(budget_stub);
+    emit.cmp_byte_mem(JIT_REG_CONTEXT, CONTEXT(stop), 0);
+    jit_stub_t stop_stub = {emit.jcc(X86_CC_NE, emit.position()), JIT_EXIT_BUDGET, pc, 0, false};
+    stubs.push_back(stop_stub);
+    emit.alu_mem_imm(X86_SUB, JIT_REG_CONTEXT, CONTEXT(budget), length, true);
+
+    // Events are counted for the whole block on entry, only taken branches
+    // as they happen
+    if (events_counted)
+    {
+        emit_count_events(emit, &ops[0], length, X86_ADD);
+    }
+
+    for (uint32_t i = 0; i < ops.size(); i++)
+    {
+        const threaded_op_t &op = ops[i];
+        uint32_t op_pc = op.link - op.length;
+
+        switch (op.kind)
+        {
+        case THREADED_OP_NOP:
+            break;
+        case THREADED_OP_LI:
+            emit.mov_store_imm(JIT_REG_X, GUEST(op.rd), op.imm);
+            break;
+
+        case THREADED_OP_ADDI:
+        case THREADED_OP_XORI:
+        case THREADED_OP_ORI:
+        case THREADED_OP_ANDI:
+        {
+            x86_alu_t alu = op.kind == THREADED_OP_ADDI ? X86_ADD : op.kind == THREADED_OP_XORI ? X86_XOR
+                                                                : op.kind == THREADED_OP_ORI    ? X86_OR
+                                                                                                : X86_AND;
+            emit.mov_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+            emit.alu_imm(alu, X86_RAX, op.imm);
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RAX);
+            break;
+        }
+
+        case THREADED_OP_SLTI:
+        case THREADED_OP_SLTIU:
+            emit.alu_reg(X86_XOR, X86_RCX, X86_RCX);
+            emit.mov_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+            emit.alu_imm(X86_CMP, X86_RAX, op.imm);
+            emit.setcc(op.kind == THREADED_OP_SLTI ? X86_CC_L : X86_CC_B, X86_RCX);
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RCX);
+            break;
+
+        case THREADED_OP_SLLI:
+        case THREADED_OP_SRLI:
+        case THREADED_OP_SRAI:
+            emit.mov_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+            emit.shift_imm(op.kind == THREADED_OP_SLLI ? X86_SHL : op.kind == THREADED_OP_SRLI ? X86_SHR
+                                                                                                 : X86_SAR,
+                           X86_RAX, (uint8_t)op.imm);
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RAX);
+            break;
+
+        case THREADED_OP_ADD:
+        case THREADED_OP_SUB:
+        case THREADED_OP_AND:
+        case THREADED_OP_OR:
+        case THREADED_OP_XOR:
+        {
+            x86_alu_t alu = op.kind == THREADED_OP_ADD ? X86_ADD : op.kind == THREADED_OP_SUB ? X86_SUB
+                                                               : op.kind == THREADED_OP_AND   ? X86_AND
+                                                               : op.kind == THREADED_OP_OR    ? X86_OR
+                                                                                              : X86_XOR;
+            emit.mov_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+            emit.alu_load(alu, X86_RAX, JIT_REG_X, GUEST(op.rs2));
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RAX);
+            break;
+        }
+
+        case THREADED_OP_SLT:
+        case THREADED_OP_SLTU:
+            emit.alu_reg(X86_XOR, X86_RCX, X86_RCX);
+            emit.mov_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+            emit.alu_load(X86_CMP, X86_RAX, JIT_REG_X, GUEST(op.rs2));
+            emit.setcc(op.kind == THREADED_OP_SLT ? X86_CC_L : X86_CC_B, X86_RCX);
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RCX);
+            break;
+
+        case THREADED_OP_SLL:
+        case THREADED_OP_SRL:
+        case THREADED_OP_SRA:
+            // x86 masks the shift count to 5 bits like RISC-V
+            emit.mov_load(X86_RCX, JIT_REG_X, GUEST(op.rs2));
+            emit.mov_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+            emit.shift_cl(op.kind == THREADED_OP_SLL ? X86_SHL : op.kind == THREADED_OP_SRL ? X86_SHR
+                                                                                             : X86_SAR,
+                          X86_RAX);
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RAX);
+            break;
+
+        case THREADED_OP_MUL:
+            emit.mov_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+            emit.imul_load(X86_RAX, JIT_REG_X, GUEST(op.rs2));
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RAX);
+            break;
+
+        case THREADED_OP_MULH:
+        case THREADED_OP_MULHSU:
+        case THREADED_OP_MULHU:
+            // Extend both operands to 64 bits and keep the upper half
+            if (op.kind == THREADED_OP_MULHU)
+            {
+                emit.mov_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+            }
+            else
+            {
+                emit.movsxd_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+            }
+            if (op.kind == THREADED_OP_MULH)
+            {
+                emit.movsxd_load(X86_RCX, JIT_REG_X, GUEST(op.rs2));
+            }
+            else
+            {
+                emit.mov_load(X86_RCX, JIT_REG_X, GUEST(op.rs2));
+            }
+            emit.imul_reg64(X86_RAX, X86_RCX);
+            emit.shift_imm(X86_SHR, X86_RAX, 32, true);
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RAX);
+            break;
+
+        case THREADED_OP_DIV:
+        case THREADED_OP_DIVU:
+        case THREADED_OP_REM:
+        case THREADED_OP_REMU:
+        {
+            // Signed operands divide in 64 bits, where 0x80000000 / -1
+            // does not overflow and gives the RISC-V results in the low half
+            bool is_signed = op.kind == THREADED_OP_DIV || op.kind == THREADED_OP_REM;
+            bool remainder = op.kind == THREADED_OP_REM || op.kind == THREADED_OP_REMU;
+            if (is_signed)
+            {
+                emit.movsxd_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+                emit.movsxd_load(X86_RCX, JIT_REG_X, GUEST(op.rs2));
+            }
+            else
+            {
+                emit.mov_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+                emit.mov_load(X86_RCX, JIT_REG_X, GUEST(op.rs2));
+            }
+            emit.test_reg(X86_RCX, X86_RCX);
+            uint8_t *by_zero = emit.jcc(X86_CC_E, emit.position());
+            if (is_signed)
+            {
+                emit.cqo();
+            }
+            else
+            {
+                emit.alu_reg(X86_XOR, X86_RDX, X86_RDX);
+            }
+            emit.div_reg(X86_RCX, is_signed, is_signed);
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), remainder ? X86_RDX : X86_RAX);
+            uint8_t *done = emit.jmp(emit.position());
+
+            // Division by zero gives all ones, the remainder is the dividend
+            X86Emitter::patch(by_zero, emit.position());
+            if (remainder)
+            {
+                emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RAX);
+            }
+            else
+            {
+                emit.mov_store_imm(JIT_REG_X, GUEST(op.rd), 0xFFFFFFFF);
+            }
+            X86Emitter::patch(done, emit.position());
+            break;
+        }
+
+        case THREADED_OP_LB:
+        case THREADED_OP_LBU:
+        case THREADED_OP_LH:
+        case THREADED_OP_LHU:
+        case THREADED_OP_LW:
+        {
+            uint16_t opcode;
+            uint32_t align;
+            uint32_t (*helper)(jit_context_t *, uint32_t);
+            switch (op.kind)
+            {
+            case THREADED_OP_LB:
+                opcode = 0x0FBE;
+                align = 0;
+                helper = jit_load_byte;
+                break;
+            case THREADED_OP_LBU:
+                opcode = 0x0FB6;
+                align = 0;
+                helper = jit_load_byte_unsigned;
+                break;
+            case THREADED_OP_LH:
+                opcode = 0x0FBF;
+                align = 1;
+                helper = jit_load_halfword;
+                break;
+            case THREADED_OP_LHU:
+                opcode = 0x0FB7;
+                align = 1;
+                helper = jit_load_halfword_unsigned;
+                break;
+            default:
+                opcode = 0x8B;
+                align = 3;
+                helper = jit_load_word;
+                break;
+            }
+
+            emit.mov_load(X86_RSI, JIT_REG_X, GUEST(op.rs1));
+            if (op.imm != 0)
+            {
+                emit.alu_imm(X86_ADD, X86_RSI, op.imm);
+            }
+
+            // Aligned reads that hit the TLB come straight from the page
+            uint8_t *misaligned = NULL;
+            if (align != 0)
+            {
+                emit.test_imm(X86_RSI, align);
+                misaligned = emit.jcc(X86_CC_NE, emit.position());
+            }
+            uint8_t *miss = emit_tlb_lookup(emit, JIT_REG_READ_TLB);
+            emit.load_indexed(opcode, X86_RAX, X86_RAX, X86_RCX);
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RAX);
+            uint8_t *done = emit.jmp(emit.position());
+
+            // Everything else goes through RAM
+            if (misaligned != NULL)
+            {
+                X86Emitter::patch(misaligned, emit.position());
+            }
+            X86Emitter::patch(miss, emit.position());
+            emit.mov_reg(X86_RDI, JIT_REG_CONTEXT, true);
+            emit.mov_imm64(X86_RAX, (uint64_t)helper);
+            emit.call_reg(X86_RAX);
+            emit.mov_store(JIT_REG_X, GUEST(op.rd), X86_RAX);
+
+            // Leave once a watched load is done
+            emit.cmp_byte_mem(JIT_REG_CONTEXT, CONTEXT(watch_pending), 0);
+            jit_stub_t stub = {emit.jcc(X86_CC_NE, emit.position()), JIT_EXIT_WATCH, op_pc, length - i - 1, false};
+            stubs.push_back(stub);
+
+            X86Emitter::patch(done, emit.position());
+            break;
+        }
+
+        case THREADED_OP_SB:
+        case THREADED_OP_SH:
+        case THREADED_OP_SW:
+        {
+            int size = op.kind == THREADED_OP_SB ? 1 : op.kind == THREADED_OP_SH ? 2
+                                                                                 : 4;
+            uint32_t (*helper)(jit_context_t *, uint32_t, uint32_t) = op.kind == THREADED_OP_SB ? jit_store_byte : op.kind == THREADED_OP_SH ? jit_store_halfword
+                                                                                                                                            : jit_store_word;
+
+            emit.mov_load(X86_RSI, JIT_REG_X, GUEST(op.rs1));
+            if (op.imm != 0)
+            {
+                emit.alu_imm(X86_ADD, X86_RSI, op.imm);
+            }
+            emit.mov_load(X86_RDX, JIT_REG_X, GUEST(op.rs2));
+
+            // Aligned stores that hit the write TLB go straight to the page,
+            // code pages are never in it
+            uint8_t *misaligned = NULL;
+            if (size > 1)
+            {
+                emit.test_imm(X86_RSI, size - 1);
+                misaligned = emit.jcc(X86_CC_NE, emit.position());
+            }
+            uint8_t *miss = emit_tlb_lookup(emit, JIT_REG_WRITE_TLB);
+            emit.store_indexed(size, X86_RAX, X86_RCX, X86_RDX);
+            uint8_t *done = emit.jmp(emit.position());
+
+            // Everything else goes through RAM, which reports code writes
+            if (misaligned != NULL)
+            {
+                X86Emitter::patch(misaligned, emit.position());
+            }
+            X86Emitter::patch(miss, emit.position());
+            emit.mov_reg(X86_RDI, JIT_REG_CONTEXT, true);
+            emit.mov_imm64(X86_RAX, (uint64_t)helper);
+            emit.call_reg(X86_RAX);
+            emit.cmp_byte_mem(JIT_REG_CONTEXT, CONTEXT(watch_pending), 0);
+            jit_stub_t watch_stub = {emit.jcc(X86_CC_NE, emit.position()), JIT_EXIT_WATCH, op_pc, length - i - 1, false};
+            stubs.push_back(watch_stub);
+            emit.test_reg(X86_RAX, X86_RAX);
+            jit_stub_t stub = {emit.jcc(X86_CC_NE, emit.position()), JIT_EXIT_CODE_WRITE, op.link, length - i - 1, false};
+            stubs.push_back(stub);
+
+            X86Emitter::patch(done, emit.position());
+            break;
+        }
+
+        case THREADED_OP_BEQ:
+        case THREADED_OP_BNE:
+        case THREADED_OP_BLT:
+        case THREADED_OP_BGE:
+        case THREADED_OP_BLTU:
+        case THREADED_OP_BGEU:
+        {
+            x86_cc_t cc;
+            switch (op.kind)
+            {
+            case THREADED_OP_BEQ:
+                cc = X86_CC_E;
+                break;
+            case THREADED_OP_BNE:
+                cc = X86_CC_NE;
+                break;
+            case THREADED_OP_BLT:
+                cc = X86_CC_L;
+                break;
+            case THREADED_OP_BGE:
+                cc = X86_CC_GE;
+                break;
+            case THREADED_OP_BLTU:
+                cc = X86_CC_B;
+                break;
+            default:
+                cc = X86_CC_AE;
+                break;
+            }
+
+            emit.mov_load(X86_RAX, JIT_REG_X, GUEST(op.rs1));
+            emit.alu_load(X86_CMP, X86_RAX, JIT_REG_X, GUEST(op.rs2));
+            uint8_t *taken = emit.jcc(cc, emit.position());
+
+            jit_stub_t not_taken_stub = {emit.jmp(emit.position()), JIT_EXIT_CHAIN, op.link, 0, true};
+            stubs.push_back(not_taken_stub);
+
+            X86Emitter::patch(taken, emit.position());
+            if (events_counted)
+            {
+                emit.mov_load64(X86_RAX, JIT_REG_CONTEXT, CONTEXT(event_counts));
+                emit.alu_mem_imm(X86_ADD, X86_RAX, HPM_EVENT_BRANCH_TAKEN * (int32_t)sizeof(uint64_t), 1, true);
+            }
+            jit_stub_t taken_stub = {emit.jmp(emit.position()), JIT_EXIT_CHAIN, op_pc + op.imm, 0, true};
+            stubs.push_back(taken_stub);
+            break;
+        }
+
+        case THREADED_OP_JAL:
+        {
+            if (op.profile != PROFILE_JUMP && processor->profiler != NULL)
+            {
+                emit.mov_imm(X86_RDX, op_pc + op.imm);
+                emit_profile_jump(emit, processor->profiler, op.profile);
+            }
+            emit.mov_store_imm(JIT_REG_X, GUEST(op.rd), op.link);
+            jit_stub_t stub = {emit.jmp(emit.position()), JIT_EXIT_CHAIN, op_pc + op.imm, 0, true};
+            stubs.push_back(stub);
+            break;
+        }
+
+        case THREADED_OP_JALR:
+        {
+            if (op.profile != PROFILE_JUMP && processor->profiler != NULL)
+            {
+                emit.mov_load(X86_RDX, JIT_REG_X, GUEST(op.rs1));
+                if (op.imm != 0)
+                {
+                    emit.alu_imm(X86_ADD, X86_RDX, op.imm);
+                }
+                emit.alu_imm(X86_AND, X86_RDX, ~1u);
+                emit_profile_jump(emit, processor->profiler, op.profile);
+            }
+
+            // Read the base before writing the link, they may be the same
+            // register. The target has bit 0 cleared.
+            emit.mov_load(X86_RCX, JIT_REG_X, GUEST(op.rs1));
+            if (op.imm != 0)
+            {
+                emit.alu_imm(X86_ADD, X86_RCX, op.imm);
+            }
+            emit.alu_imm(X86_AND, X86_RCX, ~1u);
+            emit.mov_store_imm(JIT_REG_X, GUEST(op.rd), op.link);
+            emit.mov_store(JIT_REG_CONTEXT, CONTEXT(pc), X86_RCX);
+
+            // Look the target up in the jump cache, misses exit to the dispatcher
+            emit.mov_reg(X86_RAX, X86_RCX);
+            emit.shift_imm(X86_SHR, X86_RAX, 1);
+            emit.alu_imm(X86_AND, X86_RAX, JIT_JUMP_CACHE_SIZE - 1);
+            emit.shift_imm(X86_SHL, X86_RAX, 4);
+            emit.alu_reg(X86_ADD, X86_RAX, JIT_REG_CONTEXT, true);
+            emit.op_reg_mem(0x3B, X86_RCX, X86_RAX, CONTEXT(jump_cache) + (int32_t)offsetof(jit_jump_entry_t, pc));
+            emit.jcc(X86_CC_NE, indirect_miss_code);
+            emit.jmp_mem(X86_RAX, CONTEXT(jump_cache) + (int32_t)offsetof(jit_jump_entry_t, code));
+            break;
+        }
+
+        case THREADED_OP_HALT:
+        {
+            jit_stub_t stub = {emit.jmp(emit.position()), JIT_EXIT_HALT, op_pc, 0, false};
+            stubs.push_back(stub);
+            break;
+        }
+
+        case THREADED_OP_END:
+        {
+            jit_stub_t stub = {emit.jmp(emit.position()), JIT_EXIT_CHAIN, op_pc, 0, true};
+            stubs.push_back(stub);
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    // The block ended before an instruction it can't translate
+    if (ops.back().kind < THREADED_OP_BEQ)
+    {
+        jit_stub_t stub = {emit.jmp(emit.position()), JIT_EXIT_FALLBACK, address, 0, false};
+        stubs.push_back(stub);
+    }
+
+    // Exit stubs
+    for (size_t i = 0; i < stubs.size(); i++)
+    {
+        X86Emitter::patch(stubs[i].site, emit.position());
+        if (stubs[i].chain)
+        {
+            // Tell the dispatcher which jump to link to the target
+            emit.mov_imm64(X86_RAX, (uint64_t)stubs[i].site);
+            emit.mov_store64(JIT_REG_CONTEXT, CONTEXT(patch_site), X86_RAX);
+        }
+        if (stubs[i].refund != 0)
+        {
+            // The instructions that did not run are the last of the block
+            emit.alu_mem_imm(X86_ADD, JIT_REG_CONTEXT, CONTEXT(budget), stubs[i].refund, true);
+            if (events_counted)
+            {
+                emit_count_events(emit, &ops[length - stubs[i].refund], stubs[i].refund, X86_SUB);
+            }
+        }
+        emit.mov_store_imm(JIT_REG_CONTEXT, CONTEXT(pc), stubs[i].pc);
+        emit.mov_imm(X86_RAX, stubs[i].reason);
+        emit.jmp(exit_code);
+    }
+
+    code_free = emit.position();
+
+    TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "JIT: Block at 0x%08X with %u instructions, %d bytes\n", pc, length, (int)(code_free - block->code));
+
+    coverage.mark(block->start_pc, block->end_pc);
+    blocks[pc] = block;
+    return block;
+}
+
+void JitEngine::run()
+{
+    // Without a code buffer the datapath runs everything
+    if (code_buffer == NULL)
+    {
+        return;
+    }
+
+    context.stop = processor->stop_requested.load();
+    context.watch_pending = false;
+
+    // Jump to link to the next block, and whether to cache it as a JALR target
+    uint8_t *patch_site = NULL;
+    bool indirect = false;
+
+    while (true)
+    {
+        // Translations may have been dropped, including the one holding the jump
+        if (process_invalidations())
+        {
+            patch_site = NULL;
+        }
+
+        // Translations count events only while a counter needs them
+        if (events_counted != processor->hpm_active)
+        {
+            flush();
+            events_counted = processor->hpm_active;
+            patch_site = NULL;
+        }
+
+        // Stop conditions are checked between blocks, the datapath takes over
+        if (processor->halt || processor->watch_triggered ||
+            (processor->breakpoint_set && processor->pc == processor->breakpoint))
+        {
+            return;
+        }
+
+        jit_block_t *block;
+        std::unordered_map<uint32_t, jit_block_t *>::iterator it = blocks.find(processor->pc);
+        if (it != blocks.end())
+        {
+            block = it->second;
+        }
+        else
+        {
+            uint8_t *free_before = code_free;
+            block = translate_block(processor->pc);
+            if (code_free < free_before)
+            {
+                // The buffer was flushed, the jump to link is gone
+                patch_site = NULL;
+            }
+        }
+        if (code_buffer == NULL)
+        {
+            return;
+        }
+
+        if (block == NULL)
+        {
+            if (processor->instruction_count >= processor->stop_count)
+            {
+                return;
+            }
+            processor->execute_instruction();
+            patch_site = NULL;
+            indirect = false;
+            continue;
+        }
+
+        if (patch_site != NULL && make_code_writable())
+        {
+            // Link the jump, remembering its stub in case the block is dropped
+            int32_t rel;
+            memcpy(&rel, patch_site, 4);
+            block->incoming.push_back(std::make_pair(patch_site, patch_site + 4 + rel));
+            X86Emitter::patch(patch_site, block->code);
+            patch_site = NULL;
+        }
+        if (indirect)
+        {
+            jit_jump_entry_t &entry = context.jump_cache[(block->start_pc >> 1) & (JIT_JUMP_CACHE_SIZE - 1)];
+            entry.pc = block->start_pc;
+            entry.code = block->code;
+            indirect = false;
+        }
+
+        if (!make_code_executable())
+        {
+            return;
+        }
+
+        uint64_t remaining = processor->stop_count - processor->instruction_count;
+        int64_t budget = remaining > (uint64_t)INT64_MAX ? INT64_MAX : (int64_t)remaining;
+        context.budget = budget;
+        uint32_t reason = enter(&context, block->code);
+        processor->instruction_count += budget - context.budget;
+        processor->pc = context.pc;
+
+        switch (reason)
+        {
+        case JIT_EXIT_CHAIN:
+            patch_site = context.patch_site;
+            break;
+        case JIT_EXIT_INDIRECT:
+            indirect = true;
+            break;
+        case JIT_EXIT_FALLBACK:
+            if (processor->instruction_count >= processor->stop_count)
+            {
+                return;
+            }
+            processor->execute_instruction();
+            break;
+        case JIT_EXIT_HALT:
+            processor->halt = true;
+            break;
+        case JIT_EXIT_WATCH:
+            // The access that hit a watchpoint is done, go on after it
+            context.watch_pending = false;
+            processor->last_watch_hit.pc = context.pc;
+            processor->pc = context.pc + decode_cache->lookup(context.pc)->length;
+            break;
+        case JIT_EXIT_BUDGET:
+            return;
+        default:
+            break;
+        }
+    }
+}
+
+#endif // JIT_SUPPORTED
@@ -0,0 +1,618 @@
+// Runs several instances of one program in lockstep.
+
+#include "lockstep_engine.h"
+
+#include <string.h>
+#include "alu.h"
+#include "processor.h"
+#include "trace.h"
+
+// Use labels as values and count trailing zeros where the compiler
+// supports them, otherwise dispatch through a switch and look for lanes one
+// bit at a time
+#if defined(__GNUC__)
+#define LOCKSTEP_COMPUTED_GOTO
+#define LOCKSTEP_LOWEST_LANE(mask) ((uint32_t)__builtin_ctz(mask))
+#else
+static inline uint32_t lockstep_lowest_lane(uint32_t mask)
+{
+    uint32_t lane = 0;
+    while ((mask & 1) == 0)
+    {
+        mask >>= 1;
+        lane++;
+    }
+    return lane;
+}
+#define LOCKSTEP_LOWEST_LANE(mask) lockstep_lowest_lane(mask)
+#endif
+
+#ifdef LOCKSTEP_COMPUTED_GOTO
+#define LOCKSTEP_DISPATCH() goto *handlers[op->kind]
+#else
+#define LOCKSTEP_DISPATCH() goto dispatch
+#endif
+
+// Run a statement for each active lane l in turn
+#define LOCKSTEP_FOR_EACH_LANE(statement)                           \
+    for (uint32_t mask = active_lanes; mask != 0; mask &= mask - 1) \
+    {                                                               \
+        uint32_t l = LOCKSTEP_LOWEST_LANE(mask);                    \
+        statement;                                                  \
+    }
+
+#ifdef LOCKSTEP_VECTORS
+// Source registers of the op, every lane at once
+#define LOCKSTEP_RS1 x[op->rs1]
+#define LOCKSTEP_RS2 x[op->rs2]
+
+// Signed and unsigned views of the registers, and comparisons as 0 or 1
+#define LOCKSTEP_SIGNED(value) ((lockstep_signed_vector_t)(value))
+#define LOCKSTEP_UNSIGNED(value) ((lockstep_vector_t)(value))
+#define LOCKSTEP_FLAG(condition) ((lockstep_vector_t)(condition) & 1)
+
+// A vector with every lane set to a value
+#define LOCKSTEP_SPLAT(value) (lockstep_zero + (value))
+
+// Write a vector to the destination register of the active lanes, leaving
+// the others alone
+#define LOCKSTEP_WRITE(value)                                   \
+    if (full)                                                   \
+    {                                                           \
+        x[op->rd] = (value);                                    \
+    }                                                           \
+    else                                                        \
+    {                                                           \
+        x[op->rd] = ((value) & active) | (x[op->rd] & ~active); \
+    }
+
+// Write an expression of lane l to the destination register of each active
+// lane in turn, for the operations with no vector form
+#define LOCKSTEP_WRITE_EACH_LANE(expr)              \
+    {                                               \
+        lockstep_vector_t result = x[op->rd];       \
+        LOCKSTEP_FOR_EACH_LANE(result[l] = (expr)); \
+        x[op->rd] = result;                         \
+    }
+
+// Follow a conditional branch of the active lanes, given as all ones in the
+// lanes that take it. The group carries on while every lane goes the same
+// way.
+#define LOCKSTEP_BRANCH(condition)                                                             \
+    {                                                                                          \
+        lockstep_vector_t taken = (lockstep_vector_t)(condition) & active;                     \
+        if (!lockstep_any(taken))                                                              \
+        {                                                                                      \
+            group_pc = op->link;                                                               \
+        }                                                                                      \
+        else if (!lockstep_any(taken ^ active))                                                \
+        {                                                                                      \
+            group_pc += op->imm;                                                               \
+        }                                                                                      \
+        else                                                                                   \
+        {                                                                                      \
+            pc = (taken & (group_pc + op->imm)) | (~taken & active & op->link) | (pc & ~active); \
+            diverged = true;                                                                   \
+        }                                                                                      \
+        op++;                                                                                  \
+        goto leave_block;                                                                      \
+    }
+
+static const lockstep_vector_t lockstep_zero = {};
+
+// True if any lane of a vector is not zero
+static inline bool lockstep_any(const lockstep_vector_t &value)
+{
+    uint64_t halves[sizeof(value) / 8];
+    memcpy(halves, &value, sizeof(value));
+    uint64_t any = 0;
+    for (size_t i = 0; i < sizeof(value) / 8; i++)
+    {
+        any |= halves[i];
+    }
+    return any != 0;
+}
+#else
+// Source registers of the op, in lane l
+#define LOCKSTEP_RS1 x[op->rs1][l]
+#define LOCKSTEP_RS2 x[op->rs2][l]
+
+#define LOCKSTEP_SIGNED(value) ((int32_t)(value))
+#define LOCKSTEP_UNSIGNED(value) ((uint32_t)(value))
+#define LOCKSTEP_FLAG(condition) ((uint32_t)(condition))
+#define LOCKSTEP_SPLAT(value) (value)
+
+// Write an expression of lane l to the destination register of each active
+// lane in turn
+#define LOCKSTEP_WRITE(value) LOCKSTEP_FOR_EACH_LANE(x[op->rd][l] = (value))
+#define LOCKSTEP_WRITE_EACH_LANE(expr) LOCKSTEP_WRITE(expr)
+
+// Follow a conditional branch of the active lanes, given as true in lane l
+// if it takes it. The group carries on while every lane goes the same way.
+#define LOCKSTEP_BRANCH(condition)                                                       \
+    {                                                                                    \
+        uint32_t taken = 0;                                                              \
+        LOCKSTEP_FOR_EACH_LANE(taken |= (uint32_t)(condition) << l);                     \
+        if (taken == 0)                                                                  \
+        {                                                                                \
+            group_pc = op->link;                                                         \
+        }                                                                                \
+        else if (taken == active_lanes)                                                  \
+        {                                                                                \
+            group_pc += op->imm;                                                         \
+        }                                                                                \
+        else                                                                             \
+        {                                                                                \
+            LOCKSTEP_FOR_EACH_LANE(pc[l] = (taken >> l) & 1 ? group_pc + op->imm : op->link); \
+            diverged = true;                                                             \
+        }                                                                                \
+        op++;                                                                            \
+        goto leave_block;                                                                \
+    }
+#endif
+
+// Move on from an instruction that doesn't change the flow, checking for
+// the end of the group only in blocks where it can come
+#define LOCKSTEP_NEXT()           \
+    group_pc = op->link;          \
+    op++;                         \
+    if (checked)                  \
+    {                             \
+        goto check;               \
+    }                             \
+    LOCKSTEP_DISPATCH()
+
+// Stop the block after a store that wrote code
+#define LOCKSTEP_NEXT_STORE()     \
+    if (code_modified)            \
+    {                             \
+        group_pc = op->link;      \
+        op++;                     \
+        goto leave_block;         \
+    }                             \
+    LOCKSTEP_NEXT()
+
+LockstepEngine::LockstepEngine()
+{
+    memset(x, 0, sizeof(x));
+    memset(&pc, 0, sizeof(pc));
+    memset(&active, 0, sizeof(active));
+    active_lanes = 0;
+    memset(instruction_count, 0, sizeof(instruction_count));
+    memset(stop_count, 0, sizeof(stop_count));
+    memset(runnable, 0, sizeof(runnable));
+    memset(lanes, 0, sizeof(lanes));
+    memset(rams, 0, sizeof(rams));
+    lane_count = 0;
+    scalar_only = false;
+    memset(blocks, 0, sizeof(blocks));
+    code_modified = false;
+}
+
+LockstepEngine::~LockstepEngine()
+{
+}
+
+void LockstepEngine::run(Processor *const *processors, const uint64_t *max_instructions, uint32_t count)
+{
+    lane_count = count < LOCKSTEP_LANES ? count : LOCKSTEP_LANES;
+    scalar_only = false;
+
+    // The lanes may run a different program from the last run
+    for (uint32_t i = 0; i < LOCKSTEP_BLOCK_CACHE_ENTRIES; i++)
+    {
+        blocks[i].length = 0;
+    }
+    for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        if (lane >= lane_count)
+        {
+            lanes[lane] = NULL;
+            rams[lane] = NULL;
+            runnable[lane] = false;
+            continue;
+        }
+        lanes[lane] = processors[lane];
+        rams[lane] = lanes[lane]->ram;
+        rams[lane]->add_code_observer(this);
+        load_lane(lane);
+        uint64_t budget = max_instructions[lane];
+        stop_count[lane] = budget > RUN_UNLIMITED - instruction_count[lane] ? RUN_UNLIMITED : instruction_count[lane] + budget;
+        runnable[lane] = !lanes[lane]->halt && instruction_count[lane] < stop_count[lane];
+        scalar_only = scalar_only || lanes[lane]->hpm_active;
+    }
+
+    while (true)
+    {
+        // The lanes furthest behind go first, so lanes that took different
+        // paths meet again where the paths join
+        bool any = false;
+        uint32_t group_pc = 0;
+        for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            if (runnable[lane] && (!any || pc[lane] < group_pc))
+            {
+                group_pc = pc[lane];
+                any = true;
+            }
+        }
+        if (!any)
+        {
+            break;
+        }
+        run_group(group_pc);
+    }
+
+    for (uint32_t lane = 0; lane < lane_count; lane++)
+    {
+        store_lane(lane);
+        rams[lane]->remove_code_observer(this);
+    }
+}
+
+void LockstepEngine::code_written(uint32_t address, uint32_t size)
+{
+    for (uint32_t i = 0; i < LOCKSTEP_BLOCK_CACHE_ENTRIES; i++)
+    {
+        lockstep_block_t &block = blocks[i];
+        if (block.length != 0 && address < block.end_pc && address + size > block.start_pc)
+        {
+            block.length = 0;
+            code_modified = true;
+        }
+    }
+}
+
+const lockstep_block_t *LockstepEngine::get_block(uint32_t start_pc, uint32_t first)
+{
+    lockstep_block_t *block = &blocks[(start_pc >> 1) & (LOCKSTEP_BLOCK_CACHE_ENTRIES - 1)];
+    if (block->length != 0 && block->start_pc == start_pc)
+    {
+        return block;
+    }
+
+    // Every lane runs the same code, so any of them can decode it. Blocks
+    // end at control flow and at instructions the lanes can't run, or in
+    // an END when they grow too long.
+    uint32_t pc = start_pc;
+    uint32_t length = 0;
+    while (true)
+    {
+        threaded_op_t *op = &block->ops[length++];
+        if (length == LOCKSTEP_MAX_BLOCK_LENGTH)
+        {
+            memset(op, 0, sizeof(threaded_op_t));
+            op->kind = THREADED_OP_END;
+            op->link = pc;
+            break;
+        }
+        ThreadedEngine::translate(op, *lanes[first]->decode_cache.lookup(pc), pc);
+        pc = op->link;
+        if (op->kind >= THREADED_OP_BEQ)
+        {
+            break;
+        }
+    }
+    block->start_pc = start_pc;
+    block->end_pc = pc;
+    block->length = length;
+    return block;
+}
+
+void LockstepEngine::run_group(uint32_t group_pc)
+{
+#ifdef LOCKSTEP_COMPUTED_GOTO
+#define LOCKSTEP_OP_LABEL(name) &&op_##name,
+    static const void *const handlers[THREADED_OP_COUNT] = {THREADED_OPS(LOCKSTEP_OP_LABEL)};
+#undef LOCKSTEP_OP_LABEL
+#endif
+
+    // The group runs until the lanes split, reach the budget of one of
+    // them or catch up with a waiting lane
+    uint32_t first = LOCKSTEP_LANES;
+    uint32_t waiting_pc = 0xFFFFFFFF;
+    uint64_t budget = RUN_UNLIMITED;
+    active_lanes = 0;
+    for (uint32_t lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        bool selected = runnable[lane] && pc[lane] == group_pc;
+        active[lane] = selected ? 0xFFFFFFFF : 0;
+        if (selected)
+        {
+            first = first == LOCKSTEP_LANES ? lane : first;
+            active_lanes |= 1u << lane;
+            budget = stop_count[lane] - instruction_count[lane] < budget ? stop_count[lane] - instruction_count[lane] : budget;
+        }
+        else if (runnable[lane] && pc[lane] < waiting_pc)
+        {
+            waiting_pc = pc[lane];
+        }
+    }
+
+#ifdef LOCKSTEP_VECTORS
+    // With every lane in the group, results need no masking
+    const bool full = active_lanes == (1u << lane_count) - 1;
+#endif
+    uint64_t executed = 0;
+    bool diverged = false;
+    bool scalar = scalar_only;
+    bool checked = false;
+    const lockstep_block_t *block = NULL;
+    const threaded_op_t *op = NULL;
+    if (scalar)
+    {
+        goto done;
+    }
+
+next_block:
+    block = get_block(group_pc, first);
+    code_modified = false;
+    op = block->ops;
+
+    // Instructions before the last one only need checking when the budget
+    // runs out or a waiting lane is reached inside the block
+    checked = budget - executed < block->length || block->end_pc > waiting_pc;
+    LOCKSTEP_DISPATCH();
+
+check:
+    if (executed + (uint64_t)(op - block->ops) == budget || group_pc >= waiting_pc)
+    {
+        goto leave_block;
+    }
+    LOCKSTEP_DISPATCH();
+
+#ifndef LOCKSTEP_COMPUTED_GOTO
+#define LOCKSTEP_OP_CASE(name) \
+    case THREADED_OP_##name:   \
+        goto op_##name;
+dispatch:
+    switch (op->kind)
+    {
+        THREADED_OPS(LOCKSTEP_OP_CASE)
+    default:
+        goto op_GENERIC;
+    }
+#undef LOCKSTEP_OP_CASE
+#endif
+
+op_NOP:
+    LOCKSTEP_NEXT();
+op_LI:
+    LOCKSTEP_WRITE(LOCKSTEP_SPLAT(op->imm));
+    LOCKSTEP_NEXT();
+op_ADDI:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 + op->imm);
+    LOCKSTEP_NEXT();
+op_SLTI:
+    LOCKSTEP_WRITE(LOCKSTEP_FLAG(LOCKSTEP_SIGNED(LOCKSTEP_RS1) < (int32_t)op->imm));
+    LOCKSTEP_NEXT();
+op_SLTIU:
+    LOCKSTEP_WRITE(LOCKSTEP_FLAG(LOCKSTEP_RS1 < op->imm));
+    LOCKSTEP_NEXT();
+op_XORI:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 ^ op->imm);
+    LOCKSTEP_NEXT();
+op_ORI:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 | op->imm);
+    LOCKSTEP_NEXT();
+op_ANDI:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 & op->imm);
+    LOCKSTEP_NEXT();
+op_SLLI:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 << op->imm);
+    LOCKSTEP_NEXT();
+op_SRLI:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 >> op->imm);
+    LOCKSTEP_NEXT();
+op_SRAI:
+    LOCKSTEP_WRITE(LOCKSTEP_UNSIGNED(LOCKSTEP_SIGNED(LOCKSTEP_RS1) >> (int32_t)op->imm));
+    LOCKSTEP_NEXT();
+op_ADD:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 + LOCKSTEP_RS2);
+    LOCKSTEP_NEXT();
+op_SUB:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 - LOCKSTEP_RS2);
+    LOCKSTEP_NEXT();
+op_AND:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 & LOCKSTEP_RS2);
+    LOCKSTEP_NEXT();
+op_OR:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 | LOCKSTEP_RS2);
+    LOCKSTEP_NEXT();
+op_XOR:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 ^ LOCKSTEP_RS2);
+    LOCKSTEP_NEXT();
+op_SLT:
+    LOCKSTEP_WRITE(LOCKSTEP_FLAG(LOCKSTEP_SIGNED(LOCKSTEP_RS1) < LOCKSTEP_SIGNED(LOCKSTEP_RS2)));
+    LOCKSTEP_NEXT();
+op_SLTU:
+    LOCKSTEP_WRITE(LOCKSTEP_FLAG(LOCKSTEP_RS1 < LOCKSTEP_RS2));
+    LOCKSTEP_NEXT();
+op_SLL:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 << (LOCKSTEP_RS2 & 0x1F));
+    LOCKSTEP_NEXT();
+op_SRL:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 >> (LOCKSTEP_RS2 & 0x1F));
+    LOCKSTEP_NEXT();
+op_SRA:
+    LOCKSTEP_WRITE(LOCKSTEP_UNSIGNED(LOCKSTEP_SIGNED(LOCKSTEP_RS1) >> LOCKSTEP_SIGNED(LOCKSTEP_RS2 & 0x1F)));
+    LOCKSTEP_NEXT();
+op_MUL:
+    LOCKSTEP_WRITE(LOCKSTEP_RS1 * LOCKSTEP_RS2);
+    LOCKSTEP_NEXT();
+
+// The upper halves of products and division have no vector form
+op_MULH:
+    LOCKSTEP_WRITE_EACH_LANE((uint32_t)(((int64_t)(int32_t)x[op->rs1][l] * (int64_t)(int32_t)x[op->rs2][l]) >> 32));
+    LOCKSTEP_NEXT();
+op_MULHSU:
+    LOCKSTEP_WRITE_EACH_LANE((uint32_t)(((int64_t)(int32_t)x[op->rs1][l] * (int64_t)x[op->rs2][l]) >> 32));
+    LOCKSTEP_NEXT();
+op_MULHU:
+    LOCKSTEP_WRITE_EACH_LANE((uint32_t)(((uint64_t)x[op->rs1][l] * (uint64_t)x[op->rs2][l]) >> 32));
+    LOCKSTEP_NEXT();
+op_DIV:
+    LOCKSTEP_WRITE_EACH_LANE(alu_execute(x[op->rs1][l], x[op->rs2][l], ALUOP_DIV, false, false, false));
+    LOCKSTEP_NEXT();
+op_DIVU:
+    LOCKSTEP_WRITE_EACH_LANE(alu_execute(x[op->rs1][l], x[op->rs2][l], ALUOP_DIVU, false, false, false));
+    LOCKSTEP_NEXT();
+op_REM:
+    LOCKSTEP_WRITE_EACH_LANE(alu_execute(x[op->rs1][l], x[op->rs2][l], ALUOP_REM, false, false, false));
+    LOCKSTEP_NEXT();
+op_REMU:
+    LOCKSTEP_WRITE_EACH_LANE(alu_execute(x[op->rs1][l], x[op->rs2][l], ALUOP_REMU, false, false, false));
+    LOCKSTEP_NEXT();
+
+// Memory is per lane, so accesses go one lane at a time
+op_LB:
+    LOCKSTEP_WRITE_EACH_LANE((uint32_t)(int32_t)(int8_t)rams[l]->load_byte(x[op->rs1][l] + op->imm));
+    LOCKSTEP_NEXT();
+op_LBU:
+    LOCKSTEP_WRITE_EACH_LANE(rams[l]->load_byte(x[op->rs1][l] + op->imm));
+    LOCKSTEP_NEXT();
+op_LH:
+    LOCKSTEP_WRITE_EACH_LANE((uint32_t)(int32_t)(int16_t)rams[l]->load_halfword(x[op->rs1][l] + op->imm));
+    LOCKSTEP_NEXT();
+op_LHU:
+    LOCKSTEP_WRITE_EACH_LANE(rams[l]->load_halfword(x[op->rs1][l] + op->imm));
+    LOCKSTEP_NEXT();
+op_LW:
+    LOCKSTEP_WRITE_EACH_LANE(rams[l]->load_word(x[op->rs1][l] + op->imm));
+    LOCKSTEP_NEXT();
+op_SB:
+    LOCKSTEP_FOR_EACH_LANE(rams[l]->store_byte(x[op->rs1][l] + op->imm, (uint8_t)x[op->rs2][l]));
+    LOCKSTEP_NEXT_STORE();
+op_SH:
+    LOCKSTEP_FOR_EACH_LANE(rams[l]->store_halfword(x[op->rs1][l] + op->imm, (uint16_t)x[op->rs2][l]));
+    LOCKSTEP_NEXT_STORE();
+op_SW:
+    LOCKSTEP_FOR_EACH_LANE(rams[l]->store_word(x[op->rs1][l] + op->imm, x[op->rs2][l]));
+    LOCKSTEP_NEXT_STORE();
+
+op_BEQ:
+    LOCKSTEP_BRANCH(LOCKSTEP_RS1 == LOCKSTEP_RS2);
+op_BNE:
+    LOCKSTEP_BRANCH(LOCKSTEP_RS1 != LOCKSTEP_RS2);
+op_BLT:
+    LOCKSTEP_BRANCH(LOCKSTEP_SIGNED(LOCKSTEP_RS1) < LOCKSTEP_SIGNED(LOCKSTEP_RS2));
+op_BGE:
+    LOCKSTEP_BRANCH(LOCKSTEP_SIGNED(LOCKSTEP_RS1) >= LOCKSTEP_SIGNED(LOCKSTEP_RS2));
+op_BLTU:
+    LOCKSTEP_BRANCH(LOCKSTEP_RS1 < LOCKSTEP_RS2);
+op_BGEU:
+    LOCKSTEP_BRANCH(LOCKSTEP_RS1 >= LOCKSTEP_RS2);
+op_JAL:
+    LOCKSTEP_WRITE(LOCKSTEP_SPLAT(op->link));
+    group_pc += op->imm;
+    op++;
+    goto leave_block;
+op_JALR:
+{
+#ifdef LOCKSTEP_VECTORS
+    // Read the base before writing the link, they may be the same register.
+    // The target has bit 0 cleared.
+    lockstep_vector_t target = (x[op->rs1] + op->imm) & ~1u;
+    LOCKSTEP_WRITE(LOCKSTEP_SPLAT(op->link));
+    if (!lockstep_any((target ^ target[first]) & active))
+    {
+        group_pc = target[first];
+    }
+    else
+    {
+        pc = (target & active) | (pc & ~active);
+        diverged = true;
+    }
+#else
+    // The targets go to the lanes' PCs before the link is written, the base
+    // may be the same register. The target has bit 0 cleared.
+    bool same = true;
+    LOCKSTEP_FOR_EACH_LANE(pc[l] = (x[op->rs1][l] + op->imm) & ~1u; same = same && pc[l] == pc[first]);
+    LOCKSTEP_WRITE(op->link);
+    if (same)
+    {
+        group_pc = pc[first];
+    }
+    else
+    {
+        diverged = true;
+    }
+#endif
+    op++;
+    goto leave_block;
+}
+
+// Halts and instructions without a lane handler run on the processors
+op_HALT:
+op_GENERIC:
+    scalar = true;
+    goto leave_block;
+
+// A block cut short ends in an END that runs nothing
+op_END:
+    goto leave_block;
+
+leave_block:
+    // Every instruction before op ran
+    executed += (uint64_t)(op - block->ops);
+    if (!scalar && !diverged && executed < budget && group_pc < waiting_pc)
+    {
+        goto next_block;
+    }
+
+done:
+    for (uint32_t mask = active_lanes; mask != 0; mask &= mask - 1)
+    {
+        uint32_t lane = LOCKSTEP_LOWEST_LANE(mask);
+        if (!diverged)
+        {
+            pc[lane] = group_pc;
+        }
+        instruction_count[lane] += executed;
+        runnable[lane] = instruction_count[lane] < stop_count[lane];
+    }
+    if (scalar)
+    {
+        step_scalar();
+    }
+}
+
+void LockstepEngine::step_scalar()
+{
+    scalar_only = false;
+    for (uint32_t lane = 0; lane < lane_count; lane++)
+    {
+        if (active_lanes & (1u << lane))
+        {
+            store_lane(lane);
+            lanes[lane]->execute_instruction();
+            load_lane(lane);
+            runnable[lane] = !lanes[lane]->halt && instruction_count[lane] < stop_count[lane];
+        }
+        scalar_only = scalar_only || lanes[lane]->hpm_active;
+    }
+}
+
+void LockstepEngine::store_lane(uint32_t lane)
+{
+    Processor *processor = lanes[lane];
+    uint32_t *registers = processor->registers.data();
+    for (int reg = 1; reg < 32; reg++)
+    {
+        registers[reg] = x[reg][lane];
+    }
+    processor->pc = pc[lane];
+    processor->instruction_count = instruction_count[lane];
+}
+
+void LockstepEngine::load_lane(uint32_t lane)
+{
+    Processor *processor = lanes[lane];
+    const uint32_t *registers = processor->registers.data();
+    for (int reg = 0; reg < 32; reg++)
+    {
+        x[reg][lane] = registers[reg];
+    }
+    pc[lane] = processor->pc;
+    instruction_count[lane] = processor->instruction_count;
+}
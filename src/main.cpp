@@ -1,26 +1,850 @@
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
 #include "ram.h"
 #include "processor.h"
+#include "elf_loader.h"
+#include "checkpoint.h"
+#include "profiler.h"
+#include "farm.h"
+#include "lockstep_engine.h"
+#include "uart.h"
+#include "finisher.h"
+#include "syscall_proxy.h"
+#include "timing_model.h"
+#include "cache_simulator.h"
+#include "trace_recorder.h"
+#include "gdb_server.h"
+#include "trace.h"
 
-int main()
+static void usage(const char *program)
 {
+    fprintf(stderr, "Usage: %s [-e engine] [-n instructions] [-w milliseconds] [-u address|symbol] [-p harts] [-r checkpoint] [-s checkpoint] [-f profile] [-i instructions] [-x trace] [-g port|path] [-G] [-W watch] [-H count] [-d pages] [-b] [-D] [-t level|category=level,...] [program]\n", program);
+    fprintf(stderr, "       %s -F manifest [-j threads] [-L lanes] [-o results] [-e engine] [-n instructions] [-t ...]\n", program);
+    fprintf(stderr, "  -e  Execution engine (reference, threaded, jit)\n");
+    fprintf(stderr, "  -n  Stop after this many instructions\n");
+    fprintf(stderr, "  -w  Stop after this much wall clock time\n");
+    fprintf(stderr, "  -u  Stop when execution reaches an address or ELF symbol\n");
+    fprintf(stderr, "  -p  Number of harts, each on its own thread (hart ID in a0)\n");
+    fprintf(stderr, "  -r  Resume from a checkpoint instead of loading a program\n");
+    fprintf(stderr, "  -s  Save a checkpoint when the run stops\n");
+    fprintf(stderr, "  -f  Sample guest call stacks into a folded stack file\n");
+    fprintf(stderr, "  -i  Instructions between samples (default %d)\n", PROFILER_DEFAULT_INTERVAL);
+    fprintf(stderr, "  -T  Estimate cycles with a pipeline timing model: a branch\n");
+    fprintf(stderr, "      predictor (static, bimodal, gshare) and settings (bits,\n");
+    fprintf(stderr, "      history, load, mul, mispredict, taken), e.g. gshare,mul=4\n");
+    fprintf(stderr, "  -C  Simulate caches: default, or any of l1i, l1d and l2 as\n");
+    fprintf(stderr, "      name=size:line:ways[:lru|fifo|random][:wb|wt], e.g.\n");
+    fprintf(stderr, "      l1d=32k:64:8,l2=256k:64:8:random\n");
+    fprintf(stderr, "  -x  Record an execution trace for riscv_trace, a file per\n");
+    fprintf(stderr, "      hart with .N appended when there are several\n");
+    fprintf(stderr, "  -g  Serve GDB for hart 0 on a localhost TCP port or a Unix socket\n");
+    fprintf(stderr, "  -G  Wait for GDB to connect before running\n");
+    fprintf(stderr, "  -W  Stop when memory is accessed: address|symbol[:length]\n");
+    fprintf(stderr, "      [:read|write|access|change], length from the symbol or 4,\n");
+    fprintf(stderr, "      write by default, e.g. counter:4:change (repeatable)\n");
+    fprintf(stderr, "  -H  Report the last count PCs when a watchpoint stops a hart\n");
+    fprintf(stderr, "  -d  Pages in the memory dump (all, written since loading, none)\n");
+    fprintf(stderr, "  -b  Dump memory as raw bytes to memsim.bin instead of memsim.hex\n");
+    fprintf(stderr, "  -D  Map a UART at 0x%08X and a test finisher at 0x%08X\n", UART_BASE, FINISHER_BASE);
+    fprintf(stderr, "  -F  Run every job in a manifest on a pool of threads\n");
+    fprintf(stderr, "  -j  Threads for -F (default one per host core)\n");
+    fprintf(stderr, "  -L  Jobs of one program each thread runs in lockstep (1-%d)\n", LOCKSTEP_LANES);
+    fprintf(stderr, "  -o  File for the -F results (default stdout)\n");
+    fprintf(stderr, "  -t  Trace levels (none, error, warning, info, debug) for all\n");
+    fprintf(stderr, "      categories or per category (general, decode, regfile,\n");
+    fprintf(stderr, "      memory, branch, loader)\n");
+    fprintf(stderr, "The program is an ELF executable or Intel HEX image\n");
+    fprintf(stderr, "(meminit.hex by default)\n");
+}
+
+// Processors to stop on SIGINT
+static std::vector<Processor *> running_processors;
+
+static void handle_interrupt(int signal_number)
+{
+    (void)signal_number;
+    for (size_t i = 0; i < running_processors.size(); i++)
+    {
+        running_processors[i]->request_stop();
+    }
+}
+
+// Run limits from the command line
+typedef struct
+{
+    uint64_t max_instructions;
+    uint32_t timeout_ms;
+    bool use_stop_address;
+    uint32_t stop_address;
+} run_limits_t;
+
+static run_result_t run_limited(Processor *processor, const run_limits_t &limits, uint64_t max_instructions, uint32_t timeout_ms)
+{
+    run_result_t result;
+    if (limits.use_stop_address)
+    {
+        result = processor->run_until(limits.stop_address, max_instructions);
+    }
+    else if (timeout_ms != 0)
+    {
+        result = processor->run_for(timeout_ms, max_instructions);
+    }
+    else
+    {
+        result = processor->run(max_instructions);
+    }
+
+    // A watchpoint stops every hart where it is
+    if (result.reason == STOP_WATCHPOINT)
+    {
+        handle_interrupt(SIGINT);
+    }
+    return result;
+}
+
+// Parse a -W watchpoint, address|symbol[:length][:read|write|access|change]
+// (0 on success)
+static int parse_watch_spec(const char *spec, ElfLoader *elf, ram_watch_t *watch)
+{
+    std::string text = spec;
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true)
+    {
+        size_t colon = text.find(':', start);
+        fields.push_back(text.substr(start, colon == std::string::npos ? std::string::npos : colon - start));
+        if (colon == std::string::npos)
+        {
+            break;
+        }
+        start = colon + 1;
+    }
+    if (fields.size() > 3 || fields[0].empty())
+    {
+        return -1;
+    }
+
+    // Location, either a number or a symbol name with its size
+    uint32_t length = 4;
+    char *end;
+    uint32_t address = (uint32_t)strtoul(fields[0].c_str(), &end, 0);
+    if (*end != '\0')
+    {
+        const elf_symbol_t *symbol = elf->find_symbol(fields[0].c_str());
+        if (symbol == NULL)
+        {
+            return -1;
+        }
+        address = symbol->value;
+        if (symbol->size != 0)
+        {
+            length = symbol->size;
+        }
+    }
+
+    // Then a length and a kind, either one optional
+    uint32_t kinds = RAM_WATCH_WRITE;
+    for (size_t i = 1; i < fields.size(); i++)
+    {
+        const std::string &field = fields[i];
+        if (field == "read")
+        {
+            kinds = RAM_WATCH_READ;
+        }
+        else if (field == "write")
+        {
+            kinds = RAM_WATCH_WRITE;
+        }
+        else if (field == "access")
+        {
+            kinds = RAM_WATCH_ACCESS;
+        }
+        else if (field == "change")
+        {
+            kinds = RAM_WATCH_CHANGE;
+        }
+        else if (i == 1)
+        {
+            length = (uint32_t)strtoul(field.c_str(), &end, 0);
+            if (field.empty() || *end != '\0' || length == 0)
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    if ((uint64_t)address + length - 1 > UINT32_MAX)
+    {
+        return -1;
+    }
+
+    watch->start = address;
+    watch->last = address + length - 1;
+    watch->kinds = kinds;
+    return 0;
+}
+
+// An address with the symbol it is in, if any. Data addresses only take
+// sized symbols, a label before them says nothing.
+static std::string describe_address(ElfLoader *elf, uint32_t address, bool code)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "0x%08X", address);
+    std::string description = text;
+    const elf_symbol_t *symbol = elf->symbol_at(address);
+    if (symbol != NULL && (code || symbol->size != 0))
+    {
+        snprintf(text, sizeof(text), "+0x%X", address - symbol->value);
+        description += " <" + symbol->name + (address != symbol->value ? text : "") + ">";
+    }
+    return description;
+}
+
+// Tell what the access that stopped a hart did, and what led up to it
+static void report_watch_hit(Processor *processor, ElfLoader *elf, const char *prefix)
+{
+    const watch_hit_t &hit = processor->get_watch_hit();
+    const char *kind = hit.kind == RAM_WATCH_ACCESS ? "update" : hit.kind == RAM_WATCH_WRITE ? "write" : "read";
+    fprintf(stderr, "%sWatchpoint 0x%08X-0x%08X: %s of %u bytes at %s by %s\n", prefix, hit.watch.start, hit.watch.last, kind,
+            hit.size, describe_address(elf, hit.address, false).c_str(), describe_address(elf, hit.pc, true).c_str());
+    if (hit.kind == RAM_WATCH_READ)
+    {
+        fprintf(stderr, "%s  Value 0x%0*X\n", prefix, hit.size * 2, hit.old_value);
+    }
+    else
+    {
+        fprintf(stderr, "%s  Old value 0x%0*X, new value 0x%0*X\n", prefix, hit.size * 2, hit.old_value, hit.size * 2,
+                hit.new_value);
+    }
+
+    std::vector<uint32_t> history = processor->get_pc_history();
+    if (!history.empty())
+    {
+        fprintf(stderr, "%s  Last %u PCs, oldest first:\n", prefix, (uint32_t)history.size());
+        for (size_t i = 0; i < history.size(); i++)
+        {
+            fprintf(stderr, "%s    %s\n", prefix, describe_address(elf, history[i], true).c_str());
+        }
+    }
+}
+
+// Run a hart within the limits. With a debugger the run stops whenever it
+// connects and goes on with what is left of the limits once it detaches.
+static run_result_t run_hart(Processor *processor, const run_limits_t &limits, GdbServer *debugger)
+{
+    if (debugger == NULL)
+    {
+        return run_limited(processor, limits, limits.max_instructions, limits.timeout_ms);
+    }
+
+    uint64_t first_instruction = processor->get_instruction_count();
+    auto start = std::chrono::steady_clock::now();
+    run_result_t result;
+    while (true)
+    {
+        if (debugger->is_pending() && debugger->serve() == GDB_KILLED)
+        {
+            // As Ctrl+C would, for every hart
+            handle_interrupt(SIGINT);
+            result.reason = STOP_REQUESTED;
+            break;
+        }
+        if (processor->is_halted())
+        {
+            result.reason = STOP_HALTED;
+            break;
+        }
+
+        uint64_t executed = processor->get_instruction_count() - first_instruction;
+        uint64_t max_instructions = RUN_UNLIMITED;
+        if (limits.max_instructions != RUN_UNLIMITED)
+        {
+            if (executed >= limits.max_instructions)
+            {
+                result.reason = STOP_BUDGET;
+                break;
+            }
+            max_instructions = limits.max_instructions - executed;
+        }
+        uint32_t timeout_ms = 0;
+        if (limits.timeout_ms != 0)
+        {
+            uint64_t elapsed = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            if (elapsed >= limits.timeout_ms)
+            {
+                result.reason = STOP_TIMEOUT;
+                break;
+            }
+            timeout_ms = (uint32_t)(limits.timeout_ms - elapsed);
+        }
+
+        // Only a debugger connecting sends the hart round again
+        result = run_limited(processor, limits, max_instructions, timeout_ms);
+        if (result.reason != STOP_REQUESTED || !debugger->is_pending())
+        {
+            break;
+        }
+    }
+    result.instructions = processor->get_instruction_count() - first_instruction;
+    result.pc = processor->get_pc();
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    engine_t engine = ENGINE_REFERENCE;
+    uint64_t max_instructions = RUN_UNLIMITED;
+    uint32_t timeout_ms = 0;
+    const char *stop_spec = NULL;
+    uint32_t hart_count = 1;
+    const char *restore_file = NULL;
+    const char *save_file = NULL;
+    const char *profile_file = NULL;
+    uint64_t profile_interval = PROFILER_DEFAULT_INTERVAL;
+    const char *manifest_file = NULL;
+    uint32_t farm_threads = 0;
+    uint32_t farm_lanes = 1;
+    const char *results_file = NULL;
+    const char *program_file = "meminit.hex";
+    const char *dump_pages = "all";
+    bool dump_binary = false;
+    bool use_devices = false;
+    bool use_timing = false;
+    timing_config_t timing_config;
+    timing_default_config(&timing_config);
+    bool use_caches = false;
+    cache_hierarchy_config_t cache_config;
+    cache_default_config(&cache_config);
+    const char *trace_file = NULL;
+    const char *gdb_address = NULL;
+    bool gdb_wait = false;
+    std::vector<const char *> watch_specs;
+    uint32_t history_count = 0;
+
+    // Parse command line options
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "reference") == 0)
+            {
+                engine = ENGINE_REFERENCE;
+            }
+            else if (strcmp(argv[i], "threaded") == 0)
+            {
+                engine = ENGINE_THREADED;
+            }
+            else if (strcmp(argv[i], "jit") == 0)
+            {
+                engine = ENGINE_JIT;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown engine %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            max_instructions = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+        {
+            timeout_ms = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+        {
+            stop_spec = argv[++i];
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            hart_count = (uint32_t)strtoul(argv[++i], NULL, 0);
+            if (hart_count == 0)
+            {
+                fprintf(stderr, "Invalid hart count %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            restore_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            save_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+        {
+            profile_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+        {
+            profile_interval = strtoull(argv[++i], NULL, 0);
+            if (profile_interval == 0)
+            {
+                fprintf(stderr, "Invalid sample interval %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc)
+        {
+            manifest_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            farm_threads = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc)
+        {
+            farm_lanes = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            results_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+        {
+            use_timing = true;
+            if (timing_parse_spec(argv[++i], &timing_config) != 0)
+            {
+                fprintf(stderr, "Invalid timing spec %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc)
+        {
+            use_caches = true;
+            if (cache_parse_spec(argv[++i], &cache_config) != 0)
+            {
+                fprintf(stderr, "Invalid cache spec %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+        {
+            trace_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+        {
+            gdb_address = argv[++i];
+        }
+        else if (strcmp(argv[i], "-G") == 0)
+        {
+            gdb_wait = true;
+        }
+        else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc)
+        {
+            watch_specs.push_back(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc)
+        {
+            history_count = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            dump_pages = argv[++i];
+            if (strcmp(dump_pages, "all") != 0 && strcmp(dump_pages, "written") != 0 && strcmp(dump_pages, "none") != 0)
+            {
+                fprintf(stderr, "Unknown dump pages %s\n", dump_pages);
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            dump_binary = true;
+        }
+        else if (strcmp(argv[i], "-D") == 0)
+        {
+            use_devices = true;
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            if (trace_parse_spec(argv[++i]) != 0)
+            {
+                fprintf(stderr, "Invalid trace spec %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (argv[i][0] != '-')
+        {
+            program_file = argv[i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Farm mode runs its own programs and reports on all of them at once
+    if (manifest_file != NULL)
+    {
+        Farm farm(engine, farm_threads, farm_lanes);
+        if (farm.load_manifest(manifest_file, max_instructions) != 0)
+        {
+            fprintf(stderr, "Unable to read manifest %s\n", manifest_file);
+            return 1;
+        }
+        farm.run();
+        return farm.write_results(results_file) == 0 ? 0 : 1;
+    }
+
     RAM ram;
-    Processor processor(&ram, 0x00000000);
 
-    // Load memory image
-    ram.load_memory_ihex("meminit.hex");
+    // Load the program, ELF files and HEX start address records bring their
+    // own entry point. A checkpoint brings everything, including the number
+    // of harts.
+    ElfLoader elf;
+    Checkpoint checkpoint;
+    uint32_t entry = 0x00000000;
+    if (restore_file != NULL)
+    {
+        if (checkpoint.open(restore_file) != 0)
+        {
+            fprintf(stderr, "Unable to open checkpoint %s\n", restore_file);
+            return 1;
+        }
+        hart_count = checkpoint.get_hart_count();
+    }
+    else if (ElfLoader::is_elf(program_file))
+    {
+        if (elf.load(program_file, &ram) != 0)
+        {
+            fprintf(stderr, "Unable to load %s\n", program_file);
+            return 1;
+        }
+        entry = elf.get_entry();
+    }
+    else
+    {
+        if (ram.load_memory_ihex(program_file, &entry) != 0)
+        {
+            fprintf(stderr, "Unable to load %s\n", program_file);
+            return 1;
+        }
+    }
+
+    // Stop address, either a number or a symbol name
+    run_limits_t limits;
+    limits.max_instructions = max_instructions;
+    limits.timeout_ms = timeout_ms;
+    limits.use_stop_address = stop_spec != NULL;
+    limits.stop_address = 0;
+    if (stop_spec != NULL)
+    {
+        char *end;
+        limits.stop_address = (uint32_t)strtoul(stop_spec, &end, 0);
+        if (*end != '\0')
+        {
+            const elf_symbol_t *symbol = elf.find_symbol(stop_spec);
+            if (symbol == NULL)
+            {
+                fprintf(stderr, "Unknown symbol %s\n", stop_spec);
+                return 1;
+            }
+            limits.stop_address = symbol->value;
+        }
+    }
+
+    // Watchpoints, with symbols resolved from the ELF file
+    std::vector<ram_watch_t> watches;
+    for (size_t i = 0; i < watch_specs.size(); i++)
+    {
+        ram_watch_t watch;
+        if (parse_watch_spec(watch_specs[i], &elf, &watch) != 0)
+        {
+            fprintf(stderr, "Invalid watchpoint %s\n", watch_specs[i]);
+            return 1;
+        }
+        watches.push_back(watch);
+    }
+
+    // Hart 0 uses the RAM directly, the others get views of it with their
+    // own TLBs
+    std::vector<RAM *> views;
+    std::vector<Processor *> processors;
+    for (uint32_t hart = 0; hart < hart_count; hart++)
+    {
+        RAM *hart_ram = &ram;
+        if (hart != 0)
+        {
+            hart_ram = new RAM(&ram);
+            views.push_back(hart_ram);
+        }
+        processors.push_back(new Processor(hart_ram, entry, engine, hart));
+    }
+    if (restore_file != NULL && checkpoint.restore(processors.data(), hart_count, &ram) != 0)
+    {
+        fprintf(stderr, "Unable to restore checkpoint %s\n", restore_file);
+        return 1;
+    }
+
+    // ECALL runs host system calls, with the heap after an ELF image
+    SyscallProxy syscalls;
+    syscalls.set_break(elf.get_end());
+    for (uint32_t hart = 0; hart < hart_count; hart++)
+    {
+        syscalls.add_processor(processors[hart]);
+        processors[hart]->set_syscalls(&syscalls);
+    }
+
+    // Devices are shared by every hart, the finisher stops them all
+    Uart *uart = NULL;
+    Finisher *finisher = NULL;
+    if (use_devices)
+    {
+        uart = new Uart(stdout);
+        finisher = new Finisher();
+        for (uint32_t hart = 0; hart < hart_count; hart++)
+        {
+            finisher->add_processor(processors[hart]);
+        }
+        ram.add_device(UART_BASE, UART_SIZE, uart);
+        ram.add_device(FINISHER_BASE, FINISHER_SIZE, finisher);
+    }
+
+    // Only what the guest writes from here on goes in a dump of written pages
+    bool dump_written = strcmp(dump_pages, "written") == 0;
+    if (dump_written)
+    {
+        ram.mark_clean();
+    }
+
+    // Profile every hart into one set of stacks
+    std::vector<Profiler *> profilers;
+    if (profile_file != NULL)
+    {
+        for (uint32_t hart = 0; hart < hart_count; hart++)
+        {
+            profilers.push_back(new Profiler(profile_interval));
+            processors[hart]->set_profiler(profilers[hart]);
+        }
+    }
 
-    // Execute instructions
-    while (!processor.is_halted())
+    // Every hart has its own pipeline
+    std::vector<TimingModel *> timing_models;
+    if (use_timing)
     {
-        processor.execute_instruction();
+        for (uint32_t hart = 0; hart < hart_count; hart++)
+        {
+            timing_models.push_back(new TimingModel(timing_config));
+            processors[hart]->set_timing(timing_models[hart]);
+        }
+    }
+
+    // And its own caches
+    std::vector<CacheSimulator *> cache_simulators;
+    if (use_caches)
+    {
+        for (uint32_t hart = 0; hart < hart_count; hart++)
+        {
+            cache_simulators.push_back(new CacheSimulator(cache_config, &elf));
+            processors[hart]->set_caches(cache_simulators[hart]);
+        }
+    }
+
+    // Every hart is traced into a file of its own
+    std::vector<TraceRecorder *> recorders;
+    if (trace_file != NULL)
+    {
+        for (uint32_t hart = 0; hart < hart_count; hart++)
+        {
+            std::string filename = trace_file;
+            if (hart_count > 1)
+            {
+                filename += "." + std::to_string(hart);
+            }
+            recorders.push_back(new TraceRecorder());
+            if (recorders[hart]->open(filename.c_str()) != 0)
+            {
+                fprintf(stderr, "Unable to create trace %s\n", filename.c_str());
+                return 1;
+            }
+            processors[hart]->set_recorder(recorders[hart]);
+        }
+    }
+
+    // Every hart watches through its own RAM view
+    for (uint32_t hart = 0; hart < hart_count; hart++)
+    {
+        for (size_t i = 0; i < watches.size(); i++)
+        {
+            processors[hart]->add_watchpoint(watches[i].start, watches[i].last - watches[i].start + 1, watches[i].kinds);
+        }
+        if (history_count != 0)
+        {
+            processors[hart]->set_pc_history(history_count);
+        }
+    }
+
+    // The debugger gets hart 0, the other harts run on while it is stopped
+    GdbServer *debugger = NULL;
+    if (gdb_address != NULL)
+    {
+        debugger = new GdbServer();
+        if (debugger->listen(gdb_address) != 0)
+        {
+            fprintf(stderr, "Unable to serve GDB on %s\n", gdb_address);
+            return 1;
+        }
+        if (gdb_wait)
+        {
+            fprintf(stderr, "Waiting for GDB on %s\n", gdb_address);
+            debugger->wait_for_debugger();
+        }
+        debugger->start(processors[0]);
+    }
+
+    // Execute instructions, Ctrl+C stops the guest and still dumps its state
+    running_processors = processors;
+    signal(SIGINT, handle_interrupt);
+
+    std::vector<run_result_t> results(hart_count);
+    std::vector<std::thread> threads;
+    for (uint32_t hart = 1; hart < hart_count; hart++)
+    {
+        threads.push_back(std::thread([&processors, &results, &limits, hart]() {
+            results[hart] = run_hart(processors[hart], limits, NULL);
+        }));
+    }
+    results[0] = run_hart(processors[0], limits, debugger);
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    if (debugger != NULL)
+    {
+        debugger->stop();
+    }
+
+    signal(SIGINT, SIG_DFL);
+    running_processors.clear();
+
+    // Guest output comes before the state dumps
+    if (uart != NULL)
+    {
+        uart->stop();
+    }
+
+    // Harts stopped by the finisher or an exit ran to completion
+    bool finished = (finisher != NULL && finisher->is_finished()) || syscalls.has_exited();
+    for (uint32_t hart = 0; hart < hart_count; hart++)
+    {
+        if (results[hart].reason == STOP_HALTED || (finished && results[hart].reason == STOP_REQUESTED))
+        {
+            continue;
+        }
+        if (hart_count > 1)
+        {
+            fprintf(stderr, "Hart %u stopped at 0x%08X: %s\n", hart, results[hart].pc, STOP_REASON_STR[results[hart].reason]);
+        }
+        else
+        {
+            fprintf(stderr, "Stopped at 0x%08X: %s\n", results[hart].pc, STOP_REASON_STR[results[hart].reason]);
+        }
+        if (results[hart].reason == STOP_WATCHPOINT)
+        {
+            report_watch_hit(processors[hart], &elf, hart_count > 1 ? "  " : "");
+        }
     }
 
     // Dump processor state
-    processor.dump_state();
+    for (uint32_t hart = 0; hart < hart_count; hart++)
+    {
+        if (hart_count > 1)
+        {
+            printf("\nHart %u:", hart);
+        }
+        processors[hart]->dump_state();
+        if (use_timing)
+        {
+            timing_models[hart]->report(stdout);
+        }
+        if (use_caches)
+        {
+            cache_simulators[hart]->report(stdout);
+        }
+    }
 
     // Dump memory image
-    ram.dump_memory_ihex("memsim.hex", 0x00000000, RAM_SIZE_WORDS * 4 - 4);
+    if (strcmp(dump_pages, "none") != 0)
+    {
+        if (dump_binary)
+        {
+            ram.dump_memory_bin("memsim.bin", 0x00000000, 0xFFFFFFFC, dump_written);
+        }
+        else
+        {
+            ram.dump_memory_ihex("memsim.hex", 0x00000000, 0xFFFFFFFC, dump_written);
+        }
+    }
 
-    return 0;
-}
\ No newline at end of file
+    int status = 0;
+    if (finisher != NULL && finisher->is_finished())
+    {
+        status = finisher->get_exit_code();
+    }
+    else if (syscalls.has_exited())
+    {
+        status = syscalls.get_exit_code();
+    }
+    if (profile_file != NULL && Profiler::write_folded(profile_file, profilers.data(), hart_count, &elf) != 0)
+    {
+        fprintf(stderr, "Unable to write profile %s\n", profile_file);
+        status = 1;
+    }
+    for (size_t i = 0; i < recorders.size(); i++)
+    {
+        if (recorders[i]->close() != 0)
+        {
+            fprintf(stderr, "Unable to write the trace of hart %u\n", (uint32_t)i);
+            status = 1;
+        }
+    }
+    if (save_file != NULL && Checkpoint::save(save_file, processors.data(), hart_count, &ram) != 0)
+    {
+        fprintf(stderr, "Unable to save checkpoint %s\n", save_file);
+        status = 1;
+    }
+
+    for (uint32_t hart = 0; hart < hart_count; hart++)
+    {
+        delete processors[hart];
+    }
+    for (size_t i = 0; i < views.size(); i++)
+    {
+        delete views[i];
+    }
+    for (size_t i = 0; i < profilers.size(); i++)
+    {
+        delete profilers[i];
+    }
+    for (size_t i = 0; i < timing_models.size(); i++)
+    {
+        delete timing_models[i];
+    }
+    for (size_t i = 0; i < cache_simulators.size(); i++)
+    {
+        delete cache_simulators[i];
+    }
+    for (size_t i = 0; i < recorders.size(); i++)
+    {
+        delete recorders[i];
+    }
+    delete debugger;
+    delete uart;
+    delete finisher;
+
+    return status;
+}
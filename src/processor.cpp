@@ -4,30 +4,122 @@
 #include "control.h"
 #include "alu.h"
 #include "trace.h"
+#include "threaded_engine.h"
+#include "jit_engine.h"
+#include "profiler.h"
+#include "syscall_proxy.h"
+#include "timing_model.h"
+#include "cache_simulator.h"
+#include "trace_recorder.h"
 
-Processor::Processor(RAM *ram, uint32_t start_address)
+const char *STOP_REASON_STR[] = {
+    "halted",
+    "instruction budget used up",
+    "breakpoint reached",
+    "timed out",
+    "stop requested",
+    "watchpoint hit",
+};
+static_assert(sizeof(STOP_REASON_STR) / sizeof(STOP_REASON_STR[0]) == STOP_REASON_COUNT, "every stop reason needs a name");
+
+// Guest words are used as host atomics in place
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && ATOMIC_INT_LOCK_FREE == 2, "32-bit atomics must be lock free");
+
+static inline std::atomic<uint32_t> *atomic_at(uint32_t *word)
+{
+    return reinterpret_cast<std::atomic<uint32_t> *>(word);
+}
+
+Processor::Processor(RAM *ram, uint32_t start_address, engine_t engine, uint32_t hart_id) : decode_cache(ram)
 {
     this->ram = ram;
+    this->engine = engine;
+    this->hart_id = hart_id;
+    stop_requested = false;
+    profiler = NULL;
+    syscalls = NULL;
+    timing = NULL;
+    caches = NULL;
+    recorder = NULL;
+    watch_triggered = false;
+    memset(&last_watch_hit, 0, sizeof(last_watch_hit));
+    pc_history_count = 0;
+    pc_history_next = 0;
+
+    threaded_engine = NULL;
+    jit_engine = NULL;
+#ifdef JIT_SUPPORTED
+    if (engine == ENGINE_JIT)
+    {
+        jit_engine = new JitEngine(this, ram, &decode_cache);
+        if (!jit_engine->has_code_buffer())
+        {
+            TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_WARNING, "JIT unable to get executable memory, using the threaded engine\n");
+            delete jit_engine;
+            jit_engine = NULL;
+            this->engine = ENGINE_THREADED;
+        }
+    }
+#else
+    if (engine == ENGINE_JIT)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_WARNING, "JIT not supported on this host, using the threaded engine\n");
+        this->engine = ENGINE_THREADED;
+    }
+#endif
+    if (this->engine == ENGINE_THREADED)
+    {
+        threaded_engine = new ThreadedEngine(this, ram, &decode_cache);
+    }
+
     reset(start_address);
 }
 
 Processor::~Processor()
 {
+    if (ram->has_watches())
+    {
+        ram->set_watch_observer(NULL);
+    }
+    delete threaded_engine;
+#ifdef JIT_SUPPORTED
+    delete jit_engine;
+#endif
 }
 
 void Processor::reset(uint32_t start_address)
 {
-    // Initialize registers to zero
+    // Initialize registers to zero, except a0 which tells harts apart
     registers.reset();
+    registers.set_reg(10, hart_id);
 
     // Initialize program counter to start address
     pc = start_address;
 
+    // Counters start from zero
+    memset(counter_offsets, 0, sizeof(counter_offsets));
+    memset(counter_frozen, 0, sizeof(counter_frozen));
+    counter_inhibit = 0;
+    memset(hpm_events, 0, sizeof(hpm_events));
+    memset(event_counts, 0, sizeof(event_counts));
+    hpm_active = false;
+    time_base = std::chrono::steady_clock::now();
+
+    // No reservation
+    reservation_valid = false;
+    reservation_address = 0;
+    reservation_value = 0;
+
     // Clear halt flag
     halt = false;
 
     // Clear instruction count
     instruction_count = 0;
+
+    // No run in progress
+    stop_count = RUN_UNLIMITED;
+    breakpoint_set = false;
+    breakpoint = 0;
 }
 
 bool Processor::is_halted()
@@ -35,28 +127,639 @@ bool Processor::is_halted()
     return halt;
 }
 
+void Processor::set_profiler(Profiler *profiler)
+{
+    this->profiler = profiler;
+    if (profiler != NULL)
+    {
+        profiler->start(pc, instruction_count);
+    }
+
+    // Translations only report calls to the profiler they were made for
+    fence_instructions();
+}
+
+void Processor::set_syscalls(SyscallProxy *syscalls)
+{
+    this->syscalls = syscalls;
+}
+
+void Processor::set_timing(TimingModel *timing)
+{
+    // Keep the cycle counters where they were
+    uint64_t cycle = counter_value(CSR_COUNTER_CYCLE, instruction_count);
+    this->timing = timing;
+    if (timing != NULL)
+    {
+        timing->reset();
+    }
+    set_counter(CSR_COUNTER_CYCLE, cycle);
+}
+
+void Processor::set_caches(CacheSimulator *caches)
+{
+    this->caches = caches;
+}
+
+void Processor::set_recorder(TraceRecorder *recorder)
+{
+    this->recorder = recorder;
+    if (recorder != NULL)
+    {
+        recorder->start(hart_id, pc, instruction_count, registers.data());
+    }
+}
+
+uint32_t Processor::get_register(int reg)
+{
+    return registers.get_reg(reg);
+}
+
+uint32_t Processor::get_pc()
+{
+    return pc;
+}
+
+uint64_t Processor::get_instruction_count()
+{
+    return instruction_count;
+}
+
+void Processor::set_register(int reg, uint32_t value)
+{
+    registers.set_reg(reg, value);
+}
+
+uint32_t Processor::get_hart_id()
+{
+    return hart_id;
+}
+
+run_result_t Processor::run(uint64_t max_instructions)
+{
+    breakpoint_set = false;
+    return run_limited(max_instructions, false, std::chrono::steady_clock::time_point());
+}
+
+run_result_t Processor::run_until(uint32_t address, uint64_t max_instructions)
+{
+    uint64_t start_count = instruction_count;
+
+    // Step off the address first so it can be used as a breakpoint
+    if (pc == address && max_instructions > 0 && !halt)
+    {
+        execute_instruction();
+        max_instructions--;
+    }
+
+    breakpoint_set = true;
+    breakpoint = address;
+#ifdef JIT_SUPPORTED
+    if (jit_engine != NULL)
+    {
+        jit_engine->stop_at(address);
+    }
+#endif
+    if (threaded_engine != NULL)
+    {
+        threaded_engine->stop_at(address);
+    }
+
+    run_result_t result = run_limited(max_instructions, false, std::chrono::steady_clock::time_point());
+    breakpoint_set = false;
+#ifdef JIT_SUPPORTED
+    if (jit_engine != NULL)
+    {
+        jit_engine->clear_stop(address);
+    }
+#endif
+    if (threaded_engine != NULL)
+    {
+        threaded_engine->clear_stop(address);
+    }
+
+    result.instructions = instruction_count - start_count;
+    return result;
+}
+
+run_result_t Processor::run_for(uint32_t milliseconds, uint64_t max_instructions)
+{
+    breakpoint_set = false;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+    return run_limited(max_instructions, true, deadline);
+}
+
+void Processor::add_breakpoint(uint32_t address)
+{
+    decode_cache.set_breakpoint(address, true);
+    invalidate_code(address, 2);
+}
+
+void Processor::remove_breakpoint(uint32_t address)
+{
+    decode_cache.set_breakpoint(address, false);
+    invalidate_code(address, 2);
+}
+
+bool Processor::has_breakpoint(uint32_t address)
+{
+    return decode_cache.has_breakpoint(address);
+}
+
+run_result_t Processor::step_over()
+{
+    uint32_t address = pc;
+    bool breakpoint_here = has_breakpoint(address);
+    if (breakpoint_here)
+    {
+        remove_breakpoint(address);
+    }
+    run_result_t result = run(1);
+    if (breakpoint_here)
+    {
+        add_breakpoint(address);
+    }
+    return result;
+}
+
+void Processor::add_watchpoint(uint32_t address, uint32_t length, uint32_t kinds)
+{
+    ram->set_watch_observer(this);
+    ram->add_watch(address, length, kinds);
+}
+
+void Processor::remove_watchpoint(uint32_t address, uint32_t length, uint32_t kinds)
+{
+    ram->remove_watch(address, length, kinds);
+}
+
+const watch_hit_t &Processor::get_watch_hit()
+{
+    return last_watch_hit;
+}
+
+void Processor::set_pc_history(uint32_t count)
+{
+    // A power of two, so the datapath only masks the index
+    uint32_t size = 1;
+    while (size < count)
+    {
+        size <<= 1;
+    }
+    pc_history.assign(count != 0 ? size : 0, 0);
+    pc_history_count = count;
+    pc_history_next = 0;
+}
+
+std::vector<uint32_t> Processor::get_pc_history()
+{
+    std::vector<uint32_t> history;
+    uint64_t count = pc_history_next < pc_history_count ? pc_history_next : pc_history_count;
+    for (uint64_t i = pc_history_next - count; i < pc_history_next; i++)
+    {
+        history.push_back(pc_history[i & (pc_history.size() - 1)]);
+    }
+    return history;
+}
+
+void Processor::watch_hit(const ram_watch_t &watch, uint32_t address, uint32_t size, uint32_t kind, uint32_t old_value,
+                          uint32_t new_value)
+{
+    // The first hit of an instruction is the one reported
+    if (watch_triggered)
+    {
+        return;
+    }
+    watch_triggered = true;
+
+    // The PC is only current on the datapath, the engines fill it in when
+    // they leave the block
+    last_watch_hit.pc = pc;
+    last_watch_hit.address = address;
+    last_watch_hit.size = size;
+    last_watch_hit.kind = kind;
+    last_watch_hit.old_value = old_value;
+    last_watch_hit.new_value = new_value;
+    last_watch_hit.watch = watch;
+    TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_INFO, "Watchpoint hit at 0x%08X\n", address);
+
+    // The datapath stops after this instruction, the engines after this
+    // access
+    stop_count = 0;
+#ifdef JIT_SUPPORTED
+    if (jit_engine != NULL)
+    {
+        jit_engine->watch_hit();
+    }
+#endif
+    if (threaded_engine != NULL)
+    {
+        threaded_engine->watch_hit();
+    }
+}
+
+void Processor::request_stop()
+{
+    stop_requested = true;
+#ifdef JIT_SUPPORTED
+    if (jit_engine != NULL)
+    {
+        jit_engine->request_stop();
+    }
+#endif
+}
+
+run_result_t Processor::run_limited(uint64_t max_instructions, bool use_deadline, std::chrono::steady_clock::time_point deadline)
+{
+    uint64_t start_count = instruction_count;
+    uint64_t end_count = max_instructions > RUN_UNLIMITED - start_count ? RUN_UNLIMITED : start_count + max_instructions;
+    watch_triggered = false;
+
+    stop_reason_t reason;
+    while (true)
+    {
+        // Only look at the clock between slices
+        stop_count = end_count;
+        if (use_deadline && end_count - instruction_count > RUN_DEADLINE_SLICE)
+        {
+            stop_count = instruction_count + RUN_DEADLINE_SLICE;
+        }
+
+        // Stop for the next profiler sample as well
+        if (profiler != NULL && profiler->next_sample() < stop_count)
+        {
+            stop_count = profiler->next_sample();
+        }
+
+        // The timing model, the cache simulator, the trace recorder and the
+        // PC history are only fed by the datapath
+        if (timing == NULL && caches == NULL && recorder == NULL && pc_history.empty())
+        {
+#ifdef JIT_SUPPORTED
+            if (jit_engine != NULL)
+            {
+                jit_engine->run();
+            }
+#endif
+            if (threaded_engine != NULL)
+            {
+                threaded_engine->run();
+            }
+        }
+        reason = run_reference();
+
+        if (profiler != NULL && instruction_count >= profiler->next_sample())
+        {
+            profiler->sample(pc, instruction_count);
+        }
+
+        // A watchpoint ends the budget early
+        if (watch_triggered && reason != STOP_HALTED)
+        {
+            reason = STOP_WATCHPOINT;
+            break;
+        }
+        if (reason != STOP_BUDGET || stop_count == end_count)
+        {
+            break;
+        }
+        if (use_deadline && std::chrono::steady_clock::now() >= deadline)
+        {
+            reason = STOP_TIMEOUT;
+            break;
+        }
+    }
+    stop_count = RUN_UNLIMITED;
+
+    if (reason == STOP_REQUESTED)
+    {
+        stop_requested = false;
+    }
+
+    TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_INFO, "Run stopped at 0x%08X: %s\n", pc, STOP_REASON_STR[reason]);
+
+    run_result_t result;
+    result.reason = reason;
+    result.instructions = instruction_count - start_count;
+    result.pc = pc;
+    return result;
+}
+
+// Eight datapaths in a row, starting from some features
+#define DATAPATH_EIGHT(first)                                                                \
+    &Processor::run_datapath<(first)>, &Processor::run_datapath<(first) + 1>,                \
+        &Processor::run_datapath<(first) + 2>, &Processor::run_datapath<(first) + 3>,        \
+        &Processor::run_datapath<(first) + 4>, &Processor::run_datapath<(first) + 5>,        \
+        &Processor::run_datapath<(first) + 6>, &Processor::run_datapath<(first) + 7>
+
+stop_reason_t Processor::run_reference()
+{
+    typedef bool (Processor::*datapath_t)(stop_reason_t *);
+    static const datapath_t datapaths[DATAPATH_VARIANTS] = {
+        DATAPATH_EIGHT(0),
+        DATAPATH_EIGHT(8),
+        DATAPATH_EIGHT(16),
+        DATAPATH_EIGHT(24),
+        DATAPATH_EIGHT(32),
+        DATAPATH_EIGHT(40),
+        DATAPATH_EIGHT(48),
+        DATAPATH_EIGHT(56),
+        DATAPATH_EIGHT(64),
+        DATAPATH_EIGHT(72),
+        DATAPATH_EIGHT(80),
+        DATAPATH_EIGHT(88),
+        DATAPATH_EIGHT(96),
+        DATAPATH_EIGHT(104),
+        DATAPATH_EIGHT(112),
+        DATAPATH_EIGHT(120),
+    };
+
+    // A CSR write can start or stop event counting in the middle of a run
+    stop_reason_t reason;
+    while (!(this->*datapaths[datapath_features()])(&reason))
+    {
+    }
+    return reason;
+}
+
+uint32_t Processor::datapath_features()
+{
+    uint32_t features = 0;
+    if (TRACE_ENABLED(TRACE_CAT_REGFILE, TRACE_LEVEL_DEBUG) || TRACE_ENABLED(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG) ||
+        TRACE_ENABLED(TRACE_CAT_BRANCH, TRACE_LEVEL_DEBUG))
+    {
+        features |= DATAPATH_TRACE;
+    }
+    if (hpm_active)
+    {
+        features |= DATAPATH_EVENTS;
+    }
+    if (profiler != NULL)
+    {
+        features |= DATAPATH_PROFILE;
+    }
+    if (timing != NULL)
+    {
+        features |= DATAPATH_TIMING;
+    }
+    if (caches != NULL)
+    {
+        features |= DATAPATH_CACHES;
+    }
+    if (recorder != NULL)
+    {
+        features |= DATAPATH_RECORD;
+    }
+    if (!pc_history.empty())
+    {
+        features |= DATAPATH_HISTORY;
+    }
+    return features;
+}
+
+template <uint32_t FEATURES>
+bool Processor::run_datapath(stop_reason_t *reason)
+{
+    while (true)
+    {
+        if (halt)
+        {
+            *reason = STOP_HALTED;
+            return true;
+        }
+        if (instruction_count >= stop_count)
+        {
+            *reason = STOP_BUDGET;
+            return true;
+        }
+        if (breakpoint_set && pc == breakpoint)
+        {
+            *reason = STOP_BREAKPOINT;
+            return true;
+        }
+        if (stop_requested.load(std::memory_order_relaxed))
+        {
+            *reason = STOP_REQUESTED;
+            return true;
+        }
+        if (hpm_active != ((FEATURES & DATAPATH_EVENTS) != 0))
+        {
+            return false;
+        }
+
+        execute<FEATURES>();
+    }
+}
+
+template <uint32_t FEATURES>
+uint32_t Processor::read_register(uint32_t reg)
+{
+    // Decoded register numbers are 5 bits, and x0 is never written
+    if (FEATURES & DATAPATH_TRACE)
+    {
+        return registers.get_reg(reg);
+    }
+    return registers.data()[reg];
+}
+
+template <uint32_t FEATURES>
+void Processor::write_register(uint32_t reg, uint32_t value)
+{
+    if (FEATURES & DATAPATH_TRACE)
+    {
+        registers.set_reg(reg, value);
+        return;
+    }
+    registers.data()[reg != 0 ? reg : REGISTER_SINK] = value;
+}
+
 void Processor::execute_instruction()
+{
+    execute<DATAPATH_ALL>();
+}
+
+template <uint32_t FEATURES>
+void Processor::execute()
 {
     // Count the instruction
     instruction_count++;
 
-    // Fetch the instruction
-    uint32_t instruction = ram->load_instruction(pc);
+    // Fetch and decode the instruction (only on the first visit to this PC)
+    const control_t &ctrl = *decode_cache.lookup(pc);
 
-    // Decode the instruction
-    control_t ctrl;
-    control(&ctrl, instruction);
+    // A breakpoint doesn't run the instruction, so the tools mustn't see it
+    const uint32_t OUTER = DATAPATH_TIMING | DATAPATH_CACHES | DATAPATH_RECORD | DATAPATH_HISTORY;
+    const uint32_t INNER = FEATURES & ~OUTER;
+    if ((FEATURES & OUTER) && ctrl.breakpoint)
+    {
+        execute_decoded<INNER>(ctrl);
+        return;
+    }
 
-    // Check for halt
+    if ((FEATURES & DATAPATH_HISTORY) && !pc_history.empty())
+    {
+        pc_history[pc_history_next++ & (pc_history.size() - 1)] = pc;
+    }
+
+    // The caches see the data address before the instruction can change
+    // the register it comes from
+    if ((FEATURES & DATAPATH_CACHES) && caches != NULL)
+    {
+        simulate_caches(ctrl);
+    }
+
+    bool timed = (FEATURES & DATAPATH_TIMING) && timing != NULL;
+    bool recorded = (FEATURES & DATAPATH_RECORD) && recorder != NULL;
+    if (!timed && !recorded)
+    {
+        execute_decoded<INNER>(ctrl);
+        return;
+    }
+
+    // The timing model needs to know where the instruction went, and the
+    // trace what it accessed before it could change the registers involved
+    uint32_t instruction_pc = pc;
+    uint32_t address = 0;
+    uint32_t store_value = 0;
+    if (recorded)
+    {
+        const uint32_t *regs = registers.data();
+        address = regs[ctrl.rs1] + (ctrl.amo != AMO_NONE ? 0 : ctrl.imm);
+        store_value = regs[ctrl.rs2];
+    }
+    execute_decoded<INNER>(ctrl);
+    if (timed)
+    {
+        timing->retire(ctrl, instruction_pc, pc);
+    }
+    if (recorded)
+    {
+        record_instruction(ctrl, instruction_pc, address, store_value);
+    }
+}
+
+void Processor::simulate_caches(const control_t &ctrl)
+{
+    caches->fetch(pc, ctrl.length);
+    const uint32_t *regs = registers.data();
+    if (ctrl.amo != AMO_NONE)
+    {
+        // Only LR.W leaves the word alone
+        caches->data(regs[ctrl.rs1], 4, ctrl.amo != AMO_LR);
+    }
+    else if (ctrl.mem_read || ctrl.mem_write)
+    {
+        // Sizes are coded 1, 2 and 3 for 1, 2 and 4 bytes
+        uint32_t code = ctrl.mem_write ? ctrl.mem_write : ctrl.mem_read;
+        caches->data(regs[ctrl.rs1] + ctrl.imm, 1u << (code - 1), ctrl.mem_write != 0);
+    }
+}
+
+void Processor::record_instruction(const control_t &ctrl, uint32_t instruction_pc, uint32_t address, uint32_t store_value)
+{
+    trace_record_t record;
+    record.pc = instruction_pc;
+    record.length = ctrl.length;
+    record.rd = 0;
+    record.size = 0;
+    record.write = false;
+    record.has_data = false;
+    record.address = address;
+    record.data = 0;
+
+    if (ctrl.halt || halt)
+    {
+        // Nothing was done by an instruction that halted, an ECALL the
+        // system call proxy took returns in a0
+        if (ctrl.ecall && pc != instruction_pc)
+        {
+            record.rd = 10;
+        }
+    }
+    else if (ctrl.amo != AMO_NONE)
+    {
+        // Only LR.W leaves the word alone, SC.W counts as a write even if
+        // it fails
+        record.rd = (uint8_t)ctrl.rd;
+        record.size = 4;
+        record.write = ctrl.amo != AMO_LR;
+    }
+    else if (ctrl.mem_write)
+    {
+        // Sizes are coded 1, 2 and 3 for 1, 2 and 4 bytes
+        record.size = (uint8_t)(1u << (ctrl.mem_write - 1));
+        record.write = true;
+        record.has_data = true;
+        record.data = record.size == 4 ? store_value : store_value & ((1u << (8 * record.size)) - 1);
+    }
+    else if (!ctrl.branch && !ctrl.fence && !ctrl.fence_i)
+    {
+        record.rd = (uint8_t)ctrl.rd;
+        if (ctrl.mem_read)
+        {
+            record.size = (uint8_t)(1u << (ctrl.mem_read - 1));
+        }
+    }
+    record.value = registers.data()[record.rd];
+    recorder->record(record);
+}
+
+template <uint32_t FEATURES>
+void Processor::execute_decoded(const control_t &ctrl)
+{
+    // Memory traces are compiled in with the other traces
+    const bool TRACED = (FEATURES & DATAPATH_TRACE) != 0;
+
+    // Check for halt, ECALL carries on if the system call proxy handled it
     if (ctrl.halt)
     {
+        // A breakpoint leaves the instruction uncounted and stops the run
+        // the way a run_until() address does
+        if (ctrl.breakpoint)
+        {
+            instruction_count--;
+            breakpoint_set = true;
+            breakpoint = pc;
+            return;
+        }
+        if (ctrl.ecall && syscalls != NULL && syscalls->call(this, ram))
+        {
+            pc += 4;
+            return;
+        }
         halt = true;
         return;
     }
 
+    // Atomics, fences and CSRs don't use the ALU
+    if (ctrl.amo != AMO_NONE)
+    {
+        if ((FEATURES & DATAPATH_EVENTS) && hpm_active)
+        {
+            count_events(ctrl, false);
+        }
+        execute_atomic(ctrl);
+        return;
+    }
+    if (ctrl.csr_op != CSR_NONE)
+    {
+        execute_csr(ctrl);
+        return;
+    }
+    if (ctrl.fence || ctrl.fence_i)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        pc += 4;
+        if (ctrl.fence_i)
+        {
+            fence_instructions();
+        }
+        return;
+    }
+
     // Read the source registers
-    uint32_t rs1 = registers.get_reg(ctrl.rs1);
-    uint32_t rs2 = registers.get_reg(ctrl.rs2);
+    uint32_t rs1 = read_register<FEATURES>(ctrl.rs1);
+    uint32_t rs2 = read_register<FEATURES>(ctrl.rs2);
 
     // Calculate ALU input A
     uint32_t alu_a = ctrl.alu_a_src ? pc : rs1;
@@ -70,7 +773,7 @@ void Processor::execute_instruction()
     // Write to register from ALU output
     if (!ctrl.mem_read && !ctrl.jump)
     {
-        registers.set_reg(ctrl.rd, ctrl.mem_to_reg ? ram->load_word(alu_out) : alu_out);
+        write_register<FEATURES>(ctrl.rd, ctrl.mem_to_reg ? ram->load_word<TRACED>(alu_out) : alu_out);
     }
 
     // Read from memory (address in ALU output)
@@ -78,77 +781,471 @@ void Processor::execute_instruction()
     {
         if (ctrl.mem_read_unsigned)
         {
-            registers.set_reg(ctrl.rd, (uint32_t)ram->load_byte(alu_out));
+            write_register<FEATURES>(ctrl.rd, (uint32_t)ram->load_byte<TRACED>(alu_out));
         }
         else
         {
             // Sign extend
-            uint32_t mem_val = (uint32_t)ram->load_byte(alu_out);
+            uint32_t mem_val = (uint32_t)ram->load_byte<TRACED>(alu_out);
             if (mem_val & 0x80)
             {
                 mem_val |= 0xFFFFFF00;
             }
-            registers.set_reg(ctrl.rd, mem_val);
+            write_register<FEATURES>(ctrl.rd, mem_val);
         }
     }
     else if (ctrl.mem_read == 2)
     {
         if (ctrl.mem_read_unsigned)
         {
-            registers.set_reg(ctrl.rd, (uint32_t)ram->load_halfword(alu_out));
+            write_register<FEATURES>(ctrl.rd, (uint32_t)ram->load_halfword<TRACED>(alu_out));
         }
         else
         {
             // Sign extend
-            uint32_t mem_val = (uint32_t)ram->load_halfword(alu_out);
+            uint32_t mem_val = (uint32_t)ram->load_halfword<TRACED>(alu_out);
             if (mem_val & 0x8000)
             {
                 mem_val |= 0xFFFF0000;
             }
-            registers.set_reg(ctrl.rd, mem_val);
+            write_register<FEATURES>(ctrl.rd, mem_val);
         }
     }
     else if (ctrl.mem_read == 3)
     {
-        registers.set_reg(ctrl.rd, ram->load_word(alu_out));
+        write_register<FEATURES>(ctrl.rd, ram->load_word<TRACED>(alu_out));
     }
 
     // Write to register (linking)
     if (ctrl.jump)
     {
-        registers.set_reg(ctrl.rd, pc + 4);
+        write_register<FEATURES>(ctrl.rd, pc + ctrl.length);
     }
 
     // Write to memory (address in ALU output)
     if (ctrl.mem_write == 1)
     {
-        ram->store_byte(alu_out, (uint8_t)rs2);
+        ram->store_byte<TRACED>(alu_out, (uint8_t)rs2);
     }
     else if (ctrl.mem_write == 2)
     {
-        ram->store_halfword(alu_out, (uint16_t)rs2);
+        ram->store_halfword<TRACED>(alu_out, (uint16_t)rs2);
     }
     else if (ctrl.mem_write == 3)
     {
-        ram->store_word(alu_out, rs2);
+        ram->store_word<TRACED>(alu_out, rs2);
+    }
+
+    // Count events for the performance counters, the branch outcome is only
+    // needed then
+    if ((FEATURES & DATAPATH_EVENTS) && hpm_active)
+    {
+        count_events(ctrl, ctrl.branch && ((alu_out == 0) ^ ctrl.branch_pol));
     }
 
     // PC destination
     if (ctrl.jump) {
-        // Branch unconditionally
-        pc = alu_out;
+        // Branch unconditionally. JALR clears bit 0 of the target, JAL
+        // targets are even already.
+        uint32_t target = alu_out & ~1u;
+        if ((FEATURES & DATAPATH_PROFILE) && profiler != NULL)
+        {
+            profiler->jump(profile_classify(!ctrl.alu_a_src, ctrl.rd, ctrl.rs1), target);
+        }
+        pc = target;
     } else if (ctrl.branch) {
         // Branch conditionally
         if ((alu_out == 0) ^ ctrl.branch_pol) {
             pc = ctrl.imm + pc;
-            TRACE(TRACE_LEVEL_DEBUG, "Branching to 0x%08X\n", pc);
+            if (TRACED)
+            {
+                TRACE(TRACE_CAT_BRANCH, TRACE_LEVEL_DEBUG, "Branching to 0x%08X\n", pc);
+            }
         } else {
-            TRACE(TRACE_LEVEL_DEBUG, "Branch not taken\n");
-            pc += 4;
+            if (TRACED)
+            {
+                TRACE(TRACE_CAT_BRANCH, TRACE_LEVEL_DEBUG, "Branch not taken\n");
+            }
+            pc += ctrl.length;
         }
     } else {
         // No branch
-        pc += 4;
+        pc += ctrl.length;
+    }
+}
+
+void Processor::execute_atomic(const control_t &ctrl)
+{
+    uint32_t address = registers.get_reg(ctrl.rs1);
+    uint32_t value = registers.get_reg(ctrl.rs2);
+    if (address % 4 != 0)
+    {
+        TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_ERROR, "Misaligned atomic access at 0x%08X\n", address);
+        halt = true;
+        return;
+    }
+
+    // What the instruction did to the word, for watchpoints
+    uint32_t result;
+    uint32_t kind = RAM_WATCH_READ | RAM_WATCH_WRITE;
+    uint32_t old_value;
+    uint32_t written = value;
+    if (ctrl.amo == AMO_LR)
+    {
+        result = atomic_at((uint32_t *)ram->atomic_read_word(address))->load();
+        kind = RAM_WATCH_READ;
+        old_value = result;
+        written = result;
+        reservation_valid = true;
+        reservation_address = address;
+        reservation_value = result;
+        TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Reserved 0x%08X holding 0x%08X\n", address, result);
+    }
+    else if (ctrl.amo == AMO_SC)
+    {
+        // The store succeeds if the word still holds what LR.W loaded. Other
+        // harts' stores are not tracked, so nothing slows down ordinary
+        // stores, at the cost of not noticing a value written back (ABA).
+        bool stored = false;
+        uint32_t expected = reservation_value;
+        if (reservation_valid && reservation_address == address)
+        {
+            stored = atomic_at(ram->atomic_word(address))->compare_exchange_strong(expected, value);
+        }
+        reservation_valid = false;
+        result = stored ? 0 : 1;
+        kind = stored ? RAM_WATCH_WRITE : 0;
+        old_value = expected;
+        TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Store conditional at 0x%08X %s\n", address, stored ? "succeeded" : "failed");
+    }
+    else
+    {
+        std::atomic<uint32_t> *word = atomic_at(ram->atomic_word(address));
+        switch (ctrl.amo)
+        {
+        case AMO_SWAP:
+            result = word->exchange(value);
+            break;
+        case AMO_ADD:
+            result = word->fetch_add(value);
+            written = result + value;
+            break;
+        case AMO_XOR:
+            result = word->fetch_xor(value);
+            written = result ^ value;
+            break;
+        case AMO_AND:
+            result = word->fetch_and(value);
+            written = result & value;
+            break;
+        case AMO_OR:
+            result = word->fetch_or(value);
+            written = result | value;
+            break;
+        default:
+        {
+            // No host instruction for min and max, retry until no other
+            // hart got in between
+            result = word->load();
+            uint32_t desired;
+            do
+            {
+                switch (ctrl.amo)
+                {
+                case AMO_MIN:
+                    desired = (int32_t)value < (int32_t)result ? value : result;
+                    break;
+                case AMO_MAX:
+                    desired = (int32_t)value > (int32_t)result ? value : result;
+                    break;
+                case AMO_MINU:
+                    desired = value < result ? value : result;
+                    break;
+                default:
+                    desired = value > result ? value : result;
+                    break;
+                }
+            } while (!word->compare_exchange_weak(result, desired));
+            written = desired;
+            break;
+        }
+        }
+        old_value = result;
+        TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Atomic operation at 0x%08X, old value 0x%08X\n", address, result);
+    }
+
+    // Atomics don't go through the loads and stores that check watches
+    if (ram->has_watches() && kind != 0)
+    {
+        ram->check_watches(address, 4, kind, old_value, written);
+    }
+
+    registers.set_reg(ctrl.rd, result);
+    pc += 4;
+}
+
+void Processor::execute_csr(const control_t &ctrl)
+{
+    uint32_t address = ctrl.imm;
+    uint32_t source = ctrl.csr_imm ? (uint32_t)ctrl.rs1 : registers.get_reg(ctrl.rs1);
+
+    // CSRRW to x0 doesn't read, set and clear from x0 or 0 don't write
+    bool reads = ctrl.csr_op != CSR_WRITE || ctrl.rd != 0;
+    bool writes = ctrl.csr_op == CSR_WRITE || ctrl.rs1 != 0;
+
+    uint32_t old_value = 0;
+    if ((reads || ctrl.csr_op != CSR_WRITE) && !read_csr(address, &old_value))
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unknown CSR 0x%03X at 0x%08X\n", address, pc);
+        halt = true;
+        return;
+    }
+
+    if (writes)
+    {
+        uint32_t new_value = source;
+        if (ctrl.csr_op == CSR_SET)
+        {
+            new_value = old_value | source;
+        }
+        else if (ctrl.csr_op == CSR_CLEAR)
+        {
+            new_value = old_value & ~source;
+        }
+        if (!write_csr(address, new_value))
+        {
+            TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "CSR 0x%03X can't be written at 0x%08X\n", address, pc);
+            halt = true;
+            return;
+        }
+    }
+
+    registers.set_reg(ctrl.rd, old_value);
+    pc += 4;
+}
+
+bool Processor::read_csr(uint32_t address, uint32_t *value)
+{
+    // Counters (and their read only copies)
+    uint32_t base = address & ~(CSR_COUNTER_HIGH | CSR_COUNTER_MASK);
+    int index = address & CSR_COUNTER_MASK;
+    if ((base == CSR_CYCLE || base == CSR_MCYCLE) && !(base == CSR_MCYCLE && index == CSR_COUNTER_TIME))
+    {
+        uint64_t counter = counter_value(index, instruction_count - 1);
+        *value = (address & CSR_COUNTER_HIGH) ? (uint32_t)(counter >> 32) : (uint32_t)counter;
+        return true;
+    }
+
+    if (address >= CSR_MHPMEVENT3 && address <= CSR_MHPMEVENT31)
+    {
+        *value = hpm_events[address - CSR_MHPMEVENT3];
+        return true;
+    }
+
+    switch (address)
+    {
+    case CSR_MCOUNTINHIBIT:
+        *value = counter_inhibit;
+        return true;
+    case CSR_MISA:
+        *value = CSR_MISA_VALUE;
+        return true;
+    case CSR_MHARTID:
+        *value = hart_id;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool Processor::write_csr(uint32_t address, uint32_t value)
+{
+    if (CSR_READ_ONLY(address))
+    {
+        return false;
+    }
+
+    // Machine counters, the time counter has no machine copy
+    uint32_t base = address & ~(CSR_COUNTER_HIGH | CSR_COUNTER_MASK);
+    int index = address & CSR_COUNTER_MASK;
+    if (base == CSR_MCYCLE)
+    {
+        if (index == CSR_COUNTER_TIME)
+        {
+            return false;
+        }
+        uint64_t counter = counter_value(index, instruction_count);
+        if (address & CSR_COUNTER_HIGH)
+        {
+            counter = (counter & 0xFFFFFFFF) | ((uint64_t)value << 32);
+        }
+        else
+        {
+            counter = (counter & 0xFFFFFFFF00000000ULL) | value;
+        }
+        set_counter(index, counter);
+        return true;
+    }
+
+    if (address >= CSR_MHPMEVENT3 && address <= CSR_MHPMEVENT31)
+    {
+        // Unknown events count nothing
+        int counter = address - CSR_MHPMEVENT3 + CSR_HPM_FIRST;
+        uint64_t current = counter_value(counter, instruction_count);
+        hpm_events[counter - CSR_HPM_FIRST] = value < HPM_EVENT_COUNT ? value : (uint32_t)HPM_EVENT_NONE;
+        set_counter(counter, current);
+
+        hpm_active = false;
+        for (int i = 0; i < CSR_HPM_COUNTERS; i++)
+        {
+            hpm_active = hpm_active || hpm_events[i] != HPM_EVENT_NONE;
+        }
+        return true;
+    }
+
+    switch (address)
+    {
+    case CSR_MCOUNTINHIBIT:
+    {
+        // Freeze counters being inhibited and restart the others from
+        // where they were frozen. Bit 1 (time) is hardwired to zero.
+        value &= ~(1u << CSR_COUNTER_TIME);
+        for (int i = 0; i < 32; i++)
+        {
+            uint32_t bit = 1u << i;
+            if ((value & bit) && !(counter_inhibit & bit))
+            {
+                counter_frozen[i] = counter_value(i, instruction_count);
+            }
+            else if (!(value & bit) && (counter_inhibit & bit))
+            {
+                counter_offsets[i] = counter_frozen[i] - counter_source(i, instruction_count);
+            }
+        }
+        counter_inhibit = value;
+        return true;
+    }
+    case CSR_MISA:
+        // Extensions can't be turned off
+        return true;
+    default:
+        return false;
+    }
+}
+
+uint64_t Processor::counter_source(int index, uint64_t retired)
+{
+    if (index >= CSR_HPM_FIRST)
+    {
+        return event_counts[hpm_events[index - CSR_HPM_FIRST]];
+    }
+
+    // Cycles of the timing model, or one per instruction without one
+    if (index == CSR_COUNTER_CYCLE && timing != NULL)
+    {
+        return timing->get_cycles();
+    }
+    return retired;
+}
+
+uint64_t Processor::counter_value(int index, uint64_t retired)
+{
+    if (index == CSR_COUNTER_TIME)
+    {
+        std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - time_base;
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() * (CSR_TIME_HZ / 1000000);
+    }
+    if (counter_inhibit & (1u << index))
+    {
+        return counter_frozen[index];
+    }
+    return counter_source(index, retired) + counter_offsets[index];
+}
+
+void Processor::set_counter(int index, uint64_t value)
+{
+    if (counter_inhibit & (1u << index))
+    {
+        counter_frozen[index] = value;
+    }
+    else
+    {
+        counter_offsets[index] = value - counter_source(index, instruction_count);
+    }
+}
+
+void Processor::count_events(const control_t &ctrl, bool taken)
+{
+    if (ctrl.amo != AMO_NONE)
+    {
+        event_counts[ctrl.amo == AMO_LR ? HPM_EVENT_LOAD : ctrl.amo == AMO_SC ? HPM_EVENT_STORE : HPM_EVENT_ATOMIC]++;
+        return;
+    }
+    hpm_event_t event = instruction_event(ctrl);
+    if (event != HPM_EVENT_NONE)
+    {
+        event_counts[event]++;
+    }
+    if (taken)
+    {
+        event_counts[HPM_EVENT_BRANCH_TAKEN]++;
+    }
+}
+
+hpm_event_t Processor::instruction_event(const control_t &ctrl)
+{
+    if (ctrl.mem_read || ctrl.mem_to_reg)
+    {
+        return HPM_EVENT_LOAD;
+    }
+    if (ctrl.mem_write)
+    {
+        return HPM_EVENT_STORE;
+    }
+    if (ctrl.branch)
+    {
+        return HPM_EVENT_BRANCH;
+    }
+    if (ctrl.jump)
+    {
+        return HPM_EVENT_JUMP;
+    }
+    if (ctrl.alu_op == ALUOP_MUL)
+    {
+        return HPM_EVENT_MUL;
+    }
+    return HPM_EVENT_NONE;
+}
+
+void Processor::invalidate_code(uint32_t address, uint32_t size)
+{
+    decode_cache.code_written(address, size);
+#ifdef JIT_SUPPORTED
+    if (jit_engine != NULL)
+    {
+        jit_engine->code_written(address, size);
+    }
+#endif
+    if (threaded_engine != NULL)
+    {
+        threaded_engine->code_written(address, size);
+    }
+}
+
+void Processor::fence_instructions()
+{
+    // Stores from this hart were seen already, but other harts' stores to
+    // code only become visible here
+    decode_cache.flush();
+#ifdef JIT_SUPPORTED
+    if (jit_engine != NULL)
+    {
+        jit_engine->fence_instructions();
+    }
+#endif
+    if (threaded_engine != NULL)
+    {
+        threaded_engine->fence_instructions();
     }
 }
 
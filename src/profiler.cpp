@@ -0,0 +1,115 @@
+// Samples guest call stacks.
+
+#include "profiler.h"
+
+#include <stdio.h>
+#include <map>
+#include <string>
+#include "trace.h"
+
+Profiler::Profiler(uint64_t interval)
+{
+    this->interval = interval == 0 ? 1 : interval;
+    next_count = UINT64_MAX;
+    frames[0] = 0;
+    depth = 1;
+    sample_count = 0;
+}
+
+Profiler::~Profiler()
+{
+}
+
+void Profiler::start(uint32_t pc, uint64_t instruction_count)
+{
+    frames[0] = pc;
+    depth = 1;
+    next_count = instruction_count + interval;
+}
+
+void Profiler::sample(uint32_t pc, uint64_t instruction_count)
+{
+    uint32_t recorded = depth < PROFILER_MAX_DEPTH ? depth : PROFILER_MAX_DEPTH;
+    key.assign(frames, frames + recorded);
+    key.push_back(pc);
+    stacks[key]++;
+    sample_count++;
+
+    // Instructions run outside run() may have gone past the sample
+    while (next_count <= instruction_count)
+    {
+        next_count += interval;
+    }
+}
+
+uint64_t Profiler::get_sample_count()
+{
+    return sample_count;
+}
+
+// Name of the function at an address
+static std::string function_name(uint32_t address, ElfLoader *symbols)
+{
+    const elf_symbol_t *symbol = symbols != NULL ? symbols->symbol_at(address) : NULL;
+    if (symbol != NULL)
+    {
+        return symbol->name;
+    }
+    char name[16];
+    snprintf(name, sizeof(name), "0x%08X", address);
+    return name;
+}
+
+int Profiler::write_folded(const char *filename, Profiler *const *profilers, uint32_t count, ElfLoader *symbols)
+{
+    // Stacks that only differ in the sampled PC fold into one line
+    std::map<std::string, uint64_t> folded;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        std::unordered_map<std::vector<uint32_t>, uint64_t, ProfileStackHash>::const_iterator it;
+        for (it = profilers[i]->stacks.begin(); it != profilers[i]->stacks.end(); ++it)
+        {
+            const std::vector<uint32_t> &stack = it->first;
+            std::string line;
+            for (size_t frame = 0; frame + 1 < stack.size(); frame++)
+            {
+                if (frame != 0)
+                {
+                    line += ';';
+                }
+                line += function_name(stack[frame], symbols);
+            }
+
+            // The sampled PC names the leaf when it left the last function
+            // called without a call (a tail call or a plain jump)
+            const elf_symbol_t *leaf = symbols != NULL ? symbols->symbol_at(stack.back()) : NULL;
+            const elf_symbol_t *top = symbols != NULL ? symbols->symbol_at(stack[stack.size() - 2]) : NULL;
+            if (leaf != NULL && leaf != top)
+            {
+                line += ';';
+                line += leaf->name;
+            }
+            folded[line] += it->second;
+        }
+    }
+
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unable to create profile %s\n", filename);
+        return -1;
+    }
+    std::map<std::string, uint64_t>::const_iterator it;
+    for (it = folded.begin(); it != folded.end(); ++it)
+    {
+        fprintf(file, "%s %llu\n", it->first.c_str(), (unsigned long long)it->second);
+    }
+    if (fclose(file) != 0)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unable to write profile %s\n", filename);
+        return -1;
+    }
+
+    TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_INFO, "Wrote %u stacks to %s\n", (uint32_t)folded.size(), filename);
+    return 0;
+}
@@ -5,251 +5,1080 @@
 #include <stdio.h>
 #include <string.h>
 #include <trace.h>
-#include <regex>
+#include <vector>
+#ifdef RAM_FILE_MAPPING
+#include <sys/mman.h>
+#endif
+
+// Backing for reads of pages that have never been written
+static const uint32_t zero_page[RAM_PAGE_WORDS] = {0};
+
+// The bytes an access of size bytes at an address uses out of its word
+static uint32_t access_bits(uint32_t word, uint32_t address, uint32_t size)
+{
+    if (size == 4)
+    {
+        return word;
+    }
+    if (size == 2)
+    {
+        return address % 4 == 0 ? word & 0xFFFF : word >> 16;
+    }
+    return (word >> ((address % 4) * 8)) & 0xFF;
+}
 
 RAM::RAM()
 {
-    // Initialize memory to zero
-    memset(memory, 0, sizeof(memory));
+    // No pages are allocated until they are written
+    memory = new ram_memory_t();
+    memory->views = 0;
+    memory->rams.push_back(this);
+    owner = true;
+    watch_observer = NULL;
+
+    for (int i = 0; i < RAM_TLB_ENTRIES; i++)
+    {
+        read_tlb[i].words = NULL;
+        write_tlb[i].words = NULL;
+    }
+    flush_tlb();
+}
+
+RAM::RAM(RAM *shared)
+{
+    memory = shared->memory;
+    owner = false;
+    watch_observer = NULL;
+
+    for (int i = 0; i < RAM_TLB_ENTRIES; i++)
+    {
+        read_tlb[i].words = NULL;
+        write_tlb[i].words = NULL;
+    }
+    flush_tlb();
+
+    // A zero page cached by one view would hide another view's first write
+    // to the page, so shared memory allocates pages on read instead
+    std::lock_guard<std::mutex> guard(memory->lock);
+    memory->views++;
+    memory->rams.push_back(this);
+    shared->flush_tlb();
 }
 
 RAM::~RAM()
 {
+    if (!owner)
+    {
+        std::lock_guard<std::mutex> guard(memory->lock);
+        memory->views--;
+        for (size_t i = 0; i < memory->rams.size(); i++)
+        {
+            if (memory->rams[i] == this)
+            {
+                memory->rams.erase(memory->rams.begin() + i);
+                break;
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < RAM_DIRECTORY_ENTRIES; i++)
+    {
+        ram_page_t **table = memory->directory[i];
+        if (table == NULL)
+        {
+            continue;
+        }
+        for (int j = 0; j < RAM_TABLE_ENTRIES; j++)
+        {
+            ram_page_t *page = table[j];
+            if (page != NULL && (page->flags & RAM_PAGE_MAPPED) == 0)
+            {
+                delete[] page->words;
+            }
+            delete page;
+        }
+        delete[] table;
+    }
+
+#ifdef RAM_FILE_MAPPING
+    for (size_t i = 0; i < memory->mappings.size(); i++)
+    {
+        munmap(memory->mappings[i].first, memory->mappings[i].second);
+    }
+#endif
+    delete memory;
+}
+
+ram_page_t *RAM::find_page(uint32_t page)
+{
+    ram_page_t **table = memory->directory[page >> RAM_TABLE_BITS];
+    if (table == NULL)
+    {
+        return NULL;
+    }
+    return table[page & (RAM_TABLE_ENTRIES - 1)];
+}
+
+ram_page_t *RAM::get_page(uint32_t page)
+{
+    ram_page_t **&table = memory->directory[page >> RAM_TABLE_BITS];
+    if (table == NULL)
+    {
+        table = new ram_page_t *[RAM_TABLE_ENTRIES]();
+    }
+
+    ram_page_t *&entry = table[page & (RAM_TABLE_ENTRIES - 1)];
+    if (entry == NULL)
+    {
+        TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Allocating page at 0x%08X\n", page << RAM_PAGE_SHIFT);
+        entry = new ram_page_t;
+        entry->words = new uint32_t[RAM_PAGE_WORDS]();
+        entry->flags = 0;
+
+        // Reads may still be going to the zero page
+        invalidate_tlb(page);
+    }
+    return entry;
 }
 
-void RAM::store_word(uint32_t address, uint32_t data)
+const uint32_t *RAM::read_miss(uint32_t page)
 {
-    TRACE(TRACE_LEVEL_DEBUG, "Storing 0x%08X at 0x%08X\n", data, address);
-    memory[address / 4] = data;
+    std::lock_guard<std::mutex> guard(memory->lock);
+    ram_page_t *found = memory->views == 0 ? find_page(page) : get_page(page);
+    if ((found != NULL && (found->flags & RAM_PAGE_DEVICE)) || is_watched(page))
+    {
+        return found != NULL ? found->words : zero_page;
+    }
+    ram_tlb_entry_t &entry = read_tlb[page & (RAM_TLB_ENTRIES - 1)];
+    entry.tag = page;
+    entry.words = found != NULL ? found->words : (uint32_t *)zero_page;
+    return entry.words;
 }
 
-void RAM::store_halfword(uint32_t address, uint16_t data)
+uint32_t RAM::load_miss(uint32_t address, uint32_t size)
 {
-    TRACE(TRACE_LEVEL_DEBUG, "Storing 0x%04X at 0x%08X\n", data, address);
-    uint32_t word_address = address / 4;
-    uint32_t mem_data = memory[word_address];
-    if (address % 4 == 0)
+    const ram_device_t *device = find_device(address);
+    if (device != NULL)
     {
-        mem_data = (mem_data & 0xFFFF0000) | data;
+        // Placed where the loads pick it out of the word
+        return device->device->read(address - device->start, size) << ((address & (4 - size)) * 8);
     }
-    else
+    uint32_t word = read_miss(address >> RAM_PAGE_SHIFT)[(address & (RAM_PAGE_SIZE - 1)) >> 2];
+    if (!watches.empty())
     {
-        mem_data = (mem_data & 0x0000FFFF) | (data << 16);
+        uint32_t value = access_bits(word, address, size);
+        check_watches(address, size, RAM_WATCH_READ, value, value);
     }
-    memory[word_address] = mem_data;
+    return word;
 }
 
-void RAM::store_byte(uint32_t address, uint8_t data)
+void RAM::store_miss(uint32_t address, uint32_t data, uint32_t size)
 {
-    TRACE(TRACE_LEVEL_DEBUG, "Storing 0x%02X at 0x%08X\n", data, address);
-    uint32_t word_address = address / 4;
-    uint32_t mem_data = memory[word_address];
-    uint32_t shift = (address % 4) * 8;
-    mem_data = (mem_data & ~(0xFF << shift)) | (data << shift);
-    memory[word_address] = mem_data;
+    const ram_device_t *device = find_device(address);
+    if (device != NULL)
+    {
+        device->device->write(address - device->start, data, size);
+        for (size_t i = 0; i < code_observers.size(); i++)
+        {
+            code_observers[i]->device_written();
+        }
+        return;
+    }
+    uint32_t *word = &write_miss(address, size)[(address & (RAM_PAGE_SIZE - 1)) >> 2];
+    if (watches.empty())
+    {
+        merge_store(word, address, data, size);
+        return;
+    }
+    uint32_t old_word = *word;
+    merge_store(word, address, data, size);
+    check_watches(address, size, RAM_WATCH_WRITE, access_bits(old_word, address, size), access_bits(*word, address, size));
 }
 
-uint32_t RAM::load_word(uint32_t address)
+uint32_t *RAM::write_miss(uint32_t address, uint32_t size)
 {
-    TRACE(TRACE_LEVEL_DEBUG, "Loading 0x%08X from 0x%08X\n", memory[address / 4], address);
-    return memory[address / 4];
+    uint32_t page = address >> RAM_PAGE_SHIFT;
+    std::unique_lock<std::mutex> guard(memory->lock);
+    ram_page_t *found = get_page(page);
+    uint32_t flags = found->flags;
+    mark_dirty(page);
+    guard.unlock();
+
+    // Only this view's observers are told, other harts see the store once
+    // they run FENCE.I
+    if (flags & RAM_PAGE_CODE)
+    {
+        notify_code_write(address, size);
+    }
+
+    // Pages that need checks on every store stay out of the TLB
+    if ((flags & RAM_PAGE_WRITE_SLOW) == 0 && !is_watched(page))
+    {
+        ram_tlb_entry_t &entry = write_tlb[page & (RAM_TLB_ENTRIES - 1)];
+        entry.tag = page;
+        entry.words = found->words;
+    }
+    return found->words;
 }
 
-uint32_t RAM::load_instruction(uint32_t address)
+void RAM::invalidate_tlb(uint32_t page)
 {
-    TRACE(TRACE_LEVEL_DEBUG, "Loading instruction 0x%08X from 0x%08X\n", memory[address / 4], address);
-    return memory[address / 4];
+    uint32_t index = page & (RAM_TLB_ENTRIES - 1);
+    if (read_tlb[index].tag == page)
+    {
+        read_tlb[index].tag = RAM_TLB_INVALID;
+    }
+    if (write_tlb[index].tag == page)
+    {
+        write_tlb[index].tag = RAM_TLB_INVALID;
+    }
+}
+
+void RAM::flush_tlb()
+{
+    for (int i = 0; i < RAM_TLB_ENTRIES; i++)
+    {
+        read_tlb[i].tag = RAM_TLB_INVALID;
+        write_tlb[i].tag = RAM_TLB_INVALID;
+    }
 }
 
-uint16_t RAM::load_halfword(uint32_t address)
+void RAM::replace_page(uint32_t page, uint32_t *words, uint32_t flags)
 {
-    uint32_t word_address = address / 4;
-    uint32_t mem_data = memory[word_address];
-    if (address % 4 == 0)
+    ram_page_t *found = get_page(page);
+    if ((found->flags & RAM_PAGE_MAPPED) == 0)
     {
-        TRACE(TRACE_LEVEL_DEBUG, "Loading 0x%04X from 0x%08X\n", mem_data & 0xFFFF, address);
-        return mem_data & 0xFFFF;
+        delete[] found->words;
     }
-    else
+    found->words = words;
+    found->flags = (found->flags & ~RAM_PAGE_MAPPED) | flags;
+    invalidate_tlb(page);
+    mark_dirty(page);
+
+    // Everything on the page changed
+    if (found->flags & RAM_PAGE_CODE)
     {
-        TRACE(TRACE_LEVEL_DEBUG, "Loading 0x%04X from 0x%08X\n", (mem_data >> 16) & 0xFFFF, address);
-        return (mem_data >> 16) & 0xFFFF;
+        notify_code_write(page << RAM_PAGE_SHIFT, RAM_PAGE_SIZE);
     }
 }
 
-uint8_t RAM::load_byte(uint32_t address)
+void RAM::write_block(uint32_t address, const uint8_t *data, uint32_t length)
 {
-    uint32_t word_address = address / 4;
-    uint32_t mem_data = memory[word_address];
-    uint32_t shift = (address % 4) * 8;
-    TRACE(TRACE_LEVEL_DEBUG, "Loading 0x%02X from 0x%08X\n", (mem_data >> shift) & 0xFF, address);
-    return (mem_data >> shift) & 0xFF;
+    std::lock_guard<std::mutex> guard(memory->lock);
+    while (length > 0)
+    {
+        uint32_t offset = address & (RAM_PAGE_SIZE - 1);
+        uint32_t chunk = RAM_PAGE_SIZE - offset < length ? RAM_PAGE_SIZE - offset : length;
+
+        ram_page_t *page = get_page(address >> RAM_PAGE_SHIFT);
+        if (page->flags & RAM_PAGE_CODE)
+        {
+            notify_code_write(address, chunk);
+        }
+        mark_dirty(address >> RAM_PAGE_SHIFT);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy((uint8_t *)page->words + offset, data, chunk);
+#else
+        for (uint32_t i = 0; i < chunk; i++)
+        {
+            uint32_t shift = ((offset + i) % 4) * 8;
+            uint32_t &word = page->words[(offset + i) >> 2];
+            word = (word & ~(0xFF << shift)) | (data[i] << shift);
+        }
+#endif
+
+        address += chunk;
+        data += chunk;
+        length -= chunk;
+    }
 }
 
-int RAM::load_memory_ihex(char *filename)
+void RAM::clear_block(uint32_t address, uint32_t length)
 {
-    // Open file
-    FILE *file = fopen(filename, "r");
-    if (file == NULL)
+    std::lock_guard<std::mutex> guard(memory->lock);
+    while (length > 0)
+    {
+        uint32_t offset = address & (RAM_PAGE_SIZE - 1);
+        uint32_t chunk = RAM_PAGE_SIZE - offset < length ? RAM_PAGE_SIZE - offset : length;
+
+        // Pages never written already read as zero
+        ram_page_t *page = find_page(address >> RAM_PAGE_SHIFT);
+        if (page != NULL)
+        {
+            if (page->flags & RAM_PAGE_CODE)
+            {
+                notify_code_write(address, chunk);
+            }
+            mark_dirty(address >> RAM_PAGE_SHIFT);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            memset((uint8_t *)page->words + offset, 0, chunk);
+#else
+            for (uint32_t i = 0; i < chunk; i++)
+            {
+                uint32_t shift = ((offset + i) % 4) * 8;
+                page->words[(offset + i) >> 2] &= ~(0xFF << shift);
+            }
+#endif
+        }
+
+        address += chunk;
+        length -= chunk;
+    }
+}
+
+#ifdef RAM_FILE_MAPPING
+int RAM::map_file(int fd, uint64_t offset, uint32_t address, uint32_t pages)
+{
+    std::vector<uint32_t> page_numbers(pages);
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        page_numbers[i] = (address >> RAM_PAGE_SHIFT) + i;
+    }
+    return map_file_pages(fd, offset, page_numbers.data(), pages);
+}
+
+int RAM::map_file_pages(int fd, uint64_t offset, const uint32_t *page_numbers, uint32_t count)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (count == 0)
+    {
+        return 0;
+    }
+    size_t length = (size_t)count << RAM_PAGE_SHIFT;
+    void *host = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)offset);
+    if (host == MAP_FAILED)
     {
-        TRACE(TRACE_LEVEL_ERROR, "Unable to open load file %s\n", filename);
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_WARNING, "Unable to map %u pages at 0x%08X\n", count, page_numbers[0] << RAM_PAGE_SHIFT);
         return -1;
     }
 
-    char linechar[256];
-    while (fgets(linechar, sizeof(linechar), file) != NULL)
+    std::lock_guard<std::mutex> guard(memory->lock);
+    memory->mappings.push_back(std::make_pair(host, length));
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        replace_page(page_numbers[i], (uint32_t *)((uint8_t *)host + ((size_t)i << RAM_PAGE_SHIFT)), RAM_PAGE_MAPPED);
+    }
+    return 0;
+#else
+    // Guest words are little endian, the file can't be used as is
+    return -1;
+#endif
+}
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+uint8_t *RAM::host_bytes(uint32_t address, uint32_t length, bool for_write, uint32_t *chunk)
+{
+    uint32_t offset = address & (RAM_PAGE_SIZE - 1);
+    *chunk = RAM_PAGE_SIZE - offset < length ? RAM_PAGE_SIZE - offset : length;
+
+    uint32_t page = address >> RAM_PAGE_SHIFT;
+    std::unique_lock<std::mutex> guard(memory->lock);
+    ram_page_t *found = for_write ? get_page(page) : find_page(page);
+    if (found == NULL)
     {
-        TRACE(TRACE_LEVEL_DEBUG, "Processing ihex line: %s\n", linechar);
+        // Only read, never written through
+        return (uint8_t *)zero_page + offset;
+    }
+    if (found->flags & RAM_PAGE_DEVICE)
+    {
+        return NULL;
+    }
+    if (for_write)
+    {
+        mark_dirty(page);
+        uint32_t flags = found->flags;
+        guard.unlock();
+        if (flags & RAM_PAGE_CODE)
+        {
+            notify_code_write(address, *chunk);
+        }
+    }
+    return (uint8_t *)found->words + offset;
+}
+#endif
+
+void RAM::clear()
+{
+    std::lock_guard<std::mutex> guard(memory->lock);
+    for (int i = 0; i < RAM_DIRECTORY_ENTRIES; i++)
+    {
+        ram_page_t **table = memory->directory[i];
+        if (table == NULL)
+        {
+            continue;
+        }
+        for (int j = 0; j < RAM_TABLE_ENTRIES; j++)
+        {
+            ram_page_t *page = table[j];
+            if (page == NULL)
+            {
+                continue;
+            }
+            uint32_t address = ((uint32_t)i << (RAM_TABLE_BITS + RAM_PAGE_SHIFT)) | ((uint32_t)j << RAM_PAGE_SHIFT);
+            if (page->flags & RAM_PAGE_CODE)
+            {
+                notify_code_write(address, RAM_PAGE_SIZE);
+            }
+            mark_dirty(address >> RAM_PAGE_SHIFT);
+            memset(page->words, 0, RAM_PAGE_SIZE);
+        }
+    }
+}
+
+void RAM::copy_from(RAM *source)
+{
+    std::lock_guard<std::mutex> guard(memory->lock);
 
-        // Use regex to parse the line
-        // Group 1: Byte count
-        // Group 2: Address
-        // Group 3: Record type
-        // Group 4: Data
-        // Group 5: Checksum
-        std::regex ihex_regex(R"rgx(:([0-9A-Fa-f]{2})([0-9A-Fa-f]{4})([0-9A-Fa-f]{2})([0-9A-Fa-f]{0,})([0-9A-Fa-f]{2})[\r|\n|\r\n]*)rgx");
-        std::smatch ihex_match;
-        std::string line(linechar);
-        if (std::regex_match(line, ihex_match, ihex_regex))
+    // Zero the pages the source doesn't have
+    for (int i = 0; i < RAM_DIRECTORY_ENTRIES; i++)
+    {
+        ram_page_t **table = memory->directory[i];
+        if (table == NULL)
+        {
+            continue;
+        }
+        ram_page_t **source_table = source->memory->directory[i];
+        for (int j = 0; j < RAM_TABLE_ENTRIES; j++)
         {
-            // Group 1: Byte count
-            int byte_count = std::stoi(ihex_match[1].str(), nullptr, 16);
-            // Group 2: Address
-            int address = std::stoi(ihex_match[2].str(), nullptr, 16);
-            // Group 3: Record type
-            int record_type = std::stoi(ihex_match[3].str(), nullptr, 16);
-            // Group 4: Data
-            std::string data = ihex_match[4].str();
-            // Group 5: Checksum
-            int checksum = std::stoi(ihex_match[5].str(), nullptr, 16);
+            ram_page_t *page = table[j];
+            if (page == NULL || (source_table != NULL && source_table[j] != NULL))
+            {
+                continue;
+            }
+            uint32_t address = ((uint32_t)i << (RAM_TABLE_BITS + RAM_PAGE_SHIFT)) | ((uint32_t)j << RAM_PAGE_SHIFT);
+            if (page->flags & RAM_PAGE_CODE)
+            {
+                notify_code_write(address, RAM_PAGE_SIZE);
+            }
+            mark_dirty(address >> RAM_PAGE_SHIFT);
+            memset(page->words, 0, RAM_PAGE_SIZE);
+        }
+    }
 
-            // Calculate expected checksum
-            uint8_t expected_checksum = (uint8_t)(byte_count + (address >> 8) + (address & 0xFF) + record_type);
-            for (int i = 0; i < byte_count; i++)
+    // Copy the rest
+    for (int i = 0; i < RAM_DIRECTORY_ENTRIES; i++)
+    {
+        ram_page_t **source_table = source->memory->directory[i];
+        if (source_table == NULL)
+        {
+            continue;
+        }
+        for (int j = 0; j < RAM_TABLE_ENTRIES; j++)
+        {
+            if (source_table[j] == NULL)
             {
-                expected_checksum += (uint8_t)std::stoi(data.substr(i * 2, 2), nullptr, 16);
+                continue;
             }
-            expected_checksum = ~expected_checksum + 1;
+            uint32_t page_number = ((uint32_t)i << RAM_TABLE_BITS) | (uint32_t)j;
+            ram_page_t *page = get_page(page_number);
+            if (page->flags & RAM_PAGE_CODE)
+            {
+                notify_code_write(page_number << RAM_PAGE_SHIFT, RAM_PAGE_SIZE);
+            }
+            mark_dirty(page_number);
+            memcpy(page->words, source_table[j]->words, RAM_PAGE_SIZE);
+        }
+    }
+}
 
-            // Check checksum
-            if (expected_checksum != checksum)
+uint64_t RAM::digest()
+{
+    std::lock_guard<std::mutex> guard(memory->lock);
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < RAM_DIRECTORY_ENTRIES; i++)
+    {
+        ram_page_t **table = memory->directory[i];
+        if (table == NULL)
+        {
+            continue;
+        }
+        for (int j = 0; j < RAM_TABLE_ENTRIES; j++)
+        {
+            ram_page_t *page = table[j];
+            if (page == NULL)
             {
-                TRACE(TRACE_LEVEL_ERROR, "RAM init checksum mismatch\n");
-                fclose(file);
-                return -1;
+                continue;
+            }
+            bool empty = true;
+            for (int k = 0; k < RAM_PAGE_WORDS && empty; k++)
+            {
+                empty = page->words[k] == 0;
+            }
+            if (empty)
+            {
+                continue;
             }
 
-            // Process record
-            switch (record_type)
+            // Two words at a time
+            hash = (hash ^ (((uint32_t)i << RAM_TABLE_BITS) | (uint32_t)j)) * 0x100000001B3ULL;
+            for (int k = 0; k < RAM_PAGE_WORDS; k += 2)
+            {
+                hash = (hash ^ page->words[k] ^ ((uint64_t)page->words[k + 1] << 32)) * 0x100000001B3ULL;
+            }
+        }
+    }
+    return hash;
+}
+
+void RAM::mark_clean()
+{
+    std::lock_guard<std::mutex> guard(memory->lock);
+    memset(memory->dirty, 0, sizeof(memory->dirty));
+    memset(memory->dirty_summary, 0, sizeof(memory->dirty_summary));
+
+    // Pages have to be marked again before stores skip the check
+    for (size_t i = 0; i < memory->rams.size(); i++)
+    {
+        memory->rams[i]->flush_tlb();
+    }
+}
+
+void RAM::mark_code_page(uint32_t address)
+{
+    std::lock_guard<std::mutex> guard(memory->lock);
+    ram_page_t *page = get_page(address >> RAM_PAGE_SHIFT);
+    if ((page->flags & RAM_PAGE_CODE) == 0)
+    {
+        page->flags |= RAM_PAGE_CODE;
+
+        // Stores to the page have to be seen from now on
+        invalidate_tlb(address >> RAM_PAGE_SHIFT);
+    }
+}
+
+void RAM::add_device(uint32_t address, uint32_t size, Device *device)
+{
+    std::lock_guard<std::mutex> guard(memory->lock);
+    ram_device_t entry;
+    entry.start = address;
+    entry.last = address + size - 1;
+    entry.device = device;
+    memory->devices.push_back(entry);
+
+    // Take the pages out of every view's TLBs so accesses reach the miss
+    // paths
+    uint32_t first_page = entry.start >> RAM_PAGE_SHIFT;
+    uint32_t last_page = entry.last >> RAM_PAGE_SHIFT;
+    for (uint32_t page = first_page;; page++)
+    {
+        get_page(page)->flags |= RAM_PAGE_DEVICE;
+        for (size_t i = 0; i < memory->rams.size(); i++)
+        {
+            memory->rams[i]->invalidate_tlb(page);
+        }
+        if (page == last_page)
+        {
+            break;
+        }
+    }
+}
+
+void RAM::add_watch(uint32_t address, uint32_t length, uint32_t kinds)
+{
+    ram_watch_t watch;
+    watch.start = address;
+    watch.last = address + (length != 0 ? length : 1) - 1;
+    watch.kinds = kinds;
+    watches.push_back(watch);
+    update_watched_pages();
+}
+
+void RAM::remove_watch(uint32_t address, uint32_t length, uint32_t kinds)
+{
+    uint32_t last = address + (length != 0 ? length : 1) - 1;
+    for (size_t i = 0; i < watches.size(); i++)
+    {
+        if (watches[i].start == address && watches[i].last == last && watches[i].kinds == kinds)
+        {
+            watches.erase(watches.begin() + i);
+            update_watched_pages();
+            return;
+        }
+    }
+}
+
+void RAM::set_watch_observer(WatchObserver *observer)
+{
+    watch_observer = observer;
+}
+
+void RAM::check_watches(uint32_t address, uint32_t size, uint32_t kind, uint32_t old_value, uint32_t new_value)
+{
+    uint32_t last = address + size - 1;
+    for (size_t i = 0; i < watches.size(); i++)
+    {
+        const ram_watch_t &watch = watches[i];
+        if (last < watch.start || address > watch.last)
+        {
+            continue;
+        }
+        bool changed = (kind & RAM_WATCH_WRITE) && old_value != new_value;
+        if ((watch.kinds & kind) != 0 || ((watch.kinds & RAM_WATCH_CHANGE) && changed))
+        {
+            if (watch_observer != NULL)
+            {
+                watch_observer->watch_hit(watch, address, size, kind, old_value, new_value);
+            }
+            return;
+        }
+    }
+}
+
+void RAM::update_watched_pages()
+{
+    std::vector<uint64_t> pages;
+    if (!watches.empty())
+    {
+        pages.assign(RAM_PAGE_COUNT / 64, 0);
+    }
+    for (size_t i = 0; i < watches.size(); i++)
+    {
+        uint32_t last_page = watches[i].last >> RAM_PAGE_SHIFT;
+        for (uint32_t page = watches[i].start >> RAM_PAGE_SHIFT;; page++)
+        {
+            pages[page >> 6] |= 1ULL << (page & 63);
+            if (page == last_page)
             {
-            case 0:
-                // Data record
-                for (int i = 0; i < byte_count; i += 1)
-                {
-                    uint32_t word = std::stoi(data.substr(i * 2, 2), nullptr, 16);
-                    int tlevel_save = trace_level;
-                    TRACE_SET(TRACE_LEVEL_NONE);
-                    store_byte(address + i, word);
-                    TRACE_SET(tlevel_save);
-                }
                 break;
-            case 1:
-                // End of file record
-                fclose(file);
-                return 0;
-            default:
-                TRACE(TRACE_LEVEL_ERROR, "Unknown record type %d\n", record_type);
-                fclose(file);
-                return -1;
             }
         }
     }
+    watched_pages.swap(pages);
 
-    fclose(file);
-    TRACE(TRACE_LEVEL_WARNING, "Unexpected end of hex file\n");
-    return 0;
+    // Watches change rarely, refilling the whole TLB is simplest
+    flush_tlb();
+}
+
+void RAM::add_code_observer(CodeObserver *observer)
+{
+    code_observers.push_back(observer);
+}
+
+void RAM::remove_code_observer(CodeObserver *observer)
+{
+    for (size_t i = 0; i < code_observers.size(); i++)
+    {
+        if (code_observers[i] == observer)
+        {
+            code_observers.erase(code_observers.begin() + i);
+            return;
+        }
+    }
+}
+
+void RAM::notify_code_write(uint32_t address, uint32_t size)
+{
+    TRACE(TRACE_CAT_MEMORY, TRACE_LEVEL_DEBUG, "Store to code page at 0x%08X\n", address);
+
+    // The page stays marked, observers only drop what overlaps the store
+    for (size_t i = 0; i < code_observers.size(); i++)
+    {
+        code_observers[i]->code_written(address, size);
+    }
 }
 
-void RAM::dump_memory_ihex(uint32_t start_address, uint32_t end_address)
+// Value of each character as a hex digit (-1 if it isn't one). A table
+// avoids the badly predicted digit/letter branches on random data.
+static struct hex_table
 {
-    int tlevel_save = trace_level;
-    TRACE_SET(TRACE_LEVEL_NONE);
+    int8_t value[256];
 
-    // Dump memory to stdout in Intel HEX format (word at a time)
-    for (uint32_t address = start_address; address <= end_address; address += 4)
+    hex_table()
     {
-        // Skip if word is zero
-        if (load_word(address) == 0)
+        for (int c = 0; c < 256; c++)
+        {
+            value[c] = -1;
+        }
+        for (int i = 0; i < 10; i++)
         {
+            value['0' + i] = (int8_t)i;
+        }
+        for (int i = 0; i < 6; i++)
+        {
+            value['a' + i] = (int8_t)(10 + i);
+            value['A' + i] = (int8_t)(10 + i);
+        }
+    }
+} hex_digits;
+
+// Parse two hex digits (-1 if either isn't one)
+static inline int hex_byte(const uint8_t *text)
+{
+    int high = hex_digits.value[text[0]];
+    int low = hex_digits.value[text[1]];
+    return (high | low) < 0 ? -1 : (high << 4) | low;
+}
+
+int RAM::load_memory_ihex(const char *filename, uint32_t *entry)
+{
+    // Open file
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open load file %s\n", filename);
+        return -1;
+    }
+
+    // Records are parsed straight out of a large read buffer, which is
+    // topped up whenever less than a whole record is left in it
+    std::vector<uint8_t> buffer(IHEX_BUFFER_SIZE);
+    size_t start = 0;
+    size_t end = 0;
+    bool at_eof = false;
+
+    // Added to record addresses by extended address records
+    uint32_t base = 0;
+
+    int line = 1;
+    while (true)
+    {
+        if (end - start < IHEX_MAX_RECORD && !at_eof)
+        {
+            memmove(buffer.data(), buffer.data() + start, end - start);
+            end -= start;
+            start = 0;
+            size_t count = fread(buffer.data() + end, 1, buffer.size() - end, file);
+            end += count;
+            at_eof = count == 0 || feof(file);
+        }
+        if (start == end)
+        {
+            break;
+        }
+
+        // Skip anything between records
+        uint8_t c = buffer[start];
+        if (c != ':')
+        {
+            if (c == '\n')
+            {
+                line++;
+            }
+            start++;
             continue;
         }
 
-        // Calculate byte count
-        int byte_count = 4;
+        // Header: byte count, address, record type
+        const uint8_t *text = buffer.data() + start + 1;
+        size_t available = end - start - 1;
+        int byte_count = available >= 2 ? hex_byte(text) : -1;
+        if (byte_count < 0 || available < (size_t)(10 + byte_count * 2))
+        {
+            TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Malformed record on line %d\n", line);
+            fclose(file);
+            return -1;
+        }
+
+        // Decode the record, the checksum makes all of its bytes sum to zero
+        uint8_t bytes[4 + 255 + 1];
+        uint8_t sum = 0;
+        for (int i = 0; i < byte_count + 5; i++)
+        {
+            int value = hex_byte(text + i * 2);
+            if (value < 0)
+            {
+                TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Malformed record on line %d\n", line);
+                fclose(file);
+                return -1;
+            }
+            bytes[i] = (uint8_t)value;
+            sum += (uint8_t)value;
+        }
+        if (sum != 0)
+        {
+            TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "RAM init checksum mismatch on line %d\n", line);
+            fclose(file);
+            return -1;
+        }
+        start += 1 + (byte_count + 5) * 2;
+
+        uint32_t offset = (bytes[1] << 8) | bytes[2];
+        int record_type = bytes[3];
+        const uint8_t *data = bytes + 4;
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_DEBUG, "Record type %d, %d bytes at 0x%08X\n", record_type, byte_count, base + offset);
 
-        // Calculate checksum
-        uint8_t checksum = (uint8_t)(byte_count + ((address >> 8) & 0xFF) + (address & 0xFF));
-        for (int i = 0; i < byte_count; i++)
+        // Address records carry a fixed amount of data
+        if (((record_type == 2 || record_type == 4) && byte_count != 2) || ((record_type == 3 || record_type == 5) && byte_count != 4))
         {
-            checksum += load_byte(address + i);
+            TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Address record on line %d has %d bytes\n", line, byte_count);
+            fclose(file);
+            return -1;
         }
-        checksum = ~checksum + 1;
 
-        // Print record
-        printf(":%02X%04X00", byte_count, address);
-        printf("%08X", load_word(address));
-        printf("%02X\n", checksum);
+        // Process record
+        switch (record_type)
+        {
+        case 0:
+            // Data record
+            write_block(base + offset, data, byte_count);
+            break;
+        case 1:
+            // End of file record
+            fclose(file);
+            return 0;
+        case 2:
+            // Extended segment address record
+            base = ((data[0] << 8) | data[1]) << 4;
+            break;
+        case 3:
+            // Start segment address record (CS:IP)
+            if (entry != NULL)
+            {
+                *entry = (((data[0] << 8) | data[1]) << 4) + ((data[2] << 8) | data[3]);
+            }
+            break;
+        case 4:
+            // Extended linear address record
+            base = ((data[0] << 8) | data[1]) << 16;
+            break;
+        case 5:
+            // Start linear address record
+            if (entry != NULL)
+            {
+                *entry = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+            }
+            break;
+        default:
+            TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unknown record type %d\n", record_type);
+            fclose(file);
+            return -1;
+        }
     }
 
-    // Print end of file record
-    printf(":00000001FF\n");
+    fclose(file);
+    TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_WARNING, "Unexpected end of hex file\n");
+    return 0;
+}
 
-    TRACE_SET(tlevel_save);
+void RAM::dump_memory_ihex(uint32_t start_address, uint32_t end_address, bool dirty_only)
+{
+    dump_memory_ihex(stdout, start_address, end_address, dirty_only);
 }
 
-void RAM::dump_memory_ihex(char *filename, uint32_t start_address, uint32_t end_address)
+void RAM::dump_memory_ihex(const char *filename, uint32_t start_address, uint32_t end_address, bool dirty_only)
 {
     // Open file
     FILE *file = fopen(filename, "w");
     if (file == NULL)
     {
-        TRACE(TRACE_LEVEL_ERROR, "Unable to open dump file %s\n", filename);
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open dump file %s\n", filename);
         return;
     }
 
-    int tlevel_save = trace_level;
-    TRACE_SET(TRACE_LEVEL_NONE);
+    dump_memory_ihex(file, start_address, end_address, dirty_only);
 
-    // Dump memory to stdout in Intel HEX format (word at a time)
-    for (uint32_t address = start_address; address <= end_address; address += 4)
+    fclose(file);
+}
+
+void RAM::find_dump_pages(uint32_t first_page, uint32_t last_page, bool dirty_only, std::vector<uint32_t> *pages)
+{
+    if (dirty_only)
     {
-        // Skip if word is zero
-        if (load_word(address) == 0)
+        // Only the words of the bitmap with a summary bit set hold any
+        for (uint32_t i = first_page >> 12; i <= last_page >> 12; i++)
         {
-            continue;
+            uint64_t summary = memory->dirty_summary[i];
+            while (summary != 0)
+            {
+                uint32_t word = (i << 6) | (uint32_t)__builtin_ctzll(summary);
+                summary &= summary - 1;
+                uint64_t bits = memory->dirty[word];
+                while (bits != 0)
+                {
+                    uint32_t page_number = (word << 6) | (uint32_t)__builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    if (page_number >= first_page && page_number <= last_page && find_page(page_number) != NULL)
+                    {
+                        pages->push_back(page_number);
+                    }
+                }
+            }
         }
+        return;
+    }
 
-        // Calculate byte count
-        int byte_count = 4;
+    uint32_t page_number = first_page;
+    while (true)
+    {
+        if (memory->directory[page_number >> RAM_TABLE_BITS] == NULL)
+        {
+            // Nothing in this table, skip to its last page
+            page_number |= RAM_TABLE_ENTRIES - 1;
+        }
+        else if (find_page(page_number) != NULL)
+        {
+            pages->push_back(page_number);
+        }
 
-        // Calculate checksum
-        uint8_t checksum = (uint8_t)(byte_count + ((address >> 8) & 0xFF) + (address & 0xFF));
-        for (int i = 0; i < byte_count; i++)
+        if (page_number >= last_page)
         {
-            checksum += load_byte(address + i);
+            break;
         }
-        checksum = ~checksum + 1;
+        page_number++;
+    }
+}
+
+// Raw dumps can be larger than a long can address
+#ifdef _WIN32
+#define dump_seek(file, offset) _fseeki64(file, (__int64)(offset), SEEK_SET)
+#else
+#define dump_seek(file, offset) fseeko(file, (off_t)(offset), SEEK_SET)
+#endif
+
+// Records are built in a buffer that is written out when it fills up
+#define HEX_DUMP_BUFFER_SIZE (1 << 16)
+#define HEX_DUMP_RECORD_BYTES 16
+#define HEX_DUMP_MAX_LINE (1 + 2 * (1 + 2 + 1 + HEX_DUMP_RECORD_BYTES + 1) + 1)
 
-        // Print record
-        fprintf(file, ":%02X%04X00", byte_count, address);
-        fprintf(file, "%08X", load_word(address));
-        fprintf(file, "%02X\n", checksum);
+static const char hex_digit_chars[] = "0123456789ABCDEF";
+
+// Append a byte as two hex digits
+static inline char *hex_put_byte(char *out, uint8_t value)
+{
+    out[0] = hex_digit_chars[value >> 4];
+    out[1] = hex_digit_chars[value & 0xF];
+    return out + 2;
+}
+
+// Append a record, the data bytes given in the order they are written
+static char *hex_put_record(char *out, uint8_t type, uint16_t offset, const uint8_t *data, int byte_count)
+{
+    uint8_t checksum = (uint8_t)(byte_count + (offset >> 8) + (offset & 0xFF) + type);
+    *out++ = ':';
+    out = hex_put_byte(out, (uint8_t)byte_count);
+    out = hex_put_byte(out, (uint8_t)(offset >> 8));
+    out = hex_put_byte(out, (uint8_t)offset);
+    out = hex_put_byte(out, type);
+    for (int i = 0; i < byte_count; i++)
+    {
+        out = hex_put_byte(out, data[i]);
+        checksum += data[i];
+    }
+    out = hex_put_byte(out, (uint8_t)(~checksum + 1));
+    *out++ = '\n';
+    return out;
+}
+
+void RAM::dump_memory_ihex(FILE *file, uint32_t start_address, uint32_t end_address, bool dirty_only)
+{
+    std::lock_guard<std::mutex> guard(memory->lock);
+
+    std::vector<uint32_t> pages;
+    find_dump_pages(start_address >> RAM_PAGE_SHIFT, end_address >> RAM_PAGE_SHIFT, dirty_only, &pages);
+
+    std::vector<char> buffer(HEX_DUMP_BUFFER_SIZE);
+    char *out = buffer.data();
+    char *limit = buffer.data() + HEX_DUMP_BUFFER_SIZE - 2 * HEX_DUMP_MAX_LINE;
+
+    // Upper address bits of the records written so far
+    uint32_t segment = 0;
+
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        // Words of the page inside the range
+        uint32_t page_address = pages[i] << RAM_PAGE_SHIFT;
+        uint32_t low = page_address < start_address ? (start_address - page_address) >> 2 : 0;
+        uint32_t high = end_address - page_address < RAM_PAGE_SIZE ? ((end_address - page_address) >> 2) + 1 : RAM_PAGE_WORDS;
+
+        const uint32_t *words = find_page(pages[i])->words;
+        for (uint32_t index = 0; index < RAM_PAGE_WORDS; index += HEX_DUMP_RECORD_BYTES / 4)
+        {
+            uint32_t first = index > low ? index : low;
+            uint32_t last = index + HEX_DUMP_RECORD_BYTES / 4 < high ? index + HEX_DUMP_RECORD_BYTES / 4 : high;
+            if (first >= last)
+            {
+                continue;
+            }
+
+            // Zero words are only written in dirty dumps
+            uint32_t any = 0;
+            for (uint32_t k = first; k < last; k++)
+            {
+                any |= words[k];
+            }
+            if (any == 0 && !dirty_only)
+            {
+                continue;
+            }
+
+            // Words as values, most significant byte first, not in the
+            // address order the loader reads back
+            uint8_t data[HEX_DUMP_RECORD_BYTES];
+            for (uint32_t k = first; k < last; k++)
+            {
+                uint8_t *bytes = data + (k - first) * 4;
+                bytes[0] = (uint8_t)(words[k] >> 24);
+                bytes[1] = (uint8_t)(words[k] >> 16);
+                bytes[2] = (uint8_t)(words[k] >> 8);
+                bytes[3] = (uint8_t)words[k];
+            }
+            uint32_t address = page_address | (first << 2);
+
+            // Extended linear address record when crossing 64 KiB
+            if (address >> 16 != segment)
+            {
+                segment = address >> 16;
+                uint8_t upper[2] = {(uint8_t)(segment >> 8), (uint8_t)segment};
+                out = hex_put_record(out, 4, 0, upper, 2);
+            }
+            out = hex_put_record(out, 0, (uint16_t)address, data, (int)(last - first) * 4);
+
+            if (out >= limit)
+            {
+                fwrite(buffer.data(), 1, out - buffer.data(), file);
+                out = buffer.data();
+            }
+        }
     }
 
-    // Print end of file record
-    fprintf(file, ":00000001FF\n");
+    // End of file record
+    out = hex_put_record(out, 1, 0, NULL, 0);
+    fwrite(buffer.data(), 1, out - buffer.data(), file);
+}
 
-    TRACE_SET(tlevel_save);
+void RAM::dump_memory_bin(const char *filename, uint32_t start_address, uint32_t end_address, bool dirty_only)
+{
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open dump file %s\n", filename);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(memory->lock);
+    std::vector<uint32_t> pages;
+    find_dump_pages(start_address >> RAM_PAGE_SHIFT, end_address >> RAM_PAGE_SHIFT, dirty_only, &pages);
+
+    uint8_t bytes[RAM_PAGE_SIZE];
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        // Part of the page inside the range
+        uint64_t first = (uint64_t)pages[i] << RAM_PAGE_SHIFT;
+        uint64_t last = first + RAM_PAGE_SIZE - 1;
+        first = first < start_address ? start_address : first;
+        last = last > (uint64_t)end_address + 3 ? (uint64_t)end_address + 3 : last;
+
+        const uint32_t *words = find_page(pages[i])->words;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        memcpy(bytes, words, RAM_PAGE_SIZE);
+#else
+        for (uint32_t k = 0; k < RAM_PAGE_SIZE; k++)
+        {
+            bytes[k] = (uint8_t)(words[k >> 2] >> ((k % 4) * 8));
+        }
+#endif
+
+        // Pages in between are left as holes
+        if (dump_seek(file, first - start_address) != 0 ||
+            fwrite(bytes + (first & (RAM_PAGE_SIZE - 1)), 1, last - first + 1, file) != last - first + 1)
+        {
+            TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to write dump file %s\n", filename);
+            break;
+        }
+    }
 
     fclose(file);
-}
\ No newline at end of file
+}
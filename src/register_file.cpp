@@ -23,7 +23,7 @@ void RegisterFile::set_reg(int reg, uint32_t data)
 {
     if (reg > 31)
     {
-        TRACE(TRACE_LEVEL_ERROR, "Register File: Invalid register %d\n", reg);
+        TRACE(TRACE_CAT_REGFILE, TRACE_LEVEL_ERROR, "Register File: Invalid register %d\n", reg);
         return;
     }
 
@@ -32,15 +32,15 @@ void RegisterFile::set_reg(int reg, uint32_t data)
         return;
     }
 
-    TRACE(TRACE_LEVEL_DEBUG, "Register File: Setting register %d to 0x%08X\n", reg, data);
-    registers[reg - 1] = data;
+    TRACE(TRACE_CAT_REGFILE, TRACE_LEVEL_DEBUG, "Register File: Setting register %d to 0x%08X\n", reg, data);
+    registers[reg] = data;
 }
 
 uint32_t RegisterFile::get_reg(int reg)
 {
     if (reg > 31)
     {
-        TRACE(TRACE_LEVEL_ERROR, "Register File: Invalid register %d\n", reg);
+        TRACE(TRACE_CAT_REGFILE, TRACE_LEVEL_ERROR, "Register File: Invalid register %d\n", reg);
         return 0;
     }
 
@@ -49,8 +49,8 @@ uint32_t RegisterFile::get_reg(int reg)
         return 0;
     }
 
-    TRACE(TRACE_LEVEL_DEBUG, "Register File: Getting register %d with value 0x%08X\n", reg, registers[reg - 1]);
-    return registers[reg - 1];
+    TRACE(TRACE_CAT_REGFILE, TRACE_LEVEL_DEBUG, "Register File: Getting register %d with value 0x%08X\n", reg, registers[reg]);
+    return registers[reg];
 }
 
 void RegisterFile::dump_state()
@@ -62,7 +62,7 @@ void RegisterFile::dump_state()
             printf("\n");
         }
 
-        printf("x%02d: 0x%08X  ", i, registers[i - 1]);
+        printf("x%02d: 0x%08X  ", i, registers[i]);
     }
 
     printf("\n");
@@ -0,0 +1,383 @@
+// Runs guest system calls on the host.
+
+#include "syscall_proxy.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+#ifdef SYSCALL_PROXY_SUPPORTED
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Argument and result registers
+#define SYSCALL_REG_A0 10
+#define SYSCALL_REG_A7 17
+
+SyscallProxy::SyscallProxy()
+{
+    // The guest shares the emulator's standard streams
+    for (int fd = 0; fd < 3; fd++)
+    {
+        files.push_back(fd);
+    }
+    break_start = 0;
+    break_current = 0;
+    exited = false;
+    exit_code = 0;
+}
+
+SyscallProxy::~SyscallProxy()
+{
+#ifdef SYSCALL_PROXY_SUPPORTED
+    for (size_t fd = 3; fd < files.size(); fd++)
+    {
+        if (files[fd] >= 0)
+        {
+            ::close(files[fd]);
+        }
+    }
+#endif
+}
+
+void SyscallProxy::set_break(uint32_t address)
+{
+    break_start = address;
+    break_current = address;
+}
+
+void SyscallProxy::add_processor(Processor *processor)
+{
+    processors.push_back(processor);
+}
+
+bool SyscallProxy::call(Processor *processor, RAM *ram)
+{
+    uint32_t number = processor->get_register(SYSCALL_REG_A7);
+    uint32_t a[6];
+    for (int i = 0; i < 6; i++)
+    {
+        a[i] = processor->get_register(SYSCALL_REG_A0 + i);
+    }
+    TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_DEBUG, "System call %u (0x%08X, 0x%08X, 0x%08X, 0x%08X)\n", number, a[0], a[1], a[2], a[3]);
+
+    // Exits halt the hart where it is, exit_group stops the others too
+    if (number == SYSCALL_EXIT || number == SYSCALL_EXIT_GROUP)
+    {
+        bool expected = false;
+        if (exited.compare_exchange_strong(expected, true))
+        {
+            exit_code = (int32_t)a[0];
+            TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_INFO, "Exited with status %d\n", exit_code.load());
+        }
+        if (number == SYSCALL_EXIT_GROUP)
+        {
+            for (size_t i = 0; i < processors.size(); i++)
+            {
+                if (processors[i] != processor)
+                {
+                    processors[i]->request_stop();
+                }
+            }
+        }
+        return false;
+    }
+
+#ifdef SYSCALL_PROXY_SUPPORTED
+    uint32_t result;
+    switch (number)
+    {
+    case SYSCALL_OPENAT:
+        result = (uint32_t)sys_openat(ram, (int32_t)a[0], a[1], a[2], a[3]);
+        break;
+    case SYSCALL_OPEN:
+        result = (uint32_t)sys_openat(ram, SYSCALL_AT_FDCWD, a[0], a[1], a[2]);
+        break;
+    case SYSCALL_CLOSE:
+        result = (uint32_t)sys_close(a[0]);
+        break;
+    case SYSCALL_LSEEK:
+        result = (uint32_t)sys_lseek(a[0], (int32_t)a[1], a[2]);
+        break;
+    case SYSCALL_READ:
+        result = (uint32_t)sys_read(ram, a[0], a[1], a[2]);
+        break;
+    case SYSCALL_WRITE:
+        result = (uint32_t)sys_write(ram, a[0], a[1], a[2]);
+        break;
+    case SYSCALL_FSTAT:
+        result = (uint32_t)sys_fstat(ram, a[0], a[1]);
+        break;
+    case SYSCALL_CLOCK_GETTIME:
+    case SYSCALL_CLOCK_GETTIME64:
+        result = (uint32_t)sys_clock_gettime(ram, a[0], a[1], number == SYSCALL_CLOCK_GETTIME64);
+        break;
+    case SYSCALL_BRK:
+        result = sys_brk(ram, a[0]);
+        break;
+    default:
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_WARNING, "Unsupported system call %u\n", number);
+        result = (uint32_t)-ENOSYS;
+        break;
+    }
+    processor->set_register(SYSCALL_REG_A0, result);
+    return true;
+#else
+    (void)ram;
+    TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "System calls are not supported on this host\n");
+    return false;
+#endif
+}
+
+#ifdef SYSCALL_PROXY_SUPPORTED
+
+int SyscallProxy::host_file(uint32_t fd)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return fd < files.size() ? files[fd] : -1;
+}
+
+bool SyscallProxy::map_buffer(RAM *ram, uint32_t address, uint32_t length, bool for_write, std::vector<struct iovec> *iov)
+{
+    while (length > 0)
+    {
+        uint32_t chunk;
+        uint8_t *bytes = ram->host_bytes(address, length, for_write, &chunk);
+        if (bytes == NULL)
+        {
+            return false;
+        }
+        struct iovec entry;
+        entry.iov_base = bytes;
+        entry.iov_len = chunk;
+        iov->push_back(entry);
+        address += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+int32_t SyscallProxy::sys_openat(RAM *ram, int32_t dirfd, uint32_t path, uint32_t flags, uint32_t mode)
+{
+    // The path is the only thing copied out of guest memory
+    char name[SYSCALL_PATH_MAX];
+    uint32_t length = 0;
+    while (length < sizeof(name) && (name[length] = (char)ram->load_byte(path + length)) != '\0')
+    {
+        length++;
+    }
+    if (length == sizeof(name))
+    {
+        return -ENAMETOOLONG;
+    }
+
+    int host_dirfd = AT_FDCWD;
+    if (dirfd != SYSCALL_AT_FDCWD && (host_dirfd = host_file((uint32_t)dirfd)) < 0)
+    {
+        return -EBADF;
+    }
+
+    // Guest flags have their Linux values whatever the host's are
+    int host_flags = (flags & SYSCALL_O_ACCMODE) == 1 ? O_WRONLY : (flags & SYSCALL_O_ACCMODE) == 2 ? O_RDWR
+                                                                                                    : O_RDONLY;
+    host_flags |= (flags & SYSCALL_O_CREAT) ? O_CREAT : 0;
+    host_flags |= (flags & SYSCALL_O_EXCL) ? O_EXCL : 0;
+    host_flags |= (flags & SYSCALL_O_TRUNC) ? O_TRUNC : 0;
+    host_flags |= (flags & SYSCALL_O_APPEND) ? O_APPEND : 0;
+    host_flags |= (flags & SYSCALL_O_NONBLOCK) ? O_NONBLOCK : 0;
+    host_flags |= (flags & SYSCALL_O_DIRECTORY) ? O_DIRECTORY : 0;
+    int host_fd = ::openat(host_dirfd, name, host_flags | O_CLOEXEC, (mode_t)mode);
+    if (host_fd < 0)
+    {
+        return -errno;
+    }
+
+    // Lowest free guest descriptor, as POSIX hands them out
+    std::lock_guard<std::mutex> guard(lock);
+    size_t fd = 0;
+    while (fd < files.size() && files[fd] >= 0)
+    {
+        fd++;
+    }
+    if (fd == files.size())
+    {
+        files.push_back(-1);
+    }
+    files[fd] = host_fd;
+    TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_INFO, "Guest opened %s as %u\n", name, (uint32_t)fd);
+    return (int32_t)fd;
+}
+
+int32_t SyscallProxy::sys_close(uint32_t fd)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (fd >= files.size() || files[fd] < 0)
+    {
+        return -EBADF;
+    }
+
+    // The emulator's own streams stay open for it
+    int result = fd < 3 ? 0 : ::close(files[fd]);
+    files[fd] = -1;
+    return result < 0 ? -errno : 0;
+}
+
+int32_t SyscallProxy::sys_lseek(uint32_t fd, int32_t offset, uint32_t whence)
+{
+    int host_fd = host_file(fd);
+    if (host_fd < 0)
+    {
+        return -EBADF;
+    }
+    int host_whence = whence == 0 ? SEEK_SET : whence == 1 ? SEEK_CUR : whence == 2 ? SEEK_END : -1;
+    if (host_whence < 0)
+    {
+        return -EINVAL;
+    }
+    off_t result = ::lseek(host_fd, offset, host_whence);
+    if (result < 0)
+    {
+        return -errno;
+    }
+    return result > INT32_MAX ? -EOVERFLOW : (int32_t)result;
+}
+
+int32_t SyscallProxy::sys_read(RAM *ram, uint32_t fd, uint32_t buffer, uint32_t length)
+{
+    int host_fd = host_file(fd);
+    if (host_fd < 0)
+    {
+        return -EBADF;
+    }
+    std::vector<struct iovec> iov;
+    if (!map_buffer(ram, buffer, length < SYSCALL_MAX_TRANSFER ? length : SYSCALL_MAX_TRANSFER, true, &iov))
+    {
+        return -EFAULT;
+    }
+    ssize_t result = ::readv(host_fd, iov.data(), (int)iov.size());
+    return result < 0 ? -errno : (int32_t)result;
+}
+
+int32_t SyscallProxy::sys_write(RAM *ram, uint32_t fd, uint32_t buffer, uint32_t length)
+{
+    int host_fd = host_file(fd);
+    if (host_fd < 0)
+    {
+        return -EBADF;
+    }
+    std::vector<struct iovec> iov;
+    if (!map_buffer(ram, buffer, length < SYSCALL_MAX_TRANSFER ? length : SYSCALL_MAX_TRANSFER, false, &iov))
+    {
+        return -EFAULT;
+    }
+    ssize_t result = ::writev(host_fd, iov.data(), (int)iov.size());
+    return result < 0 ? -errno : (int32_t)result;
+}
+
+// Little endian fields of guest structures
+static void put32(uint8_t *bytes, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static void put64(uint8_t *bytes, uint64_t value)
+{
+    put32(bytes, (uint32_t)value);
+    put32(bytes + 4, (uint32_t)(value >> 32));
+}
+
+int32_t SyscallProxy::sys_fstat(RAM *ram, uint32_t fd, uint32_t buffer)
+{
+    int host_fd = host_file(fd);
+    if (host_fd < 0)
+    {
+        return -EBADF;
+    }
+    struct stat host;
+    if (::fstat(host_fd, &host) != 0)
+    {
+        return -errno;
+    }
+
+    // struct stat of 32-bit RISC-V Linux and newlib
+    uint8_t bytes[SYSCALL_STAT_SIZE];
+    memset(bytes, 0, sizeof(bytes));
+    put64(bytes + 0, (uint64_t)host.st_dev);
+    put64(bytes + 8, (uint64_t)host.st_ino);
+    put32(bytes + 16, (uint32_t)host.st_mode);
+    put32(bytes + 20, (uint32_t)host.st_nlink);
+    put32(bytes + 24, (uint32_t)host.st_uid);
+    put32(bytes + 28, (uint32_t)host.st_gid);
+    put64(bytes + 32, (uint64_t)host.st_rdev);
+    put64(bytes + 48, (uint64_t)host.st_size);
+    put32(bytes + 56, (uint32_t)host.st_blksize);
+    put64(bytes + 64, (uint64_t)host.st_blocks);
+    put32(bytes + 72, (uint32_t)host.st_atime);
+    put32(bytes + 80, (uint32_t)host.st_mtime);
+    put32(bytes + 88, (uint32_t)host.st_ctime);
+    ram->write_block(buffer, bytes, sizeof(bytes));
+    return 0;
+}
+
+int32_t SyscallProxy::sys_clock_gettime(RAM *ram, uint32_t clock, uint32_t buffer, bool time64)
+{
+    clockid_t host_clock;
+    if (clock == 0)
+    {
+        host_clock = CLOCK_REALTIME;
+    }
+    else if (clock == 1)
+    {
+        host_clock = CLOCK_MONOTONIC;
+    }
+    else
+    {
+        return -EINVAL;
+    }
+    struct timespec now;
+    if (::clock_gettime(host_clock, &now) != 0)
+    {
+        return -errno;
+    }
+
+    // The 64-bit call pads tv_nsec out to 8 bytes
+    uint8_t bytes[16];
+    memset(bytes, 0, sizeof(bytes));
+    if (time64)
+    {
+        put64(bytes, (uint64_t)now.tv_sec);
+        put32(bytes + 8, (uint32_t)now.tv_nsec);
+    }
+    else
+    {
+        put32(bytes, (uint32_t)now.tv_sec);
+        put32(bytes + 4, (uint32_t)now.tv_nsec);
+    }
+    ram->write_block(buffer, bytes, time64 ? 16 : 8);
+    return 0;
+}
+
+uint32_t SyscallProxy::sys_brk(RAM *ram, uint32_t address)
+{
+    // Like Linux, failure returns the current break
+    std::lock_guard<std::mutex> guard(lock);
+    if (break_start == 0 || address < break_start)
+    {
+        return break_current;
+    }
+
+    // Memory given back comes back zeroed
+    if (address < break_current)
+    {
+        ram->clear_block(address, break_current - address);
+    }
+    break_current = address;
+    return break_current;
+}
+
+#endif // SYSCALL_PROXY_SUPPORTED
@@ -0,0 +1,818 @@
+// Basic block interpreter with one handler per instruction.
+
+#include "threaded_engine.h"
+
+#include <string.h>
+#include <set>
+#include "alu.h"
+#include "processor.h"
+#include "register_file.h"
+#include "trace.h"
+
+// Use labels as values where the compiler supports them, otherwise dispatch
+// through a switch that jumps to the same handlers
+#if defined(__GNUC__)
+#define THREADED_COMPUTED_GOTO
+#endif
+
+#ifdef THREADED_COMPUTED_GOTO
+#define DISPATCH() goto *op->handler
+#else
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() \
+    do         \
+    {          \
+        op++;  \
+        DISPATCH(); \
+    } while (0)
+
+ThreadedEngine::ThreadedEngine(Processor *processor, RAM *ram, DecodeCache *decode_cache)
+{
+    this->processor = processor;
+    this->ram = ram;
+    this->decode_cache = decode_cache;
+    code_modified = false;
+    flush_pending = false;
+    watch_pending = false;
+
+    ram->add_code_observer(this);
+}
+
+ThreadedEngine::~ThreadedEngine()
+{
+    ram->remove_code_observer(this);
+    flush();
+}
+
+void ThreadedEngine::flush()
+{
+    for (std::unordered_map<uint32_t, threaded_block_t *>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        delete it->second;
+    }
+    blocks.clear();
+    coverage.clear();
+    pending_writes.clear();
+    code_modified = false;
+    flush_pending = false;
+}
+
+void ThreadedEngine::code_written(uint32_t address, uint32_t size)
+{
+    // Data on the same page as code is not interesting
+    if (!coverage.overlaps(address, size))
+    {
+        return;
+    }
+
+    // Blocks can't be deleted here, the store may come from the block being run
+    pending_writes.push_back(std::make_pair(address, size));
+    code_modified = true;
+}
+
+void ThreadedEngine::fence_instructions()
+{
+    // Stores from other harts are not tracked, so everything goes
+    flush_pending = true;
+    code_modified = true;
+}
+
+void ThreadedEngine::watch_hit()
+{
+    watch_pending = true;
+}
+
+void ThreadedEngine::device_written()
+{
+    // The store ops already leave the block on a code write, and the stop
+    // is seen on the way back in
+    if (processor->stop_requested.load(std::memory_order_relaxed))
+    {
+        code_modified = true;
+    }
+}
+
+void ThreadedEngine::stop_at(uint32_t address)
+{
+    // Drop the block running through the address, and the one starting there
+    // in case it was chained to since the last stop_at()
+    stop_points.insert(address);
+    code_written(address, 4);
+}
+
+void ThreadedEngine::clear_stop(uint32_t address)
+{
+    // Drop the block ending at the address so it is translated through it
+    // again, along with the one starting there
+    if (stop_points.erase(address) != 0)
+    {
+        code_written(address - 2, 4);
+    }
+}
+
+bool ThreadedEngine::process_invalidations()
+{
+    if (!code_modified)
+    {
+        return false;
+    }
+    if (flush_pending)
+    {
+        flush();
+        return true;
+    }
+    code_modified = false;
+
+    std::vector<threaded_block_t *> dead;
+    for (std::unordered_map<uint32_t, threaded_block_t *>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        threaded_block_t *block = it->second;
+        for (size_t i = 0; i < pending_writes.size(); i++)
+        {
+            uint32_t address = pending_writes[i].first;
+            uint32_t size = pending_writes[i].second;
+            if (address < block->end_pc && address + size > block->start_pc)
+            {
+                dead.push_back(block);
+                break;
+            }
+        }
+    }
+    pending_writes.clear();
+
+    if (dead.empty())
+    {
+        return false;
+    }
+
+    TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "Threaded engine: Dropping %d blocks\n", (int)dead.size());
+    remove_blocks(dead);
+    return true;
+}
+
+void ThreadedEngine::remove_blocks(std::vector<threaded_block_t *> &dead)
+{
+    std::set<threaded_block_t *> dead_set(dead.begin(), dead.end());
+
+    for (size_t i = 0; i < dead.size(); i++)
+    {
+        blocks.erase(dead[i]->start_pc);
+    }
+
+    // Unlink chains from the surviving blocks
+    for (std::unordered_map<uint32_t, threaded_block_t *>::iterator it = blocks.begin(); it != blocks.end(); ++it)
+    {
+        threaded_block_t *block = it->second;
+        if (dead_set.count(block->taken))
+        {
+            block->taken = NULL;
+        }
+        if (dead_set.count(block->not_taken))
+        {
+            block->not_taken = NULL;
+        }
+        if (dead_set.count(block->indirect))
+        {
+            block->indirect = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < dead.size(); i++)
+    {
+        delete dead[i];
+    }
+}
+
+void ThreadedEngine::translate(threaded_op_t *op, const control_t &ctrl, uint32_t pc)
+{
+    op->rd = ctrl.rd == 0 ? REGISTER_SINK : ctrl.rd;
+    op->rs1 = ctrl.rs1;
+    op->rs2 = ctrl.rs2;
+    op->imm = ctrl.imm;
+    op->length = ctrl.length;
+    op->link = pc + ctrl.length;
+    op->kind = THREADED_OP_GENERIC;
+    op->profile = PROFILE_JUMP;
+    op->event = (uint8_t)Processor::instruction_event(ctrl);
+
+    if (ctrl.ecall || ctrl.breakpoint || ctrl.amo != AMO_NONE || ctrl.fence || ctrl.fence_i || ctrl.csr_op != CSR_NONE)
+    {
+        // System calls, breakpoints, atomics, fences and CSRs go through the
+        // datapath
+    }
+    else if (ctrl.halt)
+    {
+        op->kind = THREADED_OP_HALT;
+    }
+    else if (ctrl.jump)
+    {
+        // JAL adds to the PC, JALR to a register
+        op->kind = ctrl.alu_a_src ? THREADED_OP_JAL : THREADED_OP_JALR;
+        op->profile = profile_classify(!ctrl.alu_a_src, ctrl.rd, ctrl.rs1);
+    }
+    else if (ctrl.branch)
+    {
+        switch (ctrl.alu_op)
+        {
+        case ALUOP_SUB:
+            op->kind = ctrl.branch_pol ? THREADED_OP_BNE : THREADED_OP_BEQ;
+            break;
+        case ALUOP_SLT:
+            op->kind = ctrl.branch_pol ? THREADED_OP_BLT : THREADED_OP_BGE;
+            break;
+        case ALUOP_SLTU:
+            op->kind = ctrl.branch_pol ? THREADED_OP_BLTU : THREADED_OP_BGEU;
+            break;
+        default:
+            break;
+        }
+    }
+    else if (ctrl.mem_read == 1)
+    {
+        op->kind = ctrl.mem_read_unsigned ? THREADED_OP_LBU : THREADED_OP_LB;
+    }
+    else if (ctrl.mem_read == 2)
+    {
+        op->kind = ctrl.mem_read_unsigned ? THREADED_OP_LHU : THREADED_OP_LH;
+    }
+    else if (ctrl.mem_read == 3)
+    {
+        op->kind = THREADED_OP_LW;
+    }
+    else if (ctrl.mem_write == 1)
+    {
+        op->kind = THREADED_OP_SB;
+    }
+    else if (ctrl.mem_write == 2)
+    {
+        op->kind = THREADED_OP_SH;
+    }
+    else if (ctrl.mem_write == 3)
+    {
+        op->kind = THREADED_OP_SW;
+    }
+    else if (ctrl.alu_a_src)
+    {
+        // AUIPC is a constant once the PC is known
+        op->kind = THREADED_OP_LI;
+        op->imm = pc + ctrl.imm;
+    }
+    else if (ctrl.alu_b_src)
+    {
+        switch (ctrl.alu_op)
+        {
+        case ALUOP_ADD:
+            // LUI and li read x0
+            op->kind = ctrl.rs1 == 0 ? THREADED_OP_LI : THREADED_OP_ADDI;
+            break;
+        case ALUOP_SLT:
+            op->kind = THREADED_OP_SLTI;
+            break;
+        case ALUOP_SLTU:
+            op->kind = THREADED_OP_SLTIU;
+            break;
+        case ALUOP_XOR:
+            op->kind = THREADED_OP_XORI;
+            break;
+        case ALUOP_OR:
+            op->kind = THREADED_OP_ORI;
+            break;
+        case ALUOP_AND:
+            op->kind = THREADED_OP_ANDI;
+            break;
+        case ALUOP_SLL:
+            op->kind = THREADED_OP_SLLI;
+            op->imm &= 0x1F;
+            break;
+        case ALUOP_SRL:
+            op->kind = THREADED_OP_SRLI;
+            op->imm &= 0x1F;
+            break;
+        case ALUOP_SRA:
+            op->kind = THREADED_OP_SRAI;
+            op->imm &= 0x1F;
+            break;
+        default:
+            break;
+        }
+    }
+    else
+    {
+        switch (ctrl.alu_op)
+        {
+        case ALUOP_ADD:
+            op->kind = THREADED_OP_ADD;
+            break;
+        case ALUOP_SUB:
+            op->kind = THREADED_OP_SUB;
+            break;
+        case ALUOP_AND:
+            op->kind = THREADED_OP_AND;
+            break;
+        case ALUOP_OR:
+            op->kind = THREADED_OP_OR;
+            break;
+        case ALUOP_XOR:
+            op->kind = THREADED_OP_XOR;
+            break;
+        case ALUOP_SLT:
+            op->kind = THREADED_OP_SLT;
+            break;
+        case ALUOP_SLTU:
+            op->kind = THREADED_OP_SLTU;
+            break;
+        case ALUOP_SLL:
+            op->kind = THREADED_OP_SLL;
+            break;
+        case ALUOP_SRL:
+            op->kind = THREADED_OP_SRL;
+            break;
+        case ALUOP_SRA:
+            op->kind = THREADED_OP_SRA;
+            break;
+        case ALUOP_MUL:
+            if (!ctrl.mul_half && ctrl.mul_signed_a && ctrl.mul_signed_b)
+            {
+                op->kind = THREADED_OP_MUL;
+            }
+            else if (ctrl.mul_half && ctrl.mul_signed_a && ctrl.mul_signed_b)
+            {
+                op->kind = THREADED_OP_MULH;
+            }
+            else if (ctrl.mul_half && ctrl.mul_signed_a && !ctrl.mul_signed_b)
+            {
+                op->kind = THREADED_OP_MULHSU;
+            }
+            else if (ctrl.mul_half && !ctrl.mul_signed_a && !ctrl.mul_signed_b)
+            {
+                op->kind = THREADED_OP_MULHU;
+            }
+            break;
+        case ALUOP_DIV:
+            op->kind = THREADED_OP_DIV;
+            break;
+        case ALUOP_DIVU:
+            op->kind = THREADED_OP_DIVU;
+            break;
+        case ALUOP_REM:
+            op->kind = THREADED_OP_REM;
+            break;
+        case ALUOP_REMU:
+            op->kind = THREADED_OP_REMU;
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Register writes to x0 without side effects do nothing
+    if (ctrl.rd == 0 && op->kind >= THREADED_OP_LI && op->kind <= THREADED_OP_REMU)
+    {
+        op->kind = THREADED_OP_NOP;
+    }
+}
+
+threaded_block_t *ThreadedEngine::build_block(uint32_t pc)
+{
+    threaded_block_t *block = new threaded_block_t;
+    block->start_pc = pc;
+    block->end_pc = pc;
+    block->length = 0;
+    block->taken_pc = 0;
+    block->not_taken_pc = 0;
+    block->taken = NULL;
+    block->not_taken = NULL;
+    block->indirect_pc = 0;
+    block->indirect = NULL;
+    memset(block->events, 0, sizeof(block->events));
+
+    uint32_t address = pc;
+    while (true)
+    {
+        threaded_op_t op;
+        translate(&op, *decode_cache->lookup(address), address);
+        block->ops.push_back(op);
+        block->end_pc = op.link;
+
+        if (op.kind == THREADED_OP_GENERIC)
+        {
+            // Left to the reference datapath, which counts it itself
+            break;
+        }
+
+        // Events are counted for the whole block on entry, only taken
+        // branches as they happen
+        block->events[op.event]++;
+        block->length++;
+        if (op.kind >= THREADED_OP_BEQ && op.kind <= THREADED_OP_BGEU)
+        {
+            block->taken_pc = address + op.imm;
+            block->not_taken_pc = op.link;
+            break;
+        }
+        if (op.kind == THREADED_OP_JAL)
+        {
+            block->taken_pc = address + op.imm;
+            break;
+        }
+        if (op.kind == THREADED_OP_JALR || op.kind == THREADED_OP_HALT)
+        {
+            break;
+        }
+
+        // Stop at page boundaries so a block only depends on one page, and
+        // before stop points so run_until() can catch them between blocks
+        address = op.link;
+        if (block->length == THREADED_MAX_BLOCK_LENGTH || (address >> RAM_PAGE_SHIFT) != (pc >> RAM_PAGE_SHIFT) || stop_points.count(address) != 0)
+        {
+            threaded_op_t end;
+            end.kind = THREADED_OP_END;
+            end.rd = REGISTER_SINK;
+            end.rs1 = 0;
+            end.rs2 = 0;
+            end.length = 0;
+            end.imm = 0;
+            end.link = 0;
+            end.event = HPM_EVENT_NONE;
+            block->ops.push_back(end);
+            block->not_taken_pc = address;
+            break;
+        }
+    }
+
+    TRACE(TRACE_CAT_DECODE, TRACE_LEVEL_DEBUG, "Threaded engine: Block at 0x%08X with %u instructions\n", pc, block->length);
+
+    coverage.mark(block->start_pc, block->end_pc);
+    blocks[pc] = block;
+    return block;
+}
+
+void ThreadedEngine::uncount_events(const threaded_block_t *block, const threaded_op_t *op)
+{
+    for (op++; op < &block->ops[0] + block->ops.size(); op++)
+    {
+        if (op->kind == THREADED_OP_GENERIC || op->kind == THREADED_OP_END)
+        {
+            break;
+        }
+        if (op->event != HPM_EVENT_NONE)
+        {
+            processor->event_counts[op->event]--;
+        }
+    }
+}
+
+void ThreadedEngine::run()
+{
+#ifdef THREADED_COMPUTED_GOTO
+#define THREADED_OP_LABEL(name) &&op_##name,
+    static const void *const handlers[THREADED_OP_COUNT] = {THREADED_OPS(THREADED_OP_LABEL)};
+#undef THREADED_OP_LABEL
+#endif
+
+    uint32_t *x = processor->registers.data();
+    threaded_block_t *block;
+    const threaded_op_t *op;
+
+    // Chain slot to point at the next block once it is found
+    threaded_block_t **link = NULL;
+    watch_pending = false;
+
+lookup:
+    // Blocks may have been dropped, including the one holding the chain slot
+    if (process_invalidations())
+    {
+        link = NULL;
+    }
+
+    // Stop conditions are checked between blocks, the datapath takes over
+    if (processor->halt || processor->watch_triggered ||
+        (processor->breakpoint_set && processor->pc == processor->breakpoint))
+    {
+        return;
+    }
+
+    {
+        std::unordered_map<uint32_t, threaded_block_t *>::iterator it = blocks.find(processor->pc);
+        if (it != blocks.end())
+        {
+            block = it->second;
+        }
+        else
+        {
+            block = build_block(processor->pc);
+#ifdef THREADED_COMPUTED_GOTO
+            for (size_t i = 0; i < block->ops.size(); i++)
+            {
+                block->ops[i].handler = handlers[block->ops[i].kind];
+            }
+#endif
+        }
+    }
+
+    if (link != NULL)
+    {
+        *link = block;
+    }
+
+enter:
+    if (processor->instruction_count + block->length > processor->stop_count || processor->stop_requested.load(std::memory_order_relaxed))
+    {
+        processor->pc = block->start_pc;
+        return;
+    }
+    processor->instruction_count += block->length;
+    if (processor->hpm_active)
+    {
+        for (int i = HPM_EVENT_NONE + 1; i < HPM_EVENT_COUNT; i++)
+        {
+            processor->event_counts[i] += block->events[i];
+        }
+    }
+    op = &block->ops[0];
+    DISPATCH();
+
+#ifndef THREADED_COMPUTED_GOTO
+#define THREADED_OP_CASE(name)  \
+    case THREADED_OP_##name: \
+        goto op_##name;
+dispatch:
+    switch (op->kind)
+    {
+        THREADED_OPS(THREADED_OP_CASE)
+    default:
+        goto op_GENERIC;
+    }
+#undef THREADED_OP_CASE
+#endif
+
+op_NOP:
+    NEXT();
+op_LI:
+    x[op->rd] = op->imm;
+    NEXT();
+op_ADDI:
+    x[op->rd] = x[op->rs1] + op->imm;
+    NEXT();
+op_SLTI:
+    x[op->rd] = (int32_t)x[op->rs1] < (int32_t)op->imm;
+    NEXT();
+op_SLTIU:
+    x[op->rd] = x[op->rs1] < op->imm;
+    NEXT();
+op_XORI:
+    x[op->rd] = x[op->rs1] ^ op->imm;
+    NEXT();
+op_ORI:
+    x[op->rd] = x[op->rs1] | op->imm;
+    NEXT();
+op_ANDI:
+    x[op->rd] = x[op->rs1] & op->imm;
+    NEXT();
+op_SLLI:
+    x[op->rd] = x[op->rs1] << op->imm;
+    NEXT();
+op_SRLI:
+    x[op->rd] = x[op->rs1] >> op->imm;
+    NEXT();
+op_SRAI:
+    x[op->rd] = (int32_t)x[op->rs1] >> op->imm;
+    NEXT();
+op_ADD:
+    x[op->rd] = x[op->rs1] + x[op->rs2];
+    NEXT();
+op_SUB:
+    x[op->rd] = x[op->rs1] - x[op->rs2];
+    NEXT();
+op_AND:
+    x[op->rd] = x[op->rs1] & x[op->rs2];
+    NEXT();
+op_OR:
+    x[op->rd] = x[op->rs1] | x[op->rs2];
+    NEXT();
+op_XOR:
+    x[op->rd] = x[op->rs1] ^ x[op->rs2];
+    NEXT();
+op_SLT:
+    x[op->rd] = (int32_t)x[op->rs1] < (int32_t)x[op->rs2];
+    NEXT();
+op_SLTU:
+    x[op->rd] = x[op->rs1] < x[op->rs2];
+    NEXT();
+op_SLL:
+    x[op->rd] = x[op->rs1] << (x[op->rs2] & 0x1F);
+    NEXT();
+op_SRL:
+    x[op->rd] = x[op->rs1] >> (x[op->rs2] & 0x1F);
+    NEXT();
+op_SRA:
+    x[op->rd] = (int32_t)x[op->rs1] >> (x[op->rs2] & 0x1F);
+    NEXT();
+op_MUL:
+    x[op->rd] = x[op->rs1] * x[op->rs2];
+    NEXT();
+op_MULH:
+    x[op->rd] = (uint32_t)(((int64_t)(int32_t)x[op->rs1] * (int64_t)(int32_t)x[op->rs2]) >> 32);
+    NEXT();
+op_MULHSU:
+    x[op->rd] = (uint32_t)(((int64_t)(int32_t)x[op->rs1] * (int64_t)x[op->rs2]) >> 32);
+    NEXT();
+op_MULHU:
+    x[op->rd] = (uint32_t)(((uint64_t)x[op->rs1] * (uint64_t)x[op->rs2]) >> 32);
+    NEXT();
+op_DIV:
+    x[op->rd] = alu_execute(x[op->rs1], x[op->rs2], ALUOP_DIV, false, false, false);
+    NEXT();
+op_DIVU:
+    x[op->rd] = alu_execute(x[op->rs1], x[op->rs2], ALUOP_DIVU, false, false, false);
+    NEXT();
+op_REM:
+    x[op->rd] = alu_execute(x[op->rs1], x[op->rs2], ALUOP_REM, false, false, false);
+    NEXT();
+op_REMU:
+    x[op->rd] = alu_execute(x[op->rs1], x[op->rs2], ALUOP_REMU, false, false, false);
+    NEXT();
+op_LB:
+    x[op->rd] = (uint32_t)(int32_t)(int8_t)ram->load_byte(x[op->rs1] + op->imm);
+    if (watch_pending)
+    {
+        goto leave_block;
+    }
+    NEXT();
+op_LBU:
+    x[op->rd] = ram->load_byte(x[op->rs1] + op->imm);
+    if (watch_pending)
+    {
+        goto leave_block;
+    }
+    NEXT();
+op_LH:
+    x[op->rd] = (uint32_t)(int32_t)(int16_t)ram->load_halfword(x[op->rs1] + op->imm);
+    if (watch_pending)
+    {
+        goto leave_block;
+    }
+    NEXT();
+op_LHU:
+    x[op->rd] = ram->load_halfword(x[op->rs1] + op->imm);
+    if (watch_pending)
+    {
+        goto leave_block;
+    }
+    NEXT();
+op_LW:
+    x[op->rd] = ram->load_word(x[op->rs1] + op->imm);
+    if (watch_pending)
+    {
+        goto leave_block;
+    }
+    NEXT();
+op_SB:
+    ram->store_byte(x[op->rs1] + op->imm, (uint8_t)x[op->rs2]);
+    if (code_modified || watch_pending)
+    {
+        goto leave_block;
+    }
+    NEXT();
+op_SH:
+    ram->store_halfword(x[op->rs1] + op->imm, (uint16_t)x[op->rs2]);
+    if (code_modified || watch_pending)
+    {
+        goto leave_block;
+    }
+    NEXT();
+op_SW:
+    ram->store_word(x[op->rs1] + op->imm, x[op->rs2]);
+    if (code_modified || watch_pending)
+    {
+        goto leave_block;
+    }
+    NEXT();
+op_BEQ:
+    if (x[op->rs1] == x[op->rs2])
+    {
+        goto branch_taken;
+    }
+    goto not_taken;
+op_BNE:
+    if (x[op->rs1] != x[op->rs2])
+    {
+        goto branch_taken;
+    }
+    goto not_taken;
+op_BLT:
+    if ((int32_t)x[op->rs1] < (int32_t)x[op->rs2])
+    {
+        goto branch_taken;
+    }
+    goto not_taken;
+op_BGE:
+    if ((int32_t)x[op->rs1] >= (int32_t)x[op->rs2])
+    {
+        goto branch_taken;
+    }
+    goto not_taken;
+op_BLTU:
+    if (x[op->rs1] < x[op->rs2])
+    {
+        goto branch_taken;
+    }
+    goto not_taken;
+op_BGEU:
+    if (x[op->rs1] >= x[op->rs2])
+    {
+        goto branch_taken;
+    }
+    goto not_taken;
+op_JAL:
+    x[op->rd] = op->link;
+    if (op->profile != PROFILE_JUMP && processor->profiler != NULL)
+    {
+        processor->profiler->jump(op->profile, block->taken_pc);
+    }
+    goto taken;
+op_JALR:
+{
+    // Read the base before writing the link, they may be the same register.
+    // The target has bit 0 cleared.
+    uint32_t target = (x[op->rs1] + op->imm) & ~1u;
+    x[op->rd] = op->link;
+    if (op->profile != PROFILE_JUMP && processor->profiler != NULL)
+    {
+        processor->profiler->jump(op->profile, target);
+    }
+    if (block->indirect != NULL && block->indirect_pc == target)
+    {
+        block = block->indirect;
+        goto enter;
+    }
+    block->indirect_pc = target;
+    link = &block->indirect;
+    processor->pc = target;
+    goto lookup;
+}
+op_HALT:
+    processor->pc = op->link - op->length;
+    processor->halt = true;
+    return;
+op_GENERIC:
+    processor->pc = op->link - op->length;
+    if (processor->instruction_count >= processor->stop_count)
+    {
+        return;
+    }
+    processor->execute_instruction();
+    link = NULL;
+    goto lookup;
+op_END:
+    goto not_taken;
+
+branch_taken:
+    if (processor->hpm_active)
+    {
+        processor->event_counts[HPM_EVENT_BRANCH_TAKEN]++;
+    }
+taken:
+    TRACE(TRACE_CAT_BRANCH, TRACE_LEVEL_DEBUG, "Branching to 0x%08X\n", block->taken_pc);
+    if (block->taken != NULL)
+    {
+        block = block->taken;
+        goto enter;
+    }
+    link = &block->taken;
+    processor->pc = block->taken_pc;
+    goto lookup;
+
+not_taken:
+    if (block->not_taken != NULL)
+    {
+        block = block->not_taken;
+        goto enter;
+    }
+    link = &block->not_taken;
+    processor->pc = block->not_taken_pc;
+    goto lookup;
+
+leave_block:
+{
+    // A store may have changed code in this block, or the access hit a
+    // watchpoint, so leave it and give back the instructions that were
+    // counted but not run
+    uint32_t index = (uint32_t)(op - &block->ops[0]);
+    processor->instruction_count -= block->length - index - 1;
+    if (processor->hpm_active)
+    {
+        uncount_events(block, op);
+    }
+    processor->pc = op->link;
+    if (watch_pending)
+    {
+        processor->last_watch_hit.pc = op->link - op->length;
+        watch_pending = false;
+    }
+    link = NULL;
+    goto lookup;
+}
+}
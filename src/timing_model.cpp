@@ -0,0 +1,163 @@
+// Cycle estimates for an in-order pipeline with a branch predictor.
+
+#include "timing_model.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+const char *PREDICTOR_STR[] = {
+    "static",
+    "bimodal",
+    "gshare",
+};
+
+const char *TIMING_STALL_STR[] = {
+    "load-use",
+    "multiply",
+    "mispredict",
+    "taken",
+    "indirect",
+};
+
+void timing_default_config(timing_config_t *config)
+{
+    config->predictor = PREDICTOR_BIMODAL;
+    config->predictor_bits = TIMING_DEFAULT_PREDICTOR_BITS;
+    config->history_bits = TIMING_DEFAULT_HISTORY_BITS;
+    config->load_latency = TIMING_DEFAULT_LOAD_LATENCY;
+    config->mul_latency = TIMING_DEFAULT_MUL_LATENCY;
+    config->mispredict_penalty = TIMING_DEFAULT_MISPREDICT_PENALTY;
+    config->taken_penalty = TIMING_DEFAULT_TAKEN_PENALTY;
+}
+
+int timing_parse_spec(const char *spec, timing_config_t *config)
+{
+    while (*spec)
+    {
+        const char *end = strchr(spec, ',');
+        if (end == NULL)
+        {
+            end = spec + strlen(spec);
+        }
+
+        const char *equals = (const char *)memchr(spec, '=', end - spec);
+        if (equals == NULL)
+        {
+            // Bare name selects the predictor
+            int predictor;
+            for (predictor = 0; predictor <= PREDICTOR_GSHARE; predictor++)
+            {
+                if (strlen(PREDICTOR_STR[predictor]) == (size_t)(end - spec) && strncasecmp(spec, PREDICTOR_STR[predictor], end - spec) == 0)
+                {
+                    break;
+                }
+            }
+            if (predictor > PREDICTOR_GSHARE)
+            {
+                return -1;
+            }
+            config->predictor = (predictor_t)predictor;
+        }
+        else
+        {
+            char *number_end;
+            unsigned long value = strtoul(equals + 1, &number_end, 0);
+            if (number_end != end || equals + 1 == end)
+            {
+                return -1;
+            }
+
+            size_t length = equals - spec;
+            if (length == 4 && strncmp(spec, "bits", 4) == 0 && value >= 1 && value <= 24)
+            {
+                config->predictor_bits = (uint32_t)value;
+            }
+            else if (length == 7 && strncmp(spec, "history", 7) == 0 && value <= 24)
+            {
+                config->history_bits = (uint32_t)value;
+            }
+            else if (length == 4 && strncmp(spec, "load", 4) == 0 && value >= 1)
+            {
+                config->load_latency = (uint32_t)value;
+            }
+            else if (length == 3 && strncmp(spec, "mul", 3) == 0 && value >= 1)
+            {
+                config->mul_latency = (uint32_t)value;
+            }
+            else if (length == 10 && strncmp(spec, "mispredict", 10) == 0)
+            {
+                config->mispredict_penalty = (uint32_t)value;
+            }
+            else if (length == 5 && strncmp(spec, "taken", 5) == 0)
+            {
+                config->taken_penalty = (uint32_t)value;
+            }
+            else
+            {
+                return -1;
+            }
+        }
+
+        spec = *end ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+TimingModel::TimingModel(const timing_config_t &config)
+{
+    this->config = config;
+    counters.resize((size_t)1 << config.predictor_bits);
+    counter_mask = (1u << config.predictor_bits) - 1;
+    history_mask = (1u << config.history_bits) - 1;
+    reset();
+}
+
+void TimingModel::reset()
+{
+    // Filling the pipeline delays the first instruction, after that one
+    // retires every cycle unless something stalls
+    cycles = TIMING_PIPELINE_DEPTH - 1;
+    instructions = 0;
+    memset(ready, 0, sizeof(ready));
+    for (int i = 0; i < 32; i++)
+    {
+        producer[i] = TIMING_STALL_LOAD_USE;
+    }
+    memset(stalls, 0, sizeof(stalls));
+    branches = 0;
+    mispredicts = 0;
+
+    // Weakly not taken
+    for (size_t i = 0; i < counters.size(); i++)
+    {
+        counters[i] = 1;
+    }
+    history = 0;
+}
+
+void TimingModel::report(FILE *output)
+{
+    fprintf(output, "Timing: %llu cycles, %llu instructions", (unsigned long long)cycles, (unsigned long long)instructions);
+    if (instructions > 0)
+    {
+        fprintf(output, ", CPI %.3f", (double)cycles / instructions);
+    }
+    fprintf(output, "\n");
+
+    fprintf(output, "Stall cycles:");
+    for (int i = 0; i < TIMING_STALL_COUNT; i++)
+    {
+        fprintf(output, "%s %s %llu", i == 0 ? "" : ",", TIMING_STALL_STR[i], (unsigned long long)stalls[i]);
+    }
+    fprintf(output, "\n");
+
+    fprintf(output, "Branches: %llu, %llu mispredicted by the %s predictor", (unsigned long long)branches, (unsigned long long)mispredicts,
+            PREDICTOR_STR[config.predictor]);
+    if (branches > 0)
+    {
+        fprintf(output, " (%.2f%%)", 100.0 * mispredicts / branches);
+    }
+    fprintf(output, "\n");
+}
@@ -0,0 +1,117 @@
+// Process-wide trace levels.
+
+#include "trace.h"
+
+#include <string.h>
+#include <strings.h>
+
+int trace_levels[TRACE_CAT_COUNT] = {
+    TRACE_DEFAULT_LEVEL,
+    TRACE_DEFAULT_LEVEL,
+    TRACE_DEFAULT_LEVEL,
+    TRACE_DEFAULT_LEVEL,
+    TRACE_DEFAULT_LEVEL,
+    TRACE_DEFAULT_LEVEL};
+
+const char *TRACE_LEVEL_STR[] = {
+    "",
+    "ERROR",
+    "WARNING",
+    "INFO",
+    "DEBUG"};
+
+const char *TRACE_CAT_STR[] = {
+    "general",
+    "decode",
+    "regfile",
+    "memory",
+    "branch",
+    "loader"};
+
+void trace_set_level(int level)
+{
+    for (int i = 0; i < TRACE_CAT_COUNT; i++)
+    {
+        trace_levels[i] = level;
+    }
+}
+
+void trace_set_category_level(trace_cat_t category, int level)
+{
+    trace_levels[category] = level;
+}
+
+int trace_get_category_level(trace_cat_t category)
+{
+    return trace_levels[category];
+}
+
+// Parse a level name of the given length (returns -1 if unknown)
+static int parse_level(const char *name, size_t length)
+{
+    if (length == 4 && strncasecmp(name, "none", 4) == 0)
+    {
+        return TRACE_LEVEL_NONE;
+    }
+
+    for (int level = TRACE_LEVEL_ERROR; level <= TRACE_LEVEL_DEBUG; level++)
+    {
+        if (strlen(TRACE_LEVEL_STR[level]) == length && strncasecmp(name, TRACE_LEVEL_STR[level], length) == 0)
+        {
+            return level;
+        }
+    }
+
+    return -1;
+}
+
+int trace_parse_spec(const char *spec)
+{
+    while (*spec)
+    {
+        const char *end = strchr(spec, ',');
+        if (end == NULL)
+        {
+            end = spec + strlen(spec);
+        }
+
+        const char *equals = (const char *)memchr(spec, '=', end - spec);
+        if (equals == NULL)
+        {
+            // Bare level applies to every category
+            int level = parse_level(spec, end - spec);
+            if (level < 0)
+            {
+                return -1;
+            }
+            trace_set_level(level);
+        }
+        else
+        {
+            int level = parse_level(equals + 1, end - equals - 1);
+            if (level < 0)
+            {
+                return -1;
+            }
+
+            int category;
+            for (category = 0; category < TRACE_CAT_COUNT; category++)
+            {
+                if (strlen(TRACE_CAT_STR[category]) == (size_t)(equals - spec) &&
+                    strncasecmp(spec, TRACE_CAT_STR[category], equals - spec) == 0)
+                {
+                    break;
+                }
+            }
+            if (category == TRACE_CAT_COUNT)
+            {
+                return -1;
+            }
+            trace_set_category_level((trace_cat_t)category, level);
+        }
+
+        spec = *end ? end + 1 : end;
+    }
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Reads execution traces written by TraceRecorder.
+
+#include "trace_reader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+#ifdef RAM_FILE_MAPPING
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+TraceReader::TraceReader()
+{
+    fd = -1;
+    image = NULL;
+    size = 0;
+    memset(&header, 0, sizeof(header));
+    cursor = NULL;
+    end = NULL;
+    next_pc = 0;
+    memset(x, 0, sizeof(x));
+    address = 0;
+    position = 0;
+    truncated = false;
+}
+
+TraceReader::~TraceReader()
+{
+    close();
+}
+
+int TraceReader::open(const char *filename)
+{
+    close();
+
+#ifdef RAM_FILE_MAPPING
+    // Records are read once from front to back
+    fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open trace %s\n", filename);
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to read trace %s\n", filename);
+        close();
+        return -1;
+    }
+    size = (size_t)info.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to map trace %s\n", filename);
+        size = 0;
+        close();
+        return -1;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    image = (const uint8_t *)mapping;
+#else
+    // Read the whole file
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Unable to open trace %s\n", filename);
+        return -1;
+    }
+    uint8_t buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        contents.insert(contents.end(), buffer, buffer + count);
+    }
+    fclose(file);
+    image = contents.data();
+    size = contents.size();
+#endif
+
+    // Check the header
+    if (size < sizeof(header))
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Trace %s too short\n", filename);
+        close();
+        return -1;
+    }
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "%s is not an execution trace\n", filename);
+        close();
+        return -1;
+    }
+    if (header.version != TRACE_FILE_VERSION)
+    {
+        TRACE(TRACE_CAT_LOADER, TRACE_LEVEL_ERROR, "Trace %s has version %u, expected %u\n", filename, header.version, TRACE_FILE_VERSION);
+        close();
+        return -1;
+    }
+
+    rewind();
+    return 0;
+}
+
+void TraceReader::rewind()
+{
+    cursor = image + sizeof(header);
+    end = image + size;
+    next_pc = header.pc;
+    memcpy(x, header.x, sizeof(x));
+    x[0] = 0;
+    address = 0;
+    position = 0;
+    truncated = false;
+}
+
+bool TraceReader::next_near_end(trace_record_t *record)
+{
+    if (cursor >= end)
+    {
+        return false;
+    }
+
+    // Decode from a copy padded with zeros, which end any field cut short
+    uint8_t tail[TRACE_RECORD_MAX];
+    size_t remaining = end - cursor;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, cursor, remaining);
+    size_t used = decode(tail, record) - tail;
+    if (used > remaining)
+    {
+        position--;
+        truncated = true;
+        cursor = end;
+        return false;
+    }
+    cursor += used;
+    return true;
+}
+
+void TraceReader::close()
+{
+#ifdef RAM_FILE_MAPPING
+    if (image != NULL)
+    {
+        munmap((void *)image, size);
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+#else
+    contents.clear();
+#endif
+    fd = -1;
+    image = NULL;
+    size = 0;
+    cursor = NULL;
+    end = NULL;
+}
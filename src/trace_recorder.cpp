@@ -0,0 +1,170 @@
+// Writes execution traces, encoded by the hart and written out by a thread
+// of their own.
+
+#include "trace_recorder.h"
+
+#include <string.h>
+#include "trace.h"
+
+TraceRecorder::TraceRecorder()
+{
+    file = NULL;
+    memset(&header, 0, sizeof(header));
+    buffer = NULL;
+    cursor = NULL;
+    limit = NULL;
+    next_pc = 0;
+    memset(x, 0, sizeof(x));
+    address = 0;
+    record_count = 0;
+    stopping = false;
+    failed = false;
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    close();
+}
+
+int TraceRecorder::open(const char *filename)
+{
+    close();
+    file = fopen(filename, "wb");
+    if (file == NULL)
+    {
+        TRACE(TRACE_CAT_GENERAL, TRACE_LEVEL_ERROR, "Unable to create trace %s\n", filename);
+        return -1;
+    }
+    failed = false;
+    return 0;
+}
+
+void TraceRecorder::start(uint32_t hart_id, uint32_t pc, uint64_t instruction_count, const uint32_t *x)
+{
+    // The record count is filled in by close(), a trace that was never
+    // closed still reads up to its last whole record
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_FILE_VERSION;
+    header.hart_id = hart_id;
+    header.pc = pc;
+    header.first_instruction = instruction_count;
+    memcpy(header.x, x, sizeof(header.x));
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        failed = true;
+    }
+
+    next_pc = pc;
+    memcpy(this->x, x, sizeof(this->x));
+    address = 0;
+    record_count = 0;
+
+    storage.assign(TRACE_BUFFER_COUNT, std::vector<uint8_t>(TRACE_BUFFER_SIZE));
+    full.clear();
+    empty.clear();
+    for (size_t i = 1; i < storage.size(); i++)
+    {
+        empty.push_back(storage[i].data());
+    }
+    buffer = storage[0].data();
+    cursor = buffer;
+    limit = buffer + TRACE_BUFFER_SIZE - TRACE_RECORD_MAX;
+
+    stopping = false;
+    writer = std::thread(&TraceRecorder::write_buffers, this);
+}
+
+void TraceRecorder::flush()
+{
+    std::unique_lock<std::mutex> guard(queue_lock);
+    trace_buffer_t filled;
+    filled.data = buffer;
+    filled.size = cursor - buffer;
+    full.push_back(filled);
+    queue_changed.notify_all();
+
+    // Only wait when the writer is behind on every buffer
+    while (empty.empty())
+    {
+        queue_changed.wait(guard);
+    }
+    buffer = empty.back();
+    empty.pop_back();
+    cursor = buffer;
+    limit = buffer + TRACE_BUFFER_SIZE - TRACE_RECORD_MAX;
+}
+
+void TraceRecorder::write_buffers()
+{
+    std::unique_lock<std::mutex> guard(queue_lock);
+    while (true)
+    {
+        if (full.empty())
+        {
+            if (stopping)
+            {
+                break;
+            }
+            queue_changed.wait(guard);
+            continue;
+        }
+
+        // Write without the lock so the hart can keep filling buffers
+        trace_buffer_t next = full.front();
+        full.pop_front();
+        guard.unlock();
+        bool written = fwrite(next.data, 1, next.size, file) == next.size;
+        guard.lock();
+
+        if (!written)
+        {
+            failed = true;
+        }
+        empty.push_back(next.data);
+        queue_changed.notify_all();
+    }
+}
+
+int TraceRecorder::close()
+{
+    if (file == NULL)
+    {
+        return 0;
+    }
+
+    if (writer.joinable())
+    {
+        // The partial buffer goes last
+        {
+            std::lock_guard<std::mutex> guard(queue_lock);
+            trace_buffer_t filled;
+            filled.data = buffer;
+            filled.size = cursor - buffer;
+            full.push_back(filled);
+            stopping = true;
+        }
+        queue_changed.notify_all();
+        writer.join();
+
+        header.record_count = record_count;
+        if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1)
+        {
+            failed = true;
+        }
+    }
+    if (fclose(file) != 0)
+    {
+        failed = true;
+    }
+    file = NULL;
+
+    storage.clear();
+    full.clear();
+    empty.clear();
+    buffer = NULL;
+    cursor = NULL;
+    limit = NULL;
+
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,154 @@
+// Transmit side of a 16550 UART, drained to the host by its own thread.
+
+#include "uart.h"
+
+#include <chrono>
+
+Uart::Uart(FILE *output)
+{
+    this->output = output;
+    for (uint32_t i = 0; i < UART_RING_SIZE; i++)
+    {
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+        ring[i].value = 0;
+    }
+    head = 0;
+    tail = 0;
+    line_control = 0;
+    sleeping = false;
+    stopping = false;
+    io_thread = std::thread(&Uart::drain, this);
+}
+
+Uart::~Uart()
+{
+    stop();
+}
+
+uint32_t Uart::read(uint32_t offset, uint32_t size)
+{
+    (void)size;
+    switch (offset)
+    {
+    case UART_LCR:
+        return line_control.load(std::memory_order_relaxed);
+    case UART_LSR:
+        // Transmission never holds the guest up, the ring absorbs it
+        return UART_LSR_THRE | UART_LSR_TEMT;
+    default:
+        return 0;
+    }
+}
+
+void Uart::write(uint32_t offset, uint32_t value, uint32_t size)
+{
+    (void)size;
+    switch (offset)
+    {
+    case UART_THR:
+        if ((line_control.load(std::memory_order_relaxed) & UART_LCR_DLAB) == 0)
+        {
+            put((uint8_t)value);
+        }
+        break;
+    case UART_LCR:
+        line_control.store(value & 0xFF, std::memory_order_relaxed);
+        break;
+    default:
+        break;
+    }
+}
+
+void Uart::put(uint8_t value)
+{
+    // Claim the slot at head once the output thread has freed it
+    uint32_t position = head.load(std::memory_order_relaxed);
+    while (true)
+    {
+        uart_slot_t &slot = ring[position & (UART_RING_SIZE - 1)];
+        int32_t difference = (int32_t)(slot.sequence.load(std::memory_order_acquire) - position);
+        if (difference == 0)
+        {
+            if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                slot.value = value;
+                slot.sequence.store(position + 1, std::memory_order_release);
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            // Full, the host is behind
+            std::this_thread::yield();
+            position = head.load(std::memory_order_relaxed);
+        }
+        else
+        {
+            // Another hart took the slot
+            position = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    if (sleeping.load())
+    {
+        wake.notify_one();
+    }
+}
+
+void Uart::drain()
+{
+    uint8_t buffer[UART_WRITE_SIZE];
+    size_t count = 0;
+    while (true)
+    {
+        uart_slot_t &slot = ring[tail & (UART_RING_SIZE - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) == tail + 1)
+        {
+            buffer[count++] = slot.value;
+            slot.sequence.store(tail + UART_RING_SIZE, std::memory_order_release);
+            tail++;
+            if (count < sizeof(buffer))
+            {
+                continue;
+            }
+        }
+
+        // Write out what was gathered once the ring runs dry or the buffer
+        // fills
+        if (count > 0)
+        {
+            fwrite(buffer, 1, count, output);
+            fflush(output);
+            count = 0;
+            continue;
+        }
+        if (stopping.load())
+        {
+            break;
+        }
+
+        // Check again after saying so, a byte produced before the producer
+        // saw the flag would otherwise wait for the timeout
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        sleeping = true;
+        if (ring[tail & (UART_RING_SIZE - 1)].sequence.load(std::memory_order_acquire) != tail + 1 && !stopping.load())
+        {
+            wake.wait_for(guard, std::chrono::milliseconds(10));
+        }
+        sleeping = false;
+    }
+}
+
+void Uart::stop()
+{
+    if (!io_thread.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    io_thread.join();
+}
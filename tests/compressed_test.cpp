@@ -0,0 +1,153 @@
+// Checks the expansion of compressed instructions against the 32-bit
+// encodings an assembler gives for them, and the fetch of instructions that
+// straddle a word or a page.
+
+#include <stdio.h>
+#include <stdint.h>
+#include "control.h"
+#include "ram.h"
+
+// A compressed instruction and the 32-bit instruction it stands for
+typedef struct
+{
+    uint16_t compressed;
+    uint32_t expanded;
+    const char *text;
+} expansion_t;
+
+static const expansion_t expansions[] = {
+    {0x1FE0, 0x3FC10413, "c.addi4spn s0, sp, 1020"},
+    {0x005C, 0x00410793, "c.addi4spn a5, sp, 4"},
+    {0x5FE8, 0x07C7A503, "c.lw a0, 124(a5)"},
+    {0x4080, 0x0004A403, "c.lw s0, 0(s1)"},
+    {0xDFE8, 0x06A7AE23, "c.sw a0, 124(a5)"},
+    {0xC044, 0x00942223, "c.sw s1, 4(s0)"},
+    {0x0001, 0x00000013, "c.nop"},
+    {0x1501, 0xFE050513, "c.addi a0, -32"},
+    {0x0FFD, 0x01FF8F93, "c.addi t6, 31"},
+    {0x3001, 0x801FF0EF, "c.jal -2048"},
+    {0x2FFD, 0x7FE000EF, "c.jal 2046"},
+    {0x5501, 0xFE000513, "c.li a0, -32"},
+    {0x4FFD, 0x01F00F93, "c.li t6, 31"},
+    {0x7101, 0xE0010113, "c.addi16sp sp, -512"},
+    {0x617D, 0x1F010113, "c.addi16sp sp, 496"},
+    {0x7501, 0xFFFE0537, "c.lui a0, 0xfffe0"},
+    {0x6FFD, 0x0001FFB7, "c.lui t6, 31"},
+    {0x817D, 0x01F55513, "c.srli a0, 31"},
+    {0x8485, 0x4014D493, "c.srai s1, 1"},
+    {0x9BFD, 0xFFF7F793, "c.andi a5, -1"},
+    {0x887D, 0x01F47413, "c.andi s0, 31"},
+    {0x8C1D, 0x40F40433, "c.sub s0, a5"},
+    {0x8D2D, 0x00B54533, "c.xor a0, a1"},
+    {0x8E55, 0x00D66633, "c.or a2, a3"},
+    {0x8F65, 0x00977733, "c.and a4, s1"},
+    {0xB001, 0x801FF06F, "c.j -2048"},
+    {0xAFFD, 0x7FE0006F, "c.j 2046"},
+    {0xD101, 0xF00500E3, "c.beqz a0, -256"},
+    {0xECFD, 0x0E049F63, "c.bnez s1, 254"},
+    {0x0FFE, 0x01FF9F93, "c.slli t6, 31"},
+    {0x0086, 0x00109093, "c.slli ra, 1"},
+    {0x50FE, 0x0FC12083, "c.lwsp ra, 252(sp)"},
+    {0x4F82, 0x00012F83, "c.lwsp t6, 0(sp)"},
+    {0x8082, 0x00008067, "c.jr ra"},
+    {0x82FE, 0x01F002B3, "c.mv t0, t6"},
+    {0x9002, 0x00100073, "c.ebreak"},
+    {0x9282, 0x000280E7, "c.jalr t0"},
+    {0x92FE, 0x01F282B3, "c.add t0, t6"},
+    {0xDFFE, 0x0FF12E23, "c.swsp t6, 252(sp)"},
+    {0xC006, 0x00112023, "c.swsp ra, 0(sp)"},
+};
+
+// Reserved encodings, and the floating point ones RV32IMAC leaves out
+static const expansion_t illegal[] = {
+    {0x0000, 0, "all zero"},
+    {0x0004, 0, "c.addi4spn with a zero immediate"},
+    {0x2000, 0, "c.fld"},
+    {0x6000, 0, "c.flw"},
+    {0x8000, 0, "reserved quadrant 0 opcode"},
+    {0xA000, 0, "c.fsd"},
+    {0xE000, 0, "c.fsw"},
+    {0x6101, 0, "c.addi16sp with a zero immediate"},
+    {0x6501, 0, "c.lui with a zero immediate"},
+    {0x9005, 0, "c.srli with shamt[5] set"},
+    {0x9405, 0, "c.srai with shamt[5] set"},
+    {0x9C05, 0, "c.subw"},
+    {0x9C25, 0, "c.addw"},
+    {0x1086, 0, "c.slli with shamt[5] set"},
+    {0x4002, 0, "c.lwsp to x0"},
+    {0x8002, 0, "c.jr x0"},
+    {0x2002, 0, "c.fldsp"},
+    {0x6002, 0, "c.flwsp"},
+    {0xA002, 0, "c.fsdsp"},
+    {0xE002, 0, "c.fswsp"},
+};
+
+#define COUNT(table) (sizeof(table) / sizeof(table[0]))
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, uint32_t got, uint32_t expected)
+{
+    if (!ok)
+    {
+        printf("FAIL %s: got 0x%08X, expected 0x%08X\n", what, got, expected);
+        failures++;
+    }
+}
+
+// Expand every entry, with and without junk in the upper halfword, which
+// belongs to the next instruction
+static void check_table(const expansion_t *table, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t got = expand_compressed(table[i].compressed);
+        check(got == table[i].expanded, table[i].text, got, table[i].expanded);
+        got = expand_compressed(0xFFFF0000 | table[i].compressed);
+        check(got == table[i].expanded, table[i].text, got, table[i].expanded);
+    }
+}
+
+// Fetch an instruction placed one halfword at a time and check its length
+static void check_fetch(RAM &ram, uint32_t address, uint32_t instruction, uint32_t length, const char *what)
+{
+    ram.store_halfword(address, (uint16_t)instruction);
+    if (length == 4)
+    {
+        ram.store_halfword(address + 2, (uint16_t)(instruction >> 16));
+    }
+    uint32_t got = ram.load_instruction(address);
+    if (length == 2)
+    {
+        got &= 0xFFFF;
+    }
+    check(got == instruction, what, got, instruction);
+
+    control_t decoded;
+    control(&decoded, got);
+    check(decoded.length == length, what, decoded.length, length);
+}
+
+int main()
+{
+    check_table(expansions, COUNT(expansions));
+    check_table(illegal, COUNT(illegal));
+
+    // 32-bit instructions pass through unchanged
+    uint32_t addi = 0x00A00513;
+    check(expand_compressed(addi) == addi, "addi a0, zero, 10", expand_compressed(addi), addi);
+
+    RAM ram;
+    check_fetch(ram, 0x00000102, 0x3FC10413, 4, "32-bit instruction straddling a word");
+    check_fetch(ram, RAM_PAGE_SIZE - 2, 0x0FC12083, 4, "32-bit instruction straddling a page");
+    check_fetch(ram, 2 * RAM_PAGE_SIZE - 2, 0x8082, 2, "compressed instruction at the end of a page");
+    check_fetch(ram, 0xFFFFFFFC, 0x00100073, 4, "32-bit instruction at the top of memory");
+
+    if (failures != 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("%d expansions and 4 fetches checked\n", (int)(COUNT(expansions) + COUNT(illegal)));
+    return 0;
+}
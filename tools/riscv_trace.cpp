@@ -0,0 +1,281 @@
+// Prints, summarizes and compares execution traces recorded with -x.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "trace_reader.h"
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s dump [-s record] [-n records] trace\n", program);
+    fprintf(stderr, "       %s stats trace\n", program);
+    fprintf(stderr, "       %s diff [-c records] trace trace\n", program);
+    fprintf(stderr, "  dump   Print the records as text, from record -s on\n");
+    fprintf(stderr, "  stats  Count jumps, register writes and memory accesses\n");
+    fprintf(stderr, "  diff   Show the first record two traces differ in, with -c\n");
+    fprintf(stderr, "         records before it (default 8). Exits with 1 if they differ.\n");
+}
+
+// Instruction number, PC, register written and memory accessed
+static void print_record(FILE *output, uint64_t instruction, const trace_record_t &record)
+{
+    fprintf(output, "%12llu  0x%08X%s", (unsigned long long)instruction, record.pc, record.length == 2 ? "c" : " ");
+    if (record.rd != 0)
+    {
+        fprintf(output, "  x%02u = 0x%08X", record.rd, record.value);
+    }
+    if (record.size != 0)
+    {
+        fprintf(output, "  %s%u 0x%08X", record.write ? "w" : "r", record.size, record.address);
+        if (record.has_data)
+        {
+            fprintf(output, " = 0x%0*X", record.size * 2, record.data);
+        }
+    }
+    fprintf(output, "\n");
+}
+
+static bool same_record(const trace_record_t &a, const trace_record_t &b)
+{
+    return a.pc == b.pc && a.length == b.length && a.rd == b.rd && a.value == b.value && a.size == b.size &&
+           (a.size == 0 || (a.write == b.write && a.address == b.address && a.has_data == b.has_data && a.data == b.data));
+}
+
+static int open_trace(TraceReader *reader, const char *filename)
+{
+    if (reader->open(filename) != 0)
+    {
+        fprintf(stderr, "Unable to open trace %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+static int dump(const char *filename, uint64_t first, uint64_t count)
+{
+    TraceReader reader;
+    if (open_trace(&reader, filename) != 0)
+    {
+        return 1;
+    }
+
+    const trace_file_header_t &header = reader.get_header();
+    trace_record_t record;
+    while (count > 0 && reader.next(&record))
+    {
+        if (reader.get_position() > first)
+        {
+            print_record(stdout, header.first_instruction + reader.get_position() - 1, record);
+            count--;
+        }
+    }
+    if (reader.is_truncated())
+    {
+        fprintf(stderr, "%s ends partway through a record\n", filename);
+    }
+    return 0;
+}
+
+static int stats(const char *filename)
+{
+    TraceReader reader;
+    if (open_trace(&reader, filename) != 0)
+    {
+        return 1;
+    }
+
+    // Counts by access size, 1, 2 and 4 bytes
+    uint64_t jumps = 0;
+    uint64_t compressed = 0;
+    uint64_t register_writes = 0;
+    uint64_t reads[3] = {0, 0, 0};
+    uint64_t writes[3] = {0, 0, 0};
+    uint32_t last_pc = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    trace_record_t record;
+    uint32_t next_pc = reader.get_header().pc;
+    while (reader.next(&record))
+    {
+        if (record.pc != next_pc)
+        {
+            jumps++;
+        }
+        next_pc = record.pc + record.length;
+        last_pc = record.pc;
+        if (record.length == 2)
+        {
+            compressed++;
+        }
+        if (record.rd != 0)
+        {
+            register_writes++;
+        }
+        if (record.size != 0)
+        {
+            uint32_t size_index = record.size == 4 ? 2 : record.size - 1;
+            if (record.write)
+            {
+                writes[size_index]++;
+            }
+            else
+            {
+                reads[size_index]++;
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const trace_file_header_t &header = reader.get_header();
+    uint64_t records = reader.get_position();
+    printf("Hart %u from instruction %llu at 0x%08X to 0x%08X\n", header.hart_id, (unsigned long long)header.first_instruction,
+           header.pc, last_pc);
+    printf("Records: %llu in %llu bytes", (unsigned long long)records, (unsigned long long)reader.get_size());
+    if (records > 0)
+    {
+        printf(" (%.2f bytes each)", (double)(reader.get_size() - sizeof(header)) / records);
+    }
+    printf("\n");
+    printf("Jumps: %llu, compressed instructions: %llu, register writes: %llu\n", (unsigned long long)jumps,
+           (unsigned long long)compressed, (unsigned long long)register_writes);
+    printf("Reads: %llu (bytes %llu, halfwords %llu, words %llu)\n", (unsigned long long)(reads[0] + reads[1] + reads[2]),
+           (unsigned long long)reads[0], (unsigned long long)reads[1], (unsigned long long)reads[2]);
+    printf("Writes: %llu (bytes %llu, halfwords %llu, words %llu)\n", (unsigned long long)(writes[0] + writes[1] + writes[2]),
+           (unsigned long long)writes[0], (unsigned long long)writes[1], (unsigned long long)writes[2]);
+    if (seconds > 0)
+    {
+        printf("Read in %.3f s: %.1f M records/s, %.1f MB/s\n", seconds, records / seconds / 1e6, reader.get_size() / seconds / 1e6);
+    }
+
+    if (header.record_count != records)
+    {
+        fprintf(stderr, "%s was not closed, it holds %llu whole records\n", filename, (unsigned long long)records);
+    }
+    return 0;
+}
+
+static int diff(const char *filename_a, const char *filename_b, uint32_t context)
+{
+    TraceReader a;
+    TraceReader b;
+    if (open_trace(&a, filename_a) != 0 || open_trace(&b, filename_b) != 0)
+    {
+        return 2;
+    }
+
+    const trace_file_header_t &header_a = a.get_header();
+    const trace_file_header_t &header_b = b.get_header();
+    if (header_a.pc != header_b.pc || memcmp(header_a.x + 1, header_b.x + 1, sizeof(header_a.x) - sizeof(header_a.x[0])) != 0)
+    {
+        printf("The traces start from different states\n");
+    }
+
+    // The last records both traces have in common, oldest first once the
+    // ring wraps
+    std::vector<trace_record_t> recent(context);
+    trace_record_t record_a;
+    trace_record_t record_b;
+    while (true)
+    {
+        bool more_a = a.next(&record_a);
+        bool more_b = b.next(&record_b);
+        if (!more_a && !more_b)
+        {
+            printf("Traces match, %llu records\n", (unsigned long long)a.get_position());
+            return 0;
+        }
+        if (more_a && more_b && same_record(record_a, record_b))
+        {
+            if (context > 0)
+            {
+                recent[(a.get_position() - 1) % context] = record_a;
+            }
+            continue;
+        }
+
+        // Show what led up to the difference, numbered as in the first trace
+        uint64_t common = more_a ? a.get_position() - 1 : a.get_position();
+        printf("Traces differ after %llu records\n", (unsigned long long)common);
+        uint64_t shown = common < context ? common : context;
+        for (uint64_t i = common - shown; i < common; i++)
+        {
+            printf("  ");
+            print_record(stdout, header_a.first_instruction + i, recent[i % context]);
+        }
+        if (more_a)
+        {
+            printf("< ");
+            print_record(stdout, header_a.first_instruction + common, record_a);
+        }
+        else
+        {
+            printf("< end of %s\n", filename_a);
+        }
+        if (more_b)
+        {
+            printf("> ");
+            print_record(stdout, header_b.first_instruction + common, record_b);
+        }
+        else
+        {
+            printf("> end of %s\n", filename_b);
+        }
+        return 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    const char *command = argv[1];
+
+    uint64_t first = 0;
+    uint64_t count = UINT64_MAX;
+    uint32_t context = 8;
+    std::vector<const char *> files;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            first = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            count = strtoull(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            context = (uint32_t)strtoul(argv[++i], NULL, 0);
+        }
+        else if (argv[i][0] != '-')
+        {
+            files.push_back(argv[i]);
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (strcmp(command, "dump") == 0 && files.size() == 1)
+    {
+        return dump(files[0], first, count);
+    }
+    if (strcmp(command, "stats") == 0 && files.size() == 1)
+    {
+        return stats(files[0]);
+    }
+    if (strcmp(command, "diff") == 0 && files.size() == 2)
+    {
+        return diff(files[0], files[1], context);
+    }
+    usage(argv[0]);
+    return 2;
+}